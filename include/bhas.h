@@ -1,10 +1,15 @@
 #pragma once
 
+#include <cassert>
+#include <cstddef>
 #include <cstdint>
 #include <functional>
+#include <new>
 #include <optional>
+#include <span>
 #include <string>
 #include <string_view>
+#include <type_traits>
 #include <variant>
 #include <vector>
 
@@ -22,11 +27,81 @@ enum class callback_result {
 	abort,
 };
 
+// The sample format the device is opened with. Your callback always sees
+// 32-bit float regardless. Anything other than float32 is converted by
+// bhas rather than by PortAudio. int24 is packed 3-byte samples.
+enum class sample_format {
+	float32,
+	int16,
+	int24,
+	int32,
+};
+
+// How the channels of a buffer are laid out in memory.
+//   non_interleaved: buffer[channel][frame]
+//   interleaved:     buffer[0][frame * num_channels + channel]
+enum class buffer_layout {
+	non_interleaved,
+	interleaved,
+};
+
+// The instruction sets bhas has kernels for, from slowest to fastest.
+// The best one the CPU supports is picked at init(), so the same binary
+// runs well on anything from an SSE2 machine to an AVX-512 server.
+enum class instruction_set {
+	scalar,
+	sse2,
+	avx2,
+	avx512, // AVX-512F and AVX-512BW
+};
+
+// The resampler's filter length. Longer filters have a sharper cutoff
+// and let less aliasing through, but cost more CPU and delay the signal
+// more. The latency is about half the filter length, in frames.
+//   low:    16 taps, cuts off at 0.80 of the lower Nyquist frequency
+//   medium: 32 taps, cuts off at 0.88
+//   high:   64 taps, cuts off at 0.90
+enum class resampler_quality {
+	low,
+	medium,
+	high,
+};
+
+// What bhas talks to, picked at init().
+//   portaudio: the devices PortAudio finds, through whichever host APIs
+//              it was built with. Only available if bhas was built with
+//              PortAudio (the BHAS_PORTAUDIO CMake option, on by default.)
+//   null:      a single device which records silence and throws the
+//              output away. Your callback is still called from its own
+//              thread at the stream's rate and block size, so streams
+//              behave as they would with a sound card, on machines which
+//              don't have one.
+//   offline:   renders as fast as the CPU allows instead of in real time,
+//              writing the output to a WAV file. See offline_config.
+//   loopback:  a single device whose output comes back as its input after
+//              a fixed delay, with optional clock drift and callback
+//              jitter, for testing latency measurement and xrun
+//              handling. See loopback_config.
+//   alsa:      the PCMs ALSA knows about, opened directly and transferred
+//              through their mmap areas, with no PortAudio in between.
+//              Linux only, and only if bhas was built with it (the
+//              BHAS_ALSA CMake option.)
+enum class backend {
+	portaudio,
+	null,
+	offline,
+	loopback,
+	alsa,
+};
+
+struct byte_count      { size_t value = 0; };
 struct device_index    { size_t value; };
 struct device_name     { std::string value; };
 struct device_name_view{ std::string_view value; };
 struct channel_count   { uint32_t value = 0; };
+struct channel_index   { uint32_t value = 0; };
 struct cpu_load        { double value = 0.0; };
+struct dither          { bool value = true; };
 struct error           { std::string value; };
 struct frame_count     { uint32_t value = 0; };
 struct host_index      { size_t value; };
@@ -37,11 +112,20 @@ struct input_buffer    { float const * const * buffer; };
 struct notify          { bool value = false; };
 struct output_buffer   { float       * const * buffer; };
 struct output_latency  { double value = 0.0; };
+struct render_ahead    { bool value = false; };
+struct overflow_count  { uint64_t value = 0; };
 struct sample_rate     { uint32_t value = 0; };
+struct seconds         { double value = 0.0; };
 struct stream_time     { double value = 0.0; };
 struct system_rescan   {};
+struct thread_count    { uint32_t value = 0; };
 struct warning         { std::string value; };
 
+// The largest block size which can be requested in stream_request.
+static constexpr auto MAX_BLOCK_SIZE = frame_count{4096};
+// The most worker threads which can be requested in stream_request.
+static constexpr auto MAX_WORKER_THREADS = thread_count{63};
+
 using log_item = std::variant<error, info, warning>;
 using log      = std::vector<log_item>;
 
@@ -54,6 +138,229 @@ struct device_flags {
 	int value = 0;
 };
 
+// Ask the host to skip some per-sample work, or to start faster.
+//   clip_off:   don't clip out-of-range samples when PortAudio converts
+//               to an integer format
+//   dither_off: don't dither when PortAudio converts to a smaller
+//               format. bhas's own conversions use stream_request::dither
+//   prime_output_buffers_using_stream_callback:
+//               fill the initial output buffers by calling your callback
+//               rather than with silence, for a faster first sound
+struct stream_flags {
+	enum e {
+		clip_off                                   = 1 << 0,
+		dither_off                                 = 1 << 1,
+		prime_output_buffers_using_stream_callback = 1 << 2,
+	};
+	int value = 0;
+};
+
+// How long your callback is taking, measured on every call. Load is the
+// time spent in your callback divided by the time it has to produce its
+// frames (frame_count / sample_rate), so anything over 1.0 is a missed
+// deadline. The percentiles come from a histogram with eight buckets per
+// octave so they are accurate to within about 10%. max is exact.
+struct callback_timing {
+	uint64_t callback_count      = 0;
+	uint64_t deadline_miss_count = 0;
+	double p50_load  = 0.0;
+	double p99_load  = 0.0;
+	double p999_load = 0.0;
+	double max_load  = 0.0;
+	bhas::seconds max_duration;
+};
+
+// Glitches reported by the device.
+//   input_underflow:  input data was missing and your input was padded with silence
+//   input_overflow:   input data was discarded because the device couldn't keep up
+//   output_underflow: silence was played because output didn't arrive in time
+//   output_overflow:  some of your output was discarded
+//   priming_output:   your output is being used to prime the stream and
+//                     the input is silence
+struct xrun_flags {
+	enum e {
+		input_underflow  = 1 << 0,
+		input_overflow   = 1 << 1,
+		output_underflow = 1 << 2,
+		output_overflow  = 1 << 3,
+		priming_output   = 1 << 4,
+	};
+	int value = 0;
+};
+
+struct xrun_counter {
+	uint64_t count = 0;
+	// The stream time of the most recent one. Zero if there hasn't been one.
+	bhas::stream_time last_time;
+};
+
+struct xrun_stats {
+	xrun_counter input_underflow;
+	xrun_counter input_overflow;
+	xrun_counter output_underflow;
+	xrun_counter output_overflow;
+	xrun_counter priming_output;
+};
+
+enum class thread_policy {
+	other,       // The normal time-sharing scheduler
+	fifo,        // SCHED_FIFO
+	round_robin, // SCHED_RR
+};
+
+// Scheduling for the audio thread, applied by the audio thread itself at
+// the start of the first callback. Whether each setting worked is
+// reported through the report callback during the next update(), and
+// get_audio_thread_state() tells you what the thread ended up with.
+// Currently only implemented on Linux.
+struct audio_thread_config {
+	// If this is nullopt then the thread keeps whatever scheduling the
+	// host API gave it. Real-time policies need CAP_SYS_NICE or an rtprio
+	// limit (see /etc/security/limits.conf.)
+	std::optional<bhas::thread_policy> policy;
+	// 1 to 99 for the real-time policies
+	int priority = 0;
+	// The CPUs the audio thread may run on. Empty means don't change it.
+	std::vector<uint32_t> cpus;
+	// Pin the audio thread to a CPU which shares the last level cache
+	// with this one (but not its L1), e.g. the CPU your worker threads are
+	// on. Overrides cpus.
+	std::optional<uint32_t> share_cache_with_cpu;
+};
+
+// Keeping the memory the audio thread touches resident, so that it never
+// takes a page fault. When this is enabled the engine's buffers for the
+// stream are locked and pre-faulted before the stream starts, and the
+// audio thread pre-faults its own stack at the start of its first
+// callback. Use bhas::lock_memory() for your own buffers.
+struct realtime_memory_config {
+	bool enabled = false;
+	// Also lock every page the process has now and will have in the
+	// future with mlockall(). Not available on Windows.
+	bool lock_everything = false;
+};
+
+// Level meters for every input and output channel, measured on the
+// audio thread and read from the main thread with get_meters(). The
+// input is measured as your callback receives it, and the output as it
+// is handed to the device, both in your channel order. A resampled
+// stream is measured at the device's rate. Nothing is measured unless
+// this is enabled.
+struct metering_config {
+	bool enabled = false;
+	// How often the meters are updated. The peak and RMS are measured
+	// over this much audio.
+	bhas::seconds window{0.05};
+	// How long peak_hold stays at the highest peak before it drops back
+	// down to the current one.
+	bhas::seconds peak_hold{1.5};
+};
+
+struct channel_meter {
+	// The largest absolute sample value in the most recent window
+	float peak = 0.0f;
+	float rms = 0.0f;
+	float peak_hold = 0.0f;
+};
+
+struct meters {
+	std::vector<bhas::channel_meter> input;
+	std::vector<bhas::channel_meter> output;
+	// How many times the meters have been updated since the stream
+	// started. If this hasn't changed then neither have the meters.
+	uint64_t update_count = 0;
+};
+
+// Running your callback at stream_request::sample_rate even if the device
+// doesn't support it. The device is opened at another rate instead and
+// the engine converts between the two with a polyphase resampler, so
+// your callback always sees the rate you asked for. Neither rate can be
+// more than eight times the other.
+struct resampler_config {
+	bool enabled = false;
+	bhas::resampler_quality quality = bhas::resampler_quality::medium;
+	// The rate to open the device at. If this is nullopt then it's the
+	// requested rate if the device supports it (in which case nothing is
+	// resampled), otherwise the device's default rate.
+	std::optional<bhas::sample_rate> device_sample_rate;
+};
+
+// Feeding a WAV file into your callback's input in place of what the
+// input device records, so that analysis and recording code can be
+// tested and benchmarked with known audio. This works with any backend.
+// The file is read ahead of time on a thread of its own and handed to the
+// audio thread through a lock-free ring, so the audio thread never waits
+// for the disk. If the reader does fall behind, the gap is silent and
+// counted as an input underflow, except under the offline backend, where
+// the audio thread waits for it so that a render always sees every frame.
+// The file's channels go to the input device's channels in order, and any
+// channels the file doesn't have are silent. It must be at the device's
+// sample rate, so to run at another rate turn on the resampler and set
+// its device_sample_rate to the file's rate.
+struct input_file_config {
+	// If this is empty then the input comes from the input device.
+	std::string path;
+	// Start again from the beginning at the end of the file. Otherwise
+	// the input is silent once the file has run out.
+	bool loop = false;
+	// How far ahead of the audio thread the file is read
+	bhas::seconds prefetch{0.5};
+};
+
+// What the offline backend does with a stream. Your callback is called
+// back-to-back on a thread of its own, and the time_info it gets counts
+// the frames rendered so far rather than the clock, so a render gives
+// the same results however fast the machine is. The input is silent.
+struct offline_config {
+	// The WAV file to write the output to, in the stream's sample format
+	// at the device's sample rate. If it would be bigger than 4 GB it's
+	// written as RF64. If this is empty then the output is thrown away.
+	std::string path;
+	// How many frames to render, at the device's sample rate. If this is
+	// nullopt then the render goes on until your callback returns
+	// complete or the stream is stopped.
+	//
+	// The engine's own latency (the block_size re-blocker and the
+	// resampler) is taken back out: the render runs that many frames
+	// longer than num_frames and the file starts with your callback's
+	// first frame, so it holds exactly num_frames frames of your audio.
+	// The resampler's latency is rounded to the nearest frame. If the
+	// render ends because your callback returned complete, the last
+	// output_latency's worth of audio is still inside the engine and
+	// doesn't make it into the file. Render-ahead isn't allowed, because
+	// nothing would wait for the render thread.
+	std::optional<uint64_t> num_frames;
+};
+
+// What the loopback backend does with a stream. Each output channel comes
+// back as the same input channel exactly delay frames later, so a known
+// signal sent out can be found again in the input and the round trip
+// measured. The reported input and output latencies add up to the delay.
+// The device's clock can be made to run fast or slow compared to the
+// system clock that time_info is measured against, and each callback
+// can be made to run late by a random amount. A callback which runs more
+// than a buffer late loses the buffer: it's reported as an xrun, and the
+// input it would have recorded is silent.
+struct loopback_config {
+	// At least the stream's buffer size. If this is nullopt then it's
+	// two buffers.
+	std::optional<bhas::frame_count> delay;
+	// How far the device's clock runs ahead of the system clock, in
+	// parts per million. Negative values run it slow.
+	double drift_ppm = 0.0;
+	// Each callback runs up to this much later than it's due, uniformly
+	// at random.
+	bhas::seconds jitter;
+	// The same seed gives the same jitter every time.
+	uint32_t seed = 1;
+};
+
+struct audio_thread_state {
+	bhas::thread_policy policy = bhas::thread_policy::other;
+	int priority = 0;
+	std::vector<uint32_t> cpus;
+};
+
 struct host_flags {
 	enum e {
 		asio = 1 << 0,
@@ -66,7 +373,9 @@ struct device {
 	host_index host;
 	device_name_view name;
 	device_flags flags;
+	// Input channels
 	channel_count num_channels;
+	channel_count num_output_channels;
 	sample_rate default_sample_rate;
 };
 
@@ -93,8 +402,36 @@ struct stream {
 	bhas::device_index output_device;
 	bhas::host_index host;
 	bhas::output_latency output_latency;
+	// The rate your callback runs at
 	bhas::sample_rate sample_rate;
+	// The rate the device was opened at. This is only different if the
+	// stream is being resampled.
+	bhas::sample_rate device_sample_rate;
+	bhas::sample_format sample_format = bhas::sample_format::float32;
+	bhas::buffer_layout buffer_layout = bhas::buffer_layout::non_interleaved;
 	std::optional<bhas::device_index> input_device;
+	// If a block size was requested then every callback gets exactly this
+	// many frames. Otherwise the frame count can be anything and can
+	// change from one callback to the next.
+	std::optional<bhas::frame_count> block_size;
+	// How much the re-blocking delays the output by. This is already
+	// included in output_latency.
+	bhas::frame_count block_latency;
+	// What the host was actually asked for
+	std::optional<bhas::frame_count> frames_per_buffer;
+	bhas::seconds input_latency;
+	bhas::stream_flags flags;
+	// How much memory is locked, including anything you locked yourself
+	bhas::byte_count locked_memory;
+	// How many worker threads were started for run_jobs()
+	bhas::thread_count worker_threads;
+	// How much rendering ahead delays the output by. This is already
+	// included in output_latency.
+	bhas::frame_count render_ahead_latency;
+	// How much resampling delays the output by, at sample_rate. This is
+	// already included in output_latency. The input is delayed by about
+	// the same amount, which is included in input_latency.
+	bhas::frame_count resampler_latency;
 };
 
 using audio_cb =
@@ -106,6 +443,74 @@ using audio_cb =
 		bhas::output_latency output_latency,
 		const bhas::time_info* time_info)>;
 
+// Everything a statically-dispatched processor needs for one callback.
+// This is filled in by the engine before each call. See the templated
+// init() overload below.
+struct process_block {
+	bhas::input_buffer input;
+	bhas::output_buffer output;
+	bhas::buffer_layout buffer_layout;
+	bhas::channel_count num_input_channels;
+	bhas::frame_count frame_count;
+	bhas::sample_rate sample_rate;
+	bhas::output_latency output_latency;
+	bhas::time_info time;
+	// Anything the device reported during this callback, so that you can
+	// shed load as soon as it starts glitching.
+	bhas::xrun_flags xruns;
+};
+
+// The view of a process_block which is handed to your processor, with
+// the output channel count baked in at compile time so that loops over
+// the output channels can be unrolled.
+template <uint32_t NumOutputChannels>
+struct process_context : process_block {
+	static constexpr auto num_output_channels = bhas::channel_count{NumOutputChannels};
+	// Only for streams opened with buffer_layout::non_interleaved (the
+	// default.) An interleaved stream has a single buffer, so there is
+	// nothing past buffer[0] to index.
+	[[nodiscard]] auto in(uint32_t channel) const -> std::span<const float>           { assert(buffer_layout == bhas::buffer_layout::non_interleaved); return {input.buffer[channel], frame_count.value}; }
+	[[nodiscard]] auto out(uint32_t channel) const -> std::span<float>                { assert(buffer_layout == bhas::buffer_layout::non_interleaved); return {output.buffer[channel], frame_count.value}; }
+	[[nodiscard]] auto outputs() const -> std::span<float* const, NumOutputChannels> { assert(buffer_layout == bhas::buffer_layout::non_interleaved); return std::span<float* const, NumOutputChannels>{output.buffer, NumOutputChannels}; }
+	// Only for streams opened with buffer_layout::interleaved.
+	[[nodiscard]] auto interleaved_in() const -> std::span<const float> { assert(buffer_layout == bhas::buffer_layout::interleaved); return {input.buffer[0], size_t(frame_count.value) * num_input_channels.value}; }
+	[[nodiscard]] auto interleaved_out() const -> std::span<float>      { assert(buffer_layout == bhas::buffer_layout::interleaved); return {output.buffer[0], size_t(frame_count.value) * NumOutputChannels}; }
+};
+
+// A plain function pointer plus context, called from the audio thread
+// with no type erasure in between.
+using process_fn = auto(*)(void* context, const bhas::process_block& block) -> bhas::callback_result;
+
+struct processor {
+	process_fn fn = nullptr;
+	void* context = nullptr;
+	bhas::channel_count num_output_channels;
+};
+
+// A small function object which is sent from the main thread and executed
+// in the audio thread. Use make_command() or push_command(fn) rather than
+// filling this in yourself.
+struct command {
+	static constexpr size_t MAX_SIZE = 48;
+	using fn_t = auto(*)(const void* data) -> void;
+	fn_t fn = nullptr;
+	alignas(std::max_align_t) std::byte data[MAX_SIZE];
+};
+
+template <typename Fn> [[nodiscard]]
+auto make_command(Fn fn) -> bhas::command {
+	static_assert(std::is_trivially_copyable_v<Fn>, "Commands are copied into a lock-free queue so they must be trivially copyable. Capture pointers and plain values only.");
+	static_assert(sizeof(Fn) <= bhas::command::MAX_SIZE, "Command is too big. Capture less stuff.");
+	static_assert(alignof(Fn) <= alignof(std::max_align_t));
+	bhas::command cmd;
+	cmd.fn = [](const void* data) -> void { (*std::launder(static_cast<const Fn*>(data)))(); };
+	new (cmd.data) Fn{fn};
+	return cmd;
+}
+
+// A job run by run_jobs(). Called once for every index in the batch.
+using job_fn = auto(*)(void* context, uint32_t index) -> void;
+
 using report_cb               = std::function<void(bhas::log log)>;
 using stream_start_failure_cb = std::function<void()>;
 using stream_start_success_cb = std::function<void(bhas::stream stream)>;
@@ -116,6 +521,68 @@ struct stream_request {
 	std::optional<bhas::device_index> input_device;
 	bhas::device_index output_device;
 	bhas::sample_rate sample_rate;
+	// If this is nullopt then a native format is negotiated with the
+	// device. The format which was actually used is reported in
+	// bhas::stream.
+	std::optional<bhas::sample_format> sample_format = bhas::sample_format::float32;
+	// Apply TPDF dither when converting output to int16 or int24.
+	bhas::dither dither;
+	// The layout of the buffers passed to your callback. If this is
+	// nullopt then the host API's native layout is used, so that nobody
+	// has to shuffle the samples around. If the layout and sample format
+	// both match the host then the host buffer is passed straight
+	// through without being copied.
+	std::optional<bhas::buffer_layout> buffer_layout = bhas::buffer_layout::non_interleaved;
+	// How many output channels to open, starting from the first one. If
+	// this is nullopt then it's the processor's channel count, or 2 if
+	// you're using an audio callback.
+	std::optional<bhas::channel_count> num_output_channels;
+	// Alternatively, exactly which of the device's output channels to
+	// open. Your callback sees them in this order. If this isn't empty
+	// then it overrides num_output_channels.
+	std::vector<bhas::channel_index> output_channels;
+	// How many input channels to open, starting from the first one. If
+	// this is nullopt then every input channel the device has is opened.
+	std::optional<bhas::channel_count> num_input_channels;
+	// Alternatively, exactly which of the device's input channels to
+	// open. If this isn't empty then it overrides num_input_channels.
+	std::vector<bhas::channel_index> input_channels;
+	// Call the user with exactly this many frames every time, regardless
+	// of what the device delivers. Must be a power of two, no bigger than
+	// MAX_BLOCK_SIZE. The buffers are aligned to 64 bytes. This delays the
+	// output by at most block_size - 1 frames.
+	std::optional<bhas::frame_count> block_size;
+	// The number of frames the host should deliver in each callback. If
+	// this is nullopt then the host chooses, which usually gives the
+	// lowest latency but the count can vary between callbacks.
+	std::optional<bhas::frame_count> frames_per_buffer;
+	// The latency to ask the host for, in seconds or in frames. If this
+	// is nullopt then the device's default low latency is used. The
+	// latency you actually get is reported in bhas::stream.
+	std::optional<std::variant<bhas::seconds, bhas::frame_count>> suggested_latency;
+	bhas::stream_flags flags;
+	bhas::audio_thread_config audio_thread;
+	bhas::realtime_memory_config realtime_memory;
+	// How many worker threads to start for run_jobs(), no more than
+	// MAX_WORKER_THREADS. They get the same scheduling policy and
+	// priority as the audio thread, but not its CPU affinity.
+	bhas::thread_count worker_threads;
+	// Call the user on a separate render thread, one block ahead of the
+	// device. The device callback then only has to copy the finished
+	// block out, and the user gets almost a whole block's worth of time
+	// no matter when the device callback runs. This delays the output by
+	// one more block. A block which isn't finished in time is replaced
+	// with silence and counted as an output underflow. Commands are
+	// executed on the render thread. Requires block_size.
+	bhas::render_ahead render_ahead;
+	bhas::metering_config metering;
+	bhas::resampler_config resampler;
+	// Only used by the offline backend
+	bhas::offline_config offline;
+	// Only used by the loopback backend
+	bhas::loopback_config loopback;
+	// Requires an input device
+	bhas::input_file_config input_file;
 };
 
 struct user_config {
@@ -141,7 +608,37 @@ struct callbacks {
 // If something goes wrong during intialization, the report
 // callback you pass in here will be used immediately and
 // false will be returned.
-auto init(callbacks cb) -> bool;
+// If backend is nullopt then PortAudio is used, or the null backend if
+// bhas was built without PortAudio.
+auto init(callbacks cb, std::optional<bhas::backend> backend = std::nullopt) -> bool;
+
+// Like init() but instead of the audio callback, the given processor is
+// called in the audio thread. The audio member of the callbacks is ignored.
+auto init(callbacks cb, bhas::processor processor, std::optional<bhas::backend> backend = std::nullopt) -> bool;
+
+namespace detail {
+
+template <uint32_t NumOutputChannels, typename Processor> [[nodiscard]]
+auto process(void* context, const bhas::process_block& block) -> bhas::callback_result {
+	const bhas::process_context<NumOutputChannels> ctx{block};
+	return static_cast<Processor*>(context)->process(ctx);
+}
+
+} // detail
+
+// Like init() but the audio thread calls processor->process(ctx) directly,
+// where ctx is a const bhas::process_context<NumOutputChannels>&. Your
+// processor must outlive the stream.
+// e.g.
+//   struct my_processor {
+//     auto process(const bhas::process_context<2>& ctx) -> bhas::callback_result;
+//   };
+//   bhas::init<2>(std::move(cb), &processor);
+template <uint32_t NumOutputChannels, typename Processor>
+auto init(callbacks cb, Processor* processor, std::optional<bhas::backend> backend = std::nullopt) -> bool {
+	static_assert(NumOutputChannels > 0);
+	return bhas::init(std::move(cb), bhas::processor{&detail::process<NumOutputChannels, Processor>, processor, {NumOutputChannels}}, backend);
+}
 
 // Call this to shut down the audio system.
 // If a stream is currently active, this will block until it has finished.
@@ -160,6 +657,42 @@ auto request_stream(bhas::stream_request request) -> void;
 // the stream has finished (during the next call to update().)
 auto stop_stream() -> void;
 
+// Send a command to the audio thread. This never blocks or allocates.
+// Commands are executed in the audio thread, in the order they were
+// pushed, at the start of the next audio callback (before your audio
+// callback or processor is called.) If no stream is running they wait
+// in the queue until one is.
+// The queue is bounded. If it is full then the command is dropped,
+// the overflow count is incremented and false is returned.
+// Only call this from one thread (normally the main thread.)
+// e.g.
+//   bhas::push_command([&synth, gain = 0.5f]{ synth.gain = gain; });
+auto push_command(bhas::command cmd) -> bool;
+
+template <typename Fn>
+auto push_command(Fn fn) -> bool {
+	return bhas::push_command(bhas::make_command(std::move(fn)));
+}
+
+// Only call this from your audio callback or processor. Calls
+// fn(context, i) for every i in [0, count), spread across the worker
+// threads and the calling thread, and returns once they have all
+// finished. This never allocates. Jobs may run in any order and in
+// parallel, and must not call run_jobs() themselves. If the stream has
+// no worker threads then the jobs are just run in order.
+// e.g.
+//   bhas::run_jobs(num_voices, [&](uint32_t voice) { render(voice); });
+auto run_jobs(bhas::job_fn fn, void* context, uint32_t count) -> void;
+
+template <typename Fn>
+auto run_jobs(uint32_t count, Fn&& fn) -> void {
+	using F = std::remove_reference_t<Fn>;
+	bhas::run_jobs([](void* context, uint32_t index) -> void { (*static_cast<F*>(context))(index); }, const_cast<void*>(static_cast<const void*>(&fn)), count);
+}
+
+// How many commands have been dropped because the queue was full.
+[[nodiscard]] auto get_command_overflow_count() -> overflow_count;
+
 // Keep calling this at regular intervals, in your main thread.
 // If there is a pending stream_stopped callback to call, this is
 // where that will happen.
@@ -190,6 +723,47 @@ auto update() -> void;
 // Get the current CPU load.
 [[nodiscard]] auto get_cpu_load() -> cpu_load;
 
+// Get the callback timing statistics for the current stream. These are
+// reset whenever a stream is opened. Safe to call while the stream is
+// running, in which case the result may be a callback or two out of date.
+[[nodiscard]] auto get_callback_timing() -> callback_timing;
+
+// How many glitches the device has reported for the current stream, and
+// when the most recent ones were. These are reset whenever a stream is
+// opened. Safe to call while the stream is running.
+[[nodiscard]] auto get_xrun_stats() -> xrun_stats;
+
+// The current stream's meters. These are empty if there is no stream or
+// metering wasn't enabled for it. This never makes the audio thread wait.
+[[nodiscard]] auto get_meters() -> bhas::meters;
+
+// Lock one of your own buffers into memory and touch every page of it so
+// that your audio callback can't take a page fault on it. Returns false if
+// the operating system refused, usually because of RLIMIT_MEMLOCK. Call
+// unlock_memory() with the same arguments before you free it.
+[[nodiscard]] auto lock_memory(const void* ptr, size_t size) -> bool;
+auto unlock_memory(const void* ptr, size_t size) -> void;
+
+// How much memory bhas has locked, including yours, in whole pages. A
+// page which more than one buffer shares is only counted once.
+[[nodiscard]] auto get_locked_memory() -> byte_count;
+
+// The best instruction set this CPU supports, and the one which the
+// format conversions and the bhas_buffer.h kernels are currently using.
+[[nodiscard]] auto get_supported_instruction_set() -> instruction_set;
+[[nodiscard]] auto get_instruction_set() -> instruction_set;
+
+// Make the kernels use a slower instruction set than the best one, e.g.
+// to check that every path gives the same results. This stays in effect
+// across init(). Pass nullopt to go back to the best one. Returns false,
+// changing nothing, if the CPU doesn't support the instruction set. Only
+// call this from the main thread while no stream is running.
+auto force_instruction_set(std::optional<instruction_set> isa) -> bool;
+
+// What scheduling the audio thread of the current stream actually has.
+// This is nullopt until the first callback has run.
+[[nodiscard]] auto get_audio_thread_state() -> std::optional<audio_thread_state>;
+
 // Get the current stream if there is one.
 [[nodiscard]] auto get_current_stream() -> std::optional<bhas::stream>;
 
@@ -202,6 +776,7 @@ auto update() -> void;
 // Utilities
 [[nodiscard]] inline auto is_flag_set(device_flags mask, device_flags::e flag) -> bool { return (mask.value & flag) == flag; }
 [[nodiscard]] inline auto is_flag_set(host_flags mask, host_flags::e flag) -> bool     { return (mask.value & flag) == flag; }
+[[nodiscard]] inline auto is_flag_set(xrun_flags mask, xrun_flags::e flag) -> bool     { return (mask.value & flag) == flag; }
 
 namespace jack {
 
@@ -0,0 +1,76 @@
+#pragma once
+
+#include "bhas.h"
+#include <cstddef>
+
+// Vectorised kernels for the loops almost every audio callback needs. The
+// instruction set is picked at runtime (see bhas::get_instruction_set().)
+// Pointers don't need to be aligned, but the kernels run fastest when the
+// destination is aligned to 64 bytes.
+namespace bhas {
+namespace buffer {
+
+// One channel (or one interleaved buffer) of count samples.
+auto zero(float* dst, size_t count) -> void;
+auto copy(const float* src, float* dst, size_t count) -> void;
+auto apply_gain(float* dst, size_t count, float gain) -> void;
+// dst += src * gain
+auto mix(const float* src, float* dst, size_t count, float gain) -> void;
+// The largest absolute sample value
+[[nodiscard]] auto peak(const float* src, size_t count) -> float;
+
+// The peak and the sum of the squares of the samples, in one pass. The
+// RMS is sqrt(sum_of_squares / count). The sum is accumulated in a
+// different order by each instruction set, so it can differ between
+// machines in the last few bits.
+struct levels {
+	float peak = 0.0f;
+	float sum_of_squares = 0.0f;
+};
+
+[[nodiscard]] auto measure(const float* src, size_t count) -> levels;
+// The same for every channel of an interleaved buffer at once. out must
+// have room for num_channels results.
+auto measure(const float* src, bhas::channel_count num_channels, bhas::frame_count frame_count, levels* out) -> void;
+
+// Between one plane per channel and a single interleaved buffer of
+// frame_count * num_channels samples.
+auto interleave(bhas::input_buffer src, float* dst, bhas::channel_count num_channels, bhas::frame_count frame_count) -> void;
+auto deinterleave(const float* src, bhas::output_buffer dst, bhas::channel_count num_channels, bhas::frame_count frame_count) -> void;
+
+// Every channel of a non-interleaved buffer.
+inline
+auto zero(bhas::output_buffer dst, bhas::channel_count num_channels, bhas::frame_count frame_count) -> void {
+	for (uint32_t ch = 0; ch < num_channels.value; ch++) {
+		zero(dst.buffer[ch], frame_count.value);
+	}
+}
+
+inline
+auto copy(bhas::input_buffer src, bhas::output_buffer dst, bhas::channel_count num_channels, bhas::frame_count frame_count) -> void {
+	for (uint32_t ch = 0; ch < num_channels.value; ch++) {
+		copy(src.buffer[ch], dst.buffer[ch], frame_count.value);
+	}
+}
+
+inline
+auto apply_gain(bhas::output_buffer dst, bhas::channel_count num_channels, bhas::frame_count frame_count, float gain) -> void {
+	for (uint32_t ch = 0; ch < num_channels.value; ch++) {
+		apply_gain(dst.buffer[ch], frame_count.value, gain);
+	}
+}
+
+inline
+auto mix(bhas::input_buffer src, bhas::output_buffer dst, bhas::channel_count num_channels, bhas::frame_count frame_count, float gain) -> void {
+	for (uint32_t ch = 0; ch < num_channels.value; ch++) {
+		mix(src.buffer[ch], dst.buffer[ch], frame_count.value, gain);
+	}
+}
+
+[[nodiscard]] inline
+auto peak(bhas::input_buffer src, bhas::channel_index channel, bhas::frame_count frame_count) -> float {
+	return peak(src.buffer[channel.value], frame_count.value);
+}
+
+} // buffer
+} // bhas
@@ -1,8 +1,12 @@
 #include "bhas.h"
 #include "bhas_api.h"
-#include <condition_variable>
+#include "bhas_cpu.h"
+#include "bhas_engine.h"
+#include "bhas_rt.h"
+#include "bhas_spsc.h"
+#include "bhas_workers.h"
 #include <format>
-#include <mutex>
+#include <utility>
 
 namespace bhas {
 namespace impl {
@@ -15,18 +19,41 @@ struct Callbacks {
 	bhas::stream_start_success_cb stream_start_success;
 };
 
-struct Critical {
-	std::mutex mutex;
-	bhas::stream_stopped_cb stream_stopped_cb;
-	bool just_stopped = false;
+enum class stream_event_type {
+	stopped,
+};
+
+struct stream_event {
+	stream_event_type type;
+	uint64_t stream_serial;
+};
+
+// Events sent from the backend's threads to the main thread.
+// The sending side never blocks or allocates.
+struct StreamEvents {
+	static constexpr size_t RING_SIZE = 16;
+	spsc_ring<stream_event, RING_SIZE> ring;
+	// Set after something is pushed to the ring so that the main thread
+	// can check for events with a single relaxed load.
+	std::atomic<bool> pending = false;
+	// Serial number of the stream which is currently running, so that
+	// stale events from an older stream can be ignored.
+	std::atomic<uint64_t> running_stream_serial = 0;
 };
 
 struct Model {
 	Callbacks cb;
-	Critical critical;
+	StreamEvents events;
 	std::optional<bhas::stream_request> pending_stream_request;
 	std::optional<bhas::system> system;
 	std::optional<bhas::stream> current_stream;
+	uint64_t stream_serial = 0;
+	// The stream_stopped callback is only called if the user asked for
+	// the stream to be stopped.
+	bool stop_requested = false;
+	// Set if stop_stream() was called when no stream was running, so
+	// there will be no stopped event to wait for.
+	bool stopped_while_inactive = false;
 	bool init = false;
 };
 
@@ -143,20 +170,49 @@ auto find_output_device(const bhas::system& system, host_index host, const devic
 	return std::nullopt;
 }
 
+// Called in whatever thread the backend uses to tell us a stream finished.
+static
+auto push_stream_event(stream_event_type type) -> void {
+	const auto event = stream_event{type, model.events.running_stream_serial.load(std::memory_order_relaxed)};
+	// If the ring is full the event is dropped, but the main thread
+	// still wakes up and the only event type is idempotent anyway
+	(void)(model.events.ring.push(event));
+	model.events.pending.store(true, std::memory_order_release);
+	model.events.pending.notify_all();
+}
+
 [[nodiscard]] static
 auto make_stream_stopped_cb() -> bhas::stream_stopped_cb {
 	return []() -> void {
-		std::unique_lock<std::mutex> lock{model.critical.mutex};
-		auto stopped_cb = model.critical.stream_stopped_cb;
-		model.critical.stream_stopped_cb = {};
-		model.critical.just_stopped = true;
-		lock.unlock();
-		if (stopped_cb) {
-			stopped_cb();
-		}
+		push_stream_event(stream_event_type::stopped);
 	};
 };
 
+// Main thread. Calls fn(event) for each event that has been received.
+// The flag is cleared with an exchange rather than a store so that the
+// drain can't be reordered ahead of it. Otherwise an event pushed in
+// between would be left in the ring with the flag cleared.
+template <typename Fn> static
+auto receive_stream_events(Fn&& fn) -> void {
+	model.events.pending.exchange(false, std::memory_order_acq_rel);
+	model.events.ring.drain(fn);
+}
+
+// Main thread. Blocks until the stream with the given serial has stopped.
+// Other events which arrive in the meantime are discarded.
+static
+auto wait_for_stream_to_stop(uint64_t stream_serial) -> void {
+	auto stopped = false;
+	while (!stopped) {
+		model.events.pending.wait(false, std::memory_order_acquire);
+		receive_stream_events([stream_serial, &stopped](stream_event event) {
+			if (event.type == stream_event_type::stopped && event.stream_serial == stream_serial) {
+				stopped = true;
+			}
+		});
+	}
+}
+
 static
 auto stop_stream_and_request_a_new_one(bhas::stream_request request) -> void {
 	model.pending_stream_request = request;
@@ -197,20 +253,21 @@ auto did_stream_just_stop() -> bool {
 	if (!model.init) {
 		return false;
 	}
-	auto lock = std::unique_lock<std::mutex>(model.critical.mutex);
-	return model.critical.just_stopped;
+	return model.stopped_while_inactive || model.events.pending.load(std::memory_order_acquire);
 }
 
 static
-auto init(callbacks cb) -> bool {
+auto init(callbacks cb, std::optional<bhas::backend> backend) -> bool {
 	model.cb.report = std::move(cb.report);
+	cpu::select();
 	bhas::log log;
-	if (!api::init(&log)) {
+	if (!api::init(backend, &log)) {
 		model.cb.report(std::move(log));
 		return false;
 	}
 	api::set(make_stream_stopped_cb());
 	api::set(std::move(cb.audio));
+	api::set(bhas::processor{});
 	model.cb.stream_starting      = std::move(cb.stream_starting);
 	model.cb.stream_stopped       = std::move(cb.stream_stopped);
 	model.cb.stream_start_failure = std::move(cb.stream_start_failure);
@@ -219,6 +276,15 @@ auto init(callbacks cb) -> bool {
 	return true;
 }
 
+static
+auto init(callbacks cb, bhas::processor processor, std::optional<bhas::backend> backend) -> bool {
+	if (!impl::init(std::move(cb), backend)) {
+		return false;
+	}
+	api::set(processor);
+	return true;
+}
+
 static
 auto request_stream(bhas::stream_request request) -> void {
 	if (model.current_stream) {
@@ -229,18 +295,19 @@ auto request_stream(bhas::stream_request request) -> void {
 	bhas::stream stream;
 	bhas::log log;
 	log.push_back(info_requesting_stream(request));
-	if (!api::open_stream(request, &log, &stream.num_input_channels)) {
+	if (!api::open_stream(request, &log, &stream)) {
 		model.cb.report(std::move(log));
 		model.cb.stream_start_failure();
 		return;
 	}
 	stream.host                = system.devices.at(request.output_device.value).host;
 	stream.input_device        = request.input_device;
-	stream.num_output_channels = {2};
 	stream.output_device       = request.output_device;
 	stream.output_latency      = api::get_output_latency();
 	stream.sample_rate         = request.sample_rate;
 	model.current_stream       = stream;
+	model.stop_requested       = false;
+	model.events.running_stream_serial.store(++model.stream_serial, std::memory_order_relaxed);
 	model.cb.stream_starting(stream);
 	if (!api::start_stream(&log)) {
 		model.cb.report(std::move(log));
@@ -253,9 +320,13 @@ auto request_stream(bhas::stream_request request) -> void {
 
 static
 auto stop_stream() -> void {
-	std::unique_lock<std::mutex> lock{model.critical.mutex};
-	model.critical.stream_stopped_cb = model.cb.stream_stopped;
-	lock.unlock();
+	model.stop_requested = true;
+	if (!api::is_stream_active()) {
+		// The backend won't tell us about this one so
+		// it is handled during the next update()
+		model.stopped_while_inactive = true;
+		return;
+	}
 	bhas::log log;
 	api::stop_stream(&log);
 	model.cb.report(std::move(log));
@@ -263,58 +334,56 @@ auto stop_stream() -> void {
 
 static
 auto shutdown() -> void {
-	if (!model.current_stream) {
-		api::shutdown();
-		return;
+	if (model.current_stream && api::is_stream_active()) {
+		api::stop_stream(nullptr);
+		wait_for_stream_to_stop(model.stream_serial);
 	}
-	if (!api::is_stream_active()) {
-		api::shutdown();
-		return;
-	}
-	struct stop_info {
-		bool done = false;
-		std::mutex mutex;
-		std::condition_variable cv;
-	} info;
-	bhas::stream_stopped_cb cb;
-	cb = [&info]() {
-		std::unique_lock<std::mutex> lock{info.mutex};
-		info.done = true;
-		info.cv.notify_all();
-	};
-	std::unique_lock<std::mutex> lock{info.mutex};
-	model.critical.stream_stopped_cb = std::move(cb);
-	lock.unlock();
-	api::stop_stream(nullptr);
-	lock.lock();
-	info.cv.wait(lock, [&] { return info.done; });
+	bhas::log log;
+	api::close_stream(&log);
+	model.cb.report(std::move(log));
+	model.current_stream = std::nullopt;
+	// The next init() might pick a different backend
+	model.system = std::nullopt;
 	api::shutdown();
 }
 
+static
+auto on_stream_stopped() -> void {
+	if (std::exchange(model.stop_requested, false)) {
+		model.cb.stream_stopped();
+	}
+	// Close the stream
+	bhas::log log;
+	api::close_stream(&log);
+	model.cb.report(std::move(log));
+	model.current_stream = std::nullopt;
+	if (model.pending_stream_request) {
+		// If another stream request is pending, request the stream
+		const auto request = *model.pending_stream_request;
+		model.pending_stream_request = std::nullopt;
+		impl::request_stream(request);
+	}
+}
+
 static
 auto update() -> void {
-	if (!model.current_stream) {
+	auto log = rt::take_audio_thread_report();
+	rt::take_violation_report(&log);
+	if (!log.empty()) {
+		model.cb.report(std::move(log));
+	}
+	if (std::exchange(model.stopped_while_inactive, false)) {
+		on_stream_stopped();
+	}
+	if (!model.events.pending.load(std::memory_order_relaxed)) {
 		return;
 	}
-	std::unique_lock<std::mutex> lock{model.critical.mutex};
-	if (model.critical.just_stopped) {
-		model.critical.just_stopped = false;
-		// If the stream was just stopped, call the stream_stopped callbacks
-		auto stopped_cb = model.critical.stream_stopped_cb;
-		model.critical.stream_stopped_cb = {};
-		lock.unlock();
-		if (stopped_cb) {
-			stopped_cb();
-		}
-		// Close the stream
-		api::close_stream();
-		model.current_stream = std::nullopt;
-		if (model.pending_stream_request) {
-			// If another stream request is pending, request the stream
-			impl::request_stream(*model.pending_stream_request);
-			model.pending_stream_request = std::nullopt;
+	std::atomic_thread_fence(std::memory_order_acquire);
+	receive_stream_events([](stream_event event) {
+		if (event.type == stream_event_type::stopped && event.stream_serial == model.stream_serial && model.current_stream) {
+			on_stream_stopped();
 		}
-	}
+	});
 }
 
 [[nodiscard]] static
@@ -423,10 +492,18 @@ auto did_stream_just_stop() -> bool {
 	return false;
 }
 
-auto init(callbacks cb) -> bool {
+auto init(callbacks cb, std::optional<bhas::backend> backend) -> bool {
 	try {
-		impl::init(std::move(cb));
-		return true;
+		return impl::init(std::move(cb), backend);
+	}
+	catch (const std::exception& e) { impl::model.cb.report({impl::err_exception_caught({__func__}, e.what())}); }
+	catch (...)                     { impl::model.cb.report({impl::err_exception_caught({__func__})}); }
+	return false;
+}
+
+auto init(callbacks cb, bhas::processor processor, std::optional<bhas::backend> backend) -> bool {
+	try {
+		return impl::init(std::move(cb), processor, backend);
 	}
 	catch (const std::exception& e) { impl::model.cb.report({impl::err_exception_caught({__func__}, e.what())}); }
 	catch (...)                     { impl::model.cb.report({impl::err_exception_caught({__func__})}); }
@@ -483,6 +560,58 @@ auto make_request_from_user_config(const bhas::user_config& config) -> std::opti
 	return std::nullopt;
 }
 
+auto push_command(bhas::command cmd) -> bool {
+	return engine::push_command(cmd);
+}
+
+auto run_jobs(bhas::job_fn fn, void* context, uint32_t count) -> void {
+	workers::run(fn, context, count);
+}
+
+auto get_command_overflow_count() -> overflow_count {
+	return engine::get_command_overflow_count();
+}
+
+auto get_callback_timing() -> callback_timing {
+	return engine::get_callback_timing();
+}
+
+auto get_xrun_stats() -> xrun_stats {
+	return engine::get_xrun_stats();
+}
+
+auto get_audio_thread_state() -> std::optional<audio_thread_state> {
+	return rt::get_audio_thread_state();
+}
+
+auto get_meters() -> bhas::meters {
+	return api::get_meters();
+}
+
+auto lock_memory(const void* ptr, size_t size) -> bool {
+	return rt::lock_memory(rt::memory_owner::user, ptr, size);
+}
+
+auto unlock_memory(const void* ptr, size_t size) -> void {
+	rt::unlock_memory(rt::memory_owner::user, ptr, size);
+}
+
+auto get_locked_memory() -> byte_count {
+	return rt::get_locked_memory();
+}
+
+auto get_supported_instruction_set() -> instruction_set {
+	return cpu::get_supported();
+}
+
+auto get_instruction_set() -> instruction_set {
+	return cpu::get_active();
+}
+
+auto force_instruction_set(std::optional<instruction_set> isa) -> bool {
+	return cpu::force(isa);
+}
+
 namespace jack {
 
 auto set_client_name(std::string_view name) -> void {
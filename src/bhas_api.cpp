@@ -0,0 +1,127 @@
+#include "bhas_api.h"
+#include "bhas_api_stream.h"
+#include <format>
+
+namespace bhas {
+namespace api {
+
+struct ApiModel {
+	const Backend* backend = nullptr;
+};
+
+static ApiModel model;
+
+[[nodiscard]] static
+auto err_backend_not_built(bhas::backend backend) -> bhas::error {
+	return {std::format("The {} backend was requested but bhas was built without it.", get_backend_name(backend))};
+}
+
+[[nodiscard]] static
+auto find_backend(bhas::backend backend) -> const Backend* {
+	switch (backend) {
+#		if BHAS_PORTAUDIO
+		case bhas::backend::portaudio: return &portaudio::get_backend();
+#		endif
+#		if BHAS_ALSA
+		case bhas::backend::alsa:      return &alsa::get_backend();
+#		endif
+		case bhas::backend::null:      return &null::get_backend();
+		case bhas::backend::offline:   return &offline::get_backend();
+		case bhas::backend::loopback:  return &loopback::get_backend();
+		default:                       return nullptr;
+	}
+}
+
+auto get_backend_name(bhas::backend backend) -> const char* {
+	switch (backend) {
+		case bhas::backend::portaudio: return "PortAudio";
+		case bhas::backend::null:      return "null";
+		case bhas::backend::offline:   return "offline";
+		case bhas::backend::loopback:  return "loopback";
+		case bhas::backend::alsa:      return "ALSA";
+		default:                       return "unknown";
+	}
+}
+
+auto init(std::optional<bhas::backend> backend, bhas::log* log) -> bool {
+#	if BHAS_PORTAUDIO
+	const auto requested = backend.value_or(bhas::backend::portaudio);
+#	else
+	const auto requested = backend.value_or(bhas::backend::null);
+#	endif
+	const auto found = find_backend(requested);
+	if (!found) {
+		log->push_back(err_backend_not_built(requested));
+		return false;
+	}
+	if (!found->init(log)) {
+		return false;
+	}
+	model.backend = found;
+	return true;
+}
+
+auto check_if_supported_or_try_to_fall_back(bhas::stream_request request, bhas::log* log) -> std::optional<bhas::stream_request> {
+	return model.backend->check_if_supported_or_try_to_fall_back(std::move(request), log);
+}
+
+auto get_cpu_load() -> cpu_load {
+	return model.backend->get_cpu_load();
+}
+
+auto get_meters() -> bhas::meters {
+	return model.backend ? model.backend->get_meters() : bhas::meters{};
+}
+
+auto get_output_latency() -> bhas::output_latency {
+	return model.backend->get_output_latency();
+}
+
+auto get_stream_time() -> stream_time {
+	return model.backend->get_stream_time();
+}
+
+auto is_stream_active() -> bool {
+	return model.backend && model.backend->is_stream_active();
+}
+
+auto open_stream(bhas::stream_request request, bhas::log* log, bhas::stream* stream) -> bool {
+	return model.backend->open_stream(std::move(request), log, stream);
+}
+
+auto rescan() -> bhas::system {
+	return model.backend->rescan();
+}
+
+auto start_stream(bhas::log* log) -> bool {
+	return model.backend->start_stream(log);
+}
+
+auto close_stream(bhas::log* log) -> void {
+	if (model.backend) {
+		model.backend->close_stream(log);
+	}
+}
+
+auto shutdown() -> void {
+	if (model.backend) {
+		model.backend->shutdown();
+	}
+	model.backend = nullptr;
+}
+
+auto stop_stream(bhas::log* log) -> bool {
+	return model.backend->stop_stream(log);
+}
+
+namespace jack {
+
+auto set_client_name([[maybe_unused]] std::string_view name) -> void {
+#if BHAS_PORTAUDIO
+	portaudio::set_jack_client_name(name);
+#endif
+}
+
+} // jack
+} // api
+} // bhas
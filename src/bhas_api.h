@@ -7,16 +7,22 @@ namespace bhas {
 namespace api {
 
 [[nodiscard]] auto check_if_supported_or_try_to_fall_back(bhas::stream_request request, bhas::log* log) -> std::optional<bhas::stream_request>;
+[[nodiscard]] auto get_backend_name(bhas::backend backend) -> const char*;
 [[nodiscard]] auto get_cpu_load() -> cpu_load;
+[[nodiscard]] auto get_meters() -> bhas::meters;
 [[nodiscard]] auto get_output_latency() -> bhas::output_latency;
 [[nodiscard]] auto get_stream_time() -> stream_time;
-[[nodiscard]] auto init(bhas::log* log) -> bool;
+// Picks the backend which every other function here forwards to. If
+// backend is nullopt then it's PortAudio, or the null backend if the
+// library was built without PortAudio.
+[[nodiscard]] auto init(std::optional<bhas::backend> backend, bhas::log* log) -> bool;
 [[nodiscard]] auto is_stream_active() -> bool;
-[[nodiscard]] auto open_stream(bhas::stream_request request, bhas::log* log, bhas::channel_count* num_input_channels) -> bool;
+[[nodiscard]] auto open_stream(bhas::stream_request request, bhas::log* log, bhas::stream* stream) -> bool;
 [[nodiscard]] auto rescan() -> bhas::system;
 [[nodiscard]] auto start_stream(bhas::log* log) -> bool;
-auto close_stream() -> void;
+auto close_stream(bhas::log* log) -> void;
 auto set(audio_cb cb) -> void;
+auto set(bhas::processor processor) -> void;
 auto set(stream_stopped_cb cb) -> void;
 auto shutdown() -> void;
 auto stop_stream(bhas::log* log) -> bool;
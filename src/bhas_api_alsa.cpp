@@ -0,0 +1,1046 @@
+#include "bhas_api_stream.h"
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <format>
+#include <string>
+#include <utility>
+#include <vector>
+#include <alsa/asoundlib.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+// Talking to ALSA directly instead of through PortAudio. Transfers go
+// through the PCM's mmap area: each period the audio thread asks ALSA
+// where the next period lives in the hardware buffer and, if the sample
+// format and layout of the area are the ones the stream uses, that is
+// the buffer the engine hands to the user. Nothing is copied on the way
+// in or out apart from what the engine itself needs to do (conversion,
+// channel selection), and there is no thread but ours between the
+// hardware ring and the callback. The audio thread sleeps in poll() on
+// the PCMs' descriptors, which wake it once a period can be transferred.
+namespace bhas {
+namespace api {
+namespace alsa {
+
+static constexpr auto HOST_NAME                 = "ALSA";
+// How many frames each period has if the request doesn't say
+static constexpr auto DEFAULT_FRAMES_PER_BUFFER = bhas::frame_count{256};
+// The hardware buffer holds at least this many periods
+static constexpr auto MIN_PERIODS               = 2u;
+static constexpr auto PREFERRED_SAMPLE_RATE     = 48000u;
+// Plugins will happily claim thousands of channels
+static constexpr auto MAX_CHANNELS              = 64u;
+// Listed even if nothing hints at them, so that there is always a device
+// to test with
+static constexpr const char* EXTRA_PCM_NAMES[] = {"default", "null"};
+
+using clock = std::chrono::steady_clock;
+
+struct AlsaDevice {
+	std::string pcm_name;
+	uint32_t num_inputs = 0;
+	uint32_t num_outputs = 0;
+	bhas::sample_rate default_sample_rate;
+};
+
+// What a PCM is asked to do
+struct PcmSettings {
+	snd_pcm_format_t format = SND_PCM_FORMAT_FLOAT_LE;
+	bhas::buffer_layout layout = bhas::buffer_layout::interleaved;
+	uint32_t num_channels = 0;
+	uint32_t sample_rate = 0;
+};
+
+struct Pcm {
+	snd_pcm_t* handle = nullptr;
+	std::string name;
+	snd_pcm_format_t format = SND_PCM_FORMAT_FLOAT_LE;
+	uint32_t num_channels = 0;
+	size_t bytes_per_sample = 0;
+	snd_pcm_uframes_t period_size = 0;
+	snd_pcm_uframes_t buffer_size = 0;
+	// The slice of poll_fds which belongs to this PCM
+	size_t first_fd = 0;
+	size_t num_fds = 0;
+};
+
+struct AlsaModel {
+	std::optional<CurrentStream> current_stream;
+	// By device index. Filled in by rescan().
+	std::vector<AlsaDevice> devices;
+	Pcm playback;
+	// Only if the stream has an input device
+	Pcm capture;
+	// Set if the two PCMs start and stop together
+	bool linked = false;
+	// Where the device's side of the stream goes if the mmap area can't
+	// be handed over as it is
+	DeviceBuffers device;
+	// Channel pointers into the mmap area, for non-interleaved streams
+	std::vector<const void*> input_pointers;
+	std::vector<void*> output_pointers;
+	// Both PCMs' descriptors, followed by wake_fd
+	std::vector<pollfd> poll_fds;
+	// What poll() is actually given: the descriptors of whichever PCMs
+	// aren't ready yet, followed by wake_fd. The same size as poll_fds.
+	std::vector<pollfd> waiting_fds;
+	// An eventfd which the main thread writes to when it wants the audio
+	// thread to stop, so that it doesn't have to wait for the next period
+	int wake_fd = -1;
+	VirtualThread audio_thread;
+	// Written by the audio thread and only read once it has been joined
+	bhas::log thread_log;
+};
+
+static AlsaModel model;
+
+[[nodiscard]] static
+auto to_seconds(clock::time_point time) -> double {
+	return std::chrono::duration<double>{time.time_since_epoch()}.count();
+}
+
+[[nodiscard]] static
+auto to_alsa(bhas::sample_format format) -> snd_pcm_format_t {
+	switch (format) {
+		case bhas::sample_format::int16: return SND_PCM_FORMAT_S16_LE;
+		case bhas::sample_format::int24: return SND_PCM_FORMAT_S24_3LE;
+		case bhas::sample_format::int32: return SND_PCM_FORMAT_S32_LE;
+		default:                         return SND_PCM_FORMAT_FLOAT_LE;
+	}
+}
+
+[[nodiscard]] static
+auto to_alsa(bhas::buffer_layout layout) -> snd_pcm_access_t {
+	return layout == bhas::buffer_layout::interleaved ? SND_PCM_ACCESS_MMAP_INTERLEAVED : SND_PCM_ACCESS_MMAP_NONINTERLEAVED;
+}
+
+// Uses the mmap access which matches the layout if the PCM has it, or
+// any other mmap access if it doesn't, in which case the audio thread
+// copies.
+[[nodiscard]] static
+auto set_access(snd_pcm_t* pcm, snd_pcm_hw_params_t* params, bhas::buffer_layout layout) -> int {
+	for (const auto access : {to_alsa(layout), SND_PCM_ACCESS_MMAP_INTERLEAVED, SND_PCM_ACCESS_MMAP_NONINTERLEAVED, SND_PCM_ACCESS_MMAP_COMPLEX}) {
+		if (snd_pcm_hw_params_test_access(pcm, params, access) == 0) {
+			return snd_pcm_hw_params_set_access(pcm, params, access);
+		}
+	}
+	return -EINVAL;
+}
+
+// Narrows the PCM's configuration space down to the settings. Returns
+// the first error, or zero.
+[[nodiscard]] static
+auto restrict_hw_params(snd_pcm_t* pcm, snd_pcm_hw_params_t* params, const PcmSettings& settings) -> int {
+	int err;
+	if ((err = snd_pcm_hw_params_any(pcm, params)) < 0)                               { return err; }
+	if ((err = set_access(pcm, params, settings.layout)) < 0)                         { return err; }
+	if ((err = snd_pcm_hw_params_set_format(pcm, params, settings.format)) < 0)       { return err; }
+	if ((err = snd_pcm_hw_params_set_channels(pcm, params, settings.num_channels)) < 0) { return err; }
+	return snd_pcm_hw_params_set_rate(pcm, params, settings.sample_rate, 0);
+}
+
+[[nodiscard]] static
+auto is_supported(const std::string& name, snd_pcm_stream_t direction, const PcmSettings& settings) -> bool {
+	snd_pcm_t* pcm;
+	if (snd_pcm_open(&pcm, name.c_str(), direction, SND_PCM_NONBLOCK) < 0) {
+		return false;
+	}
+	snd_pcm_hw_params_t* params;
+	snd_pcm_hw_params_alloca(&params);
+	const auto ok = restrict_hw_params(pcm, params, settings) == 0;
+	snd_pcm_close(pcm);
+	return ok;
+}
+
+[[nodiscard]] static
+auto get_device_channels(const bhas::stream_request& request) -> DeviceChannels {
+	DeviceChannels devices;
+	devices.num_outputs = model.devices.at(request.output_device.value).num_outputs;
+	if (request.input_device) {
+		devices.num_inputs = model.devices.at(request.input_device->value).num_inputs;
+	}
+	return devices;
+}
+
+[[nodiscard]] static
+auto make_pcm_settings(const bhas::stream_request& request, bhas::sample_format format, uint32_t sample_rate, const ChannelMap& map) -> PcmSettings {
+	PcmSettings settings;
+	settings.format       = to_alsa(format);
+	settings.layout       = request.buffer_layout.value_or(bhas::buffer_layout::interleaved);
+	settings.num_channels = map.num_device_channels;
+	settings.sample_rate  = sample_rate;
+	return settings;
+}
+
+[[nodiscard]] static
+auto is_supported(const bhas::stream_request& request, bhas::sample_format format, uint32_t sample_rate) -> bool {
+	const auto devices    = get_device_channels(request);
+	const auto output_map = make_channel_map(get_num_output_channels(request), request.output_channels);
+	if (!is_supported(model.devices.at(request.output_device.value).pcm_name, SND_PCM_STREAM_PLAYBACK, make_pcm_settings(request, format, sample_rate, output_map))) {
+		return false;
+	}
+	if (!request.input_device) {
+		return true;
+	}
+	const auto input_map = make_channel_map(get_num_input_channels(request, devices), request.input_channels);
+	return is_supported(model.devices.at(request.input_device->value).pcm_name, SND_PCM_STREAM_CAPTURE, make_pcm_settings(request, format, sample_rate, input_map));
+}
+
+// Hardware is almost always integer underneath, so try those first,
+// best first.
+static
+auto resolve_sample_format(bhas::stream_request* request, bhas::log* log) -> void {
+	if (request->sample_format) {
+		return;
+	}
+	request->sample_format = bhas::sample_format::float32;
+	for (const auto format : {bhas::sample_format::int32, bhas::sample_format::int24, bhas::sample_format::int16}) {
+		if (is_supported(*request, format, get_device_sample_rate(*request).value)) {
+			request->sample_format = format;
+			break;
+		}
+	}
+	log->push_back(info_negotiated_sample_format(*request->sample_format));
+}
+
+static
+auto resolve_device_sample_rate(bhas::stream_request* request, bhas::log* log) -> void {
+	if (!request->resampler.enabled || request->resampler.device_sample_rate) {
+		return;
+	}
+	const auto format = request->sample_format.value_or(bhas::sample_format::float32);
+	if (is_supported(*request, format, request->sample_rate.value)) {
+		request->resampler.device_sample_rate = request->sample_rate;
+		return;
+	}
+	request->resampler.device_sample_rate = model.devices.at(request->output_device.value).default_sample_rate;
+	log->push_back(info_resampling(request->sample_rate, *request->resampler.device_sample_rate));
+}
+
+// The hardware is interleaved underneath, nearly always.
+static
+auto resolve_request(bhas::stream_request* request, bhas::log* log) -> void {
+	if (!request->buffer_layout) {
+		request->buffer_layout = bhas::buffer_layout::interleaved;
+	}
+	resolve_device_sample_rate(request, log);
+	resolve_sample_format(request, log);
+}
+
+[[nodiscard]] static
+auto err_pcm(const std::string& name, const char* what, int err) -> bhas::error {
+	return {std::format("Failed to {} '{}'. ({})", what, name, snd_strerror(err))};
+}
+
+[[nodiscard]] static
+auto warn_period_size_changed(const std::string& name, snd_pcm_uframes_t requested, snd_pcm_uframes_t actual) -> bhas::warning {
+	return {std::format("'{}' can't do periods of {} frames, so it will use {} frames.", name, requested, actual)};
+}
+
+[[nodiscard]] static
+auto err_period_size_mismatch(snd_pcm_uframes_t playback, snd_pcm_uframes_t capture) -> bhas::error {
+	return {std::format("The input and output devices can't agree on a period size. (The output wants {} frames and the input wants {}.)", playback, capture)};
+}
+
+static
+auto close_pcm(Pcm* pcm) -> void {
+	if (pcm->handle) {
+		snd_pcm_close(pcm->handle);
+	}
+	*pcm = {};
+}
+
+// Wakes the audio thread once a whole period can be transferred. Starting
+// is left to the audio thread, and the PCM only stops by itself on an
+// xrun.
+[[nodiscard]] static
+auto set_sw_params(Pcm* pcm) -> int {
+	snd_pcm_sw_params_t* params;
+	snd_pcm_sw_params_alloca(&params);
+	snd_pcm_uframes_t boundary;
+	int err;
+	if ((err = snd_pcm_sw_params_current(pcm->handle, params)) < 0)                             { return err; }
+	if ((err = snd_pcm_sw_params_get_boundary(params, &boundary)) < 0)                           { return err; }
+	if ((err = snd_pcm_sw_params_set_avail_min(pcm->handle, params, pcm->period_size)) < 0)      { return err; }
+	if ((err = snd_pcm_sw_params_set_start_threshold(pcm->handle, params, boundary)) < 0)        { return err; }
+	if ((err = snd_pcm_sw_params_set_stop_threshold(pcm->handle, params, pcm->buffer_size)) < 0) { return err; }
+	return snd_pcm_sw_params(pcm->handle, params);
+}
+
+[[nodiscard]] static
+auto open_pcm(const std::string& name, snd_pcm_stream_t direction, const PcmSettings& settings, snd_pcm_uframes_t period_size, uint32_t num_periods, Pcm* pcm, bhas::log* log) -> bool {
+	int err;
+	// Opened non-blocking so that a busy device fails straight away
+	// rather than waiting for whoever has it
+	if ((err = snd_pcm_open(&pcm->handle, name.c_str(), direction, SND_PCM_NONBLOCK)) < 0) {
+		pcm->handle = nullptr;
+		log->push_back(err_pcm(name, "open", err));
+		return false;
+	}
+	pcm->name             = name;
+	pcm->format           = settings.format;
+	pcm->num_channels     = settings.num_channels;
+	pcm->bytes_per_sample = size_t(snd_pcm_format_physical_width(settings.format) / 8);
+	snd_pcm_hw_params_t* params;
+	snd_pcm_hw_params_alloca(&params);
+	auto buffer_size = period_size * num_periods;
+	auto dir         = 0;
+	if ((err = restrict_hw_params(pcm->handle, params, settings)) < 0 ||
+		(err = snd_pcm_hw_params_set_period_size_near(pcm->handle, params, &period_size, &dir)) < 0 ||
+		(err = snd_pcm_hw_params_set_buffer_size_near(pcm->handle, params, &buffer_size)) < 0 ||
+		(err = snd_pcm_hw_params(pcm->handle, params)) < 0)
+	{
+		log->push_back(err_pcm(name, "configure", err));
+		close_pcm(pcm);
+		return false;
+	}
+	snd_pcm_hw_params_get_period_size(params, &pcm->period_size, &dir);
+	snd_pcm_hw_params_get_buffer_size(params, &pcm->buffer_size);
+	if ((err = set_sw_params(pcm)) < 0) {
+		log->push_back(err_pcm(name, "set up wake-ups for", err));
+		close_pcm(pcm);
+		return false;
+	}
+	return true;
+}
+
+static
+auto close_pcms() -> void {
+	if (model.linked) {
+		snd_pcm_unlink(model.capture.handle);
+		model.linked = false;
+	}
+	close_pcm(&model.capture);
+	close_pcm(&model.playback);
+	model.poll_fds.clear();
+	model.waiting_fds.clear();
+}
+
+static
+auto add_poll_fds(Pcm* pcm) -> void {
+	pcm->first_fd = model.poll_fds.size();
+	pcm->num_fds  = size_t(std::max(snd_pcm_poll_descriptors_count(pcm->handle), 0));
+	model.poll_fds.resize(pcm->first_fd + pcm->num_fds);
+	snd_pcm_poll_descriptors(pcm->handle, model.poll_fds.data() + pcm->first_fd, static_cast<unsigned int>(pcm->num_fds));
+}
+
+// The output is opened first and the input is asked for the same period
+// size, because the audio thread transfers one period of each at a time.
+// The two are linked if they can be, so that they start together and
+// stay in step.
+[[nodiscard]] static
+auto open_pcms(const bhas::stream_request& request, const ChannelMap& input_map, const ChannelMap& output_map, bhas::log* log) -> bool {
+	const auto format         = *request.sample_format;
+	const auto sample_rate    = get_device_sample_rate(request).value;
+	const auto period_size    = snd_pcm_uframes_t{request.frames_per_buffer.value_or(DEFAULT_FRAMES_PER_BUFFER).value};
+	const auto latency_frames = get_suggested_latency(request, 0.0) * sample_rate;
+	const auto num_periods    = std::max(MIN_PERIODS, static_cast<uint32_t>(std::ceil(latency_frames / double(period_size))));
+	const auto& output_name   = model.devices.at(request.output_device.value).pcm_name;
+	if (!open_pcm(output_name, SND_PCM_STREAM_PLAYBACK, make_pcm_settings(request, format, sample_rate, output_map), period_size, num_periods, &model.playback, log)) {
+		return false;
+	}
+	if (model.playback.period_size != period_size && request.frames_per_buffer) {
+		log->push_back(warn_period_size_changed(output_name, period_size, model.playback.period_size));
+	}
+	if (request.input_device) {
+		const auto& input_name = model.devices.at(request.input_device->value).pcm_name;
+		if (!open_pcm(input_name, SND_PCM_STREAM_CAPTURE, make_pcm_settings(request, format, sample_rate, input_map), model.playback.period_size, num_periods, &model.capture, log)) {
+			close_pcms();
+			return false;
+		}
+		if (model.capture.period_size != model.playback.period_size) {
+			log->push_back(err_period_size_mismatch(model.playback.period_size, model.capture.period_size));
+			close_pcms();
+			return false;
+		}
+		model.linked = snd_pcm_link(model.playback.handle, model.capture.handle) == 0;
+		add_poll_fds(&model.capture);
+	}
+	add_poll_fds(&model.playback);
+	return true;
+}
+
+// Where sample i of channel ch of an mmap area is
+[[nodiscard]] static
+auto get_area_sample(const snd_pcm_channel_area_t& area, snd_pcm_uframes_t offset) -> std::byte* {
+	return static_cast<std::byte*>(area.addr) + (area.first + offset * area.step) / 8;
+}
+
+// Whether the area is laid out exactly like a device buffer in the
+// stream's layout, so that it can be handed to the engine as it is.
+[[nodiscard]] static
+auto is_direct(const Pcm& pcm, const snd_pcm_channel_area_t* areas, bhas::buffer_layout layout) -> bool {
+	const auto bits = unsigned(pcm.bytes_per_sample * 8);
+	for (uint32_t ch = 0; ch < pcm.num_channels; ch++) {
+		const auto& area = areas[ch];
+		if (area.first % 8 != 0) {
+			return false;
+		}
+		if (layout == bhas::buffer_layout::interleaved) {
+			if (area.addr != areas[0].addr || area.first != areas[0].first + ch * bits || area.step != pcm.num_channels * bits) {
+				return false;
+			}
+		}
+		else if (area.step != bits) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// Where sample i of channel ch is in one of the device buffers, in
+// samples
+[[nodiscard]] static
+auto get_sample_index(const DeviceBuffers& device, bhas::buffer_layout layout, uint32_t num_channels, uint32_t ch, snd_pcm_uframes_t i) -> size_t {
+	if (layout == bhas::buffer_layout::interleaved) {
+		return size_t(i) * num_channels + ch;
+	}
+	return size_t(ch) * device.frames_per_buffer + size_t(i);
+}
+
+// Either points straight into the mmap area or copies it into the
+// device buffer.
+[[nodiscard]] static
+auto get_input(const CurrentStream& stream, const snd_pcm_channel_area_t* areas, snd_pcm_uframes_t offset, snd_pcm_uframes_t frames) -> const void* {
+	const auto& pcm = model.capture;
+	if (is_direct(pcm, areas, stream.buffer_layout)) {
+		if (stream.buffer_layout == bhas::buffer_layout::interleaved) {
+			return get_area_sample(areas[0], offset);
+		}
+		for (uint32_t ch = 0; ch < pcm.num_channels; ch++) {
+			model.input_pointers[ch] = get_area_sample(areas[ch], offset);
+		}
+		return model.input_pointers.data();
+	}
+	for (uint32_t ch = 0; ch < pcm.num_channels; ch++) {
+		for (snd_pcm_uframes_t i = 0; i < frames; i++) {
+			const auto dst = model.device.input_samples.data() + get_sample_index(model.device, stream.buffer_layout, pcm.num_channels, ch, i) * pcm.bytes_per_sample;
+			std::memcpy(dst, get_area_sample(areas[ch], offset + i), pcm.bytes_per_sample);
+		}
+	}
+	return model.device.input;
+}
+
+[[nodiscard]] static
+auto get_output(const CurrentStream& stream, const snd_pcm_channel_area_t* areas, snd_pcm_uframes_t offset, bool direct) -> void* {
+	const auto& pcm = model.playback;
+	if (!direct) {
+		return model.device.output;
+	}
+	if (stream.buffer_layout == bhas::buffer_layout::interleaved) {
+		return get_area_sample(areas[0], offset);
+	}
+	for (uint32_t ch = 0; ch < pcm.num_channels; ch++) {
+		model.output_pointers[ch] = get_area_sample(areas[ch], offset);
+	}
+	return model.output_pointers.data();
+}
+
+static
+auto put_output(const CurrentStream& stream, const snd_pcm_channel_area_t* areas, snd_pcm_uframes_t offset, snd_pcm_uframes_t frames) -> void {
+	const auto& pcm = model.playback;
+	for (uint32_t ch = 0; ch < pcm.num_channels; ch++) {
+		for (snd_pcm_uframes_t i = 0; i < frames; i++) {
+			const auto src = model.device.output_samples.data() + get_sample_index(model.device, stream.buffer_layout, pcm.num_channels, ch, i) * pcm.bytes_per_sample;
+			std::memcpy(get_area_sample(areas[ch], offset + i), src, pcm.bytes_per_sample);
+		}
+	}
+}
+
+// Fills whatever room there is in the playback buffer with silence and
+// starts both PCMs.
+[[nodiscard]] static
+auto prime_and_start() -> int {
+	int err;
+	if ((err = snd_pcm_prepare(model.playback.handle)) < 0) {
+		return err;
+	}
+	if (model.capture.handle && !model.linked && (err = snd_pcm_prepare(model.capture.handle)) < 0) {
+		return err;
+	}
+	auto avail = snd_pcm_avail_update(model.playback.handle);
+	while (avail > 0) {
+		const snd_pcm_channel_area_t* areas;
+		snd_pcm_uframes_t offset;
+		auto frames = snd_pcm_uframes_t(avail);
+		if ((err = snd_pcm_mmap_begin(model.playback.handle, &areas, &offset, &frames)) < 0) {
+			return err;
+		}
+		snd_pcm_areas_silence(areas, offset, model.playback.num_channels, frames, model.playback.format);
+		if (const auto committed = snd_pcm_mmap_commit(model.playback.handle, offset, frames); committed < 0) {
+			return int(committed);
+		}
+		avail -= snd_pcm_sframes_t(frames);
+	}
+	if (avail < 0) {
+		return int(avail);
+	}
+	if (model.capture.handle && !model.linked && (err = snd_pcm_start(model.capture.handle)) < 0) {
+		return err;
+	}
+	return snd_pcm_start(model.playback.handle);
+}
+
+[[nodiscard]] static
+auto err_failed_to_recover(const std::string& name, int err) -> bhas::error {
+	return {std::format("'{}' stopped and couldn't be restarted. ({})", name, snd_strerror(err))};
+}
+
+// After an xrun (or a suspend) both PCMs are stopped and restarted
+// together, so that the input and output stay the same distance apart.
+[[nodiscard]] static
+auto recover(Pcm* pcm, int err) -> bool {
+	if ((err = snd_pcm_recover(pcm->handle, err, 1)) < 0) {
+		model.thread_log.push_back(err_failed_to_recover(pcm->name, err));
+		return false;
+	}
+	if (model.capture.handle) {
+		snd_pcm_drop(model.capture.handle);
+	}
+	snd_pcm_drop(model.playback.handle);
+	if ((err = prime_and_start()) < 0) {
+		model.thread_log.push_back(err_failed_to_recover(pcm->name, err));
+		return false;
+	}
+	return true;
+}
+
+enum class Wait { ready, stop, error };
+
+struct Avail {
+	snd_pcm_sframes_t playback = 0;
+	snd_pcm_sframes_t capture = 0;
+};
+
+// Adds the PCM's descriptors to waiting_fds and returns where they
+// start.
+[[nodiscard]] static
+auto watch(const Pcm& pcm, size_t* num_waiting) -> size_t {
+	const auto first = *num_waiting;
+	std::copy_n(model.poll_fds.begin() + ptrdiff_t(pcm.first_fd), pcm.num_fds, model.waiting_fds.begin() + ptrdiff_t(first));
+	*num_waiting += pcm.num_fds;
+	return first;
+}
+
+// Some plugins only update their state when asked for the events, so
+// this is called for every PCM which was polled.
+[[nodiscard]] static
+auto get_revents(const Pcm& pcm, size_t first) -> unsigned short {
+	unsigned short revents = 0;
+	snd_pcm_poll_descriptors_revents(pcm.handle, model.waiting_fds.data() + first, static_cast<unsigned int>(pcm.num_fds), &revents);
+	return revents;
+}
+
+// What snd_pcm_avail_update() would have returned for a PCM whose
+// descriptors reported an error
+[[nodiscard]] static
+auto get_state_error(const Pcm& pcm) -> int {
+	switch (snd_pcm_state(pcm.handle)) {
+		case SND_PCM_STATE_SUSPENDED:    return -ESTRPIPE;
+		case SND_PCM_STATE_DISCONNECTED: return -ENODEV;
+		default:                         return -EPIPE;
+	}
+}
+
+[[nodiscard]] static
+auto err_device_stopped_responding(const std::string& name) -> bhas::error {
+	return {std::format("'{}' stopped responding, so the stream was stopped.", name)};
+}
+
+// Sleeps until a whole period can be written, and read if there's an
+// input, recovering from any xruns on the way. Only the PCMs which
+// aren't ready yet are polled, because one which is ready would make
+// poll() return straight away every time round. Linked PCMs run off the
+// same clock, so while the input isn't ready it's the only one polled.
+[[nodiscard]] static
+auto wait_for_period(int timeout_ms, Avail* avail, bhas::xrun_flags* xruns) -> Wait {
+	const auto period = snd_pcm_sframes_t(model.playback.period_size);
+	constexpr auto NOT_WATCHED = SIZE_MAX;
+	for (;;) {
+		if (model.audio_thread.stop_requested.load(std::memory_order_acquire)) {
+			return Wait::stop;
+		}
+		avail->playback = snd_pcm_avail_update(model.playback.handle);
+		if (avail->playback < 0) {
+			xruns->value |= bhas::xrun_flags::output_underflow;
+			if (!recover(&model.playback, int(avail->playback))) {
+				return Wait::error;
+			}
+			continue;
+		}
+		avail->capture = period;
+		if (model.capture.handle) {
+			avail->capture = snd_pcm_avail_update(model.capture.handle);
+			if (avail->capture < 0) {
+				xruns->value |= bhas::xrun_flags::input_overflow;
+				if (!recover(&model.capture, int(avail->capture))) {
+					return Wait::error;
+				}
+				continue;
+			}
+		}
+		if (avail->playback >= period && avail->capture >= period) {
+			return Wait::ready;
+		}
+		const auto need_capture  = avail->capture < period;
+		const auto need_playback = avail->playback < period && !(need_capture && model.linked);
+		size_t num_waiting = 0;
+		const auto capture_fds  = need_capture ? watch(model.capture, &num_waiting) : NOT_WATCHED;
+		const auto playback_fds = need_playback ? watch(model.playback, &num_waiting) : NOT_WATCHED;
+		model.waiting_fds[num_waiting++] = model.poll_fds.back();
+		const auto ready = ::poll(model.waiting_fds.data(), nfds_t(num_waiting), timeout_ms);
+		if (ready < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return Wait::error;
+		}
+		if (ready == 0) {
+			model.thread_log.push_back(err_device_stopped_responding(need_capture ? model.capture.name : model.playback.name));
+			return Wait::error;
+		}
+		// An error means the PCM has stopped (an xrun, a suspend or the
+		// device going away). Anything else means there's more room, which
+		// is picked up at the top of the loop.
+		if (capture_fds != NOT_WATCHED && (get_revents(model.capture, capture_fds) & POLLERR)) {
+			xruns->value |= bhas::xrun_flags::input_overflow;
+			if (!recover(&model.capture, get_state_error(model.capture))) {
+				return Wait::error;
+			}
+			// Both PCMs were restarted, so the playback events are stale
+			continue;
+		}
+		if (playback_fds != NOT_WATCHED && (get_revents(model.playback, playback_fds) & POLLERR)) {
+			xruns->value |= bhas::xrun_flags::output_underflow;
+			if (!recover(&model.playback, get_state_error(model.playback))) {
+				return Wait::error;
+			}
+		}
+	}
+}
+
+// Transfers one period, or as much of it as the areas hold before they
+// wrap around. Returns false if the PCMs couldn't be recovered.
+[[nodiscard]] static
+auto transfer(CurrentStream* stream, const Avail& avail, bhas::xrun_flags* xruns, bhas::callback_result* result) -> bool {
+	const auto rate = double(stream->device_sample_rate.value);
+	const snd_pcm_channel_area_t* in_areas = nullptr;
+	const snd_pcm_channel_area_t* out_areas;
+	snd_pcm_uframes_t in_offset  = 0;
+	snd_pcm_uframes_t out_offset;
+	snd_pcm_uframes_t in_frames  = model.playback.period_size;
+	snd_pcm_uframes_t out_frames = model.playback.period_size;
+	int err;
+	if (model.capture.handle && (err = snd_pcm_mmap_begin(model.capture.handle, &in_areas, &in_offset, &in_frames)) < 0) {
+		xruns->value |= bhas::xrun_flags::input_overflow;
+		return recover(&model.capture, err);
+	}
+	if ((err = snd_pcm_mmap_begin(model.playback.handle, &out_areas, &out_offset, &out_frames)) < 0) {
+		xruns->value |= bhas::xrun_flags::output_underflow;
+		return recover(&model.playback, err);
+	}
+	const auto frames = std::min(in_frames, out_frames);
+	const auto now    = clock::now();
+	bhas::time_info time_info;
+	time_info.current_time           = to_seconds(now);
+	time_info.input_buffer_adc_time  = time_info.current_time - double(avail.capture) / rate;
+	time_info.output_buffer_dac_time = time_info.current_time + double(snd_pcm_sframes_t(model.playback.buffer_size) - avail.playback) / rate;
+	const auto input      = in_areas ? get_input(*stream, in_areas, in_offset, frames) : nullptr;
+	const auto direct_out = is_direct(model.playback, out_areas, stream->buffer_layout);
+	*result = process(stream, input, get_output(*stream, out_areas, out_offset, direct_out), {uint32_t(frames)}, time_info, *xruns);
+	*xruns  = {};
+	if (!direct_out) {
+		put_output(*stream, out_areas, out_offset, frames);
+	}
+	const auto load = std::chrono::duration<double>{clock::now() - now}.count() * rate / double(frames);
+	model.audio_thread.cpu_load.store(model.audio_thread.cpu_load.load(std::memory_order_relaxed) * 0.9 + load * 0.1, std::memory_order_relaxed);
+	if (model.capture.handle) {
+		if (const auto committed = snd_pcm_mmap_commit(model.capture.handle, in_offset, frames); committed < 0 || snd_pcm_uframes_t(committed) != frames) {
+			xruns->value |= bhas::xrun_flags::input_overflow;
+			return recover(&model.capture, committed < 0 ? int(committed) : -EPIPE);
+		}
+	}
+	if (const auto committed = snd_pcm_mmap_commit(model.playback.handle, out_offset, frames); committed < 0 || snd_pcm_uframes_t(committed) != frames) {
+		xruns->value |= bhas::xrun_flags::output_underflow;
+		return recover(&model.playback, committed < 0 ? int(committed) : -EPIPE);
+	}
+	return true;
+}
+
+// Lets whatever is in the hardware buffer play out. The PCM is
+// non-blocking, so the drain only starts it, and the wait is a poll()
+// which the main thread can cut short through wake_fd. If it does, or
+// the drain takes longer than timeout_ms, the rest is thrown away.
+static
+auto drain(int timeout_ms) -> void {
+	const auto& pcm = model.playback;
+	if (snd_pcm_drain(pcm.handle) != -EAGAIN) {
+		return;
+	}
+	const auto deadline = clock::now() + std::chrono::milliseconds{timeout_ms};
+	while (snd_pcm_state(pcm.handle) == SND_PCM_STATE_DRAINING && !model.audio_thread.stop_requested.load(std::memory_order_acquire)) {
+		const auto remaining_ms = std::chrono::ceil<std::chrono::milliseconds>(deadline - clock::now()).count();
+		if (remaining_ms <= 0) {
+			break;
+		}
+		size_t num_waiting = 0;
+		const auto playback_fds = watch(pcm, &num_waiting);
+		model.waiting_fds[num_waiting++] = model.poll_fds.back();
+		if (::poll(model.waiting_fds.data(), nfds_t(num_waiting), int(remaining_ms)) < 0 && errno != EINTR) {
+			break;
+		}
+		static_cast<void>(get_revents(pcm, playback_fds));
+	}
+	if (snd_pcm_state(pcm.handle) == SND_PCM_STATE_DRAINING) {
+		snd_pcm_drop(pcm.handle);
+	}
+}
+
+// Once the user returns complete, whatever is already in the hardware
+// buffer is played out. Otherwise it's thrown away.
+static
+auto finish(bhas::callback_result result, int timeout_ms) -> void {
+	if (result == bhas::callback_result::complete) {
+		drain(timeout_ms);
+	}
+	else {
+		snd_pcm_drop(model.playback.handle);
+	}
+	if (model.capture.handle) {
+		snd_pcm_drop(model.capture.handle);
+	}
+}
+
+static
+auto audio_thread_main(CurrentStream* stream, DeviceBuffers*) -> void {
+	// Long enough never to time out normally, short enough to notice a
+	// device which has stopped waking us up
+	const auto timeout_ms = std::max(10, int(4000.0 * double(model.playback.buffer_size) / double(stream->device_sample_rate.value)));
+	auto result = bhas::callback_result::continue_;
+	bhas::xrun_flags xruns;
+	if (const auto err = prime_and_start(); err < 0) {
+		model.thread_log.push_back(err_pcm(model.playback.name, "start", err));
+		result = bhas::callback_result::abort;
+	}
+	while (result == bhas::callback_result::continue_) {
+		Avail avail;
+		const auto wait = wait_for_period(timeout_ms, &avail, &xruns);
+		if (wait != Wait::ready) {
+			result = bhas::callback_result::abort;
+			break;
+		}
+		if (!transfer(stream, avail, &xruns, &result)) {
+			result = bhas::callback_result::abort;
+		}
+	}
+	finish(result, timeout_ms);
+	model.audio_thread.active.store(false, std::memory_order_release);
+	on_stream_finished();
+}
+
+[[nodiscard]] static
+auto err_stream_settings_not_supported() -> bhas::error {
+	return {"The requested stream settings are not supported."};
+}
+
+[[nodiscard]] static
+auto check_if_supported_or_try_to_fall_back(bhas::stream_request request, bhas::log* log) -> std::optional<bhas::stream_request> {
+	resolve_request(&request, log);
+	if (!validate_request(request, get_device_channels(request), log)) {
+		return std::nullopt;
+	}
+	if (!is_supported(request, *request.sample_format, get_device_sample_rate(request).value)) {
+		log->push_back(err_stream_settings_not_supported());
+		return std::nullopt;
+	}
+	return request;
+}
+
+[[nodiscard]] static
+auto is_stream_active() -> bool {
+	return is_virtual_stream_active(model.current_stream, model.audio_thread);
+}
+
+[[nodiscard]] static
+auto get_cpu_load() -> cpu_load {
+	if (!is_stream_active()) {
+		return {0.0};
+	}
+	return {model.audio_thread.cpu_load.load(std::memory_order_relaxed)};
+}
+
+[[nodiscard]] static
+auto get_meters() -> bhas::meters {
+	return api::get_meters(model.current_stream);
+}
+
+[[nodiscard]] static
+auto get_output_latency() -> bhas::output_latency {
+	if (!model.current_stream) {
+		return {0.0};
+	}
+	return model.current_stream->output_latency;
+}
+
+[[nodiscard]] static
+auto get_stream_time() -> stream_time {
+	if (!is_stream_active()) {
+		return {0.0};
+	}
+	return {to_seconds(clock::now())};
+}
+
+// Every PCM name ALSA hints at, plus the extras. Hints without an IOID
+// go both ways.
+[[nodiscard]] static
+auto get_pcm_hints() -> std::vector<std::pair<std::string, std::string>> {
+	std::vector<std::pair<std::string, std::string>> names;
+	void** hints;
+	if (snd_device_name_hint(-1, "pcm", &hints) == 0) {
+		for (auto hint = hints; *hint; hint++) {
+			const auto name = snd_device_name_get_hint(*hint, "NAME");
+			const auto ioid = snd_device_name_get_hint(*hint, "IOID");
+			if (name) {
+				names.emplace_back(name, ioid ? ioid : "");
+			}
+			std::free(name);
+			std::free(ioid);
+		}
+		snd_device_name_free_hint(hints);
+	}
+	for (const auto extra : EXTRA_PCM_NAMES) {
+		if (std::none_of(names.begin(), names.end(), [extra](const auto& name) { return name.first == extra; })) {
+			names.emplace_back(extra, "");
+		}
+	}
+	return names;
+}
+
+struct PcmCaps {
+	uint32_t num_channels = 0;
+	uint32_t sample_rate = 0;
+};
+
+// Only PCMs which can be mmapped are any use.
+[[nodiscard]] static
+auto probe(const std::string& name, snd_pcm_stream_t direction) -> std::optional<PcmCaps> {
+	snd_pcm_t* pcm;
+	if (snd_pcm_open(&pcm, name.c_str(), direction, SND_PCM_NONBLOCK) < 0) {
+		return std::nullopt;
+	}
+	snd_pcm_hw_params_t* params;
+	snd_pcm_hw_params_alloca(&params);
+	std::optional<PcmCaps> caps;
+	if (snd_pcm_hw_params_any(pcm, params) >= 0 && set_access(pcm, params, bhas::buffer_layout::interleaved) >= 0) {
+		unsigned int channels = 0;
+		unsigned int rate     = PREFERRED_SAMPLE_RATE;
+		auto dir              = 0;
+		snd_pcm_hw_params_get_channels_max(params, &channels);
+		if (snd_pcm_hw_params_test_rate(pcm, params, rate, 0) < 0) {
+			snd_pcm_hw_params_get_rate_min(params, &rate, &dir);
+		}
+		caps = PcmCaps{std::min(channels, MAX_CHANNELS), rate};
+	}
+	snd_pcm_close(pcm);
+	return caps;
+}
+
+[[nodiscard]] static
+auto rescan() -> bhas::system {
+	model.devices.clear();
+	for (const auto& [name, ioid] : get_pcm_hints()) {
+		const auto playback = ioid != "Input" ? probe(name, SND_PCM_STREAM_PLAYBACK) : std::nullopt;
+		const auto capture  = ioid != "Output" ? probe(name, SND_PCM_STREAM_CAPTURE) : std::nullopt;
+		if (!playback && !capture) {
+			continue;
+		}
+		AlsaDevice device;
+		device.pcm_name                  = name;
+		device.num_inputs                = capture ? capture->num_channels : 0;
+		device.num_outputs               = playback ? playback->num_channels : 0;
+		device.default_sample_rate.value = playback ? playback->sample_rate : capture->sample_rate;
+		model.devices.push_back(std::move(device));
+	}
+	bhas::system system;
+	bhas::host host;
+	host.index      = bhas::host_index{0};
+	host.name.value = HOST_NAME;
+	for (size_t i = 0; i < model.devices.size(); i++) {
+		const auto& alsa_device = model.devices[i];
+		bhas::device device;
+		device.index                     = bhas::device_index{i};
+		device.host                      = host.index;
+		device.name.value                = alsa_device.pcm_name;
+		device.num_channels.value        = alsa_device.num_inputs;
+		device.num_output_channels.value = alsa_device.num_outputs;
+		device.default_sample_rate       = alsa_device.default_sample_rate;
+		if (alsa_device.num_inputs > 0)  { device.flags.value |= bhas::device_flags::input; }
+		if (alsa_device.num_outputs > 0) { device.flags.value |= bhas::device_flags::output; }
+		// Whatever the user has set up as the default, or else the first
+		// one there is
+		const auto is_default = alsa_device.pcm_name == "default";
+		if (alsa_device.num_inputs > 0 && (is_default || !host.default_input_device))   { host.default_input_device  = device.index; }
+		if (alsa_device.num_outputs > 0 && (is_default || !host.default_output_device)) { host.default_output_device = device.index; }
+		host.devices.push_back(device.index);
+		system.devices.push_back(device);
+	}
+	system.hosts.push_back(host);
+	system.default_host          = host.index;
+	system.default_input_device  = host.default_input_device.value_or(bhas::device_index{0});
+	system.default_output_device = host.default_output_device.value_or(bhas::device_index{0});
+	return system;
+}
+
+[[nodiscard]] static
+auto warn_failed_to_lock_device_memory() -> bhas::warning {
+	return {"Failed to lock the ALSA device buffers. The audio thread may take page faults. (Check RLIMIT_MEMLOCK.)"};
+}
+
+[[nodiscard]] static
+auto info_open_stream_success(const Pcm& pcm) -> bhas::info {
+	return {std::format("Stream opened successfully. ({} periods of {} frames.)", pcm.buffer_size / pcm.period_size, pcm.period_size)};
+}
+
+[[nodiscard]] static
+auto open_stream(bhas::stream_request request, bhas::log* log, bhas::stream* stream_info) -> bool {
+	if (model.current_stream) {
+		log->push_back(warn_stream_already_open());
+		return false;
+	}
+	resolve_request(&request, log);
+	const auto devices = get_device_channels(request);
+	if (!validate_request(request, devices, log)) {
+		return false;
+	}
+	const auto input_map  = request.input_device ? make_channel_map(get_num_input_channels(request, devices), request.input_channels) : ChannelMap{};
+	const auto output_map = make_channel_map(get_num_output_channels(request), request.output_channels);
+	if (!open_pcms(request, input_map, output_map, log)) {
+		return false;
+	}
+	// What the device actually does is what gets reported
+	request.frames_per_buffer = bhas::frame_count{uint32_t(model.playback.period_size)};
+	auto& stream = model.current_stream.emplace();
+	if (!prepare_stream(request, devices, input_map, output_map, log, &stream)) {
+		release_stream(&model.current_stream);
+		close_pcms();
+		return false;
+	}
+	make_device_buffers(request, stream, request.frames_per_buffer->value, &model.device);
+	model.input_pointers.assign(input_map.num_device_channels, nullptr);
+	model.output_pointers.assign(output_map.num_device_channels, nullptr);
+	model.poll_fds.push_back({model.wake_fd, POLLIN, 0});
+	model.waiting_fds.resize(model.poll_fds.size());
+	log->push_back(info_open_stream_success(model.playback));
+	if (request.realtime_memory.enabled && !lock_device_buffers(model.device)) {
+		log->push_back(warn_failed_to_lock_device_memory());
+	}
+	// A period is recorded before the audio thread sees it, and the
+	// whole hardware buffer is queued up in front of each period played.
+	const auto rate = double(stream.device_sample_rate.value);
+	const auto input_latency  = bhas::seconds{double(model.capture.period_size) / rate};
+	const auto output_latency = bhas::seconds{double(model.playback.buffer_size) / rate};
+	finish_opening_stream(request, input_latency, output_latency, log, &stream, stream_info);
+	return true;
+}
+
+[[nodiscard]] static
+auto start_stream(bhas::log* log) -> bool {
+	return start_virtual_thread(&model.audio_thread, audio_thread_main, &model.current_stream, &model.device, log);
+}
+
+// Cuts the audio thread's poll() short so that it doesn't have to wait
+// for the next period to see that it's been asked to stop.
+static
+auto wake_audio_thread() -> void {
+	const uint64_t one = 1;
+	static_cast<void>(::write(model.wake_fd, &one, sizeof(one)));
+}
+
+static
+auto join_audio_thread(bhas::log* log) -> void {
+	if (!model.audio_thread.thread.joinable()) {
+		return;
+	}
+	join_virtual_thread(&model.audio_thread);
+	uint64_t count;
+	static_cast<void>(::read(model.wake_fd, &count, sizeof(count)));
+	if (log) {
+		log->insert(log->end(), model.thread_log.begin(), model.thread_log.end());
+	}
+	model.thread_log.clear();
+}
+
+[[nodiscard]] static
+auto stop_stream(bhas::log* log) -> bool {
+	join_audio_thread(log);
+	return true;
+}
+
+static
+auto close_stream(bhas::log* log) -> void {
+	join_audio_thread(log);
+	close_pcms();
+	release_stream(&model.current_stream);
+	model.device = {};
+}
+
+[[nodiscard]] static
+auto err_failed_to_create_wake_fd(int err) -> bhas::error {
+	return {std::format("Failed to initialize the ALSA backend. ({})", std::strerror(err))};
+}
+
+// ALSA itself needs no initializing, only the descriptor for waking the
+// audio thread.
+[[nodiscard]] static
+auto init(bhas::log* log) -> bool {
+	if (model.wake_fd >= 0) {
+		return true;
+	}
+	model.wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (model.wake_fd < 0) {
+		log->push_back(err_failed_to_create_wake_fd(errno));
+		return false;
+	}
+	model.audio_thread.wake = wake_audio_thread;
+	return true;
+}
+
+static
+auto shutdown() -> void {
+	close_stream(nullptr);
+	if (model.wake_fd >= 0) {
+		::close(model.wake_fd);
+		model.wake_fd = -1;
+	}
+	model.devices.clear();
+	snd_config_update_free_global();
+}
+
+static constexpr Backend BACKEND = {
+	check_if_supported_or_try_to_fall_back,
+	get_cpu_load,
+	get_meters,
+	get_output_latency,
+	get_stream_time,
+	init,
+	is_stream_active,
+	open_stream,
+	rescan,
+	start_stream,
+	close_stream,
+	shutdown,
+	stop_stream,
+};
+
+auto get_backend() -> const Backend& {
+	return BACKEND;
+}
+
+} // alsa
+} // api
+} // bhas
@@ -0,0 +1,417 @@
+#include "bhas_api_stream.h"
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <format>
+
+// A backend whose single device is wired back to itself. Whatever the
+// callback writes to output channel N is recorded by input channel N a
+// fixed number of frames later, so round-trip latency can be measured
+// exactly. Like the null backend the callback is run from a thread of our
+// own which sleeps until each buffer is due, but the device's clock can
+// be made to drift against the system clock and each callback can be
+// woken late by a random amount, so that drift estimation and xrun
+// handling can be tested and reproduced without a sound card.
+namespace bhas {
+namespace api {
+namespace loopback {
+
+static constexpr auto HOST_NAME                 = "Loopback";
+static constexpr auto DEVICE_NAME               = "Loopback device";
+static constexpr auto NUM_CHANNELS              = uint32_t{8};
+static constexpr auto DEFAULT_SAMPLE_RATE       = bhas::sample_rate{48000};
+// How many frames each callback gets if the request doesn't say
+static constexpr auto DEFAULT_FRAMES_PER_BUFFER = bhas::frame_count{256};
+// Anything further out than this is a mistake rather than a test
+static constexpr auto MAX_DRIFT_PPM             = 100'000.0;
+
+using clock = std::chrono::steady_clock;
+
+// What came out of the device's outputs, waiting to go back into its
+// inputs. One run of ring_frames samples per channel, in the stream's
+// sample format. The size is a power of two so that positions can be
+// masked, and at least delay plus a buffer so that a callback never reads
+// anything it's about to overwrite.
+struct Ring {
+	std::vector<std::byte> samples;
+	uint64_t frames = 0;
+	size_t bytes_per_sample = 0;
+};
+
+// A small, fast generator, so that the jitter is the same on every
+// platform for the same seed.
+struct Xorshift {
+	uint32_t state = 1;
+};
+
+struct LoopbackModel {
+	std::optional<CurrentStream> current_stream;
+	DeviceBuffers device;
+	Ring ring;
+	uint32_t delay = 0;
+	double drift_ppm = 0.0;
+	double jitter = 0.0;
+	uint32_t seed = 1;
+	VirtualThread audio_thread;
+};
+
+static LoopbackModel model;
+
+[[nodiscard]] static
+auto to_seconds(clock::time_point time) -> double {
+	return std::chrono::duration<double>{time.time_since_epoch()}.count();
+}
+
+[[nodiscard]] static
+auto next(Xorshift* rng) -> uint32_t {
+	auto x = rng->state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return rng->state = x;
+}
+
+// In [0, 1)
+[[nodiscard]] static
+auto next_unit(Xorshift* rng) -> double {
+	return double(next(rng)) / 4294967296.0;
+}
+
+// How many frames the device plays per second of system time
+[[nodiscard]] static
+auto get_device_rate(const CurrentStream& stream) -> double {
+	return double(stream.device_sample_rate.value) * (1.0 + model.drift_ppm * 1e-6);
+}
+
+[[nodiscard]] static
+auto get_buffer_duration(const CurrentStream& stream, const DeviceBuffers& device) -> double {
+	return double(device.frames_per_buffer) / double(stream.device_sample_rate.value);
+}
+
+// Where sample i of channel ch is in one of the device's buffers, in
+// samples
+[[nodiscard]] static
+auto get_sample_index(const CurrentStream& stream, const DeviceBuffers& device, uint32_t num_channels, uint32_t ch, uint32_t i) -> size_t {
+	if (stream.buffer_layout == bhas::buffer_layout::interleaved) {
+		return size_t(i) * num_channels + ch;
+	}
+	return size_t(ch) * device.frames_per_buffer + i;
+}
+
+[[nodiscard]] static
+auto get_ring_sample(Ring* ring, uint32_t ch, uint64_t pos) -> std::byte* {
+	return ring->samples.data() + (ch * ring->frames + (pos & (ring->frames - 1))) * ring->bytes_per_sample;
+}
+
+// Fills the device's input buffer with what it played delay frames
+// before frame.
+static
+auto record(const CurrentStream* stream, DeviceBuffers* device, uint64_t frame) -> void {
+	const auto num_channels = stream->input_map.num_device_channels;
+	const auto bps          = model.ring.bytes_per_sample;
+	const auto from         = frame - model.delay;
+	for (uint32_t ch = 0; ch < num_channels; ch++) {
+		for (uint32_t i = 0; i < device->frames_per_buffer; i++) {
+			const auto dst = device->input_samples.data() + get_sample_index(*stream, *device, num_channels, ch, i) * bps;
+			std::memcpy(dst, get_ring_sample(&model.ring, ch, from + i), bps);
+		}
+	}
+}
+
+// Stores what the device is about to play, starting at frame.
+static
+auto play(const CurrentStream* stream, const DeviceBuffers* device, uint64_t frame) -> void {
+	const auto num_channels = stream->output_map.num_device_channels;
+	const auto bps          = model.ring.bytes_per_sample;
+	for (uint32_t ch = 0; ch < num_channels; ch++) {
+		for (uint32_t i = 0; i < device->frames_per_buffer; i++) {
+			const auto src = device->output_samples.data() + get_sample_index(*stream, *device, num_channels, ch, i) * bps;
+			std::memcpy(get_ring_sample(&model.ring, ch, frame + i), src, bps);
+		}
+	}
+}
+
+// Nothing was played for the frames which were skipped, so nothing comes
+// back for them either.
+static
+auto skip(uint64_t from, uint64_t to) -> void {
+	const auto count = std::min(to - from, model.ring.frames);
+	const auto bps   = model.ring.bytes_per_sample;
+	for (uint32_t ch = 0; ch < NUM_CHANNELS; ch++) {
+		for (uint64_t pos = from; pos < from + count; pos++) {
+			std::memset(get_ring_sample(&model.ring, ch, pos), 0, bps);
+		}
+	}
+}
+
+// The same as the null backend's audio thread, apart from the loop back
+// through the ring, the device clock running at its drifted rate, and
+// each wake-up being pushed back by the jitter. The jitter doesn't move
+// the deadlines, only when the callback actually happens, so a late
+// callback only loses its buffer if it's more than a whole buffer late.
+static
+auto audio_thread_main(CurrentStream* stream, DeviceBuffers* device) -> void {
+	const auto rate            = get_device_rate(*stream);
+	const auto buffer_duration = get_buffer_duration(*stream, *device);
+	const auto input_latency   = buffer_duration;
+	const auto output_latency  = double(model.delay) / double(stream->device_sample_rate.value) - buffer_duration;
+	const auto start           = clock::now();
+	const auto get_deadline    = [start, rate](uint64_t frame) -> clock::time_point {
+		return start + std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>{double(frame) / rate});
+	};
+	Xorshift rng{model.seed != 0 ? model.seed : 1};
+	uint64_t frame = 0;
+	bhas::xrun_flags xruns;
+	while (!model.audio_thread.stop_requested.load(std::memory_order_acquire)) {
+		const auto deadline = get_deadline(frame);
+		const auto late     = std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>{model.jitter * next_unit(&rng)});
+		rt::sleep_until(deadline + late);
+		const auto now = clock::now();
+		bhas::time_info time_info;
+		time_info.current_time           = to_seconds(now);
+		time_info.input_buffer_adc_time  = to_seconds(deadline) - input_latency;
+		time_info.output_buffer_dac_time = to_seconds(deadline) + output_latency;
+		if (device->input) {
+			record(stream, device, frame);
+		}
+		const auto result = process(stream, device->input, device->output, {device->frames_per_buffer}, time_info, xruns);
+		const auto done   = clock::now();
+		const auto load   = std::chrono::duration<double>{done - now}.count() / buffer_duration;
+		model.audio_thread.cpu_load.store(model.audio_thread.cpu_load.load(std::memory_order_relaxed) * 0.9 + load * 0.1, std::memory_order_relaxed);
+		if (result == bhas::callback_result::abort) {
+			break;
+		}
+		play(stream, device, frame);
+		if (result == bhas::callback_result::complete) {
+			break;
+		}
+		frame += device->frames_per_buffer;
+		xruns = {};
+		if (done > get_deadline(frame + device->frames_per_buffer)) {
+			xruns.value = bhas::xrun_flags::input_overflow | bhas::xrun_flags::output_underflow;
+			const auto resume = static_cast<uint64_t>(std::chrono::duration<double>{done - start}.count() * rate);
+			skip(frame, resume);
+			frame = resume;
+		}
+	}
+	model.audio_thread.active.store(false, std::memory_order_release);
+	on_stream_finished();
+}
+
+[[nodiscard]] static
+auto make_device_channels() -> DeviceChannels {
+	return {NUM_CHANNELS, NUM_CHANNELS};
+}
+
+[[nodiscard]] static
+auto err_delay_too_short(bhas::frame_count delay, bhas::frame_count frames_per_buffer) -> bhas::error {
+	return {std::format("A loopback delay of {} frames was requested, but it can't be shorter than the buffer size ({} frames.)", delay.value, frames_per_buffer.value)};
+}
+
+[[nodiscard]] static
+auto err_invalid_drift(double drift_ppm) -> bhas::error {
+	return {std::format("A loopback clock drift of {} ppm was requested. It has to be within +/-{} ppm.", drift_ppm, MAX_DRIFT_PPM)};
+}
+
+[[nodiscard]] static
+auto err_invalid_jitter(bhas::seconds jitter) -> bhas::error {
+	return {std::format("A loopback jitter of {} seconds was requested. It can't be negative.", jitter.value)};
+}
+
+// Anything goes, like the null backend, except that the loopback delay
+// is filled in.
+static
+auto resolve_request(bhas::stream_request* request, bhas::log* log) -> void {
+	resolve_virtual_request(request, bhas::buffer_layout::non_interleaved, log);
+	if (!request->frames_per_buffer) {
+		request->frames_per_buffer = DEFAULT_FRAMES_PER_BUFFER;
+	}
+	if (!request->loopback.delay) {
+		request->loopback.delay = bhas::frame_count{request->frames_per_buffer->value * 2};
+	}
+}
+
+[[nodiscard]] static
+auto validate_request(const bhas::stream_request& request, bhas::log* log) -> bool {
+	if (!validate_virtual_request(request, make_device_channels(), log)) {
+		return false;
+	}
+	if (request.loopback.delay->value < request.frames_per_buffer->value) {
+		log->push_back(err_delay_too_short(*request.loopback.delay, *request.frames_per_buffer));
+		return false;
+	}
+	if (!(std::abs(request.loopback.drift_ppm) <= MAX_DRIFT_PPM)) {
+		log->push_back(err_invalid_drift(request.loopback.drift_ppm));
+		return false;
+	}
+	if (!(request.loopback.jitter.value >= 0.0)) {
+		log->push_back(err_invalid_jitter(request.loopback.jitter));
+		return false;
+	}
+	return true;
+}
+
+[[nodiscard]] static
+auto check_if_supported_or_try_to_fall_back(bhas::stream_request request, bhas::log* log) -> std::optional<bhas::stream_request> {
+	resolve_request(&request, log);
+	if (!validate_request(request, log)) {
+		return std::nullopt;
+	}
+	return request;
+}
+
+[[nodiscard]] static
+auto is_stream_active() -> bool {
+	return is_virtual_stream_active(model.current_stream, model.audio_thread);
+}
+
+[[nodiscard]] static
+auto get_cpu_load() -> cpu_load {
+	if (!is_stream_active()) {
+		return {0.0};
+	}
+	return {model.audio_thread.cpu_load.load(std::memory_order_relaxed)};
+}
+
+[[nodiscard]] static
+auto get_meters() -> bhas::meters {
+	return api::get_meters(model.current_stream);
+}
+
+[[nodiscard]] static
+auto get_output_latency() -> bhas::output_latency {
+	if (!model.current_stream) {
+		return {0.0};
+	}
+	return model.current_stream->output_latency;
+}
+
+[[nodiscard]] static
+auto get_stream_time() -> stream_time {
+	if (!is_stream_active()) {
+		return {0.0};
+	}
+	return {to_seconds(clock::now())};
+}
+
+[[nodiscard]] static
+auto init(bhas::log*) -> bool {
+	return true;
+}
+
+[[nodiscard]] static
+auto rescan() -> bhas::system {
+	return make_single_device_system(HOST_NAME, DEVICE_NAME, make_device_channels(), DEFAULT_SAMPLE_RATE);
+}
+
+[[nodiscard]] static
+auto warn_failed_to_lock_device_memory() -> bhas::warning {
+	return {"Failed to lock the loopback device's buffers. The audio thread may take page faults. (Check RLIMIT_MEMLOCK.)"};
+}
+
+[[nodiscard]] static
+auto info_open_stream_success() -> bhas::info {
+	return {"Stream opened successfully."};
+}
+
+[[nodiscard]] static
+auto info_loopback(const bhas::loopback_config& config) -> bhas::info {
+	return {std::format("Looping the output back to the input after {} frames, with {} ppm of clock drift and up to {} seconds of jitter.", config.delay->value, config.drift_ppm, config.jitter.value)};
+}
+
+static
+auto make_ring(const CurrentStream& stream, uint32_t delay, uint32_t frames_per_buffer, Ring* ring) -> void {
+	ring->frames           = std::bit_ceil(uint64_t{delay} + frames_per_buffer);
+	ring->bytes_per_sample = convert::get_bytes_per_sample(stream.conversion.format);
+	ring->samples.assign(size_t(ring->frames) * NUM_CHANNELS * ring->bytes_per_sample, std::byte{0});
+}
+
+[[nodiscard]] static
+auto open_stream(bhas::stream_request request, bhas::log* log, bhas::stream* stream_info) -> bool {
+	if (model.current_stream) {
+		log->push_back(warn_stream_already_open());
+		return false;
+	}
+	resolve_request(&request, log);
+	if (!validate_request(request, log)) {
+		return false;
+	}
+	const auto devices    = make_device_channels();
+	const auto input_map  = request.input_device ? make_channel_map(get_num_input_channels(request, devices), request.input_channels) : ChannelMap{};
+	const auto output_map = make_channel_map(get_num_output_channels(request), request.output_channels);
+	auto& stream = model.current_stream.emplace();
+	if (!prepare_stream(request, devices, input_map, output_map, log, &stream)) {
+		release_stream(&model.current_stream);
+		return false;
+	}
+	make_device_buffers(request, stream, request.frames_per_buffer->value, &model.device);
+	model.delay     = request.loopback.delay->value;
+	model.drift_ppm = request.loopback.drift_ppm;
+	model.jitter    = request.loopback.jitter.value;
+	model.seed      = request.loopback.seed;
+	make_ring(stream, model.delay, model.device.frames_per_buffer, &model.ring);
+	log->push_back(info_open_stream_success());
+	log->push_back(info_loopback(request.loopback));
+	if (request.realtime_memory.enabled && !(lock_device_buffers(model.device) && rt::lock_memory(rt::memory_owner::engine, model.ring.samples.data(), model.ring.samples.size()))) {
+		log->push_back(warn_failed_to_lock_device_memory());
+	}
+	// A buffer is recorded while the previous one is processed, and the
+	// rest of the delay is on the way out, so the two add up to the
+	// round trip.
+	const auto rate = double(stream.device_sample_rate.value);
+	const auto input_latency  = bhas::seconds{double(model.device.frames_per_buffer) / rate};
+	const auto output_latency = bhas::seconds{double(model.delay - model.device.frames_per_buffer) / rate};
+	finish_opening_stream(request, input_latency, output_latency, log, &stream, stream_info);
+	return true;
+}
+
+[[nodiscard]] static
+auto start_stream(bhas::log* log) -> bool {
+	return start_virtual_thread(&model.audio_thread, audio_thread_main, &model.current_stream, &model.device, log);
+}
+
+[[nodiscard]] static
+auto stop_stream(bhas::log*) -> bool {
+	join_virtual_thread(&model.audio_thread);
+	return true;
+}
+
+static
+auto close_stream(bhas::log*) -> void {
+	join_virtual_thread(&model.audio_thread);
+	release_stream(&model.current_stream);
+	model.device = {};
+	model.ring   = {};
+}
+
+static
+auto shutdown() -> void {
+	close_stream(nullptr);
+}
+
+static constexpr Backend BACKEND = {
+	check_if_supported_or_try_to_fall_back,
+	get_cpu_load,
+	get_meters,
+	get_output_latency,
+	get_stream_time,
+	init,
+	is_stream_active,
+	open_stream,
+	rescan,
+	start_stream,
+	close_stream,
+	shutdown,
+	stop_stream,
+};
+
+auto get_backend() -> const Backend& {
+	return BACKEND;
+}
+
+} // loopback
+} // api
+} // bhas
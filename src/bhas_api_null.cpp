@@ -0,0 +1,241 @@
+#include "bhas_api_stream.h"
+#include <atomic>
+#include <chrono>
+
+// A backend with no hardware behind it. There is one device which
+// records silence and throws its output away, and the audio callback is
+// run from a thread of our own which sleeps until each buffer is due.
+// Everything between the device and the user is the same as for any
+// other backend, so this is enough to exercise the whole engine on
+// machines without a sound card.
+namespace bhas {
+namespace api {
+namespace null {
+
+static constexpr auto HOST_NAME                 = "Null";
+static constexpr auto DEVICE_NAME               = "Null device";
+static constexpr auto NUM_CHANNELS              = uint32_t{8};
+static constexpr auto DEFAULT_SAMPLE_RATE       = bhas::sample_rate{48000};
+// How many frames each callback gets if the request doesn't say
+static constexpr auto DEFAULT_FRAMES_PER_BUFFER = bhas::frame_count{256};
+
+// steady_clock is CLOCK_MONOTONIC on Linux, which is what the timer
+// sleeps on, so the deadlines and the times reported to the user agree.
+using clock = std::chrono::steady_clock;
+
+struct NullModel {
+	std::optional<CurrentStream> current_stream;
+	DeviceBuffers device;
+	VirtualThread audio_thread;
+};
+
+static NullModel model;
+
+[[nodiscard]] static
+auto to_seconds(clock::time_point time) -> double {
+	return std::chrono::duration<double>{time.time_since_epoch()}.count();
+}
+
+[[nodiscard]] static
+auto get_buffer_duration(const CurrentStream& stream, const DeviceBuffers& device) -> double {
+	return double(device.frames_per_buffer) / double(stream.device_sample_rate.value);
+}
+
+// Each buffer is due when the previous one would have finished playing.
+// Deadlines are worked out from the total frame count rather than by
+// adding up buffer durations, so rounding never accumulates into drift.
+// If the user takes longer than a whole buffer to return, a real device
+// would have run out of output and dropped some input, so the next
+// callback reports that and the clock skips ahead instead of trying to
+// catch up with a burst of callbacks.
+static
+auto audio_thread_main(CurrentStream* stream, DeviceBuffers* device) -> void {
+	const auto rate            = double(stream->device_sample_rate.value);
+	const auto buffer_duration = get_buffer_duration(*stream, *device);
+	const auto start           = clock::now();
+	const auto get_deadline    = [start, rate](uint64_t frame) -> clock::time_point {
+		return start + std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>{double(frame) / rate});
+	};
+	uint64_t frame = 0;
+	bhas::xrun_flags xruns;
+	while (!model.audio_thread.stop_requested.load(std::memory_order_acquire)) {
+		const auto deadline = get_deadline(frame);
+		rt::sleep_until(deadline);
+		const auto now = clock::now();
+		bhas::time_info time_info;
+		time_info.current_time           = to_seconds(now);
+		time_info.input_buffer_adc_time  = to_seconds(deadline) - buffer_duration;
+		time_info.output_buffer_dac_time = to_seconds(deadline) + buffer_duration;
+		const auto result = process(stream, device->input, device->output, {device->frames_per_buffer}, time_info, xruns);
+		const auto done   = clock::now();
+		const auto load   = std::chrono::duration<double>{done - now}.count() / buffer_duration;
+		model.audio_thread.cpu_load.store(model.audio_thread.cpu_load.load(std::memory_order_relaxed) * 0.9 + load * 0.1, std::memory_order_relaxed);
+		if (result != bhas::callback_result::continue_) {
+			break;
+		}
+		frame += device->frames_per_buffer;
+		xruns = {};
+		if (done > get_deadline(frame + device->frames_per_buffer)) {
+			xruns.value = bhas::xrun_flags::input_overflow | bhas::xrun_flags::output_underflow;
+			frame = static_cast<uint64_t>(std::chrono::duration<double>{done - start}.count() * rate);
+		}
+	}
+	model.audio_thread.active.store(false, std::memory_order_release);
+	on_stream_finished();
+}
+
+[[nodiscard]] static
+auto make_device_channels() -> DeviceChannels {
+	return {NUM_CHANNELS, NUM_CHANNELS};
+}
+
+// Anything goes, so the request is taken as it is.
+static
+auto resolve_request(bhas::stream_request* request, bhas::log* log) -> void {
+	resolve_virtual_request(request, bhas::buffer_layout::non_interleaved, log);
+}
+
+[[nodiscard]] static
+auto validate_request(const bhas::stream_request& request, bhas::log* log) -> bool {
+	return validate_virtual_request(request, make_device_channels(), log);
+}
+
+[[nodiscard]] static
+auto check_if_supported_or_try_to_fall_back(bhas::stream_request request, bhas::log* log) -> std::optional<bhas::stream_request> {
+	resolve_request(&request, log);
+	if (!validate_request(request, log)) {
+		return std::nullopt;
+	}
+	return request;
+}
+
+[[nodiscard]] static
+auto is_stream_active() -> bool {
+	return is_virtual_stream_active(model.current_stream, model.audio_thread);
+}
+
+[[nodiscard]] static
+auto get_cpu_load() -> cpu_load {
+	if (!is_stream_active()) {
+		return {0.0};
+	}
+	return {model.audio_thread.cpu_load.load(std::memory_order_relaxed)};
+}
+
+[[nodiscard]] static
+auto get_meters() -> bhas::meters {
+	return api::get_meters(model.current_stream);
+}
+
+[[nodiscard]] static
+auto get_output_latency() -> bhas::output_latency {
+	if (!model.current_stream) {
+		return {0.0};
+	}
+	return model.current_stream->output_latency;
+}
+
+[[nodiscard]] static
+auto get_stream_time() -> stream_time {
+	if (!is_stream_active()) {
+		return {0.0};
+	}
+	return {to_seconds(clock::now())};
+}
+
+[[nodiscard]] static
+auto init(bhas::log*) -> bool {
+	return true;
+}
+
+[[nodiscard]] static
+auto rescan() -> bhas::system {
+	return make_single_device_system(HOST_NAME, DEVICE_NAME, make_device_channels(), DEFAULT_SAMPLE_RATE);
+}
+
+[[nodiscard]] static
+auto warn_failed_to_lock_device_memory() -> bhas::warning {
+	return {"Failed to lock the null device's buffers. The audio thread may take page faults. (Check RLIMIT_MEMLOCK.)"};
+}
+
+[[nodiscard]] static
+auto info_open_stream_success() -> bhas::info {
+	return {"Stream opened successfully."};
+}
+
+[[nodiscard]] static
+auto open_stream(bhas::stream_request request, bhas::log* log, bhas::stream* stream_info) -> bool {
+	if (model.current_stream) {
+		log->push_back(warn_stream_already_open());
+		return false;
+	}
+	resolve_request(&request, log);
+	if (!validate_request(request, log)) {
+		return false;
+	}
+	const auto devices    = make_device_channels();
+	const auto input_map  = request.input_device ? make_channel_map(get_num_input_channels(request, devices), request.input_channels) : ChannelMap{};
+	const auto output_map = make_channel_map(get_num_output_channels(request), request.output_channels);
+	auto& stream = model.current_stream.emplace();
+	if (!prepare_stream(request, devices, input_map, output_map, log, &stream)) {
+		release_stream(&model.current_stream);
+		return false;
+	}
+	make_device_buffers(request, stream, request.frames_per_buffer.value_or(DEFAULT_FRAMES_PER_BUFFER).value, &model.device);
+	log->push_back(info_open_stream_success());
+	if (request.realtime_memory.enabled && !lock_device_buffers(model.device)) {
+		log->push_back(warn_failed_to_lock_device_memory());
+	}
+	// One buffer is being captured while the previous one is processed,
+	// and one is playing while the next one is processed
+	const auto buffer_duration = bhas::seconds{get_buffer_duration(stream, model.device)};
+	finish_opening_stream(request, buffer_duration, buffer_duration, log, &stream, stream_info);
+	return true;
+}
+
+[[nodiscard]] static
+auto start_stream(bhas::log* log) -> bool {
+	return start_virtual_thread(&model.audio_thread, audio_thread_main, &model.current_stream, &model.device, log);
+}
+
+[[nodiscard]] static
+auto stop_stream(bhas::log*) -> bool {
+	join_virtual_thread(&model.audio_thread);
+	return true;
+}
+
+static
+auto close_stream(bhas::log*) -> void {
+	join_virtual_thread(&model.audio_thread);
+	release_stream(&model.current_stream);
+	model.device = {};
+}
+
+static
+auto shutdown() -> void {
+	close_stream(nullptr);
+}
+
+static constexpr Backend BACKEND = {
+	check_if_supported_or_try_to_fall_back,
+	get_cpu_load,
+	get_meters,
+	get_output_latency,
+	get_stream_time,
+	init,
+	is_stream_active,
+	open_stream,
+	rescan,
+	start_stream,
+	close_stream,
+	shutdown,
+	stop_stream,
+};
+
+auto get_backend() -> const Backend& {
+	return BACKEND;
+}
+
+} // null
+} // api
+} // bhas
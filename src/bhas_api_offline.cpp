@@ -0,0 +1,331 @@
+#include "bhas_api_stream.h"
+#include "bhas_wav.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <format>
+
+// A backend which renders as fast as it can instead of in real time.
+// The audio callback is called back-to-back from a thread of our own and
+// whatever it produces is written to a WAV file. Time is counted in
+// frames rather than read from a clock, so a render comes out the same
+// however long it takes and however many times it's repeated.
+namespace bhas {
+namespace api {
+namespace offline {
+
+static constexpr auto HOST_NAME                 = "Offline";
+static constexpr auto DEVICE_NAME               = "Offline renderer";
+static constexpr auto NUM_INPUT_CHANNELS        = uint32_t{8};
+static constexpr auto NUM_OUTPUT_CHANNELS       = uint32_t{32};
+static constexpr auto DEFAULT_SAMPLE_RATE       = bhas::sample_rate{48000};
+// Bigger than a real-time backend would use, because nobody is waiting
+// for the first buffer and fewer callbacks means less overhead.
+static constexpr auto DEFAULT_FRAMES_PER_BUFFER = bhas::frame_count{1024};
+
+using clock = std::chrono::steady_clock;
+
+struct OfflineModel {
+	std::optional<CurrentStream> current_stream;
+	DeviceBuffers device;
+	std::optional<wav::writer> writer;
+	std::optional<uint64_t> num_frames;
+	// The engine's own output latency (re-blocking, resampling) in device
+	// frames. That many frames of silence are rendered at the start and
+	// left out of the file, and the render runs that much longer to make
+	// up for them, so the file lines up with the callback's frame 0.
+	uint64_t latency_frames = 0;
+	// For writing part of a non-interleaved buffer
+	std::vector<const void*> output_pointers;
+	// Its cpu_load is how long each buffer took to render and write, as a
+	// fraction of how long it would take to play
+	VirtualThread render_thread;
+	std::atomic<uint64_t> frames_rendered = 0;
+	// Written by the render thread and only read once it has been joined
+	bhas::log render_log;
+};
+
+static OfflineModel model;
+
+[[nodiscard]] static
+auto err_failed_to_write_output() -> bhas::error {
+	return {"The offline render stopped early because its output couldn't be written."};
+}
+
+[[nodiscard]] static
+auto info_render_finished(uint64_t frames, double audio_seconds, double render_seconds) -> bhas::info {
+	return {std::format("Rendered {} frames ({:.1f} seconds of audio) in {:.2f} seconds, {:.0f}x real time.", frames, audio_seconds, render_seconds, render_seconds > 0.0 ? audio_seconds / render_seconds : 0.0)};
+}
+
+// Writes frames [offset, offset + count) of the device's output buffer.
+[[nodiscard]] static
+auto write_output(wav::writer* writer, const CurrentStream& stream, const DeviceBuffers& device, uint32_t offset, uint32_t count) -> bool {
+	if (stream.buffer_layout == bhas::buffer_layout::interleaved) {
+		return wav::write(writer, static_cast<const std::byte*>(device.output) + size_t(offset) * writer->bytes_per_frame, count);
+	}
+	const auto bytes_per_sample = writer->bytes_per_frame / writer->format.num_channels.value;
+	for (size_t ch = 0; ch < device.output_pointers.size(); ch++) {
+		model.output_pointers[ch] = static_cast<const std::byte*>(device.output_pointers[ch]) + size_t(offset) * bytes_per_sample;
+	}
+	return wav::write(writer, model.output_pointers.data(), count);
+}
+
+// The last buffer is cut short if num_frames isn't a multiple of the
+// buffer size. A buffer for which the user returned abort is thrown away,
+// like a device would.
+static
+auto render_thread_main(CurrentStream* stream, DeviceBuffers* device) -> void {
+	const auto rate  = double(stream->device_sample_rate.value);
+	const auto start = clock::now();
+	const auto total = model.num_frames ? std::optional{*model.num_frames + model.latency_frames} : std::nullopt;
+	uint64_t frame = 0;
+	while (!model.render_thread.stop_requested.load(std::memory_order_acquire)) {
+		auto frames = device->frames_per_buffer;
+		if (total) {
+			if (frame >= *total) {
+				break;
+			}
+			frames = uint32_t(std::min<uint64_t>(frames, *total - frame));
+		}
+		const auto begin = clock::now();
+		bhas::time_info time_info;
+		time_info.current_time           = double(frame) / rate;
+		time_info.input_buffer_adc_time  = time_info.current_time;
+		time_info.output_buffer_dac_time = time_info.current_time;
+		const auto result = process(stream, device->input, device->output, {frames}, time_info, {});
+		if (result == bhas::callback_result::abort) {
+			break;
+		}
+		const auto skip = uint32_t(std::min<uint64_t>(frames, model.latency_frames - std::min(frame, model.latency_frames)));
+		if (model.writer && skip < frames && !write_output(&*model.writer, *stream, *device, skip, frames - skip)) {
+			model.render_log.push_back(err_failed_to_write_output());
+			break;
+		}
+		frame += frames;
+		model.frames_rendered.store(frame, std::memory_order_relaxed);
+		const auto load = std::chrono::duration<double>{clock::now() - begin}.count() * rate / frames;
+		model.render_thread.cpu_load.store(model.render_thread.cpu_load.load(std::memory_order_relaxed) * 0.9 + load * 0.1, std::memory_order_relaxed);
+		if (result == bhas::callback_result::complete) {
+			break;
+		}
+	}
+	if (model.writer) {
+		// Any error has already been reported by the writer
+		static_cast<void>(wav::close(&*model.writer, &model.render_log));
+		model.writer = std::nullopt;
+	}
+	const auto output_frames = frame - std::min(frame, model.latency_frames);
+	model.render_log.push_back(info_render_finished(output_frames, double(output_frames) / rate, std::chrono::duration<double>{clock::now() - start}.count()));
+	model.render_thread.active.store(false, std::memory_order_release);
+	on_stream_finished();
+}
+
+[[nodiscard]] static
+auto make_device_channels() -> DeviceChannels {
+	return {NUM_INPUT_CHANNELS, NUM_OUTPUT_CHANNELS};
+}
+
+// WAV files are interleaved, so that's the native layout.
+static
+auto resolve_request(bhas::stream_request* request, bhas::log* log) -> void {
+	resolve_virtual_request(request, bhas::buffer_layout::interleaved, log);
+}
+
+[[nodiscard]] static
+auto err_render_ahead_not_supported() -> bhas::error {
+	return {"Render-ahead was requested for an offline render. Nothing would wait for the render thread, so blocks would be dropped depending on how the threads were scheduled. Turn render-ahead off."};
+}
+
+[[nodiscard]] static
+auto validate_request(const bhas::stream_request& request, bhas::log* log) -> bool {
+	if (request.render_ahead.value) {
+		log->push_back(err_render_ahead_not_supported());
+		return false;
+	}
+	return validate_virtual_request(request, make_device_channels(), log);
+}
+
+[[nodiscard]] static
+auto check_if_supported_or_try_to_fall_back(bhas::stream_request request, bhas::log* log) -> std::optional<bhas::stream_request> {
+	resolve_request(&request, log);
+	if (!validate_request(request, log)) {
+		return std::nullopt;
+	}
+	return request;
+}
+
+[[nodiscard]] static
+auto is_stream_active() -> bool {
+	return is_virtual_stream_active(model.current_stream, model.render_thread);
+}
+
+[[nodiscard]] static
+auto get_cpu_load() -> cpu_load {
+	if (!is_stream_active()) {
+		return {0.0};
+	}
+	return {model.render_thread.cpu_load.load(std::memory_order_relaxed)};
+}
+
+[[nodiscard]] static
+auto get_meters() -> bhas::meters {
+	return api::get_meters(model.current_stream);
+}
+
+[[nodiscard]] static
+auto get_output_latency() -> bhas::output_latency {
+	if (!model.current_stream) {
+		return {0.0};
+	}
+	return model.current_stream->output_latency;
+}
+
+// How far the render has got, in seconds of audio
+[[nodiscard]] static
+auto get_stream_time() -> stream_time {
+	if (!model.current_stream) {
+		return {0.0};
+	}
+	return {double(model.frames_rendered.load(std::memory_order_relaxed)) / double(model.current_stream->device_sample_rate.value)};
+}
+
+[[nodiscard]] static
+auto init(bhas::log*) -> bool {
+	return true;
+}
+
+[[nodiscard]] static
+auto rescan() -> bhas::system {
+	return make_single_device_system(HOST_NAME, DEVICE_NAME, make_device_channels(), DEFAULT_SAMPLE_RATE);
+}
+
+[[nodiscard]] static
+auto warn_failed_to_lock_device_memory() -> bhas::warning {
+	return {"Failed to lock the offline renderer's buffers. The render thread may take page faults. (Check RLIMIT_MEMLOCK.)"};
+}
+
+[[nodiscard]] static
+auto info_open_stream_success(const std::string& path) -> bhas::info {
+	if (path.empty()) {
+		return {"Stream opened successfully. The output will be thrown away."};
+	}
+	return {std::format("Stream opened successfully. Rendering to '{}'.", path)};
+}
+
+[[nodiscard]] static
+auto open_stream(bhas::stream_request request, bhas::log* log, bhas::stream* stream_info) -> bool {
+	if (model.current_stream) {
+		log->push_back(warn_stream_already_open());
+		return false;
+	}
+	resolve_request(&request, log);
+	if (!validate_request(request, log)) {
+		return false;
+	}
+	const auto devices    = make_device_channels();
+	const auto input_map  = request.input_device ? make_channel_map(get_num_input_channels(request, devices), request.input_channels) : ChannelMap{};
+	const auto output_map = make_channel_map(get_num_output_channels(request), request.output_channels);
+	if (!request.offline.path.empty()) {
+		wav::format format;
+		format.sample_format = *request.sample_format;
+		format.num_channels  = {output_map.num_device_channels};
+		format.sample_rate   = get_device_sample_rate(request);
+		if (!wav::open(request.offline.path, format, &model.writer.emplace(), log)) {
+			model.writer = std::nullopt;
+			return false;
+		}
+	}
+	auto& stream = model.current_stream.emplace();
+	if (!prepare_stream(request, devices, input_map, output_map, log, &stream)) {
+		release_stream(&model.current_stream);
+		if (model.writer) {
+			static_cast<void>(wav::close(&*model.writer, log));
+			model.writer = std::nullopt;
+		}
+		return false;
+	}
+	// Nothing else is setting the pace, so an input file is never allowed
+	// to fall behind
+	if (stream.input_file) {
+		stream.input_file->wait_for_data = true;
+	}
+	make_device_buffers(request, stream, request.frames_per_buffer.value_or(DEFAULT_FRAMES_PER_BUFFER).value, &model.device);
+	model.num_frames = request.offline.num_frames;
+	model.frames_rendered.store(0, std::memory_order_relaxed);
+	log->push_back(info_open_stream_success(request.offline.path));
+	if (request.realtime_memory.enabled && !lock_device_buffers(model.device)) {
+		log->push_back(warn_failed_to_lock_device_memory());
+	}
+	// Nothing is played or recorded, so the device adds no latency. Only
+	// the engine's own (re-blocking, resampling) is reported, and that's
+	// taken back out of the file.
+	finish_opening_stream(request, bhas::seconds{0.0}, bhas::seconds{0.0}, log, &stream, stream_info);
+	model.latency_frames = uint64_t(std::llround(stream.output_latency.value * double(stream.device_sample_rate.value)));
+	model.output_pointers.resize(model.device.output_pointers.size());
+	return true;
+}
+
+[[nodiscard]] static
+auto start_stream(bhas::log* log) -> bool {
+	return start_virtual_thread(&model.render_thread, render_thread_main, &model.current_stream, &model.device, log);
+}
+
+// Once this returns the file is complete and closed.
+static
+auto join_render_thread(bhas::log* log) -> void {
+	join_virtual_thread(&model.render_thread);
+	if (log) {
+		log->insert(log->end(), model.render_log.begin(), model.render_log.end());
+	}
+	model.render_log.clear();
+}
+
+[[nodiscard]] static
+auto stop_stream(bhas::log* log) -> bool {
+	join_render_thread(log);
+	return true;
+}
+
+static
+auto close_stream(bhas::log* log) -> void {
+	join_render_thread(log);
+	// If the stream was never started then the file still needs its header
+	if (model.writer) {
+		static_cast<void>(wav::close(&*model.writer, log ? log : &model.render_log));
+		model.writer = std::nullopt;
+		model.render_log.clear();
+	}
+	release_stream(&model.current_stream);
+	model.device = {};
+	model.output_pointers.clear();
+}
+
+static
+auto shutdown() -> void {
+	close_stream(nullptr);
+}
+
+static constexpr Backend BACKEND = {
+	check_if_supported_or_try_to_fall_back,
+	get_cpu_load,
+	get_meters,
+	get_output_latency,
+	get_stream_time,
+	init,
+	is_stream_active,
+	open_stream,
+	rescan,
+	start_stream,
+	close_stream,
+	shutdown,
+	stop_stream,
+};
+
+auto get_backend() -> const Backend& {
+	return BACKEND;
+}
+
+} // offline
+} // api
+} // bhas
@@ -1,7 +1,5 @@
-#include "bhas_api.h"
+#include "bhas_api_stream.h"
 #include <format>
-#include <mutex>
-#include <numeric>
 #include <portaudio.h>
 #ifdef _WIN32
 #include <pa_asio.h>
@@ -13,22 +11,12 @@
 
 namespace bhas {
 namespace api {
-
-struct Callbacks {
-	bhas::audio_cb audio;
-	bhas::stream_stopped_cb stream_stopped;
-};
-
-struct CurrentStream {
-	PaStream* pa_stream = nullptr;
-	PaHostApiTypeId host_type;
-	bhas::sample_rate sample_rate;
-	bhas::output_latency output_latency;
-};
+namespace portaudio {
 
 struct PaModel {
-	Callbacks cb;
 	std::optional<CurrentStream> current_stream;
+	PaStream* pa_stream = nullptr;
+	PaHostApiTypeId host_type;
 };
 
 static PaModel model;
@@ -39,6 +27,14 @@ struct pa_stream_parameters {
 	PaStreamParameters* input_params_ptr  = nullptr;
 	PaStreamParameters* output_params_ptr = nullptr;
 	const PaDeviceInfo* output_device_info = nullptr;
+	ChannelMap input_map;
+	ChannelMap output_map;
+#	ifdef _WIN32
+	PaAsioStreamInfo input_asio_info = {0};
+	PaAsioStreamInfo output_asio_info = {0};
+	std::vector<int> input_asio_channel_selectors;
+	std::vector<int> output_asio_channel_selectors;
+#	endif
 };
 
 [[nodiscard]] static
@@ -51,39 +47,199 @@ auto is_wasapi_loopback_device(PaDeviceIndex device) -> bool {
 }
 
 [[nodiscard]] static
-auto make_input_params(PaDeviceIndex device_index, const PaDeviceInfo& info) -> PaStreamParameters {
+auto to_pa(bhas::sample_format format) -> PaSampleFormat {
+	switch (format) {
+		case bhas::sample_format::int16: return paInt16;
+		case bhas::sample_format::int24: return paInt24;
+		case bhas::sample_format::int32: return paInt32;
+		default:                         return paFloat32;
+	}
+}
+
+[[nodiscard]] static
+auto to_pa(bhas::sample_format format, bhas::buffer_layout layout) -> PaSampleFormat {
+	if (layout == bhas::buffer_layout::interleaved) {
+		return to_pa(format);
+	}
+	return to_pa(format) | paNonInterleaved;
+}
+
+[[nodiscard]] static
+auto make_input_params(const bhas::stream_request& request, PaDeviceIndex device_index, const PaDeviceInfo& info, PaSampleFormat format, const ChannelMap& map) -> PaStreamParameters {
 	PaStreamParameters params;
 	params.device                    = device_index;
 	params.hostApiSpecificStreamInfo = nullptr;
-	params.sampleFormat              = paFloat32 | paNonInterleaved;
-	params.channelCount              = info.maxInputChannels;
-	params.suggestedLatency          = info.defaultLowInputLatency;
+	params.sampleFormat              = format;
+	params.channelCount              = static_cast<int>(map.num_device_channels);
+	params.suggestedLatency          = get_suggested_latency(request, info.defaultLowInputLatency);
 	return params;
 }
 
 [[nodiscard]] static
-auto make_output_params(PaDeviceIndex device_index, const PaDeviceInfo& info) -> PaStreamParameters {
+auto make_output_params(const bhas::stream_request& request, PaDeviceIndex device_index, const PaDeviceInfo& info, PaSampleFormat format, const ChannelMap& map) -> PaStreamParameters {
 	PaStreamParameters params;
 	params.device                    = device_index;
 	params.hostApiSpecificStreamInfo = nullptr;
-	params.sampleFormat              = paFloat32 | paNonInterleaved;
-	params.channelCount              = 2;
-	params.suggestedLatency          = info.defaultLowOutputLatency;
+	params.sampleFormat              = format;
+	params.channelCount              = static_cast<int>(map.num_device_channels);
+	params.suggestedLatency          = get_suggested_latency(request, info.defaultLowOutputLatency);
 	return params;
 }
 
+[[nodiscard]] static
+auto to_pa(bhas::stream_flags flags) -> PaStreamFlags {
+	PaStreamFlags pa_flags = paNoFlag;
+	if (flags.value & bhas::stream_flags::clip_off)                                   { pa_flags |= paClipOff; }
+	if (flags.value & bhas::stream_flags::dither_off)                                 { pa_flags |= paDitherOff; }
+	if (flags.value & bhas::stream_flags::prime_output_buffers_using_stream_callback) { pa_flags |= paPrimeOutputBuffersUsingStreamCallback; }
+	return pa_flags;
+}
+
+[[nodiscard]] static
+auto to_pa(std::optional<bhas::frame_count> frames_per_buffer) -> unsigned long {
+	return frames_per_buffer ? frames_per_buffer->value : paFramesPerBufferUnspecified;
+}
+
+#ifdef _WIN32
+// ASIO can open an arbitrary set of channels by itself, so there's no
+// need to open the ones in between and throw them away.
+static
+auto use_asio_channel_selectors(const PaDeviceInfo& info, ChannelMap* map, PaStreamParameters* params, PaAsioStreamInfo* asio_info, std::vector<int>* selectors) -> void {
+	if (is_identity(*map) || Pa_GetHostApiInfo(info.hostApi)->type != paASIO) {
+		return;
+	}
+	selectors->assign(map->device_channels.begin(), map->device_channels.end());
+	asio_info->size                   = sizeof(PaAsioStreamInfo);
+	asio_info->hostApiType            = paASIO;
+	asio_info->version                = 1;
+	asio_info->flags                  = paAsioUseChannelSelectors;
+	asio_info->channelSelectors       = selectors->data();
+	params->channelCount              = static_cast<int>(selectors->size());
+	params->hostApiSpecificStreamInfo = asio_info;
+	*map = ChannelMap{static_cast<uint32_t>(selectors->size())};
+}
+#endif
+
+[[nodiscard]] static
+auto get_device_channels(const bhas::stream_request& request) -> DeviceChannels {
+	DeviceChannels devices;
+	devices.num_outputs = static_cast<uint32_t>(Pa_GetDeviceInfo(static_cast<PaDeviceIndex>(request.output_device.value))->maxOutputChannels);
+	if (request.input_device) {
+		devices.num_inputs = static_cast<uint32_t>(Pa_GetDeviceInfo(static_cast<PaDeviceIndex>(request.input_device->value))->maxInputChannels);
+	}
+	return devices;
+}
+
 static
 auto make_pa_stream_parameters(const bhas::stream_request& request, pa_stream_parameters* params) -> void {
+	const auto format = to_pa(
+		request.sample_format.value_or(bhas::sample_format::float32),
+		request.buffer_layout.value_or(bhas::buffer_layout::non_interleaved));
 	if (request.input_device) {
 		const auto input_device_pa_index = static_cast<PaDeviceIndex>(request.input_device->value);
 		const auto input_device_info     = Pa_GetDeviceInfo(input_device_pa_index);
-		params->input_params             = make_input_params(input_device_pa_index, *input_device_info);
+		params->input_map                = make_channel_map(get_num_input_channels(request, get_device_channels(request)), request.input_channels);
+		params->input_params             = make_input_params(request, input_device_pa_index, *input_device_info, format, params->input_map);
 		params->input_params_ptr		 = &params->input_params;
+#		ifdef _WIN32
+		use_asio_channel_selectors(*input_device_info, &params->input_map, &params->input_params, &params->input_asio_info, &params->input_asio_channel_selectors);
+#		endif
 	}
 	const auto output_device_pa_index = static_cast<PaDeviceIndex>(request.output_device.value);
 	params->output_device_info        = Pa_GetDeviceInfo(output_device_pa_index);
-	params->output_params             = make_output_params(output_device_pa_index, *params->output_device_info);
+	params->output_map                = make_channel_map(get_num_output_channels(request), request.output_channels);
+	params->output_params             = make_output_params(request, output_device_pa_index, *params->output_device_info, format, params->output_map);
 	params->output_params_ptr         = &params->output_params;
+#	ifdef _WIN32
+	use_asio_channel_selectors(*params->output_device_info, &params->output_map, &params->output_params, &params->output_asio_info, &params->output_asio_channel_selectors);
+#	endif
+}
+
+// For host APIs which talk more or less directly to the hardware, the
+// device's native format is almost always an integer format, so try
+// those first, best first. Everything else mixes in float anyway.
+[[nodiscard]] static
+auto is_probably_integer_native(PaHostApiTypeId host_type) -> bool {
+	switch (host_type) {
+		case paALSA:
+		case paASIO:
+		case paAudioScienceHPI:
+		case paOSS:
+		case paWDMKS:
+			return true;
+		default:
+			return false;
+	}
+}
+
+[[nodiscard]] static
+auto negotiate_sample_format(bhas::stream_request request) -> bhas::sample_format {
+	const auto output_device_info = Pa_GetDeviceInfo(static_cast<PaDeviceIndex>(request.output_device.value));
+	if (!is_probably_integer_native(Pa_GetHostApiInfo(output_device_info->hostApi)->type)) {
+		return bhas::sample_format::float32;
+	}
+	for (const auto format : {bhas::sample_format::int32, bhas::sample_format::int24, bhas::sample_format::int16}) {
+		pa_stream_parameters params;
+		request.sample_format = format;
+		make_pa_stream_parameters(request, &params);
+		if (Pa_IsFormatSupported(params.input_params_ptr, params.output_params_ptr, get_device_sample_rate(request).value) == paFormatIsSupported) {
+			return format;
+		}
+	}
+	return bhas::sample_format::float32;
+}
+
+static
+auto resolve_sample_format(bhas::stream_request* request, bhas::log* log) -> void {
+	if (request->sample_format) {
+		return;
+	}
+	request->sample_format = negotiate_sample_format(*request);
+	log->push_back(info_negotiated_sample_format(*request->sample_format));
+}
+
+// ASIO and JACK hand over one buffer per channel. Pretty much everything
+// else is interleaved underneath.
+[[nodiscard]] static
+auto get_native_buffer_layout(PaHostApiTypeId host_type) -> bhas::buffer_layout {
+	switch (host_type) {
+		case paASIO:
+		case paJACK:
+			return bhas::buffer_layout::non_interleaved;
+		default:
+			return bhas::buffer_layout::interleaved;
+	}
+}
+
+static
+auto resolve_buffer_layout(bhas::stream_request* request) -> void {
+	if (request->buffer_layout) {
+		return;
+	}
+	const auto output_device_info = Pa_GetDeviceInfo(static_cast<PaDeviceIndex>(request->output_device.value));
+	request->buffer_layout = get_native_buffer_layout(Pa_GetHostApiInfo(output_device_info->hostApi)->type);
+}
+
+static
+auto resolve_device_sample_rate(bhas::stream_request* request, bhas::log* log) -> void {
+	if (!request->resampler.enabled || request->resampler.device_sample_rate) {
+		return;
+	}
+	pa_stream_parameters params;
+	make_pa_stream_parameters(*request, &params);
+	if (Pa_IsFormatSupported(params.input_params_ptr, params.output_params_ptr, request->sample_rate.value) == paFormatIsSupported) {
+		request->resampler.device_sample_rate = request->sample_rate;
+		return;
+	}
+	request->resampler.device_sample_rate = bhas::sample_rate{static_cast<uint32_t>(params.output_device_info->defaultSampleRate)};
+	log->push_back(info_resampling(request->sample_rate, *request->resampler.device_sample_rate));
+}
+
+static
+auto resolve_request(bhas::stream_request* request, bhas::log* log) -> void {
+	resolve_buffer_layout(request);
+	resolve_device_sample_rate(request, log);
+	resolve_sample_format(request, log);
 }
 
 [[nodiscard]] static
@@ -96,8 +252,28 @@ auto callback_result_to_pa(bhas::callback_result result) -> int {
 	}
 }
 
+[[nodiscard]] static
+auto to_xrun_flags(PaStreamCallbackFlags status_flags) -> bhas::xrun_flags {
+	bhas::xrun_flags xruns;
+	if (status_flags & paInputUnderflow)  { xruns.value |= bhas::xrun_flags::input_underflow; }
+	if (status_flags & paInputOverflow)   { xruns.value |= bhas::xrun_flags::input_overflow; }
+	if (status_flags & paOutputUnderflow) { xruns.value |= bhas::xrun_flags::output_underflow; }
+	if (status_flags & paOutputOverflow)  { xruns.value |= bhas::xrun_flags::output_overflow; }
+	if (status_flags & paPrimingOutput)   { xruns.value |= bhas::xrun_flags::priming_output; }
+	return xruns;
+}
+
+[[nodiscard]] static
+auto to_time_info(const PaStreamCallbackTimeInfo& pa_time_info) -> bhas::time_info {
+	bhas::time_info time_info;
+	time_info.current_time           = pa_time_info.currentTime;
+	time_info.input_buffer_adc_time  = pa_time_info.inputBufferAdcTime;
+	time_info.output_buffer_dac_time = pa_time_info.outputBufferDacTime;
+	return time_info;
+}
+
 static
-auto stream_audio_callback(
+auto stream_callback(
 	const void* input, 
 	void* output, 
 	unsigned long pa_frame_count, 
@@ -105,30 +281,14 @@ auto stream_audio_callback(
 	PaStreamCallbackFlags status_flags, 
 	void* user_data) -> int
 {
-	const auto input_buffer   = bhas::input_buffer{reinterpret_cast<float const * const *>(input)};
-	const auto output_buffer  = bhas::output_buffer{reinterpret_cast<float * const *>(output)};
-	const auto frame_count    = bhas::frame_count{static_cast<uint32_t>(pa_frame_count)};
-	const auto sample_rate    = model.current_stream->sample_rate;
-	const auto output_latency = model.current_stream->output_latency;
-	bhas::time_info time_info;
-	time_info.current_time           = pa_time_info->currentTime;
-	time_info.input_buffer_adc_time  = pa_time_info->inputBufferAdcTime;
-	time_info.output_buffer_dac_time = pa_time_info->outputBufferDacTime;
-	return callback_result_to_pa(
-		model.cb.audio(
-			input_buffer,
-			output_buffer,
-			frame_count,
-			sample_rate,
-			output_latency,
-			&time_info));
+	const auto stream      = static_cast<CurrentStream*>(user_data);
+	const auto frame_count = bhas::frame_count{static_cast<uint32_t>(pa_frame_count)};
+	return callback_result_to_pa(process(stream, input, output, frame_count, to_time_info(*pa_time_info), to_xrun_flags(status_flags)));
 }
 
 static
 auto stream_finished_callback(void*) -> void {
-	if (model.cb.stream_stopped) {
-		model.cb.stream_stopped();
-	}
+	on_stream_finished();
 }
 
 [[nodiscard]] static
@@ -156,10 +316,16 @@ auto warn_request_not_supported(const char* pa_error_text) -> bhas::warning {
 	return {std::format("The requested stream settings are not supported. ({})", pa_error_text)};
 }
 
+[[nodiscard]] static
 auto check_if_supported_or_try_to_fall_back(bhas::stream_request request, bhas::log* log) -> std::optional<bhas::stream_request> {
+	resolve_request(&request, log);
+	if (!validate_request(request, get_device_channels(request), log)) {
+		log->push_back(err_stream_settings_not_supported());
+		return std::nullopt;
+	}
 	pa_stream_parameters params;
 	make_pa_stream_parameters(request, &params);
-	auto supported_check = Pa_IsFormatSupported(params.input_params_ptr, params.output_params_ptr, request.sample_rate.value);
+	auto supported_check = Pa_IsFormatSupported(params.input_params_ptr, params.output_params_ptr, get_device_sample_rate(request).value);
 	if (supported_check == paFormatIsSupported) {
 		return request;
 	}
@@ -167,7 +333,8 @@ auto check_if_supported_or_try_to_fall_back(bhas::stream_request request, bhas::
 	log->push_back(warn_request_not_supported(pa_error_text));
 	const auto default_SR     = params.output_device_info->defaultSampleRate;
 	const auto default_SR_int = bhas::sample_rate{static_cast<uint32_t>(params.output_device_info->defaultSampleRate)};
-	if (default_SR_int.value != request.sample_rate.value) {
+	// A resampled stream has already fallen back to the default rate
+	if (!request.resampler.enabled && default_SR_int.value != request.sample_rate.value) {
 		log->push_back(info_sample_rate_fallback_try(default_SR_int));
 		supported_check = Pa_IsFormatSupported(params.input_params_ptr, params.output_params_ptr, default_SR);
 		if (supported_check == paFormatIsSupported) {
@@ -186,13 +353,23 @@ auto check_if_supported_or_try_to_fall_back(bhas::stream_request request, bhas::
 	return std::nullopt;
 }
 
+[[nodiscard]] static
+auto is_stream_active() -> bool {
+	if (!model.current_stream) {
+		return false;
+	}
+	return Pa_IsStreamActive(model.pa_stream) == 1;
+}
+
+[[nodiscard]] static
 auto get_cpu_load() -> cpu_load {
 	if (!is_stream_active()) {
 		return {0.0};
 	}
-	return {Pa_GetStreamCpuLoad(model.current_stream->pa_stream)};
+	return {Pa_GetStreamCpuLoad(model.pa_stream)};
 }
 
+[[nodiscard]] static
 auto get_output_latency() -> bhas::output_latency {
 	if (!model.current_stream) {
 		return {0.0};
@@ -200,20 +377,15 @@ auto get_output_latency() -> bhas::output_latency {
 	return model.current_stream->output_latency;
 }
 
+[[nodiscard]] static
 auto get_stream_time() -> stream_time {
 	if (!is_stream_active()) {
 		return {0.0};
 	}
-	return {Pa_GetStreamTime(model.current_stream->pa_stream)};
-}
-
-auto is_stream_active() -> bool {
-	if (!model.current_stream) {
-		return false;
-	}
-	return Pa_IsStreamActive(model.current_stream->pa_stream) == 1;
+	return {Pa_GetStreamTime(model.pa_stream)};
 }
 
+[[nodiscard]] static
 auto init(bhas::log* log) -> bool {
 	if (const auto err = Pa_Initialize(); err != paNoError) {
 		log->push_back(bhas::error{std::format("Failed to initialize PortAudio. ({})", Pa_GetErrorText(err))});
@@ -222,10 +394,12 @@ auto init(bhas::log* log) -> bool {
 	return true;
 }
 
+static
 auto shutdown() -> void {
 	Pa_Terminate();
 }
 
+[[nodiscard]] static
 auto rescan() -> bhas::system {
 	bhas::system system;
 	const auto api_count    = Pa_GetHostApiCount();
@@ -238,6 +412,7 @@ auto rescan() -> bhas::system {
 		device.index                     = bhas::device_index{static_cast<size_t>(i)};
 		device.name.value                = info->name;
 		device.num_channels.value        = info->maxInputChannels;
+		device.num_output_channels.value = info->maxOutputChannels;
 		device.default_sample_rate.value = static_cast<uint32_t>(info->defaultSampleRate);
 		device.host.value                = info->hostApi;
 		if (info->maxInputChannels > 0)   { device.flags.value |= bhas::device_flags::input; }
@@ -269,16 +444,16 @@ auto rescan() -> bhas::system {
 }
 
 [[nodiscard]] static
-auto try_to_open_pa_stream(bhas::stream_request request, const pa_stream_parameters& params, double sample_rate, PaStream** pa_stream) -> PaError {
+auto try_to_open_pa_stream(bhas::stream_request request, const pa_stream_parameters& params, double sample_rate, CurrentStream* stream) -> PaError {
 	return Pa_OpenStream(
-		pa_stream,
+		&model.pa_stream,
 		params.input_params_ptr,
 		params.output_params_ptr,
 		sample_rate,
-		paFramesPerBufferUnspecified,
-		paNoFlag,
-		stream_audio_callback,
-		nullptr);
+		to_pa(request.frames_per_buffer),
+		to_pa(request.flags),
+		stream_callback,
+		stream);
 }
 
 [[nodiscard]] static
@@ -306,16 +481,6 @@ auto info_open_stream_success() -> bhas::info {
 	return {"Stream opened successfully."};
 }
 
-[[nodiscard]] static
-auto warn_stream_already_open() -> bhas::warning {
-	return {"A stream is already open so I'm ignoring this request."};
-}
-
-[[nodiscard]] static
-auto err_failed_to_start_stream(const char* reason) -> bhas::error {
-	return {std::format("Failed to start the stream. ({})", reason)};
-}
-
 [[nodiscard]] static
 auto err_failed_to_close_stream(const char* reason) -> bhas::error {
 	return {std::format("Failed to close the stream. ({})", reason)};
@@ -333,22 +498,34 @@ auto make_stream_info(bhas::stream_request request, PaStream* pa_stream) -> bhas
 	return info;
 }
 
-auto open_stream(bhas::stream_request request, bhas::log* log, bhas::channel_count* input_channel_count) -> bool {
+[[nodiscard]] static
+auto open_stream(bhas::stream_request request, bhas::log* log, bhas::stream* stream_info) -> bool {
 	if (model.current_stream) {
 		log->push_back(warn_stream_already_open());
 		return false;
 	}
+	resolve_request(&request, log);
+	const auto devices = get_device_channels(request);
+	if (!validate_request(request, devices, log)) {
+		return false;
+	}
 	pa_stream_parameters params;
 	make_pa_stream_parameters(request, &params);
-	CurrentStream stream;
-	const auto SR = static_cast<double>(request.sample_rate.value);
-	auto err = try_to_open_pa_stream(request, params, SR, &stream.pa_stream);
+	// The stream is placed in the model before it is opened because its
+	// address is handed to PortAudio as the callback user data.
+	auto& stream = model.current_stream.emplace();
+	if (!prepare_stream(request, devices, params.input_map, params.output_map, log, &stream)) {
+		release_stream(&model.current_stream);
+		return false;
+	}
+	const auto SR = static_cast<double>(stream.device_sample_rate.value);
+	auto err = try_to_open_pa_stream(request, params, SR, &stream);
 	if (err != paNoError) {
 		static constexpr auto MAX_RETRIES = 3;
 		log->push_back(warn_failed_to_open_stream_but_i_will_try_again());
 		for (int i = 0; i < MAX_RETRIES; i++) {
 			log->push_back(info_open_stream_retry());
-			err = try_to_open_pa_stream(request, params, SR, &stream.pa_stream);
+			err = try_to_open_pa_stream(request, params, SR, &stream);
 			if (err == paNoError) {
 				break;
 			}
@@ -356,91 +533,110 @@ auto open_stream(bhas::stream_request request, bhas::log* log, bhas::channel_cou
 	}
 	if (err != paNoError) {
 		log->push_back(err_stream_open_failed(err));
+		release_stream(&model.current_stream);
 		return false;
 	}
 	log->push_back(info_open_stream_success());
-	stream.host_type      = Pa_GetHostApiInfo(params.output_device_info->hostApi)->type;
-	stream.output_latency = bhas::output_latency{Pa_GetStreamInfo(stream.pa_stream)->outputLatency};
-	stream.sample_rate    = request.sample_rate;
-	*input_channel_count  = bhas::channel_count{static_cast<uint32_t>(params.input_params.channelCount)};
-	model.current_stream  = stream;
+	model.host_type   = Pa_GetHostApiInfo(params.output_device_info->hostApi)->type;
+	const auto& times = *Pa_GetStreamInfo(model.pa_stream);
+	finish_opening_stream(request, {times.inputLatency}, {times.outputLatency}, log, &stream, stream_info);
 	return true;
 }
 
+[[nodiscard]] static
+auto get_meters() -> bhas::meters {
+	return api::get_meters(model.current_stream);
+}
+
+[[nodiscard]] static
 auto start_stream(bhas::log* log) -> bool {
 	if (!model.current_stream) {
 		log->push_back(err_failed_to_start_stream("No stream is open."));
 		return false;
 	}
 	PaError err;
-	if (err = Pa_SetStreamFinishedCallback(model.current_stream->pa_stream, stream_finished_callback); err != paNoError) {
+	if (err = Pa_SetStreamFinishedCallback(model.pa_stream, stream_finished_callback); err != paNoError) {
 		log->push_back(err_failed_to_start_stream(Pa_GetErrorText(err)));
 		return false;
 	}
-	if (err = Pa_StartStream(model.current_stream->pa_stream); err != paNoError) {
+	if (err = Pa_StartStream(model.pa_stream); err != paNoError) {
 		log->push_back(err_failed_to_start_stream(Pa_GetErrorText(err)));
 		return false;
 	}
 	return true;
 }
 
-auto close_stream() -> void {
+static
+auto close_stream(bhas::log* log) -> void {
 	if (!model.current_stream) {
 		return;
 	}
-	Pa_CloseStream(model.current_stream->pa_stream);
-	model.current_stream = std::nullopt;
-}
-
-auto set(audio_cb cb) -> void {
-	model.cb.audio = std::move(cb);
-}
-
-auto set(stream_stopped_cb cb) -> void {
-	model.cb.stream_stopped = std::move(cb);
+	if (const auto err = Pa_CloseStream(model.pa_stream); err != paNoError) {
+		log->push_back(err_failed_to_close_stream(Pa_GetErrorText(err)));
+	}
+	model.pa_stream = nullptr;
+	release_stream(&model.current_stream);
 }
 
+static
 auto stop_stream(bhas::log* log) -> bool {
 	if (!is_stream_active()) {
-		model.cb.stream_stopped();
 		return true;
 	}
 	PaError err;
-	if (model.current_stream->host_type == paDirectSound) {
+	if (model.host_type == paDirectSound) {
 		// Can get stuck while waiting for the stream to stop
 		// due to an unknown Windows or PortAudio bug i guess
 		// So just abort instead
-		if (err = Pa_AbortStream(model.current_stream->pa_stream); err != paNoError) {
+		if (err = Pa_AbortStream(model.pa_stream); err != paNoError) {
 			if (log) log->push_back(err_failed_to_stop_stream(Pa_GetErrorText(err)));
 			return false;
 		}
 		return true;
 	}
-	if (model.current_stream->host_type == paMME) {
+	if (model.host_type == paMME) {
 		// Likewise MME will always get stuck if you try to stop
 		// cleanly AFAIK due to a PortAudio bug which I can't be
 		// bothered to report
-		if (err = Pa_AbortStream(model.current_stream->pa_stream); err != paNoError) {
+		if (err = Pa_AbortStream(model.pa_stream); err != paNoError) {
 			if (log) log->push_back(err_failed_to_stop_stream(Pa_GetErrorText(err)));
 			return false;
 		}
 		return true;
 	}
-	if (err = Pa_StopStream(model.current_stream->pa_stream); err != paNoError) {
+	if (err = Pa_StopStream(model.pa_stream); err != paNoError) {
 		if (log) log->push_back(err_failed_to_stop_stream(Pa_GetErrorText(err)));
 		return false;
 	}
 	return true;
 }
 
-namespace jack {
+static constexpr Backend BACKEND = {
+	check_if_supported_or_try_to_fall_back,
+	get_cpu_load,
+	get_meters,
+	get_output_latency,
+	get_stream_time,
+	init,
+	is_stream_active,
+	open_stream,
+	rescan,
+	start_stream,
+	close_stream,
+	shutdown,
+	stop_stream,
+};
+
+auto get_backend() -> const Backend& {
+	return BACKEND;
+}
 
-auto set_client_name(std::string_view name) -> void {
+auto set_jack_client_name(std::string_view name) -> void {
 #if PA_USE_JACK
 	PaJack_SetClientName(name.data());
 #endif
 }
 
-} // jack
+} // portaudio
 } // api
 } // bhas
@@ -0,0 +1,931 @@
+#include "bhas_api.h"
+#include "bhas_api_stream.h"
+#include "bhas_workers.h"
+#include <algorithm>
+#include <cstring>
+#include <format>
+
+namespace bhas {
+namespace api {
+
+struct Callbacks {
+	bhas::audio_cb audio;
+	bhas::processor processor;
+	bhas::stream_stopped_cb stream_stopped;
+};
+
+struct StreamModel {
+	Callbacks cb;
+};
+
+static StreamModel model;
+
+auto get_sample_format_name(bhas::sample_format format) -> const char* {
+	switch (format) {
+		case bhas::sample_format::int16: return "int16";
+		case bhas::sample_format::int24: return "int24";
+		case bhas::sample_format::int32: return "int32";
+		default:                         return "float32";
+	}
+}
+
+auto get_num_output_channels(const bhas::stream_request& request) -> bhas::channel_count {
+	if (!request.output_channels.empty()) {
+		return {static_cast<uint32_t>(request.output_channels.size())};
+	}
+	if (request.num_output_channels) {
+		return *request.num_output_channels;
+	}
+	if (model.cb.processor.fn) {
+		return model.cb.processor.num_output_channels;
+	}
+	return DEFAULT_NUM_OUTPUT_CHANNELS;
+}
+
+auto get_num_input_channels(const bhas::stream_request& request, const DeviceChannels& devices) -> bhas::channel_count {
+	if (!request.input_channels.empty()) {
+		return {static_cast<uint32_t>(request.input_channels.size())};
+	}
+	if (request.num_input_channels) {
+		return *request.num_input_channels;
+	}
+	return {devices.num_inputs};
+}
+
+auto is_identity(const ChannelMap& map) -> bool {
+	return map.device_channels.empty();
+}
+
+[[nodiscard]] static
+auto get_device_channel(const ChannelMap& map, uint32_t user_channel) -> uint32_t {
+	return is_identity(map) ? user_channel : map.device_channels[user_channel];
+}
+
+auto make_channel_map(bhas::channel_count count, const std::vector<bhas::channel_index>& channels) -> ChannelMap {
+	ChannelMap map;
+	map.num_device_channels = count.value;
+	if (channels.empty()) {
+		return map;
+	}
+	auto is_first_n = true;
+	for (uint32_t i = 0; i < channels.size(); i++) {
+		is_first_n = is_first_n && channels[i].value == i;
+		map.num_device_channels = std::max(map.num_device_channels, channels[i].value + 1);
+	}
+	if (is_first_n) {
+		return map;
+	}
+	std::vector<bool> used(map.num_device_channels, false);
+	for (const auto channel : channels) {
+		map.device_channels.push_back(channel.value);
+		used[channel.value] = true;
+	}
+	for (uint32_t ch = 0; ch < map.num_device_channels; ch++) {
+		if (!used[ch]) {
+			map.unused_device_channels.push_back(ch);
+		}
+	}
+	return map;
+}
+
+auto get_device_sample_rate(const bhas::stream_request& request) -> bhas::sample_rate {
+	if (request.resampler.enabled && request.resampler.device_sample_rate) {
+		return *request.resampler.device_sample_rate;
+	}
+	return request.sample_rate;
+}
+
+auto get_suggested_latency(const bhas::stream_request& request, double default_latency) -> double {
+	if (!request.suggested_latency) {
+		return default_latency;
+	}
+	if (const auto frames = std::get_if<bhas::frame_count>(&*request.suggested_latency)) {
+		return double(frames->value) / double(request.sample_rate.value);
+	}
+	return std::get<bhas::seconds>(*request.suggested_latency).value;
+}
+
+auto info_negotiated_sample_format(bhas::sample_format format) -> bhas::info {
+	return {std::format("Negotiated sample format: {}", get_sample_format_name(format))};
+}
+
+auto info_resampling(bhas::sample_rate sample_rate, bhas::sample_rate device_sample_rate) -> bhas::info {
+	return {std::format("The device doesn't support {} Hz, so it will run at its default rate of {} Hz and be resampled.", sample_rate.value, device_sample_rate.value)};
+}
+
+[[nodiscard]] static
+auto err_channel_out_of_range(std::string_view direction, bhas::channel_index channel, uint32_t num_device_channels) -> bhas::error {
+	return {std::format("Channel {} was requested but the device only has {} {} channels.", channel.value, num_device_channels, direction)};
+}
+
+[[nodiscard]] static
+auto err_too_many_channels(std::string_view direction, bhas::channel_count count, uint32_t num_device_channels) -> bhas::error {
+	return {std::format("{} {} channels were requested but the device only has {}.", count.value, direction, num_device_channels)};
+}
+
+[[nodiscard]] static
+auto err_output_channel_count_doesnt_match_processor(bhas::channel_count count, bhas::channel_count processor_count) -> bhas::error {
+	return {std::format("{} output channels were requested but the processor was compiled for {}.", count.value, processor_count.value)};
+}
+
+[[nodiscard]] static
+auto err_no_channels(std::string_view direction) -> bhas::error {
+	return {std::format("No {} channels were requested. Ask for at least one.", direction)};
+}
+
+[[nodiscard]] static
+auto err_duplicate_channel(std::string_view direction, bhas::channel_index channel) -> bhas::error {
+	return {std::format("The {} channel {} was requested more than once. Each device channel can only be opened once.", direction, channel.value)};
+}
+
+[[nodiscard]] static
+auto validate_channels(std::string_view direction, bhas::channel_count count, const std::vector<bhas::channel_index>& channels, uint32_t num_device_channels, bhas::log* log) -> bool {
+	if (count.value == 0) {
+		log->push_back(err_no_channels(direction));
+		return false;
+	}
+	if (count.value > num_device_channels) {
+		log->push_back(err_too_many_channels(direction, count, num_device_channels));
+		return false;
+	}
+	for (const auto channel : channels) {
+		if (channel.value >= num_device_channels) {
+			log->push_back(err_channel_out_of_range(direction, channel, num_device_channels));
+			return false;
+		}
+	}
+	for (auto it = channels.begin(); it != channels.end(); it++) {
+		if (std::find_if(channels.begin(), it, [it](bhas::channel_index c) { return c.value == it->value; }) != it) {
+			log->push_back(err_duplicate_channel(direction, *it));
+			return false;
+		}
+	}
+	return true;
+}
+
+[[nodiscard]] static
+auto err_invalid_block_size(bhas::frame_count block_size) -> bhas::error {
+	return {std::format("A block size of {} was requested but it has to be a power of two no bigger than {}.", block_size.value, bhas::MAX_BLOCK_SIZE.value)};
+}
+
+[[nodiscard]] static
+auto validate_channels(const bhas::stream_request& request, const DeviceChannels& devices, bhas::log* log) -> bool {
+	const auto output_count = get_num_output_channels(request);
+	if (model.cb.processor.fn && output_count.value != model.cb.processor.num_output_channels.value) {
+		log->push_back(err_output_channel_count_doesnt_match_processor(output_count, model.cb.processor.num_output_channels));
+		return false;
+	}
+	if (!validate_channels("output", output_count, request.output_channels, devices.num_outputs, log)) {
+		return false;
+	}
+	if (request.input_device) {
+		return validate_channels("input", get_num_input_channels(request, devices), request.input_channels, devices.num_inputs, log);
+	}
+	return true;
+}
+
+[[nodiscard]] static
+auto err_render_ahead_needs_block_size() -> bhas::error {
+	return {"Render-ahead was requested without a block size. Render-ahead works in fixed blocks so a block size is required."};
+}
+
+[[nodiscard]] static
+auto err_too_many_worker_threads(bhas::thread_count count) -> bhas::error {
+	return {std::format("{} worker threads were requested but no more than {} are allowed.", count.value, bhas::MAX_WORKER_THREADS.value)};
+}
+
+[[nodiscard]] static
+auto err_invalid_metering_config(const bhas::metering_config& config) -> bhas::error {
+	return {std::format("Metering was requested with a window of {}s and a peak hold of {}s. The window must be positive and the peak hold can't be negative.", config.window.value, config.peak_hold.value)};
+}
+
+[[nodiscard]] static
+auto err_unsupported_resampling(bhas::sample_rate sample_rate, bhas::sample_rate device_sample_rate) -> bhas::error {
+	return {std::format("Can't resample between {} Hz and {} Hz. Neither rate can be more than {} times the other, and the ratio between them has to reduce to a fraction with nothing bigger than {} in it.", sample_rate.value, device_sample_rate.value, resample::MAX_RATIO, resample::MAX_PHASES)};
+}
+
+[[nodiscard]] static
+auto err_input_file_needs_input_device() -> bhas::error {
+	return {"An input file was requested without an input device. The file takes the place of an input device's audio so one is required."};
+}
+
+auto validate_request(const bhas::stream_request& request, const DeviceChannels& devices, bhas::log* log) -> bool {
+	if (request.block_size && !engine::is_valid_block_size(*request.block_size)) {
+		log->push_back(err_invalid_block_size(*request.block_size));
+		return false;
+	}
+	if (request.render_ahead.value && !request.block_size) {
+		log->push_back(err_render_ahead_needs_block_size());
+		return false;
+	}
+	if (request.worker_threads.value > bhas::MAX_WORKER_THREADS.value) {
+		log->push_back(err_too_many_worker_threads(request.worker_threads));
+		return false;
+	}
+	if (request.metering.enabled && !(request.metering.window.value > 0.0 && request.metering.peak_hold.value >= 0.0)) {
+		log->push_back(err_invalid_metering_config(request.metering));
+		return false;
+	}
+	if (!request.input_file.path.empty() && !request.input_device) {
+		log->push_back(err_input_file_needs_input_device());
+		return false;
+	}
+	const auto device_sample_rate = get_device_sample_rate(request);
+	if (device_sample_rate.value != request.sample_rate.value && !resample::is_supported(request.sample_rate, device_sample_rate)) {
+		log->push_back(err_unsupported_resampling(request.sample_rate, device_sample_rate));
+		return false;
+	}
+	return validate_channels(request, devices, log);
+}
+
+[[nodiscard]] static
+auto get_input_buffer(CurrentStream* stream, const void* input) -> bhas::input_buffer {
+	if (stream->buffer_layout == bhas::buffer_layout::interleaved) {
+		stream->interleaved_input = static_cast<const float*>(input);
+		return {input ? &stream->interleaved_input : nullptr};
+	}
+	const auto device = static_cast<float const * const *>(input);
+	const auto& map   = stream->input_map;
+	if (!input || is_identity(map)) {
+		return {device};
+	}
+	for (size_t ch = 0; ch < map.device_channels.size(); ch++) {
+		stream->input_pointers[ch] = device[map.device_channels[ch]];
+	}
+	return {stream->input_pointers.data()};
+}
+
+[[nodiscard]] static
+auto get_output_buffer(CurrentStream* stream, void* output, uint32_t frame_count) -> bhas::output_buffer {
+	if (stream->buffer_layout == bhas::buffer_layout::interleaved) {
+		stream->interleaved_output = static_cast<float*>(output);
+		return {&stream->interleaved_output};
+	}
+	const auto device = static_cast<float * const *>(output);
+	const auto& map   = stream->output_map;
+	if (is_identity(map)) {
+		return {device};
+	}
+	for (size_t ch = 0; ch < map.device_channels.size(); ch++) {
+		stream->output_pointers[ch] = device[map.device_channels[ch]];
+	}
+	for (const auto ch : map.unused_device_channels) {
+		std::fill_n(device[ch], frame_count, 0.0f);
+	}
+	return {stream->output_pointers.data()};
+}
+
+// Everything which has to happen at the start of every callback before
+// the user is called.
+static
+auto begin_callback(CurrentStream* stream, bhas::xrun_flags xruns, const bhas::time_info& time_info) -> void {
+	if (!stream->audio_thread_ready) {
+		rt::apply_audio_thread_setup(stream->audio_thread);
+		stream->audio_thread_ready = true;
+	}
+	rt::enter_audio_callback();
+	stream->xruns = xruns;
+	engine::record_xruns(stream->xruns, {time_info.current_time});
+	// With render-ahead these belong to the render thread
+	if (!stream->render_pipeline) {
+		engine::drain_commands();
+		stream->block.xruns = stream->xruns;
+	}
+}
+
+// Everything which has to happen at the end of every callback.
+[[nodiscard]] static
+auto end_callback(bhas::callback_result result) -> bhas::callback_result {
+	rt::leave_audio_callback();
+	return result;
+}
+
+// Call with the buffers the user just saw. Just a branch if metering is off.
+static
+auto meter(CurrentStream* stream, bhas::input_buffer input, bhas::output_buffer output, bhas::frame_count frame_count) -> void {
+	if (stream->meters) {
+		engine::meter(stream->meters.get(), input, output, frame_count);
+	}
+}
+
+[[nodiscard]] static
+auto process_audio(CurrentStream* stream, const void* input, void* output, bhas::frame_count frame_count, const bhas::time_info& time_info, bhas::xrun_flags xruns) -> bhas::callback_result {
+	begin_callback(stream, xruns, time_info);
+	const auto input_buffer   = get_input_buffer(stream, input);
+	const auto output_buffer  = get_output_buffer(stream, output, frame_count.value);
+	const auto sample_rate    = stream->sample_rate;
+	const auto output_latency = stream->output_latency;
+	const auto start  = engine::callback_clock::now();
+	const auto result = model.cb.audio(
+		input_buffer,
+		output_buffer,
+		frame_count,
+		sample_rate,
+		output_latency,
+		&time_info);
+	engine::record_callback_duration(engine::callback_clock::now() - start, frame_count, sample_rate);
+	meter(stream, input_buffer, output_buffer, frame_count);
+	return end_callback(result);
+}
+
+[[nodiscard]] static
+auto process_processor(CurrentStream* stream, const void* input, void* output, bhas::frame_count frame_count, const bhas::time_info& time_info, bhas::xrun_flags xruns) -> bhas::callback_result {
+	begin_callback(stream, xruns, time_info);
+	auto& block       = stream->block;
+	block.input       = get_input_buffer(stream, input);
+	block.output      = get_output_buffer(stream, output, frame_count.value);
+	block.frame_count = frame_count;
+	block.time        = time_info;
+	const auto start  = engine::callback_clock::now();
+	const auto result = stream->processor.fn(stream->processor.context, block);
+	engine::record_callback_duration(engine::callback_clock::now() - start, block.frame_count, block.sample_rate);
+	meter(stream, block.input, block.output, block.frame_count);
+	return end_callback(result);
+}
+
+[[nodiscard]] static
+auto call_user_untimed(CurrentStream* stream, bhas::input_buffer input, bhas::output_buffer output, bhas::frame_count frame_count, const bhas::time_info& time_info) -> bhas::callback_result {
+	if (stream->processor.fn) {
+		auto& block       = stream->block;
+		block.input       = input;
+		block.output      = output;
+		block.frame_count = frame_count;
+		block.time        = time_info;
+		return stream->processor.fn(stream->processor.context, block);
+	}
+	return model.cb.audio(input, output, frame_count, stream->sample_rate, stream->output_latency, &time_info);
+}
+
+[[nodiscard]] static
+auto call_user(CurrentStream* stream, bhas::input_buffer input, bhas::output_buffer output, bhas::frame_count frame_count, const bhas::time_info& time_info) -> bhas::callback_result {
+	const auto start  = engine::callback_clock::now();
+	const auto result = call_user_untimed(stream, input, output, frame_count, time_info);
+	engine::record_callback_duration(engine::callback_clock::now() - start, frame_count, stream->sample_rate);
+	return result;
+}
+
+// Called on the render thread, with the xruns the device reported for the
+// block being rendered.
+[[nodiscard]] static
+auto call_user_render(void* context, bhas::input_buffer input, bhas::output_buffer output, bhas::frame_count frame_count, const bhas::time_info& time_info, bhas::xrun_flags xruns) -> bhas::callback_result {
+	const auto stream   = static_cast<CurrentStream*>(context);
+	stream->block.xruns = xruns;
+	return call_user(stream, input, output, frame_count, time_info);
+}
+
+[[nodiscard]] static
+auto call_user_block(void* context, bhas::input_buffer input, bhas::output_buffer output, bhas::frame_count frame_count, const bhas::time_info& time_info) -> bhas::callback_result {
+	const auto stream = static_cast<CurrentStream*>(context);
+	if (stream->render_pipeline) {
+		return engine::render_ahead(stream->render_pipeline.get(), input, output, frame_count, time_info, stream->xruns, stream->sample_rate);
+	}
+	return call_user(stream, input, output, frame_count, time_info);
+}
+
+// Calls the user directly, or via the re-blocker if the user asked for a
+// fixed block size.
+[[nodiscard]] static
+auto run_user(CurrentStream* stream, bhas::input_buffer input, bhas::output_buffer output, bhas::frame_count frame_count, const bhas::time_info& time_info) -> bhas::callback_result {
+	if (stream->reblocker) {
+		return engine::reblock(&*stream->reblocker, input, output, frame_count, time_info, stream->sample_rate, call_user_block, stream);
+	}
+	return call_user(stream, input, output, frame_count, time_info);
+}
+
+[[nodiscard]] static
+auto run_user_block(void* context, bhas::input_buffer input, bhas::output_buffer output, bhas::frame_count frame_count, const bhas::time_info& time_info) -> bhas::callback_result {
+	return run_user(static_cast<CurrentStream*>(context), input, output, frame_count, time_info);
+}
+
+// Used for float streams which need re-blocking but no conversion.
+[[nodiscard]] static
+auto process_reblock(CurrentStream* stream, const void* input, void* output, bhas::frame_count frame_count, const bhas::time_info& time_info, bhas::xrun_flags xruns) -> bhas::callback_result {
+	begin_callback(stream, xruns, time_info);
+	const auto input_buffer  = get_input_buffer(stream, input);
+	const auto output_buffer = get_output_buffer(stream, output, frame_count.value);
+	const auto result        = run_user(stream, input_buffer, output_buffer, frame_count, time_info);
+	meter(stream, input_buffer, output_buffer, frame_count);
+	return end_callback(result);
+}
+
+[[nodiscard]] static
+auto offset_time_info(const bhas::time_info& time_info, double offset) -> bhas::time_info {
+	bhas::time_info offset_info;
+	offset_info.current_time           = time_info.current_time;
+	offset_info.input_buffer_adc_time  = time_info.input_buffer_adc_time + offset;
+	offset_info.output_buffer_dac_time = time_info.output_buffer_dac_time + offset;
+	return offset_info;
+}
+
+// Picks the user's channels out of all of the device's interleaved
+// channels.
+static
+auto gather_interleaved(const ChannelMap& map, const float* src, float* dst, uint32_t frames) -> void {
+	const auto num_user_channels   = map.device_channels.size();
+	const auto num_device_channels = map.num_device_channels;
+	for (uint32_t frame = 0; frame < frames; frame++) {
+		const auto src_frame = src + size_t(frame) * num_device_channels;
+		for (size_t ch = 0; ch < num_user_channels; ch++) {
+			dst[frame * num_user_channels + ch] = src_frame[map.device_channels[ch]];
+		}
+	}
+}
+
+static
+auto read_device_input(CurrentStream* stream, const void* input, uint32_t offset, uint32_t frames) -> void {
+	auto& conversion            = stream->conversion;
+	const auto& map             = stream->input_map;
+	const auto bytes_per_sample = convert::get_bytes_per_sample(conversion.format);
+	if (stream->buffer_layout == bhas::buffer_layout::interleaved) {
+		const auto src = static_cast<const std::byte*>(input) + size_t(offset) * map.num_device_channels * bytes_per_sample;
+		const auto dst = const_cast<float*>(conversion.input_pointers[0]);
+		if (is_identity(map)) {
+			convert::to_float(conversion.format, src, dst, size_t(frames) * map.num_device_channels);
+			return;
+		}
+		convert::to_float(conversion.format, src, conversion.device_input_samples.data(), size_t(frames) * map.num_device_channels);
+		gather_interleaved(map, conversion.device_input_samples.data(), dst, frames);
+		return;
+	}
+	const auto device = static_cast<const void* const*>(input);
+	for (uint32_t ch = 0; ch < stream->block.num_input_channels.value; ch++) {
+		const auto src = static_cast<const std::byte*>(device[get_device_channel(map, ch)]) + size_t(offset) * bytes_per_sample;
+		convert::to_float(conversion.format, src, const_cast<float*>(conversion.input_pointers[ch]), frames);
+	}
+}
+
+// Spreads the user's interleaved channels out over all of the device's
+// channels, leaving the unused ones silent.
+[[nodiscard]] static
+auto scatter_interleaved(const ChannelMap& map, const float* src, float* dst, uint32_t frames) -> const float* {
+	const auto num_user_channels   = map.device_channels.size();
+	const auto num_device_channels = map.num_device_channels;
+	for (uint32_t frame = 0; frame < frames; frame++) {
+		auto dst_frame = dst + size_t(frame) * num_device_channels;
+		std::fill_n(dst_frame, num_device_channels, 0.0f);
+		for (size_t ch = 0; ch < num_user_channels; ch++) {
+			dst_frame[map.device_channels[ch]] = src[frame * num_user_channels + ch];
+		}
+	}
+	return dst;
+}
+
+static
+auto write_device_output(CurrentStream* stream, void* output, uint32_t offset, uint32_t frames, convert::dither_state* dither) -> void {
+	auto& conversion            = stream->conversion;
+	const auto& map             = stream->output_map;
+	const auto bytes_per_sample = convert::get_bytes_per_sample(conversion.format);
+	if (stream->buffer_layout == bhas::buffer_layout::interleaved) {
+		const auto dst = static_cast<std::byte*>(output) + size_t(offset) * map.num_device_channels * bytes_per_sample;
+		auto src       = static_cast<const float*>(conversion.output_pointers[0]);
+		if (!is_identity(map)) {
+			src = scatter_interleaved(map, src, conversion.device_output_samples.data(), frames);
+		}
+		convert::from_float(conversion.format, src, dst, size_t(frames) * map.num_device_channels, dither);
+		return;
+	}
+	const auto device = static_cast<void* const*>(output);
+	for (uint32_t ch = 0; ch < stream->num_output_channels.value; ch++) {
+		const auto dst = static_cast<std::byte*>(device[get_device_channel(map, ch)]) + size_t(offset) * bytes_per_sample;
+		convert::from_float(conversion.format, conversion.output_pointers[ch], dst, frames, dither);
+	}
+	for (const auto ch : map.unused_device_channels) {
+		std::memset(static_cast<std::byte*>(device[ch]) + size_t(offset) * bytes_per_sample, 0, size_t(frames) * bytes_per_sample);
+	}
+}
+
+static
+auto silence_device_output(CurrentStream* stream, void* output, uint32_t offset, uint32_t frames) -> void {
+	const auto bytes_per_sample    = convert::get_bytes_per_sample(stream->conversion.format);
+	const auto num_device_channels = stream->output_map.num_device_channels;
+	if (stream->buffer_layout == bhas::buffer_layout::interleaved) {
+		const auto frame_size = size_t(num_device_channels) * bytes_per_sample;
+		std::memset(static_cast<std::byte*>(output) + offset * frame_size, 0, frames * frame_size);
+		return;
+	}
+	const auto device = static_cast<void* const*>(output);
+	for (uint32_t ch = 0; ch < num_device_channels; ch++) {
+		std::memset(static_cast<std::byte*>(device[ch]) + size_t(offset) * bytes_per_sample, 0, size_t(frames) * bytes_per_sample);
+	}
+}
+
+// Used when the device's sample format or channel layout can't be passed
+// straight to the user. The user is called with float buffers containing
+// exactly the channels they asked for and the conversion is done here.
+[[nodiscard]] static
+auto process_convert(CurrentStream* stream, const void* input, void* output, bhas::frame_count frame_count, const bhas::time_info& time_info, bhas::xrun_flags xruns) -> bhas::callback_result {
+	begin_callback(stream, xruns, time_info);
+	auto& conversion        = stream->conversion;
+	const auto dither       = conversion.dither ? &conversion.dither_state : nullptr;
+	const auto total_frames = frame_count.value;
+	auto result             = bhas::callback_result::continue_;
+	uint32_t offset         = 0;
+	while (offset < total_frames && result == bhas::callback_result::continue_) {
+		const auto frames = std::min(total_frames - offset, MAX_CONVERSION_FRAMES);
+		if (input) {
+			read_device_input(stream, input, offset, frames);
+		}
+		const auto chunk_time_info = offset_time_info(time_info, double(offset) / double(stream->device_sample_rate.value));
+		const auto input_buffer    = bhas::input_buffer{input ? conversion.input_pointers.data() : nullptr};
+		const auto output_buffer   = bhas::output_buffer{conversion.output_pointers.data()};
+		result = stream->resampler
+			? engine::resample(&*stream->resampler, input_buffer, output_buffer, bhas::frame_count{frames}, chunk_time_info, run_user_block, stream)
+			: run_user(stream, input_buffer, output_buffer, bhas::frame_count{frames}, chunk_time_info);
+		meter(stream, input_buffer, output_buffer, bhas::frame_count{frames});
+		write_device_output(stream, output, offset, frames, dither);
+		offset += frames;
+	}
+	if (offset < total_frames) {
+		// The user stopped part way through a chunked callback
+		silence_device_output(stream, output, offset, total_frames - offset);
+	}
+	return end_callback(result);
+}
+
+[[nodiscard]] static
+auto needs_conversion(const CurrentStream& stream) -> bool {
+	// The resampler works on the conversion buffers
+	if (stream.conversion.format != bhas::sample_format::float32 || stream.resampler) {
+		return true;
+	}
+	// Non-interleaved channels can be picked out by pointer but
+	// interleaved ones have to be copied
+	return stream.buffer_layout == bhas::buffer_layout::interleaved && (!is_identity(stream.input_map) || !is_identity(stream.output_map));
+}
+
+[[nodiscard]] static
+auto choose_process_fn(const CurrentStream& stream) -> process_fn {
+	if (needs_conversion(stream)) {
+		return process_convert;
+	}
+	if (stream.reblocker) {
+		return process_reblock;
+	}
+	if (stream.processor.fn) {
+		return process_processor;
+	}
+	return process_audio;
+}
+
+template <typename T> static
+auto allocate_channels(uint32_t num_channels, bhas::buffer_layout layout, std::vector<float>* samples, std::vector<T*>* pointers) -> void {
+	samples->resize(size_t(MAX_CONVERSION_FRAMES) * num_channels);
+	if (num_channels == 0) {
+		pointers->clear();
+		return;
+	}
+	if (layout == bhas::buffer_layout::interleaved) {
+		pointers->assign(1, samples->data());
+		return;
+	}
+	pointers->resize(num_channels);
+	for (uint32_t ch = 0; ch < num_channels; ch++) {
+		(*pointers)[ch] = samples->data() + size_t(ch) * MAX_CONVERSION_FRAMES;
+	}
+}
+
+static
+auto allocate_conversion_buffers(CurrentStream* stream) -> void {
+	auto& conversion = stream->conversion;
+	allocate_channels(stream->block.num_input_channels.value, stream->buffer_layout, &conversion.input_samples, &conversion.input_pointers);
+	allocate_channels(stream->num_output_channels.value, stream->buffer_layout, &conversion.output_samples, &conversion.output_pointers);
+	if (stream->buffer_layout == bhas::buffer_layout::interleaved && !is_identity(stream->input_map)) {
+		conversion.device_input_samples.resize(size_t(MAX_CONVERSION_FRAMES) * stream->input_map.num_device_channels);
+	}
+	if (stream->buffer_layout == bhas::buffer_layout::interleaved && !is_identity(stream->output_map)) {
+		conversion.device_output_samples.resize(size_t(MAX_CONVERSION_FRAMES) * stream->output_map.num_device_channels);
+	}
+}
+
+auto prepare_stream(const bhas::stream_request& request, const DeviceChannels& devices, const ChannelMap& input_map, const ChannelMap& output_map, bhas::log* log, CurrentStream* stream) -> bool {
+	engine::reset_callback_timing();
+	engine::reset_xrun_stats();
+	rt::reset_audio_thread_state();
+	stream->audio_thread = rt::make_thread_setup(request.audio_thread, log);
+	stream->audio_thread.prefault_stack = request.realtime_memory.enabled;
+	stream->processor           = model.cb.processor;
+	stream->conversion.format   = *request.sample_format;
+	stream->conversion.dither   = request.dither.value;
+	stream->block.num_input_channels = request.input_device ? get_num_input_channels(request, devices) : bhas::channel_count{0};
+	stream->num_output_channels = get_num_output_channels(request);
+	stream->input_map           = input_map;
+	stream->output_map          = output_map;
+	stream->buffer_layout       = *request.buffer_layout;
+	stream->block.buffer_layout = stream->buffer_layout;
+	stream->input_pointers.resize(stream->block.num_input_channels.value);
+	stream->output_pointers.resize(stream->num_output_channels.value);
+	stream->sample_rate         = request.sample_rate;
+	stream->device_sample_rate  = get_device_sample_rate(request);
+	if (stream->device_sample_rate.value != stream->sample_rate.value) {
+		stream->resampler = engine::make_resampler(request.resampler.quality, stream->buffer_layout, stream->block.num_input_channels, stream->num_output_channels, stream->sample_rate, stream->device_sample_rate);
+	}
+	if (needs_conversion(*stream)) {
+		stream->conversion.dither_state = convert::make_dither_state(static_cast<uint32_t>(request.sample_rate.value));
+		allocate_conversion_buffers(stream);
+	}
+	if (request.block_size) {
+		// If the device is left to pick its own buffer size then its
+		// frame count isn't known and the worst case is assumed.
+		stream->block_latency = engine::get_reblock_latency(*request.block_size, request.frames_per_buffer);
+		stream->reblocker     = engine::make_reblocker(*request.block_size, stream->block_latency, stream->buffer_layout, stream->block.num_input_channels, stream->num_output_channels);
+	}
+	if (request.render_ahead.value) {
+		stream->render_pipeline = engine::make_render_pipeline(*request.block_size, stream->buffer_layout, stream->block.num_input_channels, stream->num_output_channels);
+	}
+	if (request.metering.enabled) {
+		// Measured on the device's side of the resampler
+		stream->meters = engine::make_meter_bank(request.metering, stream->buffer_layout, stream->block.num_input_channels, stream->num_output_channels, stream->device_sample_rate);
+	}
+	if (!request.input_file.path.empty()) {
+		// The device can deliver any number of frames if it isn't told
+		// how many. Bigger buffers than this get the device's own input.
+		const auto max_frames = std::max(request.frames_per_buffer.value_or(bhas::frame_count{0}).value, MAX_CONVERSION_FRAMES * 2);
+		stream->input_file = std::make_unique<input_file::reader>();
+		if (!input_file::open(request.input_file, stream->conversion.format, stream->buffer_layout, {input_map.num_device_channels}, stream->device_sample_rate, max_frames, stream->input_file.get(), log)) {
+			stream->input_file.reset();
+			return false;
+		}
+	}
+	stream->process = choose_process_fn(*stream);
+	return true;
+}
+
+template <typename T> [[nodiscard]] static
+auto lock_memory(const std::vector<T>& v) -> bool {
+	return rt::lock_memory(rt::memory_owner::engine, v.data(), v.size() * sizeof(T));
+}
+
+[[nodiscard]] static
+auto info_locked_stream_memory(bhas::byte_count bytes) -> bhas::info {
+	return {std::format("Locked {} bytes of memory for the audio thread.", bytes.value)};
+}
+
+[[nodiscard]] static
+auto warn_failed_to_lock_stream_memory() -> bhas::warning {
+	return {"Failed to lock some of the stream's memory. The audio thread may take page faults. (Check RLIMIT_MEMLOCK.)"};
+}
+
+// Locks and pre-faults everything the audio thread touches which belongs
+// to the engine rather than to the backend or the user.
+static
+auto lock_stream_memory(const CurrentStream& stream, bhas::log* log) -> void {
+	const auto& conversion = stream.conversion;
+	auto ok = rt::lock_memory(rt::memory_owner::engine, &stream, sizeof(stream));
+	ok = engine::lock_memory() && ok;
+	ok = lock_memory(conversion.input_samples) && ok;
+	ok = lock_memory(conversion.output_samples) && ok;
+	ok = lock_memory(conversion.device_input_samples) && ok;
+	ok = lock_memory(conversion.device_output_samples) && ok;
+	ok = lock_memory(conversion.input_pointers) && ok;
+	ok = lock_memory(conversion.output_pointers) && ok;
+	ok = lock_memory(stream.input_pointers) && ok;
+	ok = lock_memory(stream.output_pointers) && ok;
+	ok = workers::lock_memory() && ok;
+	if (stream.reblocker) {
+		ok = lock_memory(stream.reblocker->input_samples) && ok;
+		ok = lock_memory(stream.reblocker->output_samples) && ok;
+		ok = lock_memory(stream.reblocker->queue_samples) && ok;
+		ok = lock_memory(stream.reblocker->input_pointers) && ok;
+		ok = lock_memory(stream.reblocker->output_pointers) && ok;
+	}
+	if (stream.render_pipeline) {
+		ok = rt::lock_memory(rt::memory_owner::engine, stream.render_pipeline.get(), sizeof(engine::render_pipeline)) && ok;
+		for (const auto& slot : stream.render_pipeline->slots) {
+			ok = lock_memory(slot.input_samples) && ok;
+			ok = lock_memory(slot.output_samples) && ok;
+			ok = lock_memory(slot.input_pointers) && ok;
+			ok = lock_memory(slot.output_pointers) && ok;
+		}
+	}
+	if (stream.resampler) {
+		ok = lock_memory(stream.resampler->input.coefficients) && ok;
+		ok = lock_memory(stream.resampler->input.history) && ok;
+		ok = lock_memory(stream.resampler->output.coefficients) && ok;
+		ok = lock_memory(stream.resampler->output.history) && ok;
+		ok = lock_memory(stream.resampler->queue_samples) && ok;
+		ok = lock_memory(stream.resampler->input_samples) && ok;
+		ok = lock_memory(stream.resampler->output_samples) && ok;
+		ok = lock_memory(stream.resampler->input_pointers) && ok;
+		ok = lock_memory(stream.resampler->output_pointers) && ok;
+		ok = lock_memory(stream.resampler->planes) && ok;
+	}
+	if (stream.meters) {
+		ok = engine::lock_memory(*stream.meters) && ok;
+	}
+	if (stream.input_file) {
+		ok = input_file::lock_memory(*stream.input_file) && ok;
+	}
+	if (!ok) {
+		log->push_back(warn_failed_to_lock_stream_memory());
+	}
+	log->push_back(info_locked_stream_memory(rt::get_locked_memory()));
+}
+
+template <typename T> static
+auto allocate_device_buffer(const CurrentStream& stream, uint32_t num_channels, uint32_t frames, std::vector<std::byte>* samples, std::vector<T*>* pointers) -> T* {
+	const auto bytes_per_sample = convert::get_bytes_per_sample(stream.conversion.format);
+	samples->assign(size_t(frames) * num_channels * bytes_per_sample, std::byte{0});
+	if (stream.buffer_layout == bhas::buffer_layout::interleaved) {
+		return samples->data();
+	}
+	pointers->resize(num_channels);
+	for (uint32_t ch = 0; ch < num_channels; ch++) {
+		(*pointers)[ch] = samples->data() + size_t(ch) * frames * bytes_per_sample;
+	}
+	return pointers->data();
+}
+
+auto make_device_buffers(const bhas::stream_request& request, const CurrentStream& stream, uint32_t frames_per_buffer, DeviceBuffers* buffers) -> void {
+	*buffers = {};
+	buffers->frames_per_buffer = frames_per_buffer;
+	buffers->output = allocate_device_buffer(stream, stream.output_map.num_device_channels, frames_per_buffer, &buffers->output_samples, &buffers->output_pointers);
+	if (request.input_device) {
+		buffers->input = allocate_device_buffer(stream, stream.input_map.num_device_channels, frames_per_buffer, &buffers->input_samples, &buffers->input_pointers);
+	}
+}
+
+auto lock_device_buffers(const DeviceBuffers& buffers) -> bool {
+	auto ok = lock_memory(buffers.input_samples);
+	ok = lock_memory(buffers.output_samples) && ok;
+	ok = lock_memory(buffers.input_pointers) && ok;
+	ok = lock_memory(buffers.output_pointers) && ok;
+	return ok;
+}
+
+auto finish_opening_stream(const bhas::stream_request& request, bhas::seconds device_input_latency, bhas::seconds device_output_latency, bhas::log* log, CurrentStream* stream, bhas::stream* stream_info) -> void {
+	const auto render_ahead_latency   = stream->render_pipeline ? *request.block_size : bhas::frame_count{0};
+	const auto resampler_latency      = stream->resampler ? bhas::frame_count{stream->resampler->latency} : bhas::frame_count{0};
+	stream->output_latency.value      = device_output_latency.value + double(stream->block_latency.value + render_ahead_latency.value + resampler_latency.value) / double(stream->sample_rate.value);
+	stream->block.sample_rate         = stream->sample_rate;
+	stream->block.output_latency      = stream->output_latency;
+	stream_info->num_input_channels   = stream->block.num_input_channels;
+	stream_info->num_output_channels  = stream->num_output_channels;
+	stream_info->sample_format        = stream->conversion.format;
+	stream_info->buffer_layout        = stream->buffer_layout;
+	stream_info->block_size           = request.block_size;
+	stream_info->block_latency        = stream->block_latency;
+	stream_info->frames_per_buffer    = request.frames_per_buffer;
+	stream_info->input_latency        = request.input_device ? device_input_latency : bhas::seconds{0.0};
+	if (request.input_device && stream->resampler) {
+		stream_info->input_latency.value += stream->resampler->input_latency.value;
+	}
+	stream_info->flags                = request.flags;
+	stream_info->worker_threads       = workers::start(request.worker_threads, stream->audio_thread);
+	stream_info->render_ahead_latency = render_ahead_latency;
+	stream_info->device_sample_rate   = stream->device_sample_rate;
+	stream_info->resampler_latency    = resampler_latency;
+	if (stream->render_pipeline) {
+		engine::start_render_thread(stream->render_pipeline.get(), call_user_render, stream, stream->audio_thread);
+	}
+	if (stream->input_file) {
+		input_file::start(stream->input_file.get());
+	}
+	if (request.realtime_memory.enabled) {
+		if (request.realtime_memory.lock_everything) {
+			rt::lock_everything(log);
+		}
+		lock_stream_memory(*stream, log);
+	}
+	stream_info->locked_memory        = rt::get_locked_memory();
+}
+
+auto release_stream(std::optional<CurrentStream>* stream) -> void {
+	if (!*stream) {
+		return;
+	}
+	if ((*stream)->render_pipeline) {
+		engine::stop_render_thread((*stream)->render_pipeline.get());
+	}
+	if ((*stream)->input_file) {
+		input_file::stop((*stream)->input_file.get());
+	}
+	*stream = std::nullopt;
+	workers::stop();
+	rt::unlock_all_memory(rt::memory_owner::engine);
+}
+
+auto get_meters(const std::optional<CurrentStream>& stream) -> bhas::meters {
+	if (!stream || !stream->meters) {
+		return {};
+	}
+	return engine::read_meters(*stream->meters);
+}
+
+auto warn_stream_already_open() -> bhas::warning {
+	return {"A stream is already open so I'm ignoring this request."};
+}
+
+auto err_failed_to_start_stream(const char* reason) -> bhas::error {
+	return {std::format("Failed to start the stream. ({})", reason)};
+}
+
+auto make_single_device_system(const char* host_name, const char* device_name, const DeviceChannels& channels, bhas::sample_rate default_sample_rate) -> bhas::system {
+	bhas::system system;
+	bhas::device device;
+	device.index                     = bhas::device_index{0};
+	device.host                      = bhas::host_index{0};
+	device.name.value                = device_name;
+	device.flags.value               = bhas::device_flags::input | bhas::device_flags::output;
+	device.num_channels.value        = channels.num_inputs;
+	device.num_output_channels.value = channels.num_outputs;
+	device.default_sample_rate       = default_sample_rate;
+	bhas::host host;
+	host.index                 = bhas::host_index{0};
+	host.name.value            = host_name;
+	host.devices               = {device.index};
+	host.default_input_device  = device.index;
+	host.default_output_device = device.index;
+	system.devices.push_back(device);
+	system.hosts.push_back(host);
+	system.default_host          = host.index;
+	system.default_input_device  = device.index;
+	system.default_output_device = device.index;
+	return system;
+}
+
+auto resolve_virtual_request(bhas::stream_request* request, bhas::buffer_layout default_layout, bhas::log* log) -> void {
+	if (!request->buffer_layout) {
+		request->buffer_layout = default_layout;
+	}
+	if (request->resampler.enabled && !request->resampler.device_sample_rate) {
+		request->resampler.device_sample_rate = request->sample_rate;
+	}
+	if (!request->sample_format) {
+		request->sample_format = bhas::sample_format::float32;
+		log->push_back(info_negotiated_sample_format(bhas::sample_format::float32));
+	}
+}
+
+[[nodiscard]] static
+auto err_invalid_sample_rate() -> bhas::error {
+	return {"A sample rate of 0 Hz was requested."};
+}
+
+[[nodiscard]] static
+auto err_invalid_frames_per_buffer() -> bhas::error {
+	return {"A buffer size of 0 frames was requested."};
+}
+
+auto validate_virtual_request(const bhas::stream_request& request, const DeviceChannels& devices, bhas::log* log) -> bool {
+	if (request.sample_rate.value == 0 || get_device_sample_rate(request).value == 0) {
+		log->push_back(err_invalid_sample_rate());
+		return false;
+	}
+	if (request.frames_per_buffer && request.frames_per_buffer->value == 0) {
+		log->push_back(err_invalid_frames_per_buffer());
+		return false;
+	}
+	return validate_request(request, devices, log);
+}
+
+auto start_virtual_thread(VirtualThread* thread, virtual_thread_fn fn, std::optional<CurrentStream>* stream, DeviceBuffers* device, bhas::log* log) -> bool {
+	if (!*stream) {
+		log->push_back(err_failed_to_start_stream("No stream is open."));
+		return false;
+	}
+	if (thread->thread.joinable()) {
+		log->push_back(err_failed_to_start_stream("The stream is already running."));
+		return false;
+	}
+	thread->stop_requested.store(false, std::memory_order_relaxed);
+	thread->cpu_load.store(0.0, std::memory_order_relaxed);
+	thread->active.store(true, std::memory_order_release);
+	thread->thread = std::thread{fn, &**stream, device};
+	return true;
+}
+
+auto join_virtual_thread(VirtualThread* thread) -> void {
+	if (!thread->thread.joinable()) {
+		return;
+	}
+	thread->stop_requested.store(true, std::memory_order_release);
+	if (thread->wake) {
+		thread->wake();
+	}
+	thread->thread.join();
+}
+
+auto is_virtual_stream_active(const std::optional<CurrentStream>& stream, const VirtualThread& thread) -> bool {
+	return stream && thread.active.load(std::memory_order_acquire);
+}
+
+auto on_stream_finished() -> void {
+	if (model.cb.stream_stopped) {
+		model.cb.stream_stopped();
+	}
+}
+
+auto set(audio_cb cb) -> void {
+	model.cb.audio = std::move(cb);
+}
+
+auto set(bhas::processor processor) -> void {
+	model.cb.processor = processor;
+}
+
+auto set(stream_stopped_cb cb) -> void {
+	model.cb.stream_stopped = std::move(cb);
+}
+
+} // api
+} // bhas
@@ -0,0 +1,270 @@
+#pragma once
+
+#include "bhas.h"
+#include "bhas_convert.h"
+#include "bhas_engine.h"
+#include "bhas_input_file.h"
+#include "bhas_rt.h"
+#include <atomic>
+#include <memory>
+#include <optional>
+#include <thread>
+#include <vector>
+
+// What every backend has in common. A backend finds out what its devices
+// can do, opens them and runs the audio thread. Everything between the
+// device's buffers and the user's callback (picking channels, converting
+// formats, re-blocking, resampling, metering) happens here, so every
+// backend gets all of it.
+namespace bhas {
+namespace api {
+
+static constexpr auto DEFAULT_NUM_OUTPUT_CHANNELS = bhas::channel_count{2};
+// If the device gives us more frames than this in one go then the
+// conversion is done in chunks, calling the user once per chunk.
+static constexpr auto MAX_CONVERSION_FRAMES = uint32_t{4096};
+
+// The functions each backend provides. init() picks one and everything
+// in bhas_api.h apart from set() forwards to it.
+struct Backend {
+	auto (*check_if_supported_or_try_to_fall_back)(bhas::stream_request request, bhas::log* log) -> std::optional<bhas::stream_request>;
+	auto (*get_cpu_load)() -> cpu_load;
+	auto (*get_meters)() -> bhas::meters;
+	auto (*get_output_latency)() -> bhas::output_latency;
+	auto (*get_stream_time)() -> stream_time;
+	auto (*init)(bhas::log* log) -> bool;
+	auto (*is_stream_active)() -> bool;
+	auto (*open_stream)(bhas::stream_request request, bhas::log* log, bhas::stream* stream) -> bool;
+	auto (*rescan)() -> bhas::system;
+	auto (*start_stream)(bhas::log* log) -> bool;
+	auto (*close_stream)(bhas::log* log) -> void;
+	auto (*shutdown)() -> void;
+	auto (*stop_stream)(bhas::log* log) -> bool;
+};
+
+#if BHAS_PORTAUDIO
+namespace portaudio {
+
+[[nodiscard]] auto get_backend() -> const Backend&;
+auto set_jack_client_name(std::string_view name) -> void;
+
+} // portaudio
+#endif
+
+#if BHAS_ALSA
+namespace alsa {
+
+[[nodiscard]] auto get_backend() -> const Backend&;
+
+} // alsa
+#endif
+
+namespace null {
+
+[[nodiscard]] auto get_backend() -> const Backend&;
+
+} // null
+
+namespace offline {
+
+[[nodiscard]] auto get_backend() -> const Backend&;
+
+} // offline
+
+namespace loopback {
+
+[[nodiscard]] auto get_backend() -> const Backend&;
+
+} // loopback
+
+// How many channels the devices in a request have.
+struct DeviceChannels {
+	uint32_t num_inputs = 0;
+	uint32_t num_outputs = 0;
+};
+
+// Which of the device's channels the user's channels correspond to.
+struct ChannelMap {
+	// How many channels the device is asked to open
+	uint32_t num_device_channels = 0;
+	// The device channel for each of the user's channels. This is empty
+	// if the user simply gets the first num_device_channels channels.
+	std::vector<uint32_t> device_channels;
+	// Channels which have to be opened but which the user didn't ask for
+	std::vector<uint32_t> unused_device_channels;
+};
+
+// Float buffers for converting to and from the device's sample format
+// and channel layout, when that can't be done by just passing pointers
+// around. Allocated when the stream is opened.
+struct Conversion {
+	bhas::sample_format format = bhas::sample_format::float32;
+	bool dither = false;
+	convert::dither_state dither_state;
+	std::vector<float> input_samples;
+	std::vector<float> output_samples;
+	// Interleaved samples for every device channel, for interleaved
+	// streams which only use some of the channels
+	std::vector<float> device_input_samples;
+	std::vector<float> device_output_samples;
+	// One per channel, or just one if the stream is interleaved
+	std::vector<const float*> input_pointers;
+	std::vector<float*> output_pointers;
+};
+
+struct CurrentStream;
+
+// Runs one device callback. input and output are the device's buffers,
+// in the stream's sample format and layout. input is null if there is no
+// input device.
+using process_fn = auto(*)(CurrentStream* stream, const void* input, void* output, bhas::frame_count frame_count, const bhas::time_info& time_info, bhas::xrun_flags xruns) -> bhas::callback_result;
+
+// The device's side of a stream, for backends which have no device
+// buffers of their own to hand over. In the stream's sample format and
+// layout.
+struct DeviceBuffers {
+	uint32_t frames_per_buffer = 0;
+	std::vector<std::byte> input_samples;
+	std::vector<std::byte> output_samples;
+	// One per channel for non-interleaved streams
+	std::vector<const void*> input_pointers;
+	std::vector<void*> output_pointers;
+	// What's handed to process(): either the single interleaved buffer
+	// or the array of channel pointers. input is null if there is no
+	// input device.
+	const void* input = nullptr;
+	void* output = nullptr;
+};
+
+using wake_fn = auto(*)() -> void;
+
+// The audio thread of a backend which calls the user from a thread of
+// its own rather than one the audio API gives it (null, loopback,
+// offline, ALSA.)
+struct VirtualThread {
+	std::thread thread;
+	// Set by the main thread to ask the audio thread to finish
+	std::atomic<bool> stop_requested = false;
+	// For threads which block on something other than the clock. Called
+	// by join_virtual_thread() once stop_requested is set, to wake the
+	// thread up so that it sees it.
+	wake_fn wake = nullptr;
+	// Cleared by the audio thread once it has stopped calling the user
+	std::atomic<bool> active = false;
+	// The fraction of each buffer's duration spent processing it,
+	// smoothed over a few buffers
+	std::atomic<double> cpu_load = 0.0;
+};
+
+using virtual_thread_fn = auto(*)(CurrentStream* stream, DeviceBuffers* device) -> void;
+
+struct CurrentStream {
+	bhas::sample_rate sample_rate;
+	bhas::sample_rate device_sample_rate;
+	bhas::output_latency output_latency;
+	bhas::channel_count num_output_channels;
+	bhas::buffer_layout buffer_layout = bhas::buffer_layout::non_interleaved;
+	ChannelMap input_map;
+	ChannelMap output_map;
+	Conversion conversion;
+	// For non-interleaved float streams which only use some of the
+	// device's channels, these point into the device buffers.
+	std::vector<const float*> input_pointers;
+	std::vector<float*> output_pointers;
+	// For interleaved streams these hold the single buffer pointer so
+	// that it can be passed on as a pointer-to-pointer without a copy.
+	const float* interleaved_input = nullptr;
+	float* interleaved_output = nullptr;
+	// Applied by the audio thread at the start of the first callback
+	rt::thread_setup audio_thread;
+	bool audio_thread_ready = false;
+	// Only if a fixed block size was requested
+	std::optional<engine::reblocker> reblocker;
+	bhas::frame_count block_latency;
+	// Only if render-ahead was requested
+	std::unique_ptr<engine::render_pipeline> render_pipeline;
+	// Only if the device runs at a different rate to the user
+	std::optional<engine::resampler> resampler;
+	// Only if metering was requested
+	std::unique_ptr<engine::meter_bank> meters;
+	// Only if the input comes from a file. Backends which call the user
+	// as fast as they can set wait_for_data before the stream starts.
+	std::unique_ptr<input_file::reader> input_file;
+	// What the device reported at the start of the current callback
+	bhas::xrun_flags xruns;
+	// Only used by the statically-dispatched processor path. A pointer
+	// to this stream is what backends hand to their audio thread, so the
+	// audio thread doesn't have to go through a model.
+	bhas::processor processor;
+	bhas::process_block block;
+	// The cheapest way of getting from the device to the user for this
+	// stream. Picked when the stream is opened.
+	process_fn process = nullptr;
+};
+
+// Main thread
+[[nodiscard]] auto get_sample_format_name(bhas::sample_format format) -> const char*;
+[[nodiscard]] auto get_num_output_channels(const bhas::stream_request& request) -> bhas::channel_count;
+[[nodiscard]] auto get_num_input_channels(const bhas::stream_request& request, const DeviceChannels& devices) -> bhas::channel_count;
+[[nodiscard]] auto is_identity(const ChannelMap& map) -> bool;
+[[nodiscard]] auto make_channel_map(bhas::channel_count count, const std::vector<bhas::channel_index>& channels) -> ChannelMap;
+// The rate the device is opened at. Only different from the requested
+// rate if the stream is being resampled.
+[[nodiscard]] auto get_device_sample_rate(const bhas::stream_request& request) -> bhas::sample_rate;
+// In seconds
+[[nodiscard]] auto get_suggested_latency(const bhas::stream_request& request, double default_latency) -> double;
+[[nodiscard]] auto info_negotiated_sample_format(bhas::sample_format format) -> bhas::info;
+// For when the device can't run at the requested rate and is opened at
+// its default one instead
+[[nodiscard]] auto info_resampling(bhas::sample_rate sample_rate, bhas::sample_rate device_sample_rate) -> bhas::info;
+// Everything which can be checked without asking the device.
+[[nodiscard]] auto validate_request(const bhas::stream_request& request, const DeviceChannels& devices, bhas::log* log) -> bool;
+// Sets up everything the audio thread needs apart from the device
+// itself. Call with a resolved, validated request before opening the
+// device. The stream mustn't move afterwards. If this fails then release
+// the stream.
+[[nodiscard]] auto prepare_stream(const bhas::stream_request& request, const DeviceChannels& devices, const ChannelMap& input_map, const ChannelMap& output_map, bhas::log* log, CurrentStream* stream) -> bool;
+// Allocates silent buffers for every device channel the stream opens.
+auto make_device_buffers(const bhas::stream_request& request, const CurrentStream& stream, uint32_t frames_per_buffer, DeviceBuffers* buffers) -> void;
+[[nodiscard]] auto lock_device_buffers(const DeviceBuffers& buffers) -> bool;
+// Call once the device is open, with the latencies it reported. Fills in
+// stream_info and starts the worker and render threads.
+auto finish_opening_stream(const bhas::stream_request& request, bhas::seconds device_input_latency, bhas::seconds device_output_latency, bhas::log* log, CurrentStream* stream, bhas::stream* stream_info) -> void;
+// Call once the device is closed.
+auto release_stream(std::optional<CurrentStream>* stream) -> void;
+[[nodiscard]] auto get_meters(const std::optional<CurrentStream>& stream) -> bhas::meters;
+[[nodiscard]] auto warn_stream_already_open() -> bhas::warning;
+[[nodiscard]] auto err_failed_to_start_stream(const char* reason) -> bhas::error;
+
+// For backends with no device behind them. There is one device, which is
+// the default for both directions and is on a host of its own.
+[[nodiscard]] auto make_single_device_system(const char* host_name, const char* device_name, const DeviceChannels& channels, bhas::sample_rate default_sample_rate) -> bhas::system;
+// Anything goes, so the sample format is float32 and a resampled stream
+// runs the device at the requested rate, unless the request says
+// otherwise, which means nothing is actually resampled.
+auto resolve_virtual_request(bhas::stream_request* request, bhas::buffer_layout default_layout, bhas::log* log) -> void;
+[[nodiscard]] auto validate_virtual_request(const bhas::stream_request& request, const DeviceChannels& devices, bhas::log* log) -> bool;
+// Runs fn on the thread's own std::thread. The thread has to clear
+// active and call on_stream_finished() when it's done.
+[[nodiscard]] auto start_virtual_thread(VirtualThread* thread, virtual_thread_fn fn, std::optional<CurrentStream>* stream, DeviceBuffers* device, bhas::log* log) -> bool;
+// Asks the thread to finish and waits for it, if it's running.
+auto join_virtual_thread(VirtualThread* thread) -> void;
+[[nodiscard]] auto is_virtual_stream_active(const std::optional<CurrentStream>& stream, const VirtualThread& thread) -> bool;
+
+// Audio thread
+[[nodiscard]] inline
+auto process(CurrentStream* stream, const void* input, void* output, bhas::frame_count frame_count, const bhas::time_info& time_info, bhas::xrun_flags xruns) -> bhas::callback_result {
+	if (stream->input_file) {
+		if (const auto file_input = input_file::read(stream->input_file.get(), frame_count, &xruns)) {
+			input = file_input;
+		}
+	}
+	return stream->process(stream, input, output, frame_count, time_info, xruns);
+}
+
+// Whatever thread the backend finishes a stream in. Tells the main
+// thread that the stream has stopped.
+auto on_stream_finished() -> void;
+
+} // api
+} // bhas
@@ -0,0 +1,603 @@
+// Headless benchmarks for the engine. Only the alsa benchmark opens a device,
+// and the ALSA null PCM will do for that.
+// Pass a substring as the first argument to run only the matching benchmarks.
+#include "bhas.h"
+#include "bhas_buffer.h"
+#include "bhas_convert.h"
+#include "bhas_cpu.h"
+#include "bhas_engine.h"
+#include "bhas_resample.h"
+#include "bhas_wav.h"
+#include "bhas_workers.h"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <filesystem>
+#include <optional>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+using bench_clock = std::chrono::steady_clock;
+
+static constexpr auto SAMPLE_RATE = bhas::sample_rate{48000};
+
+struct latency_stats {
+	double p50 = 0.0;
+	double p99 = 0.0;
+	double max = 0.0;
+};
+
+[[nodiscard]] static
+auto summarize(std::vector<double> samples) -> latency_stats {
+	if (samples.empty()) {
+		return {};
+	}
+	std::sort(samples.begin(), samples.end());
+	const auto at = [&samples](double p) { return samples.at(static_cast<size_t>(p * static_cast<double>(samples.size() - 1))); };
+	return {at(0.5), at(0.99), samples.back()};
+}
+
+[[nodiscard]] static
+auto period_duration(bhas::frame_count period) -> bench_clock::duration {
+	return std::chrono::duration_cast<bench_clock::duration>(std::chrono::duration<double>{double(period.value) / double(SAMPLE_RATE.value)});
+}
+
+// Measures how long it takes for a command pushed from the main thread to
+// be executed by a simulated audio thread which drains the command queue
+// at the start of every period. A period of zero means the audio thread
+// spins on the queue, which measures the raw hand-off cost.
+static
+auto bench_command_latency(bhas::frame_count period) -> void {
+	static constexpr auto NUM_COMMANDS = 2000;
+	struct received {
+		std::vector<double> latencies_us;
+		std::atomic<int> count = 0;
+	} results;
+	results.latencies_us.reserve(NUM_COMMANDS);
+	std::atomic<bool> done = false;
+	std::thread audio_thread{[period, &done] {
+		auto next = bench_clock::now();
+		while (!done.load(std::memory_order_relaxed)) {
+			if (period.value > 0) {
+				next += period_duration(period);
+				std::this_thread::sleep_until(next);
+			}
+			bhas::engine::drain_commands();
+		}
+	}};
+	for (int i = 0; i < NUM_COMMANDS; i++) {
+		const auto sent = bench_clock::now();
+		const auto ok = bhas::push_command([sent, results = &results] {
+			const auto latency = std::chrono::duration<double, std::micro>{bench_clock::now() - sent};
+			results->latencies_us.push_back(latency.count());
+			results->count.fetch_add(1, std::memory_order_release);
+		});
+		if (!ok) {
+			std::fprintf(stderr, "command queue overflowed\n");
+		}
+		// Spread the commands out so they land at random points in the period
+		std::this_thread::sleep_for(std::chrono::microseconds{50 + (i * 37) % 250});
+	}
+	while (results.count.load(std::memory_order_acquire) < NUM_COMMANDS) {
+		std::this_thread::sleep_for(std::chrono::milliseconds{1});
+	}
+	done = true;
+	audio_thread.join();
+	const auto stats = summarize(std::move(results.latencies_us));
+	std::printf("command latency  period=%4u frames  p50=%9.2fus  p99=%9.2fus  max=%9.2fus  overflows=%llu\n",
+		period.value, stats.p50, stats.p99, stats.max,
+		static_cast<unsigned long long>(bhas::get_command_overflow_count().value));
+}
+
+static
+auto bench_command_latency() -> void {
+	for (const auto period : {0u, 32u, 64u, 128u, 256u}) {
+		bench_command_latency(bhas::frame_count{period});
+	}
+}
+
+// Measures the per-period cost of converting a device's input channels to
+// float, comparing opening every channel of a 64-channel interface with
+// opening only the two which are actually used. This is the work (and
+// memory traffic) which input channel selection saves on every period,
+// before the driver's own transfer is even counted.
+static
+auto bench_input_channels(bhas::channel_count num_channels) -> void {
+	static constexpr auto PERIOD      = bhas::frame_count{256};
+	static constexpr auto NUM_PERIODS = 20000;
+	static constexpr auto FORMAT      = bhas::sample_format::int32;
+	const auto bytes_per_sample = bhas::convert::get_bytes_per_sample(FORMAT);
+	std::vector<std::byte> device(size_t(PERIOD.value) * num_channels.value * bytes_per_sample);
+	std::vector<float> user(size_t(PERIOD.value) * num_channels.value);
+	for (size_t i = 0; i < device.size(); i++) {
+		device[i] = static_cast<std::byte>(i * 31);
+	}
+	std::vector<double> durations_us;
+	durations_us.reserve(NUM_PERIODS);
+	const auto start = bench_clock::now();
+	for (int i = 0; i < NUM_PERIODS; i++) {
+		const auto period_start = bench_clock::now();
+		for (uint32_t ch = 0; ch < num_channels.value; ch++) {
+			const auto src = device.data() + size_t(ch) * PERIOD.value * bytes_per_sample;
+			bhas::convert::to_float(FORMAT, src, user.data() + size_t(ch) * PERIOD.value, PERIOD.value);
+		}
+		durations_us.push_back(std::chrono::duration<double, std::micro>{bench_clock::now() - period_start}.count());
+	}
+	const auto elapsed  = std::chrono::duration<double>{bench_clock::now() - start}.count();
+	const auto bytes    = double(device.size() + user.size() * sizeof(float)) * NUM_PERIODS;
+	const auto audio_mb = double(device.size() + user.size() * sizeof(float)) * double(SAMPLE_RATE.value) / double(PERIOD.value) / 1e6;
+	const auto stats    = summarize(std::move(durations_us));
+	std::printf("input channels  channels=%3u  p50=%8.3fus  p99=%8.3fus  %8.2f MB/s of audio  %8.2f GB/s achieved\n",
+		num_channels.value, stats.p50, stats.p99, audio_mb, bytes / elapsed / 1e9);
+}
+
+static
+auto bench_input_channels() -> void {
+	for (const auto channels : {64u, 2u}) {
+		bench_input_channels(bhas::channel_count{channels});
+	}
+}
+
+// Measures how the time spent in a simulated audio callback scales with
+// the number of worker threads. Every period the callback renders a
+// fixed set of voices as one batch of jobs. The callback sleeps between
+// periods like a real one would, so the cost of waking the workers back
+// up is included.
+static
+auto bench_worker_scaling(bhas::thread_count num_workers, bhas::frame_count period) -> void {
+	static constexpr auto NUM_VOICES  = 64;
+	static constexpr auto NUM_STAGES  = 16;
+	static constexpr auto NUM_PERIODS = 300;
+	struct voice {
+		std::array<float, NUM_STAGES> state = {};
+		std::vector<float> output;
+	};
+	struct render {
+		std::vector<voice> voices;
+		uint32_t frames;
+		auto operator()(uint32_t index) -> void {
+			auto& v = voices[index];
+			for (uint32_t i = 0; i < frames; i++) {
+				auto x = float(i & 15) * 0.0625f;
+				for (auto& s : v.state) {
+					s += 0.1f * (x - s);
+					x  = s;
+				}
+				v.output[i] = x;
+			}
+		}
+	};
+	render job{std::vector<voice>(NUM_VOICES), period.value};
+	for (auto& v : job.voices) {
+		v.output.resize(period.value);
+	}
+	bhas::workers::start(num_workers, {});
+	std::vector<double> durations_us;
+	durations_us.reserve(NUM_PERIODS);
+	auto next = bench_clock::now();
+	for (int i = 0; i < NUM_PERIODS; i++) {
+		next += period_duration(period);
+		std::this_thread::sleep_until(next);
+		const auto start = bench_clock::now();
+		bhas::workers::run([](void* context, uint32_t index) { (*static_cast<render*>(context))(index); }, &job, NUM_VOICES);
+		durations_us.push_back(std::chrono::duration<double, std::micro>{bench_clock::now() - start}.count());
+	}
+	bhas::workers::stop();
+	const auto period_us = std::chrono::duration<double, std::micro>{period_duration(period)}.count();
+	const auto stats     = summarize(std::move(durations_us));
+	std::printf("worker scaling  period=%4u frames  workers=%2u  p50=%8.2fus  p99=%8.2fus  max=%8.2fus  p99 load=%5.1f%%\n",
+		period.value, num_workers.value, stats.p50, stats.p99, stats.max, 100.0 * stats.p99 / period_us);
+}
+
+static
+auto bench_worker_scaling() -> void {
+	const auto max_workers = std::min(std::max(std::thread::hardware_concurrency(), 2u) - 1, bhas::MAX_WORKER_THREADS.value);
+	for (const auto period : {64u, 128u, 256u}) {
+		for (uint32_t workers = 0; workers <= max_workers; workers = workers ? workers * 2 : 1) {
+			bench_worker_scaling(bhas::thread_count{workers}, bhas::frame_count{period});
+		}
+		if ((max_workers & (max_workers - 1)) != 0) {
+			bench_worker_scaling(bhas::thread_count{max_workers}, bhas::frame_count{period});
+		}
+	}
+}
+
+// Keeps the optimizer from throwing away work whose result isn't used.
+static volatile float sink;
+
+// Times fn over many repetitions and returns nanoseconds per call.
+template <typename Fn> [[nodiscard]] static
+auto time_per_call_ns(Fn&& fn) -> double {
+	static constexpr auto NUM_CALLS = 200000;
+	const auto start = bench_clock::now();
+	for (int i = 0; i < NUM_CALLS; i++) {
+		fn();
+	}
+	return std::chrono::duration<double, std::nano>{bench_clock::now() - start}.count() / NUM_CALLS;
+}
+
+static
+auto print_kernel(const char* name, bhas::frame_count frames, double naive_ns, double kernel_ns) -> void {
+	std::printf("buffer kernels  %-12s frames=%4u  naive=%8.1fns  kernel=%8.1fns  speedup=%5.2fx\n",
+		name, frames.value, naive_ns, kernel_ns, naive_ns / kernel_ns);
+}
+
+// Compares each of the public buffer kernels against the loop people
+// would otherwise write, on one channel (or one stereo frame buffer) of
+// a typical period. The gain flips the sign so that repeatedly applying
+// it never sends the samples into denormals.
+static
+auto bench_buffer_kernels(bhas::frame_count frames) -> void {
+	const auto n = size_t(frames.value);
+	std::vector<float> a(n * 2);
+	std::vector<float> b(n * 2);
+	for (size_t i = 0; i < a.size(); i++) {
+		a[i] = std::sin(float(i) * 0.01f);
+	}
+	const float* planes[] = {a.data(), a.data() + n};
+	float* out_planes[]   = {b.data(), b.data() + n};
+	print_kernel("zero", frames,
+		time_per_call_ns([&] { for (size_t i = 0; i < n; i++) { b[i] = 0.0f; } sink = b[n - 1]; }),
+		time_per_call_ns([&] { bhas::buffer::zero(b.data(), n); sink = b[n - 1]; }));
+	print_kernel("copy", frames,
+		time_per_call_ns([&] { for (size_t i = 0; i < n; i++) { b[i] = a[i]; } sink = b[n - 1]; }),
+		time_per_call_ns([&] { bhas::buffer::copy(a.data(), b.data(), n); sink = b[n - 1]; }));
+	print_kernel("apply_gain", frames,
+		time_per_call_ns([&] { for (size_t i = 0; i < n; i++) { b[i] *= -1.0f; } sink = b[n - 1]; }),
+		time_per_call_ns([&] { bhas::buffer::apply_gain(b.data(), n, -1.0f); sink = b[n - 1]; }));
+	print_kernel("mix", frames,
+		time_per_call_ns([&] { for (size_t i = 0; i < n; i++) { b[i] += a[i] * 0.5f; } sink = b[n - 1]; }),
+		time_per_call_ns([&] { bhas::buffer::mix(a.data(), b.data(), n, 0.5f); sink = b[n - 1]; }));
+	print_kernel("peak", frames,
+		time_per_call_ns([&] { float p = 0.0f; for (size_t i = 0; i < n; i++) { p = std::max(p, std::fabs(a[i])); } sink = p; }),
+		time_per_call_ns([&] { sink = bhas::buffer::peak(a.data(), n); }));
+	print_kernel("interleave", frames,
+		time_per_call_ns([&] { for (size_t i = 0; i < n; i++) { for (size_t ch = 0; ch < 2; ch++) { b[i * 2 + ch] = planes[ch][i]; } } sink = b[n - 1]; }),
+		time_per_call_ns([&] { bhas::buffer::interleave({planes}, b.data(), {2}, frames); sink = b[n - 1]; }));
+	print_kernel("deinterleave", frames,
+		time_per_call_ns([&] { for (size_t i = 0; i < n; i++) { for (size_t ch = 0; ch < 2; ch++) { out_planes[ch][i] = a[i * 2 + ch]; } } sink = b[n - 1]; }),
+		time_per_call_ns([&] { bhas::buffer::deinterleave(a.data(), {out_planes}, {2}, frames); sink = b[n - 1]; }));
+}
+
+static
+auto bench_buffer_kernels() -> void {
+	for (const auto frames : {64u, 256u, 1024u}) {
+		bench_buffer_kernels(bhas::frame_count{frames});
+	}
+}
+
+// The same kernels forced onto each instruction set this CPU supports, on
+// one channel of a typical period.
+static
+auto bench_instruction_sets() -> void {
+	static constexpr size_t NUM_FRAMES = 256;
+	std::vector<float> a(NUM_FRAMES);
+	std::vector<float> b(NUM_FRAMES);
+	std::vector<int16_t> device(NUM_FRAMES);
+	for (size_t i = 0; i < NUM_FRAMES; i++) {
+		a[i] = std::sin(float(i) * 0.01f);
+	}
+	auto dither = bhas::convert::make_dither_state(1);
+	const auto supported = bhas::get_supported_instruction_set();
+	for (auto isa = bhas::instruction_set::scalar; isa <= supported; isa = bhas::instruction_set(int(isa) + 1)) {
+		if (!bhas::force_instruction_set(isa)) {
+			continue;
+		}
+		const auto mix_ns     = time_per_call_ns([&] { bhas::buffer::mix(a.data(), b.data(), NUM_FRAMES, -1.0f); sink = b[NUM_FRAMES - 1]; });
+		const auto peak_ns    = time_per_call_ns([&] { sink = bhas::buffer::peak(a.data(), NUM_FRAMES); });
+		const auto to_ns      = time_per_call_ns([&] { bhas::convert::to_float(bhas::sample_format::int16, device.data(), b.data(), NUM_FRAMES); sink = b[NUM_FRAMES - 1]; });
+		const auto from_ns    = time_per_call_ns([&] { bhas::convert::from_float(bhas::sample_format::int16, a.data(), device.data(), NUM_FRAMES, nullptr); sink = device[NUM_FRAMES - 1]; });
+		const auto dither_ns  = time_per_call_ns([&] { bhas::convert::from_float(bhas::sample_format::int16, a.data(), device.data(), NUM_FRAMES, &dither); sink = device[NUM_FRAMES - 1]; });
+		std::printf("instruction set %-8s mix=%6.1fns  peak=%6.1fns  int16->float=%6.1fns  float->int16=%6.1fns  dithered=%6.1fns\n",
+			bhas::cpu::get_name(isa), mix_ns, peak_ns, to_ns, from_ns, dither_ns);
+	}
+	(void)bhas::force_instruction_set(std::nullopt);
+}
+
+// What metering adds to each callback when it's enabled. When it's
+// disabled the callback only checks a null pointer. The window is long
+// enough that most callbacks only accumulate, so publishing is amortised
+// in the way it would be in a real stream.
+static
+auto bench_metering() -> void {
+	bhas::metering_config config;
+	config.enabled = true;
+	for (const auto layout : {bhas::buffer_layout::non_interleaved, bhas::buffer_layout::interleaved}) {
+		for (const auto num_channels : {2u, 8u}) {
+			for (const auto frames : {64u, 256u, 1024u}) {
+				const auto bank = bhas::engine::make_meter_bank(config, layout, {num_channels}, {num_channels}, SAMPLE_RATE);
+				std::vector<float> samples(size_t(frames) * num_channels);
+				for (size_t i = 0; i < samples.size(); i++) {
+					samples[i] = std::sin(float(i) * 0.01f);
+				}
+				std::vector<float*> planes(num_channels);
+				for (uint32_t ch = 0; ch < num_channels; ch++) {
+					planes[ch] = layout == bhas::buffer_layout::interleaved ? samples.data() : samples.data() + size_t(ch) * frames;
+				}
+				const auto input = bhas::input_buffer{const_cast<const float* const*>(planes.data())};
+				const auto ns    = time_per_call_ns([&] { bhas::engine::meter(bank.get(), input, {planes.data()}, {frames}); });
+				std::printf("metering  %-15s channels=%u+%u  frames=%4u  per_callback=%8.1fns  per_sample=%5.2fns\n",
+					layout == bhas::buffer_layout::interleaved ? "interleaved" : "non-interleaved",
+					num_channels, num_channels, frames, ns, ns / (2.0 * frames * num_channels));
+			}
+		}
+	}
+}
+
+// What resampling a duplex stereo stream costs, per device frame, at each
+// quality. The user callback does nothing, so this is the resampler alone:
+// one filter for the input and one for the output.
+static
+auto bench_resampler() -> void {
+	static constexpr auto NUM_CHANNELS = bhas::channel_count{2};
+	static constexpr auto FRAMES       = 256u;
+	const auto fn = [](void*, bhas::input_buffer, bhas::output_buffer output, bhas::frame_count frame_count, const bhas::time_info&) -> bhas::callback_result {
+		bhas::buffer::zero(output, NUM_CHANNELS, frame_count);
+		return bhas::callback_result::continue_;
+	};
+	for (const auto quality : {bhas::resampler_quality::low, bhas::resampler_quality::medium, bhas::resampler_quality::high}) {
+		for (const auto& [user_rate, device_rate] : {std::pair{44100u, 48000u}, std::pair{48000u, 44100u}}) {
+			auto r = bhas::engine::make_resampler(quality, bhas::buffer_layout::non_interleaved, NUM_CHANNELS, NUM_CHANNELS, {user_rate}, {device_rate});
+			std::vector<float> in(size_t(FRAMES) * NUM_CHANNELS.value);
+			std::vector<float> out(in.size());
+			for (size_t i = 0; i < in.size(); i++) {
+				in[i] = std::sin(float(i) * 0.01f);
+			}
+			const float* in_planes[] = {in.data(), in.data() + FRAMES};
+			float* out_planes[]      = {out.data(), out.data() + FRAMES};
+			const auto ns = time_per_call_ns([&] { (void)bhas::engine::resample(&r, {in_planes}, {out_planes}, {FRAMES}, {}, fn, nullptr); });
+			std::printf("resampler  taps=%2u  %5u -> %5u  frames=%u  per_callback=%8.1fns  per_frame=%6.2fns\n",
+				bhas::resample::get_taps(quality), user_rate, device_rate, FRAMES, ns, ns / FRAMES);
+		}
+	}
+}
+
+// How much faster than real time the offline backend renders ten minutes
+// of stereo, through the whole engine, with the output thrown away and
+// with it written to a WAV file. The callback only writes silence, so
+// this is the backend's own overhead plus the disk.
+static
+auto bench_offline_render() -> void {
+	static constexpr auto NUM_FRAMES = uint64_t{SAMPLE_RATE.value} * 600;
+	const auto path = std::filesystem::temp_directory_path() / "bhas_bench_offline.wav";
+	for (const auto write_file : {false, true}) {
+		bool started = false;
+		bhas::callbacks cb;
+		cb.audio = [](bhas::input_buffer, bhas::output_buffer output, bhas::frame_count frame_count, bhas::sample_rate, bhas::output_latency, const bhas::time_info*) -> bhas::callback_result {
+			bhas::buffer::zero(output, {2}, frame_count);
+			return bhas::callback_result::continue_;
+		};
+		cb.report               = [](bhas::log) -> void {};
+		cb.stream_starting      = [](bhas::stream) -> void {};
+		cb.stream_start_failure = []() -> void {};
+		cb.stream_start_success = [&started](bhas::stream) -> void { started = true; };
+		cb.stream_stopped       = []() -> void {};
+		if (!bhas::init(std::move(cb), bhas::backend::offline)) {
+			std::printf("offline backend unavailable\n");
+			return;
+		}
+		const auto& system = bhas::get_system();
+		bhas::stream_request request;
+		request.output_device      = system.default_output_device;
+		request.sample_rate        = SAMPLE_RATE;
+		request.offline.num_frames = NUM_FRAMES;
+		if (write_file) {
+			request.offline.path = path.string();
+		}
+		const auto start = bench_clock::now();
+		bhas::request_stream(request);
+		while (!started || bhas::get_current_stream()) {
+			bhas::update();
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+		const auto elapsed = std::chrono::duration<double>{bench_clock::now() - start}.count();
+		const auto audio   = double(NUM_FRAMES) / double(SAMPLE_RATE.value);
+		bhas::shutdown();
+		std::printf("offline_render  %-9s  audio=%.0fs  render=%.3fs  speed=%7.0fx real time  one_hour=%.2fs\n",
+			write_file ? "wav" : "discard", audio, elapsed, audio / elapsed, elapsed * 3600.0 / audio);
+	}
+	std::filesystem::remove(path);
+}
+
+// The offline render again, this time with an 8 channel int24 file as
+// the input and a callback which mixes every input channel into its
+// output. This is the reader thread, the format conversion and the
+// input path through the engine, with no disk writes.
+static
+auto bench_input_file() -> void {
+	static constexpr auto NUM_CHANNELS = bhas::channel_count{8};
+	static constexpr auto FILE_FRAMES  = uint64_t{SAMPLE_RATE.value} * 60;
+	const auto path = std::filesystem::temp_directory_path() / "bhas_bench_input.wav";
+	{
+		bhas::log log;
+		bhas::wav::writer writer;
+		if (!bhas::wav::open(path.string(), {bhas::sample_format::int24, NUM_CHANNELS, SAMPLE_RATE}, &writer, &log)) {
+			std::printf("couldn't write %s\n", path.string().c_str());
+			return;
+		}
+		std::vector<std::byte> chunk(size_t(SAMPLE_RATE.value) * NUM_CHANNELS.value * 3);
+		for (size_t i = 0; i < chunk.size(); i++) {
+			chunk[i] = static_cast<std::byte>(i * 31);
+		}
+		for (uint64_t frame = 0; frame < FILE_FRAMES; frame += SAMPLE_RATE.value) {
+			(void)bhas::wav::write(&writer, chunk.data(), SAMPLE_RATE.value);
+		}
+		(void)bhas::wav::close(&writer, &log);
+	}
+	bool started = false;
+	bhas::callbacks cb;
+	cb.audio = [](bhas::input_buffer input, bhas::output_buffer output, bhas::frame_count frame_count, bhas::sample_rate, bhas::output_latency, const bhas::time_info*) -> bhas::callback_result {
+		for (uint32_t out = 0; out < 2; out++) {
+			bhas::buffer::copy(input.buffer[0], output.buffer[out], frame_count.value);
+			for (uint32_t ch = 1; ch < NUM_CHANNELS.value; ch++) {
+				bhas::buffer::mix(input.buffer[ch], output.buffer[out], frame_count.value, 1.0f);
+			}
+		}
+		return bhas::callback_result::continue_;
+	};
+	cb.report               = [](bhas::log) -> void {};
+	cb.stream_starting      = [](bhas::stream) -> void {};
+	cb.stream_start_failure = []() -> void {};
+	cb.stream_start_success = [&started](bhas::stream) -> void { started = true; };
+	cb.stream_stopped       = []() -> void {};
+	if (!bhas::init(std::move(cb), bhas::backend::offline)) {
+		std::printf("offline backend unavailable\n");
+		return;
+	}
+	const auto& system = bhas::get_system();
+	bhas::stream_request request;
+	request.input_device       = system.default_input_device;
+	request.output_device      = system.default_output_device;
+	request.sample_rate        = SAMPLE_RATE;
+	request.num_input_channels = NUM_CHANNELS;
+	request.offline.num_frames = FILE_FRAMES;
+	request.input_file.path    = path.string();
+	const auto start = bench_clock::now();
+	bhas::request_stream(request);
+	while (!started || bhas::get_current_stream()) {
+		bhas::update();
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+	const auto elapsed = std::chrono::duration<double>{bench_clock::now() - start}.count();
+	const auto audio   = double(FILE_FRAMES) / double(SAMPLE_RATE.value);
+	bhas::shutdown();
+	std::filesystem::remove(path);
+	std::printf("input_file  channels=%u  int24  audio=%.0fs  render=%.3fs  speed=%6.0fx real time\n", NUM_CHANNELS.value, audio, elapsed, audio / elapsed);
+}
+
+// Compares the native ALSA backend with PortAudio's ALSA host API on the
+// same PCM, which is "null" unless BHAS_BENCH_ALSA_DEVICE names another
+// (a "file" plugin PCM, or real hardware.) For each period this prints
+// the process CPU time per callback, which counts the backend's own
+// thread and copies as well as the callback, and the number of xruns in
+// two seconds of audio. The null plugin doesn't keep time, so on it only
+// the CPU figures mean anything.
+struct alsa_bench_result {
+	bool found = false;
+	bool started = false;
+	uint64_t callbacks = 0;
+	double cpu_us = 0.0;
+	uint64_t xruns = 0;
+};
+
+[[nodiscard]] static
+auto run_alsa_bench(bhas::backend backend, const std::string& device_name, bhas::frame_count period) -> std::optional<alsa_bench_result> {
+	static constexpr auto SECONDS = 2u;
+	const auto num_callbacks = SAMPLE_RATE.value * SECONDS / period.value;
+	std::atomic<uint64_t> callbacks = 0;
+	alsa_bench_result result;
+	bool failed = false;
+	bhas::callbacks cb;
+	cb.audio = [&callbacks, num_callbacks](bhas::input_buffer, bhas::output_buffer output, bhas::frame_count frame_count, bhas::sample_rate, bhas::output_latency, const bhas::time_info*) -> bhas::callback_result {
+		bhas::buffer::zero(output, {2}, frame_count);
+		return callbacks.fetch_add(1, std::memory_order_relaxed) + 1 < num_callbacks ? bhas::callback_result::continue_ : bhas::callback_result::complete;
+	};
+	cb.report               = [](bhas::log) -> void {};
+	cb.stream_starting      = [](bhas::stream) -> void {};
+	cb.stream_start_failure = [&failed]() -> void { failed = true; };
+	cb.stream_start_success = [&result](bhas::stream) -> void { result.started = true; };
+	cb.stream_stopped       = []() -> void {};
+	if (!bhas::init(std::move(cb), backend)) {
+		return std::nullopt;
+	}
+	const auto& system = bhas::get_system();
+	const auto device  = std::find_if(system.devices.begin(), system.devices.end(), [&device_name](const bhas::device& d) {
+		return d.name.value == device_name && (d.flags.value & bhas::device_flags::output);
+	});
+	if (device == system.devices.end()) {
+		bhas::shutdown();
+		return result;
+	}
+	result.found = true;
+	bhas::stream_request request;
+	request.output_device       = device->index;
+	request.num_output_channels = bhas::channel_count{2};
+	request.sample_rate         = SAMPLE_RATE;
+	request.frames_per_buffer   = period;
+	const auto cpu_start = std::clock();
+	const auto deadline  = bench_clock::now() + std::chrono::seconds{SECONDS * 5};
+	bhas::request_stream(request);
+	while (!failed && (!result.started || bhas::get_current_stream()) && bench_clock::now() < deadline) {
+		bhas::update();
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+	const auto xruns  = bhas::get_xrun_stats();
+	result.callbacks  = callbacks.load(std::memory_order_relaxed);
+	result.xruns      = xruns.output_underflow.count + xruns.input_overflow.count;
+	bhas::shutdown();
+	if (result.callbacks > 0) {
+		result.cpu_us = 1e6 * double(std::clock() - cpu_start) / CLOCKS_PER_SEC / double(result.callbacks);
+	}
+	return result;
+}
+
+static
+auto bench_alsa() -> void {
+	const auto env         = std::getenv("BHAS_BENCH_ALSA_DEVICE");
+	const auto device_name = std::string{env ? env : "null"};
+	for (const auto& [backend, name] : {std::pair{bhas::backend::alsa, "alsa"}, std::pair{bhas::backend::portaudio, "portaudio"}}) {
+		std::optional<uint32_t> min_period;
+		for (const auto period : {32u, 64u, 128u, 256u}) {
+			const auto result = run_alsa_bench(backend, device_name, bhas::frame_count{period});
+			if (!result) {
+				std::printf("alsa  %-9s  unavailable\n", name);
+				break;
+			}
+			if (!result->found) {
+				std::printf("alsa  %-9s  no output device named %s\n", name, device_name.c_str());
+				break;
+			}
+			if (!result->started) {
+				std::printf("alsa  %-9s  device=%s  period=%4u frames  failed to start\n", name, device_name.c_str(), period);
+				continue;
+			}
+			std::printf("alsa  %-9s  device=%s  period=%4u frames  callbacks=%6llu  cpu=%8.2fus/callback  xruns=%llu\n",
+				name, device_name.c_str(), period, static_cast<unsigned long long>(result->callbacks), result->cpu_us,
+				static_cast<unsigned long long>(result->xruns));
+			if (!min_period && result->xruns == 0) {
+				min_period = period;
+			}
+		}
+		if (min_period) {
+			std::printf("alsa  %-9s  minimum period without xruns=%u frames\n", name, *min_period);
+		}
+	}
+}
+
+struct benchmark {
+	const char* name;
+	void (*fn)();
+};
+
+static const benchmark BENCHMARKS[] = {
+	{"command_latency", bench_command_latency},
+	{"input_channels", bench_input_channels},
+	{"worker_scaling", bench_worker_scaling},
+	{"buffer_kernels", bench_buffer_kernels},
+	{"instruction_sets", bench_instruction_sets},
+	{"metering", bench_metering},
+	{"resampler", bench_resampler},
+	{"offline_render", bench_offline_render},
+	{"input_file", bench_input_file},
+	{"alsa", bench_alsa},
+};
+
+auto main(int argc, char** argv) -> int {
+	const char* filter = argc > 1 ? argv[1] : nullptr;
+	for (const auto& bench : BENCHMARKS) {
+		if (filter && !std::strstr(bench.name, filter)) {
+			continue;
+		}
+		std::printf("== %s\n", bench.name);
+		bench.fn();
+	}
+	return 0;
+}
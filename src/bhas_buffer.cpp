@@ -0,0 +1,603 @@
+#include "bhas_buffer.h"
+#include "bhas_cpu.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+
+#if BHAS_CPU_SSE2
+#	include <emmintrin.h>
+#endif
+
+#if BHAS_CPU_DISPATCH
+#	include <immintrin.h>
+#endif
+
+namespace bhas {
+namespace buffer {
+
+// How many samples to handle one at a time so that the vector loop's
+// stores are aligned. If dst isn't even float-aligned then it never will
+// be, so don't bother.
+[[nodiscard]] static
+auto get_head_count(const float* dst, size_t alignment, size_t count) -> size_t {
+	const auto misalignment = reinterpret_cast<uintptr_t>(dst) % alignment;
+	if (misalignment == 0 || misalignment % sizeof(float) != 0) {
+		return 0;
+	}
+	return std::min(count, (alignment - misalignment) / sizeof(float));
+}
+
+namespace scalar {
+
+static
+auto zero(float* dst, size_t begin, size_t end) -> void {
+	for (size_t i = begin; i < end; i++) {
+		dst[i] = 0.0f;
+	}
+}
+
+static
+auto copy(const float* src, float* dst, size_t begin, size_t end) -> void {
+	for (size_t i = begin; i < end; i++) {
+		dst[i] = src[i];
+	}
+}
+
+static
+auto apply_gain(float* dst, size_t begin, size_t end, float gain) -> void {
+	for (size_t i = begin; i < end; i++) {
+		dst[i] *= gain;
+	}
+}
+
+static
+auto mix(const float* src, float* dst, size_t begin, size_t end, float gain) -> void {
+	for (size_t i = begin; i < end; i++) {
+		dst[i] += src[i] * gain;
+	}
+}
+
+[[nodiscard]] static
+auto peak(const float* src, size_t begin, size_t end, float result) -> float {
+	for (size_t i = begin; i < end; i++) {
+		result = std::max(result, std::fabs(src[i]));
+	}
+	return result;
+}
+
+// Adds frames [begin, end) to the levels already in out.
+static
+auto measure(const float* src, uint32_t num_channels, size_t begin, size_t end, levels* out) -> void {
+	for (size_t i = begin; i < end; i++) {
+		for (uint32_t ch = 0; ch < num_channels; ch++) {
+			const auto x = src[i * num_channels + ch];
+			out[ch].peak = std::max(out[ch].peak, std::fabs(x));
+			out[ch].sum_of_squares += x * x;
+		}
+	}
+}
+
+static
+auto interleave(const float* const* src, float* dst, uint32_t num_channels, size_t begin, size_t end) -> void {
+	for (size_t i = begin; i < end; i++) {
+		for (uint32_t ch = 0; ch < num_channels; ch++) {
+			dst[i * num_channels + ch] = src[ch][i];
+		}
+	}
+}
+
+static
+auto deinterleave(const float* src, float* const* dst, uint32_t num_channels, size_t begin, size_t end) -> void {
+	for (size_t i = begin; i < end; i++) {
+		for (uint32_t ch = 0; ch < num_channels; ch++) {
+			dst[ch][i] = src[i * num_channels + ch];
+		}
+	}
+}
+
+static auto zero(float* dst, size_t count) -> void                                { zero(dst, 0, count); }
+static auto copy(const float* src, float* dst, size_t count) -> void              { copy(src, dst, 0, count); }
+static auto apply_gain(float* dst, size_t count, float gain) -> void              { apply_gain(dst, 0, count, gain); }
+static auto mix(const float* src, float* dst, size_t count, float gain) -> void   { mix(src, dst, 0, count, gain); }
+[[nodiscard]] static auto peak(const float* src, size_t count) -> float           { return peak(src, 0, count, 0.0f); }
+static auto measure(const float* src, uint32_t num_channels, size_t count, levels* out) -> void { measure(src, num_channels, 0, count, out); }
+static auto interleave(const float* const* src, float* dst, uint32_t num_channels, size_t count) -> void   { interleave(src, dst, num_channels, 0, count); }
+static auto deinterleave(const float* src, float* const* dst, uint32_t num_channels, size_t count) -> void { deinterleave(src, dst, num_channels, 0, count); }
+
+} // scalar
+
+#if BHAS_CPU_SSE2
+namespace sse2 {
+
+static constexpr size_t ALIGNMENT = 16;
+
+static
+auto zero(float* dst, size_t count) -> void {
+	size_t i = get_head_count(dst, ALIGNMENT, count);
+	scalar::zero(dst, 0, i);
+	const auto z = _mm_setzero_ps();
+	for (; i + 4 <= count; i += 4) {
+		_mm_storeu_ps(dst + i, z);
+	}
+	scalar::zero(dst, i, count);
+}
+
+static
+auto copy(const float* src, float* dst, size_t count) -> void {
+	size_t i = get_head_count(dst, ALIGNMENT, count);
+	scalar::copy(src, dst, 0, i);
+	for (; i + 4 <= count; i += 4) {
+		_mm_storeu_ps(dst + i, _mm_loadu_ps(src + i));
+	}
+	scalar::copy(src, dst, i, count);
+}
+
+static
+auto apply_gain(float* dst, size_t count, float gain) -> void {
+	size_t i = get_head_count(dst, ALIGNMENT, count);
+	scalar::apply_gain(dst, 0, i, gain);
+	const auto g = _mm_set1_ps(gain);
+	for (; i + 4 <= count; i += 4) {
+		_mm_storeu_ps(dst + i, _mm_mul_ps(_mm_loadu_ps(dst + i), g));
+	}
+	scalar::apply_gain(dst, i, count, gain);
+}
+
+static
+auto mix(const float* src, float* dst, size_t count, float gain) -> void {
+	size_t i = get_head_count(dst, ALIGNMENT, count);
+	scalar::mix(src, dst, 0, i, gain);
+	const auto g = _mm_set1_ps(gain);
+	for (; i + 4 <= count; i += 4) {
+		_mm_storeu_ps(dst + i, _mm_add_ps(_mm_loadu_ps(dst + i), _mm_mul_ps(_mm_loadu_ps(src + i), g)));
+	}
+	scalar::mix(src, dst, i, count, gain);
+}
+
+[[nodiscard]] static
+auto peak(const float* src, size_t count) -> float {
+	const auto abs_mask = _mm_castsi128_ps(_mm_set1_epi32(0x7FFFFFFF));
+	auto m = _mm_setzero_ps();
+	size_t i = 0;
+	for (; i + 4 <= count; i += 4) {
+		m = _mm_max_ps(m, _mm_and_ps(_mm_loadu_ps(src + i), abs_mask));
+	}
+	m = _mm_max_ps(m, _mm_shuffle_ps(m, m, _MM_SHUFFLE(1, 0, 3, 2)));
+	m = _mm_max_ps(m, _mm_shuffle_ps(m, m, _MM_SHUFFLE(2, 3, 0, 1)));
+	return scalar::peak(src, i, count, _mm_cvtss_f32(m));
+}
+
+// Interleaved buffers are vectorised when every vector holds a whole
+// number of frames, so each lane always belongs to the same channel.
+static
+auto measure(const float* src, uint32_t num_channels, size_t frame_count, levels* out) -> void {
+	if (4 % num_channels != 0) {
+		scalar::measure(src, num_channels, 0, frame_count, out);
+		return;
+	}
+	const auto abs_mask = _mm_castsi128_ps(_mm_set1_epi32(0x7FFFFFFF));
+	const auto count    = frame_count * num_channels;
+	auto m = _mm_setzero_ps();
+	auto s = _mm_setzero_ps();
+	size_t i = 0;
+	for (; i + 4 <= count; i += 4) {
+		const auto x = _mm_loadu_ps(src + i);
+		m = _mm_max_ps(m, _mm_and_ps(x, abs_mask));
+		s = _mm_add_ps(s, _mm_mul_ps(x, x));
+	}
+	alignas(16) float peaks[4];
+	alignas(16) float sums[4];
+	_mm_store_ps(peaks, m);
+	_mm_store_ps(sums, s);
+	for (uint32_t lane = 0, ch = 0; lane < 4; lane++, ch = ch + 1 == num_channels ? 0 : ch + 1) {
+		out[ch].peak = std::max(out[ch].peak, peaks[lane]);
+		out[ch].sum_of_squares += sums[lane];
+	}
+	scalar::measure(src, num_channels, i / num_channels, frame_count, out);
+}
+
+// Only stereo is vectorised. Anything else is strided enough that the
+// scalar loop does about as well.
+static
+auto interleave(const float* const* src, float* dst, uint32_t num_channels, size_t count) -> void {
+	if (num_channels != 2) {
+		scalar::interleave(src, dst, num_channels, 0, count);
+		return;
+	}
+	size_t i = 0;
+	for (; i + 4 <= count; i += 4) {
+		const auto l = _mm_loadu_ps(src[0] + i);
+		const auto r = _mm_loadu_ps(src[1] + i);
+		_mm_storeu_ps(dst + i * 2,     _mm_unpacklo_ps(l, r));
+		_mm_storeu_ps(dst + i * 2 + 4, _mm_unpackhi_ps(l, r));
+	}
+	scalar::interleave(src, dst, num_channels, i, count);
+}
+
+static
+auto deinterleave(const float* src, float* const* dst, uint32_t num_channels, size_t count) -> void {
+	if (num_channels != 2) {
+		scalar::deinterleave(src, dst, num_channels, 0, count);
+		return;
+	}
+	size_t i = 0;
+	for (; i + 4 <= count; i += 4) {
+		const auto a = _mm_loadu_ps(src + i * 2);
+		const auto b = _mm_loadu_ps(src + i * 2 + 4);
+		_mm_storeu_ps(dst[0] + i, _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0)));
+		_mm_storeu_ps(dst[1] + i, _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1)));
+	}
+	scalar::deinterleave(src, dst, num_channels, i, count);
+}
+
+} // sse2
+#endif
+
+#if BHAS_CPU_DISPATCH
+namespace avx2 {
+
+static constexpr size_t ALIGNMENT = 32;
+
+static BHAS_TARGET_AVX2
+auto zero(float* dst, size_t count) -> void {
+	size_t i = get_head_count(dst, ALIGNMENT, count);
+	scalar::zero(dst, 0, i);
+	const auto z = _mm256_setzero_ps();
+	for (; i + 8 <= count; i += 8) {
+		_mm256_storeu_ps(dst + i, z);
+	}
+	scalar::zero(dst, i, count);
+}
+
+static BHAS_TARGET_AVX2
+auto copy(const float* src, float* dst, size_t count) -> void {
+	size_t i = get_head_count(dst, ALIGNMENT, count);
+	scalar::copy(src, dst, 0, i);
+	for (; i + 8 <= count; i += 8) {
+		_mm256_storeu_ps(dst + i, _mm256_loadu_ps(src + i));
+	}
+	scalar::copy(src, dst, i, count);
+}
+
+static BHAS_TARGET_AVX2
+auto apply_gain(float* dst, size_t count, float gain) -> void {
+	size_t i = get_head_count(dst, ALIGNMENT, count);
+	scalar::apply_gain(dst, 0, i, gain);
+	const auto g = _mm256_set1_ps(gain);
+	for (; i + 8 <= count; i += 8) {
+		_mm256_storeu_ps(dst + i, _mm256_mul_ps(_mm256_loadu_ps(dst + i), g));
+	}
+	scalar::apply_gain(dst, i, count, gain);
+}
+
+// Deliberately not fused, so the result is exactly the same as the
+// scalar and SSE2 kernels.
+static BHAS_TARGET_AVX2
+auto mix(const float* src, float* dst, size_t count, float gain) -> void {
+	size_t i = get_head_count(dst, ALIGNMENT, count);
+	scalar::mix(src, dst, 0, i, gain);
+	const auto g = _mm256_set1_ps(gain);
+	for (; i + 8 <= count; i += 8) {
+		_mm256_storeu_ps(dst + i, _mm256_add_ps(_mm256_loadu_ps(dst + i), _mm256_mul_ps(_mm256_loadu_ps(src + i), g)));
+	}
+	scalar::mix(src, dst, i, count, gain);
+}
+
+[[nodiscard]] static BHAS_TARGET_AVX2
+auto peak(const float* src, size_t count) -> float {
+	const auto abs_mask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7FFFFFFF));
+	auto m = _mm256_setzero_ps();
+	size_t i = 0;
+	for (; i + 8 <= count; i += 8) {
+		m = _mm256_max_ps(m, _mm256_and_ps(_mm256_loadu_ps(src + i), abs_mask));
+	}
+	auto m4 = _mm_max_ps(_mm256_castps256_ps128(m), _mm256_extractf128_ps(m, 1));
+	m4 = _mm_max_ps(m4, _mm_shuffle_ps(m4, m4, _MM_SHUFFLE(1, 0, 3, 2)));
+	m4 = _mm_max_ps(m4, _mm_shuffle_ps(m4, m4, _MM_SHUFFLE(2, 3, 0, 1)));
+	return scalar::peak(src, i, count, _mm_cvtss_f32(m4));
+}
+
+static BHAS_TARGET_AVX2
+auto measure(const float* src, uint32_t num_channels, size_t frame_count, levels* out) -> void {
+	if (8 % num_channels != 0) {
+		scalar::measure(src, num_channels, 0, frame_count, out);
+		return;
+	}
+	const auto abs_mask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7FFFFFFF));
+	const auto count    = frame_count * num_channels;
+	auto m = _mm256_setzero_ps();
+	auto s = _mm256_setzero_ps();
+	size_t i = 0;
+	for (; i + 8 <= count; i += 8) {
+		const auto x = _mm256_loadu_ps(src + i);
+		m = _mm256_max_ps(m, _mm256_and_ps(x, abs_mask));
+		s = _mm256_add_ps(s, _mm256_mul_ps(x, x));
+	}
+	alignas(32) float peaks[8];
+	alignas(32) float sums[8];
+	_mm256_store_ps(peaks, m);
+	_mm256_store_ps(sums, s);
+	// The scalar tail is compiled without VEX, and isn't inlined, so the
+	// upper halves of the registers have to be cleared before calling it
+	// to avoid the SSE/AVX transition penalty.
+	_mm256_zeroupper();
+	for (uint32_t lane = 0, ch = 0; lane < 8; lane++, ch = ch + 1 == num_channels ? 0 : ch + 1) {
+		out[ch].peak = std::max(out[ch].peak, peaks[lane]);
+		out[ch].sum_of_squares += sums[lane];
+	}
+	scalar::measure(src, num_channels, i / num_channels, frame_count, out);
+}
+
+static BHAS_TARGET_AVX2
+auto interleave(const float* const* src, float* dst, uint32_t num_channels, size_t count) -> void {
+	if (num_channels != 2) {
+		scalar::interleave(src, dst, num_channels, 0, count);
+		return;
+	}
+	size_t i = 0;
+	for (; i + 8 <= count; i += 8) {
+		const auto l  = _mm256_loadu_ps(src[0] + i);
+		const auto r  = _mm256_loadu_ps(src[1] + i);
+		// Each of these holds frames 0-1 and 4-5, or 2-3 and 6-7
+		const auto lo = _mm256_unpacklo_ps(l, r);
+		const auto hi = _mm256_unpackhi_ps(l, r);
+		_mm256_storeu_ps(dst + i * 2,     _mm256_permute2f128_ps(lo, hi, 0x20));
+		_mm256_storeu_ps(dst + i * 2 + 8, _mm256_permute2f128_ps(lo, hi, 0x31));
+	}
+	scalar::interleave(src, dst, num_channels, i, count);
+}
+
+static BHAS_TARGET_AVX2
+auto deinterleave(const float* src, float* const* dst, uint32_t num_channels, size_t count) -> void {
+	if (num_channels != 2) {
+		scalar::deinterleave(src, dst, num_channels, 0, count);
+		return;
+	}
+	size_t i = 0;
+	for (; i + 8 <= count; i += 8) {
+		const auto a  = _mm256_loadu_ps(src + i * 2);
+		const auto b  = _mm256_loadu_ps(src + i * 2 + 8);
+		// Frames 0-1 and 4-5 in one, 2-3 and 6-7 in the other
+		const auto lo = _mm256_permute2f128_ps(a, b, 0x20);
+		const auto hi = _mm256_permute2f128_ps(a, b, 0x31);
+		_mm256_storeu_ps(dst[0] + i, _mm256_shuffle_ps(lo, hi, _MM_SHUFFLE(2, 0, 2, 0)));
+		_mm256_storeu_ps(dst[1] + i, _mm256_shuffle_ps(lo, hi, _MM_SHUFFLE(3, 1, 3, 1)));
+	}
+	scalar::deinterleave(src, dst, num_channels, i, count);
+}
+
+} // avx2
+#endif
+
+#if BHAS_CPU_DISPATCH
+// GCC 12's AVX-512 intrinsics warn about their own placeholder values.
+#if defined(__GNUC__) && !defined(__clang__)
+#	pragma GCC diagnostic push
+#	pragma GCC diagnostic ignored "-Wuninitialized"
+#	pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#endif
+namespace avx512 {
+
+static constexpr size_t ALIGNMENT = 64;
+
+// The lanes of a vector which hold the last count - i samples
+[[nodiscard]] static BHAS_TARGET_AVX512
+auto tail_mask(size_t i, size_t count) -> __mmask16 {
+	return static_cast<__mmask16>((1u << (count - i)) - 1);
+}
+
+static BHAS_TARGET_AVX512
+auto zero(float* dst, size_t count) -> void {
+	size_t i = get_head_count(dst, ALIGNMENT, count);
+	scalar::zero(dst, 0, i);
+	const auto z = _mm512_setzero_ps();
+	for (; i + 16 <= count; i += 16) {
+		_mm512_storeu_ps(dst + i, z);
+	}
+	_mm512_mask_storeu_ps(dst + i, tail_mask(i, count), z);
+}
+
+static BHAS_TARGET_AVX512
+auto copy(const float* src, float* dst, size_t count) -> void {
+	size_t i = get_head_count(dst, ALIGNMENT, count);
+	scalar::copy(src, dst, 0, i);
+	for (; i + 16 <= count; i += 16) {
+		_mm512_storeu_ps(dst + i, _mm512_loadu_ps(src + i));
+	}
+	const auto mask = tail_mask(i, count);
+	_mm512_mask_storeu_ps(dst + i, mask, _mm512_maskz_loadu_ps(mask, src + i));
+}
+
+static BHAS_TARGET_AVX512
+auto apply_gain(float* dst, size_t count, float gain) -> void {
+	size_t i = get_head_count(dst, ALIGNMENT, count);
+	scalar::apply_gain(dst, 0, i, gain);
+	const auto g = _mm512_set1_ps(gain);
+	for (; i + 16 <= count; i += 16) {
+		_mm512_storeu_ps(dst + i, _mm512_mul_ps(_mm512_loadu_ps(dst + i), g));
+	}
+	const auto mask = tail_mask(i, count);
+	_mm512_mask_storeu_ps(dst + i, mask, _mm512_mul_ps(_mm512_maskz_loadu_ps(mask, dst + i), g));
+}
+
+// Not fused either, for the same reason as avx2::mix().
+static BHAS_TARGET_AVX512
+auto mix(const float* src, float* dst, size_t count, float gain) -> void {
+	size_t i = get_head_count(dst, ALIGNMENT, count);
+	scalar::mix(src, dst, 0, i, gain);
+	const auto g = _mm512_set1_ps(gain);
+	for (; i + 16 <= count; i += 16) {
+		_mm512_storeu_ps(dst + i, _mm512_add_ps(_mm512_loadu_ps(dst + i), _mm512_mul_ps(_mm512_loadu_ps(src + i), g)));
+	}
+	const auto mask = tail_mask(i, count);
+	_mm512_mask_storeu_ps(dst + i, mask, _mm512_add_ps(_mm512_maskz_loadu_ps(mask, dst + i), _mm512_mul_ps(_mm512_maskz_loadu_ps(mask, src + i), g)));
+}
+
+// The lanes past the end are loaded as zero, which can't change the result.
+[[nodiscard]] static BHAS_TARGET_AVX512
+auto peak(const float* src, size_t count) -> float {
+	auto m = _mm512_setzero_ps();
+	size_t i = 0;
+	for (; i + 16 <= count; i += 16) {
+		m = _mm512_max_ps(m, _mm512_abs_ps(_mm512_loadu_ps(src + i)));
+	}
+	m = _mm512_max_ps(m, _mm512_abs_ps(_mm512_maskz_loadu_ps(tail_mask(i, count), src + i)));
+	return _mm512_reduce_max_ps(m);
+}
+
+static BHAS_TARGET_AVX512
+auto measure(const float* src, uint32_t num_channels, size_t frame_count, levels* out) -> void {
+	if (16 % num_channels != 0) {
+		scalar::measure(src, num_channels, 0, frame_count, out);
+		return;
+	}
+	const auto count = frame_count * num_channels;
+	auto m = _mm512_setzero_ps();
+	auto s = _mm512_setzero_ps();
+	size_t i = 0;
+	for (; i + 16 <= count; i += 16) {
+		const auto x = _mm512_loadu_ps(src + i);
+		m = _mm512_max_ps(m, _mm512_abs_ps(x));
+		s = _mm512_add_ps(s, _mm512_mul_ps(x, x));
+	}
+	// The masked lanes load zeros, which don't change either level, and
+	// the tail still starts on a frame boundary.
+	const auto x = _mm512_maskz_loadu_ps(tail_mask(i, count), src + i);
+	m = _mm512_max_ps(m, _mm512_abs_ps(x));
+	s = _mm512_add_ps(s, _mm512_mul_ps(x, x));
+	if (num_channels == 1) {
+		out[0].peak            = std::max(out[0].peak, _mm512_reduce_max_ps(m));
+		out[0].sum_of_squares += _mm512_reduce_add_ps(s);
+		return;
+	}
+	alignas(64) float peaks[16];
+	alignas(64) float sums[16];
+	_mm512_store_ps(peaks, m);
+	_mm512_store_ps(sums, s);
+	for (uint32_t lane = 0, ch = 0; lane < 16; lane++, ch = ch + 1 == num_channels ? 0 : ch + 1) {
+		out[ch].peak = std::max(out[ch].peak, peaks[lane]);
+		out[ch].sum_of_squares += sums[lane];
+	}
+}
+
+static BHAS_TARGET_AVX512
+auto interleave(const float* const* src, float* dst, uint32_t num_channels, size_t count) -> void {
+	if (num_channels != 2) {
+		scalar::interleave(src, dst, num_channels, 0, count);
+		return;
+	}
+	// Indices 16 and up come from the right channel
+	const auto lo_index = _mm512_setr_epi32(0, 16, 1, 17, 2, 18, 3, 19, 4, 20, 5, 21, 6, 22, 7, 23);
+	const auto hi_index = _mm512_setr_epi32(8, 24, 9, 25, 10, 26, 11, 27, 12, 28, 13, 29, 14, 30, 15, 31);
+	size_t i = 0;
+	for (; i + 16 <= count; i += 16) {
+		const auto l = _mm512_loadu_ps(src[0] + i);
+		const auto r = _mm512_loadu_ps(src[1] + i);
+		_mm512_storeu_ps(dst + i * 2,      _mm512_permutex2var_ps(l, lo_index, r));
+		_mm512_storeu_ps(dst + i * 2 + 16, _mm512_permutex2var_ps(l, hi_index, r));
+	}
+	scalar::interleave(src, dst, num_channels, i, count);
+}
+
+static BHAS_TARGET_AVX512
+auto deinterleave(const float* src, float* const* dst, uint32_t num_channels, size_t count) -> void {
+	if (num_channels != 2) {
+		scalar::deinterleave(src, dst, num_channels, 0, count);
+		return;
+	}
+	const auto l_index = _mm512_setr_epi32(0, 2, 4, 6, 8, 10, 12, 14, 16, 18, 20, 22, 24, 26, 28, 30);
+	const auto r_index = _mm512_setr_epi32(1, 3, 5, 7, 9, 11, 13, 15, 17, 19, 21, 23, 25, 27, 29, 31);
+	size_t i = 0;
+	for (; i + 16 <= count; i += 16) {
+		const auto a = _mm512_loadu_ps(src + i * 2);
+		const auto b = _mm512_loadu_ps(src + i * 2 + 16);
+		_mm512_storeu_ps(dst[0] + i, _mm512_permutex2var_ps(a, l_index, b));
+		_mm512_storeu_ps(dst[1] + i, _mm512_permutex2var_ps(a, r_index, b));
+	}
+	scalar::deinterleave(src, dst, num_channels, i, count);
+}
+
+} // avx512
+#if defined(__GNUC__) && !defined(__clang__)
+#	pragma GCC diagnostic pop
+#endif
+#endif
+
+struct Kernels {
+	auto (*zero)(float* dst, size_t count) -> void;
+	auto (*copy)(const float* src, float* dst, size_t count) -> void;
+	auto (*apply_gain)(float* dst, size_t count, float gain) -> void;
+	auto (*mix)(const float* src, float* dst, size_t count, float gain) -> void;
+	auto (*peak)(const float* src, size_t count) -> float;
+	auto (*measure)(const float* src, uint32_t num_channels, size_t frame_count, levels* out) -> void;
+	auto (*interleave)(const float* const* src, float* dst, uint32_t num_channels, size_t count) -> void;
+	auto (*deinterleave)(const float* src, float* const* dst, uint32_t num_channels, size_t count) -> void;
+};
+
+static constexpr Kernels SCALAR = {scalar::zero, scalar::copy, scalar::apply_gain, scalar::mix, scalar::peak, scalar::measure, scalar::interleave, scalar::deinterleave};
+#if BHAS_CPU_SSE2
+static constexpr Kernels SSE2   = {sse2::zero, sse2::copy, sse2::apply_gain, sse2::mix, sse2::peak, sse2::measure, sse2::interleave, sse2::deinterleave};
+#endif
+#if BHAS_CPU_DISPATCH
+static constexpr Kernels AVX2   = {avx2::zero, avx2::copy, avx2::apply_gain, avx2::mix, avx2::peak, avx2::measure, avx2::interleave, avx2::deinterleave};
+static constexpr Kernels AVX512 = {avx512::zero, avx512::copy, avx512::apply_gain, avx512::mix, avx512::peak, avx512::measure, avx512::interleave, avx512::deinterleave};
+#endif
+
+[[nodiscard]] static
+auto get_kernels() -> const Kernels& {
+	switch (cpu::get_active()) {
+#	if BHAS_CPU_DISPATCH
+		case bhas::instruction_set::avx512: return AVX512;
+		case bhas::instruction_set::avx2:   return AVX2;
+#	endif
+#	if BHAS_CPU_SSE2
+		case bhas::instruction_set::sse2:   return SSE2;
+#	endif
+		default:                            return SCALAR;
+	}
+}
+
+auto zero(float* dst, size_t count) -> void {
+	get_kernels().zero(dst, count);
+}
+
+auto copy(const float* src, float* dst, size_t count) -> void {
+	get_kernels().copy(src, dst, count);
+}
+
+auto apply_gain(float* dst, size_t count, float gain) -> void {
+	get_kernels().apply_gain(dst, count, gain);
+}
+
+auto mix(const float* src, float* dst, size_t count, float gain) -> void {
+	get_kernels().mix(src, dst, count, gain);
+}
+
+auto peak(const float* src, size_t count) -> float {
+	return get_kernels().peak(src, count);
+}
+
+auto measure(const float* src, size_t count) -> levels {
+	levels result;
+	get_kernels().measure(src, 1, count, &result);
+	return result;
+}
+
+auto measure(const float* src, bhas::channel_count num_channels, bhas::frame_count frame_count, levels* out) -> void {
+	std::fill_n(out, num_channels.value, levels{});
+	if (num_channels.value == 0) {
+		return;
+	}
+	get_kernels().measure(src, num_channels.value, frame_count.value, out);
+}
+
+auto interleave(bhas::input_buffer src, float* dst, bhas::channel_count num_channels, bhas::frame_count frame_count) -> void {
+	get_kernels().interleave(src.buffer, dst, num_channels.value, frame_count.value);
+}
+
+auto deinterleave(const float* src, bhas::output_buffer dst, bhas::channel_count num_channels, bhas::frame_count frame_count) -> void {
+	get_kernels().deinterleave(src, dst.buffer, num_channels.value, frame_count.value);
+}
+
+} // buffer
+} // bhas
@@ -0,0 +1,567 @@
+#include "bhas_convert.h"
+#include "bhas_cpu.h"
+#include <bit>
+#include <cmath>
+#include <cstring>
+
+#if BHAS_CPU_SSE2
+#	include <emmintrin.h>
+#endif
+
+#if BHAS_CPU_DISPATCH
+#	include <immintrin.h>
+#endif
+
+namespace bhas {
+namespace convert {
+
+static constexpr auto INT16_SCALE     = 32767.0f;
+static constexpr auto INT16_LO        = -32768.0f;
+static constexpr auto INT16_HI        = 32767.0f;
+static constexpr auto INT16_INV_SCALE = 1.0f / 32768.0f;
+static constexpr auto INT24_SCALE     = 8388607.0f;
+static constexpr auto INT24_LO        = -8388608.0f;
+static constexpr auto INT24_HI        = 8388607.0f;
+static constexpr auto INT24_INV_SCALE = 1.0f / 8388608.0f;
+static constexpr auto INT32_SCALE     = 2147483647.0f;
+static constexpr auto INT32_LO        = -2147483648.0f;
+// The largest float below 2^31, because 2^31 itself doesn't fit
+static constexpr auto INT32_HI        = 2147483520.0f;
+static constexpr auto INT32_INV_SCALE = 1.0f / 2147483648.0f;
+static constexpr auto DITHER_SCALE    = 1.0f / 65536.0f;
+
+namespace scalar {
+
+[[nodiscard]] static
+auto next_random(uint32_t* x) -> uint32_t {
+	*x ^= *x << 13;
+	*x ^= *x >> 17;
+	*x ^= *x << 5;
+	return *x;
+}
+
+// Difference of two 16-bit uniform values, i.e. triangular in (-1, 1) LSB
+[[nodiscard]] static
+auto tpdf(uint32_t r) -> float {
+	return static_cast<float>(r & 0xFFFF) * DITHER_SCALE - static_cast<float>(r >> 16) * DITHER_SCALE;
+}
+
+// Same semantics as _mm_max_ps/_mm_min_ps, including for NaN, so that
+// the scalar and vectorised kernels agree exactly.
+[[nodiscard]] static
+auto clamp(float x, float lo, float hi) -> float {
+	x = x > lo ? x : lo;
+	return x < hi ? x : hi;
+}
+
+[[nodiscard]] static
+auto round_to_int(float x) -> int32_t {
+	return static_cast<int32_t>(std::nearbyint(x));
+}
+
+[[nodiscard]] static
+auto read_int24(const uint8_t* src) -> int32_t {
+	if constexpr (std::endian::native == std::endian::little) {
+		return static_cast<int32_t>((uint32_t(src[0]) << 8) | (uint32_t(src[1]) << 16) | (uint32_t(src[2]) << 24)) >> 8;
+	}
+	else {
+		return static_cast<int32_t>((uint32_t(src[2]) << 8) | (uint32_t(src[1]) << 16) | (uint32_t(src[0]) << 24)) >> 8;
+	}
+}
+
+static
+auto write_int24(int32_t value, uint8_t* dst) -> void {
+	const auto v = static_cast<uint32_t>(value);
+	if constexpr (std::endian::native == std::endian::little) {
+		dst[0] = uint8_t(v);
+		dst[1] = uint8_t(v >> 8);
+		dst[2] = uint8_t(v >> 16);
+	}
+	else {
+		dst[0] = uint8_t(v >> 16);
+		dst[1] = uint8_t(v >> 8);
+		dst[2] = uint8_t(v);
+	}
+}
+
+// Converts samples [begin, end) and advances the dither generator by
+// whole groups of DITHER_LANES, so it can also be used for the tail
+// left over by the vectorised kernels.
+template <typename WriteFn> static
+auto quantize(const float* src, size_t begin, size_t end, float scale, float lo, float hi, dither_state* dither, WriteFn&& write) -> void {
+	for (auto i = begin; i < end; i += DITHER_LANES) {
+		float noise[DITHER_LANES] = {};
+		if (dither) {
+			for (size_t lane = 0; lane < DITHER_LANES; lane++) {
+				noise[lane] = tpdf(next_random(&dither->lanes[lane]));
+			}
+		}
+		for (size_t lane = 0; lane < DITHER_LANES && i + lane < end; lane++) {
+			auto y = src[i + lane] * scale;
+			if (dither) {
+				y = y + noise[lane];
+			}
+			write(i + lane, round_to_int(clamp(y, lo, hi)));
+		}
+	}
+}
+
+static
+auto int16_to_float(const int16_t* src, float* dst, size_t begin, size_t end) -> void {
+	for (auto i = begin; i < end; i++) {
+		dst[i] = static_cast<float>(src[i]) * INT16_INV_SCALE;
+	}
+}
+
+static
+auto int24_to_float(const uint8_t* src, float* dst, size_t begin, size_t end) -> void {
+	for (auto i = begin; i < end; i++) {
+		dst[i] = static_cast<float>(read_int24(src + i * 3)) * INT24_INV_SCALE;
+	}
+}
+
+static
+auto int32_to_float(const int32_t* src, float* dst, size_t begin, size_t end) -> void {
+	for (auto i = begin; i < end; i++) {
+		dst[i] = static_cast<float>(src[i]) * INT32_INV_SCALE;
+	}
+}
+
+static
+auto float_to_int16(const float* src, int16_t* dst, size_t begin, size_t end, dither_state* dither) -> void {
+	quantize(src, begin, end, INT16_SCALE, INT16_LO, INT16_HI, dither, [dst](size_t i, int32_t v) { dst[i] = static_cast<int16_t>(v); });
+}
+
+static
+auto float_to_int24(const float* src, uint8_t* dst, size_t begin, size_t end, dither_state* dither) -> void {
+	quantize(src, begin, end, INT24_SCALE, INT24_LO, INT24_HI, dither, [dst](size_t i, int32_t v) { write_int24(v, dst + i * 3); });
+}
+
+static
+auto float_to_int32(const float* src, int32_t* dst, size_t begin, size_t end) -> void {
+	quantize(src, begin, end, INT32_SCALE, INT32_LO, INT32_HI, nullptr, [dst](size_t i, int32_t v) { dst[i] = v; });
+}
+
+static auto int16_to_float(const int16_t* src, float* dst, size_t count) -> void { int16_to_float(src, dst, 0, count); }
+static auto int24_to_float(const uint8_t* src, float* dst, size_t count) -> void { int24_to_float(src, dst, 0, count); }
+static auto int32_to_float(const int32_t* src, float* dst, size_t count) -> void { int32_to_float(src, dst, 0, count); }
+static auto float_to_int16(const float* src, int16_t* dst, size_t count, dither_state* dither) -> void { float_to_int16(src, dst, 0, count, dither); }
+static auto float_to_int24(const float* src, uint8_t* dst, size_t count, dither_state* dither) -> void { float_to_int24(src, dst, 0, count, dither); }
+static auto float_to_int32(const float* src, int32_t* dst, size_t count) -> void { float_to_int32(src, dst, 0, count); }
+
+} // scalar
+
+#if BHAS_CPU_SSE2
+namespace sse2 {
+
+struct dither_regs {
+	__m128i lo;
+	__m128i hi;
+};
+
+[[nodiscard]] static
+auto next_random(__m128i* x) -> __m128i {
+	*x = _mm_xor_si128(*x, _mm_slli_epi32(*x, 13));
+	*x = _mm_xor_si128(*x, _mm_srli_epi32(*x, 17));
+	*x = _mm_xor_si128(*x, _mm_slli_epi32(*x, 5));
+	return *x;
+}
+
+[[nodiscard]] static
+auto tpdf(__m128i r) -> __m128 {
+	const auto scale = _mm_set1_ps(DITHER_SCALE);
+	const auto a     = _mm_mul_ps(_mm_cvtepi32_ps(_mm_and_si128(r, _mm_set1_epi32(0xFFFF))), scale);
+	const auto b     = _mm_mul_ps(_mm_cvtepi32_ps(_mm_srli_epi32(r, 16)), scale);
+	return _mm_sub_ps(a, b);
+}
+
+[[nodiscard]] static
+auto quantize(__m128 x, __m128 scale, __m128 lo, __m128 hi, __m128i* dither) -> __m128i {
+	auto y = _mm_mul_ps(x, scale);
+	if (dither) {
+		y = _mm_add_ps(y, tpdf(next_random(dither)));
+	}
+	return _mm_cvtps_epi32(_mm_min_ps(_mm_max_ps(y, lo), hi));
+}
+
+static
+auto int16_to_float(const int16_t* src, float* dst, size_t count) -> void {
+	const auto scale = _mm_set1_ps(INT16_INV_SCALE);
+	size_t i = 0;
+	for (; i + 8 <= count; i += 8) {
+		const auto v    = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+		// Sign extend by unpacking into the high half and shifting back down
+		const auto v_lo = _mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16);
+		const auto v_hi = _mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16);
+		_mm_storeu_ps(dst + i,     _mm_mul_ps(_mm_cvtepi32_ps(v_lo), scale));
+		_mm_storeu_ps(dst + i + 4, _mm_mul_ps(_mm_cvtepi32_ps(v_hi), scale));
+	}
+	scalar::int16_to_float(src, dst, i, count);
+}
+
+// SSE2 has no byte shuffle so packed 24-bit samples are left to the
+// scalar kernel.
+static
+auto int24_to_float(const uint8_t* src, float* dst, size_t count) -> void {
+	scalar::int24_to_float(src, dst, count);
+}
+
+static
+auto int32_to_float(const int32_t* src, float* dst, size_t count) -> void {
+	const auto scale = _mm_set1_ps(INT32_INV_SCALE);
+	size_t i = 0;
+	for (; i + 4 <= count; i += 4) {
+		const auto v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+		_mm_storeu_ps(dst + i, _mm_mul_ps(_mm_cvtepi32_ps(v), scale));
+	}
+	scalar::int32_to_float(src, dst, i, count);
+}
+
+static
+auto float_to_int16(const float* src, int16_t* dst, size_t count, dither_state* dither) -> void {
+	const auto scale = _mm_set1_ps(INT16_SCALE);
+	const auto lo    = _mm_set1_ps(INT16_LO);
+	const auto hi    = _mm_set1_ps(INT16_HI);
+	dither_regs regs = {_mm_setzero_si128(), _mm_setzero_si128()};
+	if (dither) {
+		regs.lo = _mm_load_si128(reinterpret_cast<const __m128i*>(dither->lanes));
+		regs.hi = _mm_load_si128(reinterpret_cast<const __m128i*>(dither->lanes + 4));
+	}
+	size_t i = 0;
+	for (; i + 8 <= count; i += 8) {
+		const auto a = quantize(_mm_loadu_ps(src + i),     scale, lo, hi, dither ? &regs.lo : nullptr);
+		const auto b = quantize(_mm_loadu_ps(src + i + 4), scale, lo, hi, dither ? &regs.hi : nullptr);
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), _mm_packs_epi32(a, b));
+	}
+	if (dither) {
+		_mm_store_si128(reinterpret_cast<__m128i*>(dither->lanes), regs.lo);
+		_mm_store_si128(reinterpret_cast<__m128i*>(dither->lanes + 4), regs.hi);
+	}
+	scalar::float_to_int16(src, dst, i, count, dither);
+}
+
+static
+auto float_to_int24(const float* src, uint8_t* dst, size_t count, dither_state* dither) -> void {
+	const auto scale = _mm_set1_ps(INT24_SCALE);
+	const auto lo    = _mm_set1_ps(INT24_LO);
+	const auto hi    = _mm_set1_ps(INT24_HI);
+	dither_regs regs = {_mm_setzero_si128(), _mm_setzero_si128()};
+	if (dither) {
+		regs.lo = _mm_load_si128(reinterpret_cast<const __m128i*>(dither->lanes));
+		regs.hi = _mm_load_si128(reinterpret_cast<const __m128i*>(dither->lanes + 4));
+	}
+	size_t i = 0;
+	for (; i + 8 <= count; i += 8) {
+		alignas(16) int32_t values[8];
+		_mm_store_si128(reinterpret_cast<__m128i*>(values),     quantize(_mm_loadu_ps(src + i),     scale, lo, hi, dither ? &regs.lo : nullptr));
+		_mm_store_si128(reinterpret_cast<__m128i*>(values + 4), quantize(_mm_loadu_ps(src + i + 4), scale, lo, hi, dither ? &regs.hi : nullptr));
+		for (size_t j = 0; j < 8; j++) {
+			scalar::write_int24(values[j], dst + (i + j) * 3);
+		}
+	}
+	if (dither) {
+		_mm_store_si128(reinterpret_cast<__m128i*>(dither->lanes), regs.lo);
+		_mm_store_si128(reinterpret_cast<__m128i*>(dither->lanes + 4), regs.hi);
+	}
+	scalar::float_to_int24(src, dst, i, count, dither);
+}
+
+static
+auto float_to_int32(const float* src, int32_t* dst, size_t count) -> void {
+	const auto scale = _mm_set1_ps(INT32_SCALE);
+	const auto lo    = _mm_set1_ps(INT32_LO);
+	const auto hi    = _mm_set1_ps(INT32_HI);
+	size_t i = 0;
+	for (; i + 4 <= count; i += 4) {
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), quantize(_mm_loadu_ps(src + i), scale, lo, hi, nullptr));
+	}
+	scalar::float_to_int32(src, dst, i, count);
+}
+
+} // sse2
+#endif
+
+#if BHAS_CPU_DISPATCH
+namespace avx2 {
+
+// Moves four packed 24-bit samples into the top three bytes of each
+// 32-bit lane, ready for an arithmetic shift right.
+static const auto INT24_UNPACK = _mm_setr_epi8(-1, 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11);
+// The opposite, packing the low three bytes of each lane into 12 bytes.
+static const auto INT24_PACK   = _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+
+[[nodiscard]] static BHAS_TARGET_AVX2
+auto next_random(__m256i* x) -> __m256i {
+	*x = _mm256_xor_si256(*x, _mm256_slli_epi32(*x, 13));
+	*x = _mm256_xor_si256(*x, _mm256_srli_epi32(*x, 17));
+	*x = _mm256_xor_si256(*x, _mm256_slli_epi32(*x, 5));
+	return *x;
+}
+
+[[nodiscard]] static BHAS_TARGET_AVX2
+auto tpdf(__m256i r) -> __m256 {
+	const auto scale = _mm256_set1_ps(DITHER_SCALE);
+	const auto a     = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_and_si256(r, _mm256_set1_epi32(0xFFFF))), scale);
+	const auto b     = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_srli_epi32(r, 16)), scale);
+	return _mm256_sub_ps(a, b);
+}
+
+[[nodiscard]] static BHAS_TARGET_AVX2
+auto quantize(__m256 x, __m256 scale, __m256 lo, __m256 hi, __m256i* dither) -> __m256i {
+	auto y = _mm256_mul_ps(x, scale);
+	if (dither) {
+		y = _mm256_add_ps(y, tpdf(next_random(dither)));
+	}
+	return _mm256_cvtps_epi32(_mm256_min_ps(_mm256_max_ps(y, lo), hi));
+}
+
+static BHAS_TARGET_AVX2
+auto int16_to_float(const int16_t* src, float* dst, size_t count) -> void {
+	const auto scale = _mm256_set1_ps(INT16_INV_SCALE);
+	size_t i = 0;
+	for (; i + 8 <= count; i += 8) {
+		const auto v = _mm256_cvtepi16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i)));
+		_mm256_storeu_ps(dst + i, _mm256_mul_ps(_mm256_cvtepi32_ps(v), scale));
+	}
+	scalar::int16_to_float(src, dst, i, count);
+}
+
+static BHAS_TARGET_AVX2
+auto int24_to_float(const uint8_t* src, float* dst, size_t count) -> void {
+	const auto scale = _mm256_set1_ps(INT24_INV_SCALE);
+	size_t i = 0;
+	// Each 16-byte load only uses 12 bytes, so stop early enough that
+	// the last load doesn't read past the end of the buffer.
+	for (; i + 10 <= count; i += 8) {
+		const auto a = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i * 3)), INT24_UNPACK);
+		const auto b = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i * 3 + 12)), INT24_UNPACK);
+		const auto v = _mm256_srai_epi32(_mm256_inserti128_si256(_mm256_castsi128_si256(a), b, 1), 8);
+		_mm256_storeu_ps(dst + i, _mm256_mul_ps(_mm256_cvtepi32_ps(v), scale));
+	}
+	scalar::int24_to_float(src, dst, i, count);
+}
+
+static BHAS_TARGET_AVX2
+auto int32_to_float(const int32_t* src, float* dst, size_t count) -> void {
+	const auto scale = _mm256_set1_ps(INT32_INV_SCALE);
+	size_t i = 0;
+	for (; i + 8 <= count; i += 8) {
+		const auto v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i));
+		_mm256_storeu_ps(dst + i, _mm256_mul_ps(_mm256_cvtepi32_ps(v), scale));
+	}
+	scalar::int32_to_float(src, dst, i, count);
+}
+
+static BHAS_TARGET_AVX2
+auto float_to_int16(const float* src, int16_t* dst, size_t count, dither_state* dither) -> void {
+	const auto scale = _mm256_set1_ps(INT16_SCALE);
+	const auto lo    = _mm256_set1_ps(INT16_LO);
+	const auto hi    = _mm256_set1_ps(INT16_HI);
+	auto regs = _mm256_setzero_si256();
+	if (dither) {
+		regs = _mm256_load_si256(reinterpret_cast<const __m256i*>(dither->lanes));
+	}
+	size_t i = 0;
+	for (; i + 8 <= count; i += 8) {
+		const auto v = quantize(_mm256_loadu_ps(src + i), scale, lo, hi, dither ? &regs : nullptr);
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), _mm_packs_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1)));
+	}
+	if (dither) {
+		_mm256_store_si256(reinterpret_cast<__m256i*>(dither->lanes), regs);
+	}
+	scalar::float_to_int16(src, dst, i, count, dither);
+}
+
+static BHAS_TARGET_AVX2
+auto float_to_int24(const float* src, uint8_t* dst, size_t count, dither_state* dither) -> void {
+	const auto scale = _mm256_set1_ps(INT24_SCALE);
+	const auto lo    = _mm256_set1_ps(INT24_LO);
+	const auto hi    = _mm256_set1_ps(INT24_HI);
+	auto regs = _mm256_setzero_si256();
+	if (dither) {
+		regs = _mm256_load_si256(reinterpret_cast<const __m256i*>(dither->lanes));
+	}
+	size_t i = 0;
+	// Each 16-byte store only has 12 useful bytes. The other four are
+	// overwritten by the next store, so stop early enough that the last
+	// store doesn't write past the end of the buffer.
+	for (; i + 10 <= count; i += 8) {
+		const auto v = quantize(_mm256_loadu_ps(src + i), scale, lo, hi, dither ? &regs : nullptr);
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i * 3),      _mm_shuffle_epi8(_mm256_castsi256_si128(v), INT24_PACK));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i * 3 + 12), _mm_shuffle_epi8(_mm256_extracti128_si256(v, 1), INT24_PACK));
+	}
+	if (dither) {
+		_mm256_store_si256(reinterpret_cast<__m256i*>(dither->lanes), regs);
+	}
+	scalar::float_to_int24(src, dst, i, count, dither);
+}
+
+static BHAS_TARGET_AVX2
+auto float_to_int32(const float* src, int32_t* dst, size_t count) -> void {
+	const auto scale = _mm256_set1_ps(INT32_SCALE);
+	const auto lo    = _mm256_set1_ps(INT32_LO);
+	const auto hi    = _mm256_set1_ps(INT32_HI);
+	size_t i = 0;
+	for (; i + 8 <= count; i += 8) {
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), quantize(_mm256_loadu_ps(src + i), scale, lo, hi, nullptr));
+	}
+	scalar::float_to_int32(src, dst, i, count);
+}
+
+} // avx2
+#endif
+
+#if BHAS_CPU_DISPATCH
+// See the AVX-512 kernels in bhas_buffer.cpp
+#if defined(__GNUC__) && !defined(__clang__)
+#	pragma GCC diagnostic push
+#	pragma GCC diagnostic ignored "-Wuninitialized"
+#	pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#endif
+// Dither and packed 24-bit samples are left to the AVX2 kernels, because
+// the dither generator only has eight lanes.
+namespace avx512 {
+
+[[nodiscard]] static BHAS_TARGET_AVX512
+auto quantize(__m512 x, __m512 scale, __m512 lo, __m512 hi) -> __m512i {
+	return _mm512_cvtps_epi32(_mm512_min_ps(_mm512_max_ps(_mm512_mul_ps(x, scale), lo), hi));
+}
+
+static BHAS_TARGET_AVX512
+auto int16_to_float(const int16_t* src, float* dst, size_t count) -> void {
+	const auto scale = _mm512_set1_ps(INT16_INV_SCALE);
+	size_t i = 0;
+	for (; i + 16 <= count; i += 16) {
+		const auto v = _mm512_cvtepi16_epi32(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i)));
+		_mm512_storeu_ps(dst + i, _mm512_mul_ps(_mm512_cvtepi32_ps(v), scale));
+	}
+	scalar::int16_to_float(src, dst, i, count);
+}
+
+static BHAS_TARGET_AVX512
+auto int24_to_float(const uint8_t* src, float* dst, size_t count) -> void {
+	avx2::int24_to_float(src, dst, count);
+}
+
+static BHAS_TARGET_AVX512
+auto int32_to_float(const int32_t* src, float* dst, size_t count) -> void {
+	const auto scale = _mm512_set1_ps(INT32_INV_SCALE);
+	size_t i = 0;
+	for (; i + 16 <= count; i += 16) {
+		const auto v = _mm512_loadu_si512(src + i);
+		_mm512_storeu_ps(dst + i, _mm512_mul_ps(_mm512_cvtepi32_ps(v), scale));
+	}
+	scalar::int32_to_float(src, dst, i, count);
+}
+
+static BHAS_TARGET_AVX512
+auto float_to_int16(const float* src, int16_t* dst, size_t count, dither_state* dither) -> void {
+	if (dither) {
+		avx2::float_to_int16(src, dst, count, dither);
+		return;
+	}
+	const auto scale = _mm512_set1_ps(INT16_SCALE);
+	const auto lo    = _mm512_set1_ps(INT16_LO);
+	const auto hi    = _mm512_set1_ps(INT16_HI);
+	size_t i = 0;
+	for (; i + 16 <= count; i += 16) {
+		// Already clamped, so the saturation never kicks in
+		const auto v = quantize(_mm512_loadu_ps(src + i), scale, lo, hi);
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), _mm512_cvtsepi32_epi16(v));
+	}
+	scalar::float_to_int16(src, dst, i, count, nullptr);
+}
+
+static BHAS_TARGET_AVX512
+auto float_to_int24(const float* src, uint8_t* dst, size_t count, dither_state* dither) -> void {
+	avx2::float_to_int24(src, dst, count, dither);
+}
+
+static BHAS_TARGET_AVX512
+auto float_to_int32(const float* src, int32_t* dst, size_t count) -> void {
+	const auto scale = _mm512_set1_ps(INT32_SCALE);
+	const auto lo    = _mm512_set1_ps(INT32_LO);
+	const auto hi    = _mm512_set1_ps(INT32_HI);
+	size_t i = 0;
+	for (; i + 16 <= count; i += 16) {
+		_mm512_storeu_si512(dst + i, quantize(_mm512_loadu_ps(src + i), scale, lo, hi));
+	}
+	scalar::float_to_int32(src, dst, i, count);
+}
+
+} // avx512
+#if defined(__GNUC__) && !defined(__clang__)
+#	pragma GCC diagnostic pop
+#endif
+#endif
+
+struct Kernels {
+	auto (*int16_to_float)(const int16_t* src, float* dst, size_t count) -> void;
+	auto (*int24_to_float)(const uint8_t* src, float* dst, size_t count) -> void;
+	auto (*int32_to_float)(const int32_t* src, float* dst, size_t count) -> void;
+	auto (*float_to_int16)(const float* src, int16_t* dst, size_t count, dither_state* dither) -> void;
+	auto (*float_to_int24)(const float* src, uint8_t* dst, size_t count, dither_state* dither) -> void;
+	auto (*float_to_int32)(const float* src, int32_t* dst, size_t count) -> void;
+};
+
+static constexpr Kernels SCALAR = {scalar::int16_to_float, scalar::int24_to_float, scalar::int32_to_float, scalar::float_to_int16, scalar::float_to_int24, scalar::float_to_int32};
+#if BHAS_CPU_SSE2
+static constexpr Kernels SSE2   = {sse2::int16_to_float, sse2::int24_to_float, sse2::int32_to_float, sse2::float_to_int16, sse2::float_to_int24, sse2::float_to_int32};
+#endif
+#if BHAS_CPU_DISPATCH
+static constexpr Kernels AVX2   = {avx2::int16_to_float, avx2::int24_to_float, avx2::int32_to_float, avx2::float_to_int16, avx2::float_to_int24, avx2::float_to_int32};
+static constexpr Kernels AVX512 = {avx512::int16_to_float, avx512::int24_to_float, avx512::int32_to_float, avx512::float_to_int16, avx512::float_to_int24, avx512::float_to_int32};
+#endif
+
+[[nodiscard]] static
+auto get_kernels() -> const Kernels& {
+	switch (cpu::get_active()) {
+#	if BHAS_CPU_DISPATCH
+		case bhas::instruction_set::avx512: return AVX512;
+		case bhas::instruction_set::avx2:   return AVX2;
+#	endif
+#	if BHAS_CPU_SSE2
+		case bhas::instruction_set::sse2:   return SSE2;
+#	endif
+		default:                            return SCALAR;
+	}
+}
+
+auto get_bytes_per_sample(bhas::sample_format format) -> size_t {
+	switch (format) {
+		case bhas::sample_format::int16: return 2;
+		case bhas::sample_format::int24: return 3;
+		case bhas::sample_format::int32: return 4;
+		default:                         return 4;
+	}
+}
+
+auto make_dither_state(uint32_t seed) -> dither_state {
+	dither_state state;
+	for (size_t lane = 0; lane < DITHER_LANES; lane++) {
+		// xorshift32 must never be seeded with zero
+		state.lanes[lane] = (seed + static_cast<uint32_t>(lane) * 0x9E3779B9u) | 1u;
+	}
+	return state;
+}
+
+auto to_float(bhas::sample_format format, const void* src, float* dst, size_t count) -> void {
+	switch (format) {
+		case bhas::sample_format::float32: std::memcpy(dst, src, count * sizeof(float)); return;
+		case bhas::sample_format::int16:   get_kernels().int16_to_float(static_cast<const int16_t*>(src), dst, count); return;
+		case bhas::sample_format::int24:   get_kernels().int24_to_float(static_cast<const uint8_t*>(src), dst, count); return;
+		case bhas::sample_format::int32:   get_kernels().int32_to_float(static_cast<const int32_t*>(src), dst, count); return;
+	}
+}
+
+auto from_float(bhas::sample_format format, const float* src, void* dst, size_t count, dither_state* dither) -> void {
+	switch (format) {
+		case bhas::sample_format::float32: std::memcpy(dst, src, count * sizeof(float)); return;
+		case bhas::sample_format::int16:   get_kernels().float_to_int16(src, static_cast<int16_t*>(dst), count, dither); return;
+		case bhas::sample_format::int24:   get_kernels().float_to_int24(src, static_cast<uint8_t*>(dst), count, dither); return;
+		case bhas::sample_format::int32:   get_kernels().float_to_int32(src, static_cast<int32_t*>(dst), count); return;
+	}
+}
+
+} // convert
+} // bhas
@@ -0,0 +1,32 @@
+#pragma once
+
+#include "bhas.h"
+#include <cstddef>
+#include <cstdint>
+
+// Sample format conversion kernels.
+// Integer device formats are converted to and from float by the engine
+// rather than by PortAudio so that the work can be vectorised.
+namespace bhas {
+namespace convert {
+
+static constexpr size_t DITHER_LANES = 8;
+
+// TPDF dither generator state. Each lane is an independent xorshift32
+// generator and samples are assigned to lanes in groups of eight, so the
+// scalar and vectorised kernels produce exactly the same noise.
+struct dither_state {
+	alignas(32) uint32_t lanes[DITHER_LANES];
+};
+
+[[nodiscard]] auto get_bytes_per_sample(bhas::sample_format format) -> size_t;
+[[nodiscard]] auto make_dither_state(uint32_t seed) -> dither_state;
+
+// Convert one channel of non-interleaved samples.
+// If dither is null then no dither is applied. Dither is never applied
+// to float32 or int32 output.
+auto to_float(bhas::sample_format format, const void* src, float* dst, size_t count) -> void;
+auto from_float(bhas::sample_format format, const float* src, void* dst, size_t count, dither_state* dither) -> void;
+
+} // convert
+} // bhas
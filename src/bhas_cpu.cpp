@@ -0,0 +1,91 @@
+#include "bhas_cpu.h"
+#if BHAS_CPU_DISPATCH && defined(_MSC_VER) && !defined(__clang__)
+#include <immintrin.h>
+#include <intrin.h>
+#endif
+
+namespace bhas {
+namespace cpu {
+
+struct Model {
+	std::optional<bhas::instruction_set> forced;
+};
+
+static Model model;
+
+#if BHAS_CPU_DISPATCH && defined(_MSC_VER) && !defined(__clang__)
+// The AVX registers are only usable if the OS saves them on a context
+// switch, which XGETBV tells us.
+[[nodiscard]] static
+auto detect() -> bhas::instruction_set {
+	int regs[4];
+	__cpuid(regs, 1);
+	const auto osxsave = (regs[2] & (1 << 27)) != 0;
+	if (!osxsave) {
+		return bhas::instruction_set::sse2;
+	}
+	const auto xcr0 = _xgetbv(0);
+	__cpuidex(regs, 7, 0);
+	const auto avx2     = (regs[1] & (1 << 5)) != 0 && (xcr0 & 0x06) == 0x06;
+	const auto avx512f  = (regs[1] & (1 << 16)) != 0;
+	const auto avx512bw = (regs[1] & (1 << 30)) != 0;
+	if (avx2 && avx512f && avx512bw && (xcr0 & 0xE6) == 0xE6) {
+		return bhas::instruction_set::avx512;
+	}
+	if (avx2) {
+		return bhas::instruction_set::avx2;
+	}
+	return bhas::instruction_set::sse2;
+}
+#elif BHAS_CPU_DISPATCH
+// These check that the OS has enabled the AVX registers too.
+[[nodiscard]] static
+auto detect() -> bhas::instruction_set {
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw")) {
+		return bhas::instruction_set::avx512;
+	}
+	if (__builtin_cpu_supports("avx2")) {
+		return bhas::instruction_set::avx2;
+	}
+	return bhas::instruction_set::sse2;
+}
+#else
+[[nodiscard]] static
+auto detect() -> bhas::instruction_set {
+	return BASELINE;
+}
+#endif
+
+auto get_supported() -> bhas::instruction_set {
+	static const auto supported = detect();
+	return supported;
+}
+
+auto get_name(bhas::instruction_set isa) -> const char* {
+	switch (isa) {
+		case bhas::instruction_set::scalar: return "scalar";
+		case bhas::instruction_set::sse2:   return "SSE2";
+		case bhas::instruction_set::avx2:   return "AVX2";
+		case bhas::instruction_set::avx512: return "AVX-512";
+	}
+	return "unknown";
+}
+
+auto select() -> bhas::instruction_set {
+	const auto isa = model.forced.value_or(get_supported());
+	active.store(isa, std::memory_order_relaxed);
+	return isa;
+}
+
+auto force(std::optional<bhas::instruction_set> isa) -> bool {
+	if (isa && *isa > get_supported()) {
+		return false;
+	}
+	model.forced = isa;
+	select();
+	return true;
+}
+
+} // cpu
+} // bhas
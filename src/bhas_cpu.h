@@ -0,0 +1,75 @@
+#pragma once
+
+#include "bhas.h"
+#include <atomic>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#	define BHAS_CPU_SSE2 1
+#endif
+
+// Kernels for anything beyond the baseline instruction set are compiled
+// per function with a target attribute, and only called if the CPU
+// supports them. MSVC doesn't need the attribute to use the intrinsics.
+#if BHAS_CPU_SSE2 && (defined(__GNUC__) || defined(__clang__))
+#	define BHAS_CPU_DISPATCH 1
+#	define BHAS_TARGET_AVX2   __attribute__((target("avx2")))
+#	define BHAS_TARGET_AVX512 __attribute__((target("avx2,avx512f,avx512bw")))
+#elif BHAS_CPU_SSE2 && defined(_MSC_VER)
+#	define BHAS_CPU_DISPATCH 1
+#	define BHAS_TARGET_AVX2
+#	define BHAS_TARGET_AVX512
+#endif
+
+// For a loop shared by the kernels of every instruction set. It has to be
+// inlined into each kernel so that it's compiled for that kernel's target,
+// and so that the target-specific functions it calls can be inlined too.
+#if defined(__GNUC__) || defined(__clang__)
+#	define BHAS_INLINE_KERNEL __attribute__((always_inline)) inline
+#elif defined(_MSC_VER)
+#	define BHAS_INLINE_KERNEL __forceinline
+#else
+#	define BHAS_INLINE_KERNEL inline
+#endif
+
+// Which kernels the engine's hot loops (format conversion and the
+// bhas_buffer.h kernels) use. The best instruction set the CPU supports
+// is picked when the library is loaded, and again at init() in case one
+// has been forced.
+namespace bhas {
+namespace cpu {
+
+// What the compiler was told it can assume
+#if defined(__AVX512F__) && defined(__AVX512BW__)
+static constexpr auto BASELINE = bhas::instruction_set::avx512;
+#elif defined(__AVX2__)
+static constexpr auto BASELINE = bhas::instruction_set::avx2;
+#elif BHAS_CPU_SSE2
+static constexpr auto BASELINE = bhas::instruction_set::sse2;
+#else
+static constexpr auto BASELINE = bhas::instruction_set::scalar;
+#endif
+
+[[nodiscard]] auto get_supported() -> bhas::instruction_set;
+
+// Read by every kernel call, possibly in the audio thread. Only written
+// from the main thread while no stream is running. This starts off at
+// the best supported instruction set so that the bhas_buffer.h kernels
+// are fast even if init() is never called.
+inline std::atomic<bhas::instruction_set> active = get_supported();
+
+[[nodiscard]] auto get_name(bhas::instruction_set isa) -> const char*;
+
+[[nodiscard]] inline
+auto get_active() -> bhas::instruction_set {
+	return active.load(std::memory_order_relaxed);
+}
+
+// Main thread
+// Picks the forced instruction set if there is one, otherwise the best
+// one the CPU supports.
+auto select() -> bhas::instruction_set;
+// Returns false, changing nothing, if the CPU doesn't support isa.
+[[nodiscard]] auto force(std::optional<bhas::instruction_set> isa) -> bool;
+
+} // cpu
+} // bhas
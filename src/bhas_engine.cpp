@@ -0,0 +1,778 @@
+#include "bhas_engine.h"
+#include "bhas_buffer.h"
+#include "bhas_rt.h"
+#include "bhas_spsc.h"
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cmath>
+#include <cstring>
+#include <memory>
+#include <numeric>
+
+namespace bhas {
+namespace engine {
+
+struct Commands {
+	spsc_ring<bhas::command, COMMAND_QUEUE_SIZE> queue;
+	std::atomic<uint64_t> overflow_count = 0;
+};
+
+// Only the audio thread writes to these so they don't need to be
+// read-modify-write operations. The main thread may see a snapshot
+// which is a callback or two behind but it will never see a torn value.
+struct Timing {
+	std::array<std::atomic<uint64_t>, TIMING_BUCKET_COUNT> buckets = {};
+	std::atomic<uint64_t> callback_count = 0;
+	std::atomic<uint64_t> deadline_miss_count = 0;
+	std::atomic<double> max_load = 0.0;
+	std::atomic<double> max_duration = 0.0;
+};
+
+struct XrunCounter {
+	std::atomic<uint64_t> count = 0;
+	std::atomic<double> last_time = 0.0;
+};
+
+struct Xruns {
+	XrunCounter input_underflow;
+	XrunCounter input_overflow;
+	XrunCounter output_underflow;
+	XrunCounter output_overflow;
+	XrunCounter priming_output;
+};
+
+struct Model {
+	Commands commands;
+	Timing timing;
+	Xruns xruns;
+};
+
+static Model model;
+
+// Loads below the bottom of the histogram go in the first bucket and
+// loads above the top go in the last one.
+[[nodiscard]] static
+auto get_timing_bucket(double load) -> int {
+	if (load <= 0.0) {
+		return 0;
+	}
+	const auto index = static_cast<int>(std::floor((std::log2(load) - TIMING_MIN_OCTAVE) * TIMING_BUCKETS_PER_OCTAVE));
+	return std::clamp(index, 0, TIMING_BUCKET_COUNT - 1);
+}
+
+[[nodiscard]] static
+auto get_timing_bucket_upper_bound(int bucket) -> double {
+	return std::exp2(double(TIMING_MIN_OCTAVE) + double(bucket + 1) / TIMING_BUCKETS_PER_OCTAVE);
+}
+
+[[nodiscard]] static
+auto get_percentile(const std::array<uint64_t, TIMING_BUCKET_COUNT>& buckets, uint64_t total, double percentile, double max) -> double {
+	if (total == 0) {
+		return 0.0;
+	}
+	const auto rank = static_cast<uint64_t>(std::ceil(percentile * double(total)));
+	uint64_t count = 0;
+	for (int bucket = 0; bucket < TIMING_BUCKET_COUNT; bucket++) {
+		count += buckets[bucket];
+		if (count >= rank) {
+			return std::min(get_timing_bucket_upper_bound(bucket), max);
+		}
+	}
+	return max;
+}
+
+auto get_callback_timing() -> bhas::callback_timing {
+	auto& timing = model.timing;
+	std::array<uint64_t, TIMING_BUCKET_COUNT> buckets;
+	uint64_t total = 0;
+	for (int bucket = 0; bucket < TIMING_BUCKET_COUNT; bucket++) {
+		buckets[bucket] = timing.buckets[bucket].load(std::memory_order_relaxed);
+		total          += buckets[bucket];
+	}
+	bhas::callback_timing out;
+	out.callback_count       = timing.callback_count.load(std::memory_order_relaxed);
+	out.deadline_miss_count  = timing.deadline_miss_count.load(std::memory_order_relaxed);
+	out.max_load             = timing.max_load.load(std::memory_order_relaxed);
+	out.max_duration.value   = timing.max_duration.load(std::memory_order_relaxed);
+	out.p50_load             = get_percentile(buckets, total, 0.5, out.max_load);
+	out.p99_load             = get_percentile(buckets, total, 0.99, out.max_load);
+	out.p999_load            = get_percentile(buckets, total, 0.999, out.max_load);
+	return out;
+}
+
+auto reset_callback_timing() -> void {
+	auto& timing = model.timing;
+	for (auto& bucket : timing.buckets) {
+		bucket.store(0, std::memory_order_relaxed);
+	}
+	timing.callback_count.store(0, std::memory_order_relaxed);
+	timing.deadline_miss_count.store(0, std::memory_order_relaxed);
+	timing.max_load.store(0.0, std::memory_order_relaxed);
+	timing.max_duration.store(0.0, std::memory_order_relaxed);
+}
+
+auto record_callback_duration(callback_clock::duration duration, bhas::frame_count frame_count, bhas::sample_rate sample_rate) -> void {
+	auto& timing        = model.timing;
+	const auto seconds  = std::chrono::duration<double>{duration}.count();
+	const auto budget   = double(frame_count.value) / double(sample_rate.value);
+	const auto load     = budget > 0.0 ? seconds / budget : 0.0;
+	auto& bucket        = timing.buckets[get_timing_bucket(load)];
+	bucket.store(bucket.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+	timing.callback_count.store(timing.callback_count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+	if (load > 1.0) {
+		timing.deadline_miss_count.store(timing.deadline_miss_count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+	}
+	if (load > timing.max_load.load(std::memory_order_relaxed)) {
+		timing.max_load.store(load, std::memory_order_relaxed);
+	}
+	if (seconds > timing.max_duration.load(std::memory_order_relaxed)) {
+		timing.max_duration.store(seconds, std::memory_order_relaxed);
+	}
+}
+
+[[nodiscard]] static
+auto get_xrun_counter(const XrunCounter& counter) -> bhas::xrun_counter {
+	return {counter.count.load(std::memory_order_relaxed), {counter.last_time.load(std::memory_order_relaxed)}};
+}
+
+auto get_xrun_stats() -> bhas::xrun_stats {
+	const auto& xruns = model.xruns;
+	bhas::xrun_stats out;
+	out.input_underflow  = get_xrun_counter(xruns.input_underflow);
+	out.input_overflow   = get_xrun_counter(xruns.input_overflow);
+	out.output_underflow = get_xrun_counter(xruns.output_underflow);
+	out.output_overflow  = get_xrun_counter(xruns.output_overflow);
+	out.priming_output   = get_xrun_counter(xruns.priming_output);
+	return out;
+}
+
+static
+auto reset(XrunCounter* counter) -> void {
+	counter->count.store(0, std::memory_order_relaxed);
+	counter->last_time.store(0.0, std::memory_order_relaxed);
+}
+
+auto reset_xrun_stats() -> void {
+	reset(&model.xruns.input_underflow);
+	reset(&model.xruns.input_overflow);
+	reset(&model.xruns.output_underflow);
+	reset(&model.xruns.output_overflow);
+	reset(&model.xruns.priming_output);
+}
+
+static
+auto record(XrunCounter* counter, bhas::stream_time time) -> void {
+	counter->count.store(counter->count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+	counter->last_time.store(time.value, std::memory_order_relaxed);
+}
+
+auto record_xruns(bhas::xrun_flags xruns, bhas::stream_time time) -> void {
+	if (xruns.value == 0) {
+		return;
+	}
+	if (bhas::is_flag_set(xruns, bhas::xrun_flags::input_underflow))  { record(&model.xruns.input_underflow, time); }
+	if (bhas::is_flag_set(xruns, bhas::xrun_flags::input_overflow))   { record(&model.xruns.input_overflow, time); }
+	if (bhas::is_flag_set(xruns, bhas::xrun_flags::output_underflow)) { record(&model.xruns.output_underflow, time); }
+	if (bhas::is_flag_set(xruns, bhas::xrun_flags::output_overflow))  { record(&model.xruns.output_overflow, time); }
+	if (bhas::is_flag_set(xruns, bhas::xrun_flags::priming_output))   { record(&model.xruns.priming_output, time); }
+}
+
+auto lock_memory() -> bool {
+	return rt::lock_memory(rt::memory_owner::engine, &model, sizeof(model));
+}
+
+auto get_command_overflow_count() -> bhas::overflow_count {
+	return {model.commands.overflow_count.load(std::memory_order_relaxed)};
+}
+
+auto push_command(bhas::command cmd) -> bool {
+	if (!model.commands.queue.push(cmd)) {
+		model.commands.overflow_count.fetch_add(1, std::memory_order_relaxed);
+		return false;
+	}
+	return true;
+}
+
+auto drain_commands() -> void {
+	model.commands.queue.drain([](const bhas::command& cmd) {
+		cmd.fn(cmd.data);
+	});
+}
+
+// Planes are padded to a multiple of this many floats, and the first
+// one is aligned to it, so every plane starts on a cache line.
+static constexpr size_t PLANE_ALIGNMENT = CACHE_LINE_SIZE / sizeof(float);
+
+auto is_valid_block_size(bhas::frame_count block_size) -> bool {
+	return block_size.value > 0 && block_size.value <= bhas::MAX_BLOCK_SIZE.value && std::has_single_bit(block_size.value);
+}
+
+auto get_reblock_latency(bhas::frame_count block_size, std::optional<bhas::frame_count> device_frame_count) -> bhas::frame_count {
+	if (!device_frame_count) {
+		return {block_size.value - 1};
+	}
+	// The output has to cover however far the input has got past the
+	// last complete block, and with a fixed device buffer size that
+	// never exceeds this.
+	return {block_size.value - std::gcd(device_frame_count->value, block_size.value)};
+}
+
+[[nodiscard]] static
+auto pad_to_alignment(size_t count) -> size_t {
+	return (count + PLANE_ALIGNMENT - 1) / PLANE_ALIGNMENT * PLANE_ALIGNMENT;
+}
+
+// Returns the first aligned position in the storage.
+[[nodiscard]] static
+auto allocate_planes(uint32_t num_planes, size_t stride, std::vector<float>* storage) -> float* {
+	storage->assign(num_planes * stride + PLANE_ALIGNMENT, 0.0f);
+	void* ptr   = storage->data();
+	auto space  = storage->size() * sizeof(float);
+	return static_cast<float*>(std::align(CACHE_LINE_SIZE, num_planes * stride * sizeof(float), ptr, space));
+}
+
+auto make_reblocker(bhas::frame_count block_size, bhas::frame_count latency, bhas::buffer_layout layout, bhas::channel_count num_input_channels, bhas::channel_count num_output_channels) -> reblocker {
+	reblocker r;
+	r.block_size = block_size.value;
+	r.latency    = latency.value;
+	if (layout == bhas::buffer_layout::interleaved) {
+		r.num_input_planes         = num_input_channels.value > 0 ? 1 : 0;
+		r.num_output_planes        = num_output_channels.value > 0 ? 1 : 0;
+		r.input_samples_per_frame  = num_input_channels.value;
+		r.output_samples_per_frame = num_output_channels.value;
+	}
+	else {
+		r.num_input_planes  = num_input_channels.value;
+		r.num_output_planes = num_output_channels.value;
+	}
+	r.input_stride    = pad_to_alignment(size_t(r.block_size) * r.input_samples_per_frame);
+	r.output_stride   = pad_to_alignment(size_t(r.block_size) * r.output_samples_per_frame);
+	r.queue_stride    = size_t(r.block_size) * 2 * r.output_samples_per_frame;
+	const auto input  = allocate_planes(r.num_input_planes, r.input_stride, &r.input_samples);
+	const auto output = allocate_planes(r.num_output_planes, r.output_stride, &r.output_samples);
+	r.queue           = allocate_planes(r.num_output_planes, r.queue_stride, &r.queue_samples);
+	for (uint32_t plane = 0; plane < r.num_input_planes; plane++) {
+		r.input_pointers.push_back(input + plane * r.input_stride);
+	}
+	for (uint32_t plane = 0; plane < r.num_output_planes; plane++) {
+		r.output_pointers.push_back(output + plane * r.output_stride);
+	}
+	// The queue starts off with latency frames of silence in it
+	r.queue_write = r.latency;
+	return r;
+}
+
+static
+auto copy_input(reblocker* r, bhas::input_buffer input, uint32_t offset, uint32_t frames) -> void {
+	const auto spf = r->input_samples_per_frame;
+	for (uint32_t plane = 0; plane < r->num_input_planes; plane++) {
+		std::memcpy(
+			const_cast<float*>(r->input_pointers[plane]) + size_t(r->input_fill) * spf,
+			input.buffer[plane] + size_t(offset) * spf,
+			size_t(frames) * spf * sizeof(float));
+	}
+}
+
+// The queue is a ring of two blocks, so anything written or read in one
+// go wraps at most once.
+static
+auto push_block(reblocker* r) -> void {
+	const auto spf      = r->output_samples_per_frame;
+	const auto capacity = r->block_size * 2;
+	const auto pos      = static_cast<uint32_t>(r->queue_write % capacity);
+	const auto first    = std::min(r->block_size, capacity - pos);
+	for (uint32_t plane = 0; plane < r->num_output_planes; plane++) {
+		const auto dst = r->queue + plane * r->queue_stride;
+		const auto src = r->output_pointers[plane];
+		std::memcpy(dst + size_t(pos) * spf, src, size_t(first) * spf * sizeof(float));
+		std::memcpy(dst, src + size_t(first) * spf, size_t(r->block_size - first) * spf * sizeof(float));
+	}
+	r->queue_write += r->block_size;
+}
+
+static
+auto pop_output(reblocker* r, bhas::output_buffer output, uint32_t offset, uint32_t frames) -> void {
+	const auto spf       = r->output_samples_per_frame;
+	const auto capacity  = r->block_size * 2;
+	const auto available = static_cast<uint32_t>(std::min<uint64_t>(r->queue_write - r->queue_read, frames));
+	const auto pos       = static_cast<uint32_t>(r->queue_read % capacity);
+	const auto first     = std::min(available, capacity - pos);
+	for (uint32_t plane = 0; plane < r->num_output_planes; plane++) {
+		const auto src = r->queue + plane * r->queue_stride;
+		const auto dst = output.buffer[plane] + size_t(offset) * spf;
+		std::memcpy(dst, src + size_t(pos) * spf, size_t(first) * spf * sizeof(float));
+		std::memcpy(dst + size_t(first) * spf, src, size_t(available - first) * spf * sizeof(float));
+		// Only if the device delivered more frames than it said it would,
+		// or the user has stopped
+		std::fill_n(dst + size_t(available) * spf, size_t(frames - available) * spf, 0.0f);
+	}
+	r->queue_read += available;
+}
+
+auto reblock(reblocker* r, bhas::input_buffer input, bhas::output_buffer output, bhas::frame_count frame_count, const bhas::time_info& time_info, bhas::sample_rate sample_rate, block_fn fn, void* context) -> bhas::callback_result {
+	const auto has_input = input.buffer && r->num_input_planes > 0;
+	auto result          = bhas::callback_result::continue_;
+	uint32_t offset      = 0;
+	while (offset < frame_count.value) {
+		const auto frames = std::min(frame_count.value - offset, r->block_size - r->input_fill);
+		if (has_input) {
+			copy_input(r, input, offset, frames);
+		}
+		r->input_fill += frames;
+		offset        += frames;
+		if (r->input_fill == r->block_size) {
+			r->input_fill = 0;
+			if (result == bhas::callback_result::continue_) {
+				// Where the block starts relative to the start of this callback
+				const auto block_start = double(offset) - double(r->block_size);
+				bhas::time_info block_time;
+				block_time.current_time           = time_info.current_time;
+				block_time.input_buffer_adc_time  = time_info.input_buffer_adc_time + block_start / double(sample_rate.value);
+				block_time.output_buffer_dac_time = time_info.output_buffer_dac_time + (block_start + double(r->latency)) / double(sample_rate.value);
+				result = fn(
+					context,
+					bhas::input_buffer{has_input ? r->input_pointers.data() : nullptr},
+					bhas::output_buffer{r->output_pointers.data()},
+					bhas::frame_count{r->block_size},
+					block_time);
+				push_block(r);
+			}
+		}
+		pop_output(r, output, offset - frames, frames);
+	}
+	return result;
+}
+
+auto make_resampler(bhas::resampler_quality quality, bhas::buffer_layout layout, bhas::channel_count num_input_channels, bhas::channel_count num_output_channels, bhas::sample_rate sample_rate, bhas::sample_rate device_sample_rate) -> resampler {
+	resampler r;
+	r.layout              = layout;
+	r.num_input_channels  = num_input_channels.value;
+	r.num_output_channels = num_output_channels.value;
+	r.sample_rate         = sample_rate;
+	r.device_sample_rate  = device_sample_rate;
+	// N device frames never need more than (N - 1) * ratio + 1 user frames
+	r.max_device_frames   = static_cast<uint32_t>(uint64_t(MAX_RESAMPLE_FRAMES - 1) * device_sample_rate.value / sample_rate.value + 1);
+	r.latency             = static_cast<uint32_t>(std::lround(resample::get_latency(quality)));
+	// The filter's delay at the device's rate, plus the frame or so which
+	// can be left in the queue
+	r.input_latency.value = resample::get_latency(quality) / double(device_sample_rate.value) + 1.0 / double(sample_rate.value);
+	r.input               = resample::make_converter(device_sample_rate, sample_rate, quality, num_input_channels, r.max_device_frames);
+	r.output              = resample::make_converter(sample_rate, device_sample_rate, quality, num_output_channels, MAX_RESAMPLE_FRAMES);
+	// One chunk's worth of input plus whatever was left over from the last
+	r.queue_stride        = pad_to_alignment(MAX_RESAMPLE_FRAMES + resample::MAX_RATIO * 2 + 2);
+	r.queue_samples.assign(r.queue_stride * r.num_input_channels, 0.0f);
+	r.planes.resize(std::max(r.num_input_channels, r.num_output_channels));
+	if (layout == bhas::buffer_layout::interleaved) {
+		r.input_samples.resize(size_t(r.queue_stride) * r.num_input_channels);
+		r.output_samples.resize(size_t(MAX_RESAMPLE_FRAMES) * r.num_output_channels);
+		if (r.num_input_channels > 0) {
+			r.input_pointers.assign(1, r.input_samples.data());
+		}
+		if (r.num_output_channels > 0) {
+			r.output_pointers.assign(1, r.output_samples.data());
+		}
+	}
+	else {
+		r.input_pointers.resize(r.num_input_channels);
+		r.output_pointers.resize(r.num_output_channels);
+		for (uint32_t ch = 0; ch < r.num_input_channels; ch++) {
+			r.input_pointers[ch] = r.queue_samples.data() + ch * r.queue_stride;
+		}
+	}
+	return r;
+}
+
+// Resamples the device's input and adds it to the queue.
+static
+auto push_input(resampler* r, bhas::input_buffer input, uint32_t offset, uint32_t frames) -> void {
+	const auto nch = r->num_input_channels;
+	if (r->layout == bhas::buffer_layout::interleaved) {
+		for (uint32_t ch = 0; ch < nch; ch++) {
+			r->planes[ch] = resample::get_write_pointer(&r->input, ch);
+		}
+		bhas::buffer::deinterleave(input.buffer[0] + size_t(offset) * nch, {r->planes.data()}, {nch}, {frames});
+	}
+	else {
+		for (uint32_t ch = 0; ch < nch; ch++) {
+			bhas::buffer::copy(input.buffer[ch] + offset, resample::get_write_pointer(&r->input, ch), frames);
+		}
+	}
+	resample::commit(&r->input, frames);
+	const auto available = resample::get_available_output(r->input);
+	for (uint32_t ch = 0; ch < nch; ch++) {
+		r->planes[ch] = r->queue_samples.data() + ch * r->queue_stride + r->queue_fill;
+	}
+	resample::process(&r->input, r->planes.data(), 1, available);
+	r->queue_fill += available;
+}
+
+// Takes frames off the front of the queue, after the user has seen them.
+static
+auto pop_input(resampler* r, uint32_t frames) -> void {
+	const auto taken = std::min(frames, r->queue_fill);
+	const auto left  = r->queue_fill - taken;
+	for (uint32_t ch = 0; ch < r->num_input_channels; ch++) {
+		const auto plane = r->queue_samples.data() + ch * r->queue_stride;
+		std::memmove(plane, plane + taken, size_t(left) * sizeof(float));
+	}
+	r->queue_fill = left;
+}
+
+[[nodiscard]] static
+auto get_user_input(resampler* r, uint32_t frames) -> const float* const* {
+	if (r->queue_fill < frames) {
+		// Can't happen unless the device delivered input for some
+		// callbacks but not for others
+		for (uint32_t ch = 0; ch < r->num_input_channels; ch++) {
+			std::fill_n(r->queue_samples.data() + ch * r->queue_stride + r->queue_fill, frames - r->queue_fill, 0.0f);
+		}
+		r->queue_fill = frames;
+	}
+	if (r->layout == bhas::buffer_layout::interleaved) {
+		for (uint32_t ch = 0; ch < r->num_input_channels; ch++) {
+			r->planes[ch] = r->queue_samples.data() + ch * r->queue_stride;
+		}
+		bhas::buffer::interleave({r->planes.data()}, r->input_samples.data(), {r->num_input_channels}, {frames});
+	}
+	return r->input_pointers.data();
+}
+
+[[nodiscard]] static
+auto get_user_output(resampler* r) -> float* const* {
+	if (r->layout == bhas::buffer_layout::non_interleaved) {
+		for (uint32_t ch = 0; ch < r->num_output_channels; ch++) {
+			r->output_pointers[ch] = resample::get_write_pointer(&r->output, ch);
+		}
+	}
+	return r->output_pointers.data();
+}
+
+// Moves what the user wrote into the output converter.
+static
+auto push_output(resampler* r, uint32_t frames) -> void {
+	if (r->layout == bhas::buffer_layout::interleaved) {
+		for (uint32_t ch = 0; ch < r->num_output_channels; ch++) {
+			r->planes[ch] = resample::get_write_pointer(&r->output, ch);
+		}
+		bhas::buffer::deinterleave(r->output_samples.data(), {r->planes.data()}, {r->num_output_channels}, {frames});
+	}
+	resample::commit(&r->output, frames);
+}
+
+static
+auto pull_output(resampler* r, bhas::output_buffer output, uint32_t offset, uint32_t frames) -> void {
+	const auto nch = r->num_output_channels;
+	if (r->layout == bhas::buffer_layout::interleaved) {
+		for (uint32_t ch = 0; ch < nch; ch++) {
+			r->planes[ch] = output.buffer[0] + size_t(offset) * nch + ch;
+		}
+		resample::process(&r->output, r->planes.data(), nch, frames);
+		return;
+	}
+	for (uint32_t ch = 0; ch < nch; ch++) {
+		r->planes[ch] = output.buffer[ch] + offset;
+	}
+	resample::process(&r->output, r->planes.data(), 1, frames);
+}
+
+auto resample(resampler* r, bhas::input_buffer input, bhas::output_buffer output, bhas::frame_count frame_count, const bhas::time_info& time_info, block_fn fn, void* context) -> bhas::callback_result {
+	const auto has_input = input.buffer && r->num_input_channels > 0;
+	auto result          = bhas::callback_result::continue_;
+	uint32_t offset      = 0;
+	while (offset < frame_count.value) {
+		const auto frames = std::min(frame_count.value - offset, r->max_device_frames);
+		if (has_input) {
+			push_input(r, input, offset, frames);
+		}
+		const auto user_frames = resample::get_required_input(r->output, frames);
+		if (user_frames > 0) {
+			const auto user_output = get_user_output(r);
+			if (result == bhas::callback_result::continue_) {
+				const auto chunk_time = double(offset) / double(r->device_sample_rate.value);
+				bhas::time_info user_time;
+				user_time.current_time           = time_info.current_time;
+				user_time.input_buffer_adc_time  = time_info.input_buffer_adc_time + chunk_time - r->input_latency.value;
+				user_time.output_buffer_dac_time = time_info.output_buffer_dac_time + chunk_time + double(r->latency) / double(r->sample_rate.value);
+				result = fn(
+					context,
+					bhas::input_buffer{has_input ? get_user_input(r, user_frames) : nullptr},
+					bhas::output_buffer{user_output},
+					bhas::frame_count{user_frames},
+					user_time);
+			}
+			else if (r->layout == bhas::buffer_layout::interleaved) {
+				// The user has stopped. Let the filter ring out into silence.
+				std::fill_n(r->output_samples.data(), size_t(user_frames) * r->num_output_channels, 0.0f);
+			}
+			else {
+				for (uint32_t ch = 0; ch < r->num_output_channels; ch++) {
+					std::fill_n(user_output[ch], user_frames, 0.0f);
+				}
+			}
+			if (has_input) {
+				pop_input(r, user_frames);
+			}
+			push_output(r, user_frames);
+		}
+		pull_output(r, output, offset, frames);
+		offset += frames;
+	}
+	return result;
+}
+
+auto make_render_pipeline(bhas::frame_count block_size, bhas::buffer_layout layout, bhas::channel_count num_input_channels, bhas::channel_count num_output_channels) -> std::unique_ptr<render_pipeline> {
+	auto p = std::make_unique<render_pipeline>();
+	p->block_size = block_size.value;
+	if (layout == bhas::buffer_layout::interleaved) {
+		p->num_input_planes         = num_input_channels.value > 0 ? 1 : 0;
+		p->num_output_planes        = num_output_channels.value > 0 ? 1 : 0;
+		p->input_samples_per_frame  = num_input_channels.value;
+		p->output_samples_per_frame = num_output_channels.value;
+	}
+	else {
+		p->num_input_planes  = num_input_channels.value;
+		p->num_output_planes = num_output_channels.value;
+	}
+	const auto input_stride  = pad_to_alignment(size_t(p->block_size) * p->input_samples_per_frame);
+	const auto output_stride = pad_to_alignment(size_t(p->block_size) * p->output_samples_per_frame);
+	for (auto& slot : p->slots) {
+		const auto input  = allocate_planes(p->num_input_planes, input_stride, &slot.input_samples);
+		const auto output = allocate_planes(p->num_output_planes, output_stride, &slot.output_samples);
+		for (uint32_t plane = 0; plane < p->num_input_planes; plane++) {
+			slot.input_pointers.push_back(input + plane * input_stride);
+		}
+		for (uint32_t plane = 0; plane < p->num_output_planes; plane++) {
+			slot.output_pointers.push_back(output + plane * output_stride);
+		}
+	}
+	for (uint32_t i = 0; i < RENDER_SLOT_COUNT; i++) {
+		p->free_slots[i] = i;
+	}
+	p->num_free_slots = RENDER_SLOT_COUNT;
+	return p;
+}
+
+static
+auto render(render_pipeline* p, render_slot* slot) -> void {
+	if (p->finished) {
+		// The user has already stopped. The stream is on its way down.
+		for (const auto plane : slot->output_pointers) {
+			std::fill_n(plane, size_t(p->block_size) * p->output_samples_per_frame, 0.0f);
+		}
+		return;
+	}
+	drain_commands();
+	rt::enter_audio_callback();
+	slot->result = p->fn(
+		p->context,
+		bhas::input_buffer{p->num_input_planes > 0 ? slot->input_pointers.data() : nullptr},
+		bhas::output_buffer{slot->output_pointers.data()},
+		bhas::frame_count{p->block_size},
+		slot->time,
+		slot->xruns);
+	rt::leave_audio_callback();
+	p->finished = slot->result != bhas::callback_result::continue_;
+}
+
+static
+auto render_thread_main(render_pipeline* p, rt::thread_setup setup) -> void {
+	rt::apply_worker_thread_setup(setup);
+	uint32_t seen = 0;
+	for (;;) {
+		wait_until(&p->pending, [seen](uint32_t pending) { return pending != seen; });
+		seen = p->pending.value.load(std::memory_order_acquire);
+		if (p->stopping.load(std::memory_order_acquire)) {
+			return;
+		}
+		uint32_t index;
+		while (p->to_render.pop(&index)) {
+			render(p, &p->slots[index]);
+			// Can't fail because there are fewer slots than places in the ring
+			static_cast<void>(p->rendered.push(index));
+		}
+	}
+}
+
+auto start_render_thread(render_pipeline* p, render_fn fn, void* context, const rt::thread_setup& setup) -> void {
+	p->fn      = fn;
+	p->context = context;
+	p->thread  = std::thread{render_thread_main, p, setup};
+}
+
+auto stop_render_thread(render_pipeline* p) -> void {
+	if (!p->thread.joinable()) {
+		return;
+	}
+	p->stopping.store(true, std::memory_order_release);
+	p->pending.value.fetch_add(1, std::memory_order_seq_cst);
+	wake(&p->pending);
+	p->thread.join();
+}
+
+auto render_ahead(render_pipeline* p, bhas::input_buffer input, bhas::output_buffer output, bhas::frame_count frame_count, const bhas::time_info& time_info, bhas::xrun_flags xruns, bhas::sample_rate sample_rate) -> bhas::callback_result {
+	const auto sequence = p->next_sequence++;
+	// Find the block which was rendered for this one. Anything older
+	// than that was finished too late and is thrown away.
+	std::optional<uint32_t> ready;
+	uint32_t index;
+	while (p->rendered.pop(&index)) {
+		if (p->slots[index].sequence + 1 == sequence) {
+			ready = index;
+		}
+		else {
+			p->free_slots[p->num_free_slots++] = index;
+		}
+	}
+	// Hand this block's input to the render thread. If every slot is
+	// still in use then the render thread is more than a block behind,
+	// and the block is skipped.
+	if (p->num_free_slots > 0) {
+		const auto slot_index = p->free_slots[--p->num_free_slots];
+		auto& slot            = p->slots[slot_index];
+		if (input.buffer) {
+			for (uint32_t plane = 0; plane < p->num_input_planes; plane++) {
+				std::memcpy(const_cast<float*>(slot.input_pointers[plane]), input.buffer[plane], size_t(frame_count.value) * p->input_samples_per_frame * sizeof(float));
+			}
+		}
+		slot.time     = time_info;
+		slot.time.output_buffer_dac_time += double(p->block_size) / double(sample_rate.value);
+		slot.xruns    = xruns;
+		slot.sequence = sequence;
+		static_cast<void>(p->to_render.push(slot_index));
+		p->pending.value.fetch_add(1, std::memory_order_seq_cst);
+		wake(&p->pending);
+	}
+	if (!ready) {
+		for (uint32_t plane = 0; plane < p->num_output_planes; plane++) {
+			std::fill_n(output.buffer[plane], size_t(frame_count.value) * p->output_samples_per_frame, 0.0f);
+		}
+		// The very first block is always silent
+		if (sequence > 0) {
+			record_xruns({bhas::xrun_flags::output_underflow}, {time_info.current_time});
+		}
+		return bhas::callback_result::continue_;
+	}
+	const auto& slot = p->slots[*ready];
+	for (uint32_t plane = 0; plane < p->num_output_planes; plane++) {
+		std::memcpy(output.buffer[plane], slot.output_pointers[plane], size_t(frame_count.value) * p->output_samples_per_frame * sizeof(float));
+	}
+	p->free_slots[p->num_free_slots++] = *ready;
+	return slot.result;
+}
+
+auto make_meter_bank(const bhas::metering_config& config, bhas::buffer_layout layout, bhas::channel_count num_input_channels, bhas::channel_count num_output_channels, bhas::sample_rate sample_rate) -> std::unique_ptr<meter_bank> {
+	const auto num_channels = num_input_channels.value + num_output_channels.value;
+	auto bank = std::make_unique<meter_bank>();
+	bank->layout              = layout;
+	bank->num_input_channels  = num_input_channels.value;
+	bank->num_output_channels = num_output_channels.value;
+	bank->window_frames       = std::max(1u, static_cast<uint32_t>(config.window.value * sample_rate.value));
+	bank->peak_hold_frames    = static_cast<uint32_t>(config.peak_hold.value * sample_rate.value);
+	bank->accumulators.resize(num_channels);
+	bank->levels.resize(std::max(num_input_channels.value, num_output_channels.value));
+	bank->published = std::make_unique<published_meter[]>(num_channels);
+	return bank;
+}
+
+auto read_meters(const meter_bank& bank) -> bhas::meters {
+	bhas::meters meters;
+	meters.input.resize(bank.num_input_channels);
+	meters.output.resize(bank.num_output_channels);
+	const auto read = [&bank](uint32_t index, bhas::channel_meter* meter) {
+		const auto& published = bank.published[index];
+		meter->peak      = published.peak.load(std::memory_order_relaxed);
+		meter->rms       = published.rms.load(std::memory_order_relaxed);
+		meter->peak_hold = published.peak_hold.load(std::memory_order_relaxed);
+	};
+	for (;;) {
+		const auto sequence = bank.sequence.load(std::memory_order_acquire);
+		if (sequence & 1) {
+			cpu_relax();
+			continue;
+		}
+		for (uint32_t ch = 0; ch < bank.num_input_channels; ch++) {
+			read(ch, &meters.input[ch]);
+		}
+		for (uint32_t ch = 0; ch < bank.num_output_channels; ch++) {
+			read(bank.num_input_channels + ch, &meters.output[ch]);
+		}
+		std::atomic_thread_fence(std::memory_order_acquire);
+		if (bank.sequence.load(std::memory_order_relaxed) == sequence) {
+			meters.update_count = sequence / 2;
+			return meters;
+		}
+	}
+}
+
+auto lock_memory(const meter_bank& bank) -> bool {
+	const auto num_channels = bank.num_input_channels + bank.num_output_channels;
+	auto ok = rt::lock_memory(rt::memory_owner::engine, &bank, sizeof(bank));
+	ok = rt::lock_memory(rt::memory_owner::engine, bank.accumulators.data(), bank.accumulators.size() * sizeof(meter_accumulator)) && ok;
+	ok = rt::lock_memory(rt::memory_owner::engine, bank.levels.data(), bank.levels.size() * sizeof(bhas::buffer::levels)) && ok;
+	ok = rt::lock_memory(rt::memory_owner::engine, bank.published.get(), num_channels * sizeof(published_meter)) && ok;
+	return ok;
+}
+
+static
+auto accumulate(meter_accumulator* accumulator, const bhas::buffer::levels& levels) -> void {
+	accumulator->peak            = std::max(accumulator->peak, levels.peak);
+	accumulator->sum_of_squares += levels.sum_of_squares;
+}
+
+static
+auto accumulate(meter_bank* bank, const float* const* buffer, uint32_t num_channels, meter_accumulator* accumulators, uint32_t frames) -> void {
+	if (num_channels == 0) {
+		return;
+	}
+	if (bank->layout == bhas::buffer_layout::interleaved) {
+		bhas::buffer::measure(buffer[0], {num_channels}, {frames}, bank->levels.data());
+		for (uint32_t ch = 0; ch < num_channels; ch++) {
+			accumulate(&accumulators[ch], bank->levels[ch]);
+		}
+		return;
+	}
+	for (uint32_t ch = 0; ch < num_channels; ch++) {
+		accumulate(&accumulators[ch], bhas::buffer::measure(buffer[ch], frames));
+	}
+}
+
+static
+auto publish(meter_bank* bank) -> void {
+	const auto num_channels = bank->num_input_channels + bank->num_output_channels;
+	const auto sequence     = bank->sequence.load(std::memory_order_relaxed);
+	bank->sequence.store(sequence + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+	for (uint32_t i = 0; i < num_channels; i++) {
+		auto& a = bank->accumulators[i];
+		if (a.peak >= a.peak_hold || a.peak_hold_frames_left <= bank->frames) {
+			a.peak_hold             = a.peak;
+			a.peak_hold_frames_left = bank->peak_hold_frames;
+		}
+		else {
+			a.peak_hold_frames_left -= bank->frames;
+		}
+		auto& p = bank->published[i];
+		p.peak.store(a.peak, std::memory_order_relaxed);
+		p.rms.store(static_cast<float>(std::sqrt(a.sum_of_squares / bank->frames)), std::memory_order_relaxed);
+		p.peak_hold.store(a.peak_hold, std::memory_order_relaxed);
+		a.peak           = 0.0f;
+		a.sum_of_squares = 0.0;
+	}
+	bank->sequence.store(sequence + 2, std::memory_order_release);
+	bank->frames = 0;
+}
+
+auto meter(meter_bank* bank, bhas::input_buffer input, bhas::output_buffer output, bhas::frame_count frame_count) -> void {
+	if (input.buffer) {
+		accumulate(bank, input.buffer, bank->num_input_channels, bank->accumulators.data(), frame_count.value);
+	}
+	accumulate(bank, output.buffer, bank->num_output_channels, bank->accumulators.data() + bank->num_input_channels, frame_count.value);
+	bank->frames += frame_count.value;
+	if (bank->frames >= bank->window_frames) {
+		publish(bank);
+	}
+}
+
+} // engine
+} // bhas
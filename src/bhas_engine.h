@@ -0,0 +1,238 @@
+#pragma once
+
+#include "bhas.h"
+#include "bhas_buffer.h"
+#include "bhas_resample.h"
+#include "bhas_rt.h"
+#include "bhas_spsc.h"
+#include "bhas_wait.h"
+#include <array>
+#include <chrono>
+#include <memory>
+#include <optional>
+#include <thread>
+#include <vector>
+
+// Backend-independent parts of the audio callback which are owned by the
+// engine rather than by any particular audio API.
+namespace bhas {
+namespace engine {
+
+static constexpr size_t COMMAND_QUEUE_SIZE = 1024;
+// The callback timing histogram covers loads from 2^-10 to 2^4
+static constexpr int TIMING_BUCKETS_PER_OCTAVE = 8;
+static constexpr int TIMING_MIN_OCTAVE         = -10;
+static constexpr int TIMING_MAX_OCTAVE         = 4;
+static constexpr int TIMING_BUCKET_COUNT       = (TIMING_MAX_OCTAVE - TIMING_MIN_OCTAVE) * TIMING_BUCKETS_PER_OCTAVE;
+
+using callback_clock = std::chrono::steady_clock;
+
+// Main thread
+[[nodiscard]] auto get_callback_timing() -> bhas::callback_timing;
+[[nodiscard]] auto get_xrun_stats() -> bhas::xrun_stats;
+[[nodiscard]] auto get_command_overflow_count() -> bhas::overflow_count;
+[[nodiscard]] auto push_command(bhas::command cmd) -> bool;
+// Only while no stream is running
+auto reset_callback_timing() -> void;
+auto reset_xrun_stats() -> void;
+// Locks the engine's own state (the command queue and the statistics)
+[[nodiscard]] auto lock_memory() -> bool;
+
+// Audio thread
+auto drain_commands() -> void;
+auto record_callback_duration(callback_clock::duration duration, bhas::frame_count frame_count, bhas::sample_rate sample_rate) -> void;
+auto record_xruns(bhas::xrun_flags xruns, bhas::stream_time time) -> void;
+
+// Re-blocking.
+// Collects whatever the device delivers into blocks of exactly
+// block_size frames for the user. Output is delayed by a fixed number of
+// frames so that there is always enough of it to hand back.
+using block_fn = auto(*)(void* context, bhas::input_buffer input, bhas::output_buffer output, bhas::frame_count frame_count, const bhas::time_info& time_info) -> bhas::callback_result;
+
+struct reblocker {
+	uint32_t block_size = 0;
+	uint32_t latency = 0;
+	// An interleaved buffer is a single plane containing every channel.
+	// A non-interleaved buffer has one plane per channel.
+	uint32_t num_input_planes = 0;
+	uint32_t num_output_planes = 0;
+	uint32_t input_samples_per_frame = 1;
+	uint32_t output_samples_per_frame = 1;
+	// Distance between planes, padded so that every plane is aligned
+	size_t input_stride = 0;
+	size_t output_stride = 0;
+	size_t queue_stride = 0;
+	std::vector<float> input_samples;
+	std::vector<float> output_samples;
+	// Ring of output frames waiting to be handed back to the device.
+	// Big enough for two blocks.
+	std::vector<float> queue_samples;
+	std::vector<const float*> input_pointers;
+	std::vector<float*> output_pointers;
+	float* queue = nullptr;
+	uint32_t input_fill = 0;
+	uint64_t queue_read = 0;
+	uint64_t queue_write = 0;
+};
+
+// Main thread
+[[nodiscard]] auto is_valid_block_size(bhas::frame_count block_size) -> bool;
+// The smallest delay which guarantees that output is never starved. If
+// the device's buffer size isn't known then it could be anything.
+[[nodiscard]] auto get_reblock_latency(bhas::frame_count block_size, std::optional<bhas::frame_count> device_frame_count) -> bhas::frame_count;
+[[nodiscard]] auto make_reblocker(bhas::frame_count block_size, bhas::frame_count latency, bhas::buffer_layout layout, bhas::channel_count num_input_channels, bhas::channel_count num_output_channels) -> reblocker;
+
+// Audio thread
+// input.buffer may be null if there is no input.
+auto reblock(reblocker* r, bhas::input_buffer input, bhas::output_buffer output, bhas::frame_count frame_count, const bhas::time_info& time_info, bhas::sample_rate sample_rate, block_fn fn, void* context) -> bhas::callback_result;
+
+// Resampling.
+// Calls the user at their own sample rate when the device runs at a
+// different one. The device's input is resampled into a queue at the
+// user's rate, and the user is called for exactly as many frames as the
+// output resampler needs to fill the device buffer, which can be a
+// different number every time. Both directions step through the same
+// ratio from the same starting point, so the queue always has enough
+// input for the user and never holds more than a couple of frames in
+// between.
+static constexpr uint32_t MAX_RESAMPLE_FRAMES = 4096;
+
+struct resampler {
+	bhas::buffer_layout layout = bhas::buffer_layout::non_interleaved;
+	uint32_t num_input_channels = 0;
+	uint32_t num_output_channels = 0;
+	// Device callbacks are split into chunks of at most this many frames,
+	// so that the user is never called for more than MAX_RESAMPLE_FRAMES.
+	uint32_t max_device_frames = 0;
+	bhas::sample_rate sample_rate;
+	bhas::sample_rate device_sample_rate;
+	// How much the output is delayed by, in the user's frames
+	uint32_t latency = 0;
+	bhas::seconds input_latency;
+	// Device rate to user rate, and back
+	resample::converter input;
+	resample::converter output;
+	// Resampled input waiting for the user, one plane per channel
+	std::vector<float> queue_samples;
+	size_t queue_stride = 0;
+	uint32_t queue_fill = 0;
+	// The user's buffers. Non-interleaved streams are handed planes of the
+	// queue and of the output converter's history, so only interleaved
+	// streams need any samples of their own.
+	std::vector<float> input_samples;
+	std::vector<float> output_samples;
+	std::vector<const float*> input_pointers;
+	std::vector<float*> output_pointers;
+	// Somewhere to build lists of plane pointers in the audio thread
+	std::vector<float*> planes;
+};
+
+// Main thread
+[[nodiscard]] auto make_resampler(bhas::resampler_quality quality, bhas::buffer_layout layout, bhas::channel_count num_input_channels, bhas::channel_count num_output_channels, bhas::sample_rate sample_rate, bhas::sample_rate device_sample_rate) -> resampler;
+
+// Audio thread
+// The buffers and frame_count are at the device's rate, and in the
+// user's layout. input.buffer may be null if there is no input.
+auto resample(resampler* r, bhas::input_buffer input, bhas::output_buffer output, bhas::frame_count frame_count, const bhas::time_info& time_info, block_fn fn, void* context) -> bhas::callback_result;
+
+// Render-ahead.
+// The user is called on a render thread, one block ahead of the device.
+// Every device block, the audio thread hands the block's input to the
+// render thread and copies out the output which was rendered during the
+// previous block, so the output is delayed by exactly one block. Blocks
+// are passed back and forth through a set of three slots, so that the
+// render thread can run up to a block late without holding up the audio
+// thread. A block which isn't ready in time is replaced with silence.
+static constexpr uint32_t RENDER_SLOT_COUNT = 3;
+
+using render_fn = auto(*)(void* context, bhas::input_buffer input, bhas::output_buffer output, bhas::frame_count frame_count, const bhas::time_info& time_info, bhas::xrun_flags xruns) -> bhas::callback_result;
+
+struct render_slot {
+	std::vector<float> input_samples;
+	std::vector<float> output_samples;
+	std::vector<const float*> input_pointers;
+	std::vector<float*> output_pointers;
+	bhas::time_info time;
+	bhas::xrun_flags xruns;
+	uint64_t sequence = 0;
+	bhas::callback_result result = bhas::callback_result::continue_;
+};
+
+struct render_pipeline {
+	uint32_t block_size = 0;
+	uint32_t num_input_planes = 0;
+	uint32_t num_output_planes = 0;
+	uint32_t input_samples_per_frame = 1;
+	uint32_t output_samples_per_frame = 1;
+	std::array<render_slot, RENDER_SLOT_COUNT> slots;
+	// Audio thread to render thread, and back
+	spsc_ring<uint32_t, RENDER_SLOT_COUNT + 1> to_render;
+	spsc_ring<uint32_t, RENDER_SLOT_COUNT + 1> rendered;
+	// Incremented whenever a slot is sent to the render thread
+	wait_word pending;
+	// Audio thread only
+	std::array<uint32_t, RENDER_SLOT_COUNT> free_slots;
+	uint32_t num_free_slots = 0;
+	uint64_t next_sequence = 0;
+	// Render thread only
+	bool finished = false;
+	render_fn fn = nullptr;
+	void* context = nullptr;
+	std::atomic<bool> stopping = false;
+	std::thread thread;
+};
+
+// Main thread
+[[nodiscard]] auto make_render_pipeline(bhas::frame_count block_size, bhas::buffer_layout layout, bhas::channel_count num_input_channels, bhas::channel_count num_output_channels) -> std::unique_ptr<render_pipeline>;
+auto start_render_thread(render_pipeline* p, render_fn fn, void* context, const rt::thread_setup& setup) -> void;
+auto stop_render_thread(render_pipeline* p) -> void;
+
+// Audio thread
+// frame_count must be the pipeline's block size.
+auto render_ahead(render_pipeline* p, bhas::input_buffer input, bhas::output_buffer output, bhas::frame_count frame_count, const bhas::time_info& time_info, bhas::xrun_flags xruns, bhas::sample_rate sample_rate) -> bhas::callback_result;
+
+// Metering.
+// The audio thread accumulates every channel's levels until a window's
+// worth of frames has gone by, then publishes them all at once with a
+// seqlock. The main thread retries its read if it overlapped a publish,
+// so the audio thread never waits for it.
+struct meter_accumulator {
+	float peak = 0.0f;
+	double sum_of_squares = 0.0;
+	float peak_hold = 0.0f;
+	uint32_t peak_hold_frames_left = 0;
+};
+
+struct published_meter {
+	std::atomic<float> peak = 0.0f;
+	std::atomic<float> rms = 0.0f;
+	std::atomic<float> peak_hold = 0.0f;
+};
+
+struct meter_bank {
+	bhas::buffer_layout layout = bhas::buffer_layout::non_interleaved;
+	uint32_t num_input_channels = 0;
+	uint32_t num_output_channels = 0;
+	uint32_t window_frames = 0;
+	uint32_t peak_hold_frames = 0;
+	// Audio thread only. The input channels followed by the output
+	// channels.
+	std::vector<meter_accumulator> accumulators;
+	std::vector<bhas::buffer::levels> levels;
+	uint32_t frames = 0;
+	// Odd while the audio thread is publishing
+	alignas(CACHE_LINE_SIZE) std::atomic<uint64_t> sequence = 0;
+	std::unique_ptr<published_meter[]> published;
+};
+
+// Main thread
+[[nodiscard]] auto make_meter_bank(const bhas::metering_config& config, bhas::buffer_layout layout, bhas::channel_count num_input_channels, bhas::channel_count num_output_channels, bhas::sample_rate sample_rate) -> std::unique_ptr<meter_bank>;
+[[nodiscard]] auto read_meters(const meter_bank& bank) -> bhas::meters;
+[[nodiscard]] auto lock_memory(const meter_bank& bank) -> bool;
+
+// Audio thread
+// input.buffer may be null if there is no input.
+auto meter(meter_bank* bank, bhas::input_buffer input, bhas::output_buffer output, bhas::frame_count frame_count) -> void;
+
+} // engine
+} // bhas
@@ -0,0 +1,274 @@
+#include "bhas_input_file.h"
+#include "bhas_convert.h"
+#include "bhas_rt.h"
+#include <algorithm>
+#include <bit>
+#include <chrono>
+#include <cstring>
+#include <format>
+
+namespace bhas {
+namespace input_file {
+
+[[nodiscard]] static
+auto err_no_audio(const std::string& path) -> bhas::error {
+	return {std::format("The input file '{}' has no audio in it.", path)};
+}
+
+[[nodiscard]] static
+auto err_sample_rate_mismatch(const std::string& path, bhas::sample_rate file_rate, bhas::sample_rate device_rate) -> bhas::error {
+	return {std::format("The input file '{}' is at {} Hz but the device is running at {} Hz. (Turn on the resampler and set its device_sample_rate to {} Hz.)", path, file_rate.value, device_rate.value, file_rate.value)};
+}
+
+[[nodiscard]] static
+auto info_reading_input_file(const wav::reader& file) -> bhas::info {
+	return {std::format("Reading the input from '{}' ({} channels, {} frames.)", file.path, file.format.num_channels.value, file.num_frames)};
+}
+
+[[nodiscard]] static
+auto get_space(const reader& r) -> uint64_t {
+	return r.ring_frames - (r.write_pos.load(std::memory_order_relaxed) - r.read_pos.load(std::memory_order_acquire));
+}
+
+// Converts frames from the file's format and channel count to the
+// device's, in device_samples.
+[[nodiscard]] static
+auto decode(reader* r, uint64_t count) -> const std::byte* {
+	const auto& file = r->file.format;
+	if (file.sample_format == r->format && file.num_channels.value == r->num_channels) {
+		return r->file_samples.data();
+	}
+	const auto file_channels = file.num_channels.value;
+	convert::to_float(file.sample_format, r->file_samples.data(), r->file_floats.data(), size_t(count) * file_channels);
+	const auto shared = std::min(file_channels, r->num_channels);
+	for (size_t i = 0; i < count; i++) {
+		const auto src = r->file_floats.data() + i * file_channels;
+		const auto dst = r->device_floats.data() + i * r->num_channels;
+		std::copy_n(src, shared, dst);
+		std::fill(dst + shared, dst + r->num_channels, 0.0f);
+	}
+	convert::from_float(r->format, r->device_floats.data(), r->device_samples.data(), size_t(count) * r->num_channels, nullptr);
+	return r->device_samples.data();
+}
+
+static
+auto write_to_ring(reader* r, const std::byte* src, uint64_t count) -> void {
+	const auto pos   = r->write_pos.load(std::memory_order_relaxed);
+	const auto start = pos & (r->ring_frames - 1);
+	const auto first = std::min(count, r->ring_frames - start);
+	std::memcpy(r->ring.data() + start * r->bytes_per_frame, src, size_t(first) * r->bytes_per_frame);
+	std::memcpy(r->ring.data(), src + first * r->bytes_per_frame, size_t(count - first) * r->bytes_per_frame);
+	r->write_pos.store(pos + count, std::memory_order_release);
+	r->data_written.value.fetch_add(1, std::memory_order_seq_cst);
+	wake(&r->data_written);
+}
+
+static
+auto finish(reader* r) -> void {
+	r->finished.store(true, std::memory_order_release);
+	r->data_written.value.fetch_add(1, std::memory_order_seq_cst);
+	wake(&r->data_written);
+}
+
+// Tops the ring up. Returns false once the reader has nothing more to
+// give.
+[[nodiscard]] static
+auto fill(reader* r) -> bool {
+	for (;;) {
+		const auto count = std::min<uint64_t>(get_space(*r), CHUNK_FRAMES);
+		if (count == 0) {
+			return true;
+		}
+		if (r->file.position == r->file.num_frames) {
+			if (!r->loop || !wav::rewind(&r->file)) {
+				finish(r);
+				return false;
+			}
+		}
+		const auto got = wav::read(&r->file, r->file_samples.data(), count);
+		if (got == 0) {
+			// The file is shorter than its header says, or unreadable
+			finish(r);
+			return false;
+		}
+		write_to_ring(r, decode(r, got), got);
+	}
+}
+
+// When the audio thread is waiting on it, the reader thread waits to be
+// woken as soon as there's room for a chunk. Otherwise it polls, so that
+// the audio thread never has to make a system call to wake it.
+static
+auto reader_thread_main(reader* r) -> void {
+	const auto chunk = std::min<uint64_t>(CHUNK_FRAMES, r->ring_frames / 2);
+	while (!r->stop_requested.load(std::memory_order_acquire)) {
+		if (!fill(r)) {
+			return;
+		}
+		if (r->wait_for_data) {
+			wait_until(&r->data_read, [r, chunk](uint32_t) {
+				return r->stop_requested.load(std::memory_order_acquire) || get_space(*r) >= chunk;
+			});
+		}
+		else {
+			std::this_thread::sleep_for(std::chrono::duration<double>{r->poll_interval});
+		}
+	}
+}
+
+template <size_t BytesPerSample> static
+auto deinterleave(const std::byte* src, uint32_t num_channels, size_t count, std::byte* dst, size_t dst_stride) -> void {
+	for (size_t i = 0; i < count; i++) {
+		for (uint32_t ch = 0; ch < num_channels; ch++) {
+			std::memcpy(dst + (ch * dst_stride + i) * BytesPerSample, src, BytesPerSample);
+			src += BytesPerSample;
+		}
+	}
+}
+
+// Copies count frames out of the ring, starting at pos, to the output
+// buffer starting at frame offset.
+static
+auto copy_from_ring(reader* r, uint64_t pos, size_t count, size_t offset) -> void {
+	const auto src = r->ring.data() + (pos & (r->ring_frames - 1)) * r->bytes_per_frame;
+	if (r->layout == bhas::buffer_layout::interleaved) {
+		std::memcpy(r->samples.data() + offset * r->bytes_per_frame, src, count * r->bytes_per_frame);
+		return;
+	}
+	const auto dst = r->samples.data() + offset * r->bytes_per_sample;
+	switch (r->bytes_per_sample) {
+		case 2: deinterleave<2>(src, r->num_channels, count, dst, r->max_frames); break;
+		case 3: deinterleave<3>(src, r->num_channels, count, dst, r->max_frames); break;
+		default: deinterleave<4>(src, r->num_channels, count, dst, r->max_frames); break;
+	}
+}
+
+static
+auto zero(reader* r, size_t offset, size_t count) -> void {
+	if (r->layout == bhas::buffer_layout::interleaved) {
+		std::memset(r->samples.data() + offset * r->bytes_per_frame, 0, count * r->bytes_per_frame);
+		return;
+	}
+	for (uint32_t ch = 0; ch < r->num_channels; ch++) {
+		std::memset(r->samples.data() + (size_t(ch) * r->max_frames + offset) * r->bytes_per_sample, 0, count * r->bytes_per_sample);
+	}
+}
+
+auto open(const bhas::input_file_config& config, bhas::sample_format format, bhas::buffer_layout layout, bhas::channel_count num_channels, bhas::sample_rate sample_rate, uint32_t max_frames, reader* r, bhas::log* log) -> bool {
+	if (!wav::open(config.path, &r->file, log)) {
+		return false;
+	}
+	if (r->file.num_frames == 0) {
+		log->push_back(err_no_audio(config.path));
+		wav::close(&r->file);
+		return false;
+	}
+	if (r->file.format.sample_rate.value != sample_rate.value) {
+		log->push_back(err_sample_rate_mismatch(config.path, r->file.format.sample_rate, sample_rate));
+		wav::close(&r->file);
+		return false;
+	}
+	r->loop             = config.loop;
+	r->format           = format;
+	r->layout           = layout;
+	r->num_channels     = num_channels.value;
+	r->bytes_per_sample = convert::get_bytes_per_sample(format);
+	r->bytes_per_frame  = r->bytes_per_sample * r->num_channels;
+	r->max_frames       = max_frames;
+	r->samples.assign(size_t(max_frames) * r->bytes_per_frame, std::byte{0});
+	if (layout == bhas::buffer_layout::interleaved) {
+		r->buffer = r->samples.data();
+	}
+	else {
+		r->pointers.resize(r->num_channels);
+		for (uint32_t ch = 0; ch < r->num_channels; ch++) {
+			r->pointers[ch] = r->samples.data() + size_t(ch) * max_frames * r->bytes_per_sample;
+		}
+		r->buffer = r->pointers.data();
+	}
+	const auto prefetch_frames = uint64_t(std::max(config.prefetch.value, 0.0) * sample_rate.value);
+	r->ring_frames   = std::bit_ceil(std::max({prefetch_frames, uint64_t{max_frames} * 2, uint64_t{CHUNK_FRAMES} * 2}));
+	r->poll_interval = std::max(config.prefetch.value / 4.0, 0.001);
+	r->ring.assign(size_t(r->ring_frames) * r->bytes_per_frame, std::byte{0});
+	r->file_samples.resize(size_t(CHUNK_FRAMES) * r->file.bytes_per_frame);
+	r->file_floats.resize(size_t(CHUNK_FRAMES) * r->file.format.num_channels.value);
+	r->device_floats.resize(size_t(CHUNK_FRAMES) * r->num_channels);
+	r->device_samples.resize(size_t(CHUNK_FRAMES) * r->bytes_per_frame);
+	// So that the stream starts with a full ring
+	static_cast<void>(fill(r));
+	log->push_back(info_reading_input_file(r->file));
+	return true;
+}
+
+auto start(reader* r) -> void {
+	if (r->finished.load(std::memory_order_acquire)) {
+		// The whole file fitted in the ring
+		return;
+	}
+	r->thread = std::thread{reader_thread_main, r};
+}
+
+auto stop(reader* r) -> void {
+	if (r->thread.joinable()) {
+		r->stop_requested.store(true, std::memory_order_seq_cst);
+		r->data_read.value.fetch_add(1, std::memory_order_seq_cst);
+		wake(&r->data_read);
+		r->thread.join();
+	}
+	wav::close(&r->file);
+}
+
+template <typename T> [[nodiscard]] static
+auto lock_vector(const std::vector<T>& v) -> bool {
+	return rt::lock_memory(rt::memory_owner::engine, v.data(), v.size() * sizeof(T));
+}
+
+auto lock_memory(const reader& r) -> bool {
+	auto ok = rt::lock_memory(rt::memory_owner::engine, &r, sizeof(r));
+	ok = lock_vector(r.samples) && ok;
+	ok = lock_vector(r.pointers) && ok;
+	ok = lock_vector(r.ring) && ok;
+	return ok;
+}
+
+auto read(reader* r, bhas::frame_count frame_count, bhas::xrun_flags* xruns) -> const void* {
+	if (frame_count.value > r->max_frames) {
+		xruns->value |= bhas::xrun_flags::input_underflow;
+		return nullptr;
+	}
+	const auto wanted = frame_count.value;
+	const auto pos    = r->read_pos.load(std::memory_order_relaxed);
+	auto available    = r->write_pos.load(std::memory_order_acquire) - pos;
+	if (available < wanted && r->wait_for_data) {
+		wait_until(&r->data_written, [r, pos, wanted, &available](uint32_t) {
+			available = r->write_pos.load(std::memory_order_acquire) - pos;
+			return available >= wanted || r->finished.load(std::memory_order_acquire);
+		});
+	}
+	// The reader thread moves write_pos on before it sets finished, so
+	// available may be from before the last write even though finished
+	// is set. Reading it again afterwards gets everything there is.
+	auto finished = false;
+	if (available < wanted) {
+		finished  = r->finished.load(std::memory_order_acquire);
+		available = r->write_pos.load(std::memory_order_acquire) - pos;
+	}
+	const auto count = size_t(std::min<uint64_t>(available, wanted));
+	// The ring may wrap around in the middle
+	const auto first = std::min<size_t>(count, r->ring_frames - (pos & (r->ring_frames - 1)));
+	copy_from_ring(r, pos, first, 0);
+	copy_from_ring(r, pos + first, count - first, first);
+	zero(r, count, wanted - count);
+	r->read_pos.store(pos + count, std::memory_order_release);
+	if (r->wait_for_data) {
+		r->data_read.value.fetch_add(1, std::memory_order_seq_cst);
+		wake(&r->data_read);
+	}
+	if (count < wanted && !finished) {
+		xruns->value |= bhas::xrun_flags::input_underflow;
+	}
+	return r->buffer;
+}
+
+} // input_file
+} // bhas
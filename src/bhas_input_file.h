@@ -0,0 +1,91 @@
+#pragma once
+
+#include "bhas.h"
+#include "bhas_spsc.h"
+#include "bhas_wait.h"
+#include "bhas_wav.h"
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <thread>
+#include <vector>
+
+// Feeding a WAV file to the audio thread in place of the input device.
+// A reader thread decodes the file into the device's sample format and
+// channel count and writes it into a ring, keeping the ring topped up
+// with input_file_config::prefetch worth of frames. The audio thread
+// copies out of the ring into buffers which look exactly like the
+// device's, so everything downstream (channel selection, conversion,
+// resampling, metering) treats the file like any other input.
+namespace bhas {
+namespace input_file {
+
+// How many frames the reader thread decodes at a time
+static constexpr uint32_t CHUNK_FRAMES = 4096;
+
+struct reader {
+	wav::reader file;
+	bool loop = false;
+	// If this is set then the audio thread waits for the reader thread
+	// whenever the ring runs dry, instead of filling in with silence. For
+	// backends which aren't paced by a clock. Set it before start().
+	bool wait_for_data = false;
+	// The device's side of the stream
+	bhas::sample_format format = bhas::sample_format::float32;
+	bhas::buffer_layout layout = bhas::buffer_layout::non_interleaved;
+	uint32_t num_channels = 0;
+	size_t bytes_per_sample = 0;
+	size_t bytes_per_frame = 0;
+	// What the audio thread hands on, holding up to max_frames frames.
+	// buffer is either samples.data() or pointers.data(), depending on
+	// the layout.
+	uint32_t max_frames = 0;
+	std::vector<std::byte> samples;
+	std::vector<const void*> pointers;
+	const void* buffer = nullptr;
+	// Interleaved frames in the device's format. The size is a power of
+	// two so that positions can be masked.
+	std::vector<std::byte> ring;
+	uint64_t ring_frames = 0;
+	alignas(CACHE_LINE_SIZE) std::atomic<uint64_t> read_pos = 0;
+	alignas(CACHE_LINE_SIZE) std::atomic<uint64_t> write_pos = 0;
+	// Set by the reader thread once everything it will ever write is in
+	// the ring, because the file has ended (and isn't looping) or
+	// couldn't be read.
+	std::atomic<bool> finished = false;
+	// Bumped by the reader thread whenever it writes, and by the audio
+	// thread whenever it reads if wait_for_data is set.
+	wait_word data_written;
+	wait_word data_read;
+	std::atomic<bool> stop_requested = false;
+	// How long the reader thread sleeps when the ring is full, if it
+	// isn't woken by the audio thread
+	double poll_interval = 0.0;
+	std::thread thread;
+	// Only touched by whichever thread is filling the ring
+	std::vector<std::byte> file_samples;
+	std::vector<float> file_floats;
+	std::vector<float> device_floats;
+	std::vector<std::byte> device_samples;
+};
+
+// Main thread
+// Opens the file and fills the ring. format, layout and num_channels
+// describe the input device, and max_frames is the most frames the
+// device will ask for at once.
+[[nodiscard]] auto open(const bhas::input_file_config& config, bhas::sample_format format, bhas::buffer_layout layout, bhas::channel_count num_channels, bhas::sample_rate sample_rate, uint32_t max_frames, reader* r, bhas::log* log) -> bool;
+auto start(reader* r) -> void;
+// Stops the reader thread and closes the file.
+auto stop(reader* r) -> void;
+[[nodiscard]] auto lock_memory(const reader& r) -> bool;
+
+// Audio thread
+// Returns frame_count frames of input in the device's format and layout.
+// Anything the ring doesn't have yet is silent and reported as an input
+// underflow, unless the file has ended. If the device asks for more than
+// max_frames then null is returned and an underflow is reported, and the
+// device's own input should be used instead.
+[[nodiscard]] auto read(reader* r, bhas::frame_count frame_count, bhas::xrun_flags* xruns) -> const void*;
+
+} // input_file
+} // bhas
@@ -0,0 +1,303 @@
+#include "bhas_resample.h"
+#include "bhas_cpu.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <numbers>
+#include <numeric>
+
+#if BHAS_CPU_SSE2
+#	include <emmintrin.h>
+#endif
+
+#if BHAS_CPU_DISPATCH
+#	include <immintrin.h>
+#endif
+
+namespace bhas {
+namespace resample {
+
+// The prototype filter is a Kaiser-windowed sinc. A longer filter can
+// have a sharper transition band, so its cutoff can sit closer to the
+// lower of the two Nyquist frequencies, and a bigger beta buys more
+// stopband attenuation (very roughly 6 dB + 9 dB per unit of beta.)
+// Every tap count is a multiple of 16 so that the kernels never need a
+// scalar tail.
+struct Design {
+	uint32_t taps;
+	double beta;
+	// The cutoff as a fraction of the lower Nyquist frequency
+	double cutoff;
+};
+
+[[nodiscard]] static
+auto get_design(bhas::resampler_quality quality) -> Design {
+	switch (quality) {
+		case bhas::resampler_quality::low:    return {16, 6.0, 0.80};
+		case bhas::resampler_quality::medium: return {32, 8.0, 0.88};
+		case bhas::resampler_quality::high:   return {64, 10.0, 0.90};
+	}
+	return {32, 8.0, 0.88};
+}
+
+// The zeroth order modified Bessel function of the first kind
+[[nodiscard]] static
+auto bessel_i0(double x) -> double {
+	auto sum  = 1.0;
+	auto term = 1.0;
+	for (int k = 1; term > sum * 1e-12; k++) {
+		term *= (x / (2.0 * k)) * (x / (2.0 * k));
+		sum  += term;
+	}
+	return sum;
+}
+
+// Produces count output frames, one dot product each, walking the
+// window and phase along by the step. Each instruction set's filter()
+// instantiates it with its own dot().
+template <auto Dot> static BHAS_INLINE_KERNEL
+auto filter(const converter& c, const float* history, float* dst, size_t dst_stride, uint32_t count) -> void {
+	const auto step_whole = c.step / c.num_phases;
+	const auto step_frac  = c.step % c.num_phases;
+	auto position = c.position;
+	auto phase    = c.phase;
+	for (uint32_t n = 0; n < count; n++) {
+		dst[n * dst_stride] = Dot(c.coefficients.data() + size_t(phase) * c.taps, history + position, c.taps);
+		position += step_whole;
+		phase    += step_frac;
+		if (phase >= c.num_phases) {
+			phase -= c.num_phases;
+			position++;
+		}
+	}
+}
+
+namespace scalar {
+
+[[nodiscard]] static
+auto dot(const float* a, const float* b, uint32_t count) -> float {
+	auto sum = 0.0f;
+	for (uint32_t i = 0; i < count; i++) {
+		sum += a[i] * b[i];
+	}
+	return sum;
+}
+
+static
+auto filter(const converter& c, const float* history, float* dst, size_t dst_stride, uint32_t count) -> void {
+	resample::filter<dot>(c, history, dst, dst_stride, count);
+}
+
+} // scalar
+
+#if BHAS_CPU_SSE2
+namespace sse2 {
+
+[[nodiscard]] static
+auto dot(const float* a, const float* b, uint32_t count) -> float {
+	auto s0 = _mm_setzero_ps();
+	auto s1 = _mm_setzero_ps();
+	for (uint32_t i = 0; i < count; i += 8) {
+		s0 = _mm_add_ps(s0, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+		s1 = _mm_add_ps(s1, _mm_mul_ps(_mm_loadu_ps(a + i + 4), _mm_loadu_ps(b + i + 4)));
+	}
+	auto s = _mm_add_ps(s0, s1);
+	s = _mm_add_ps(s, _mm_shuffle_ps(s, s, _MM_SHUFFLE(1, 0, 3, 2)));
+	s = _mm_add_ps(s, _mm_shuffle_ps(s, s, _MM_SHUFFLE(2, 3, 0, 1)));
+	return _mm_cvtss_f32(s);
+}
+
+static
+auto filter(const converter& c, const float* history, float* dst, size_t dst_stride, uint32_t count) -> void {
+	resample::filter<dot>(c, history, dst, dst_stride, count);
+}
+
+} // sse2
+#endif
+
+#if BHAS_CPU_DISPATCH
+namespace avx2 {
+
+[[nodiscard]] static BHAS_TARGET_AVX2
+auto dot(const float* a, const float* b, uint32_t count) -> float {
+	auto s0 = _mm256_setzero_ps();
+	auto s1 = _mm256_setzero_ps();
+	for (uint32_t i = 0; i < count; i += 16) {
+		s0 = _mm256_add_ps(s0, _mm256_mul_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i)));
+		s1 = _mm256_add_ps(s1, _mm256_mul_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8)));
+	}
+	const auto s8 = _mm256_add_ps(s0, s1);
+	auto s = _mm_add_ps(_mm256_castps256_ps128(s8), _mm256_extractf128_ps(s8, 1));
+	s = _mm_add_ps(s, _mm_shuffle_ps(s, s, _MM_SHUFFLE(1, 0, 3, 2)));
+	s = _mm_add_ps(s, _mm_shuffle_ps(s, s, _MM_SHUFFLE(2, 3, 0, 1)));
+	return _mm_cvtss_f32(s);
+}
+
+static BHAS_TARGET_AVX2
+auto filter(const converter& c, const float* history, float* dst, size_t dst_stride, uint32_t count) -> void {
+	resample::filter<dot>(c, history, dst, dst_stride, count);
+}
+
+} // avx2
+
+// See the AVX-512 kernels in bhas_buffer.cpp
+#if defined(__GNUC__) && !defined(__clang__)
+#	pragma GCC diagnostic push
+#	pragma GCC diagnostic ignored "-Wuninitialized"
+#	pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#endif
+namespace avx512 {
+
+[[nodiscard]] static BHAS_TARGET_AVX512
+auto dot(const float* a, const float* b, uint32_t count) -> float {
+	auto s = _mm512_setzero_ps();
+	for (uint32_t i = 0; i < count; i += 16) {
+		s = _mm512_add_ps(s, _mm512_mul_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i)));
+	}
+	return _mm512_reduce_add_ps(s);
+}
+
+static BHAS_TARGET_AVX512
+auto filter(const converter& c, const float* history, float* dst, size_t dst_stride, uint32_t count) -> void {
+	resample::filter<dot>(c, history, dst, dst_stride, count);
+}
+
+} // avx512
+#if defined(__GNUC__) && !defined(__clang__)
+#	pragma GCC diagnostic pop
+#endif
+#endif
+
+struct Kernels {
+	auto (*filter)(const converter& c, const float* history, float* dst, size_t dst_stride, uint32_t count) -> void;
+};
+
+static constexpr Kernels SCALAR = {scalar::filter};
+#if BHAS_CPU_SSE2
+static constexpr Kernels SSE2   = {sse2::filter};
+#endif
+#if BHAS_CPU_DISPATCH
+static constexpr Kernels AVX2   = {avx2::filter};
+static constexpr Kernels AVX512 = {avx512::filter};
+#endif
+
+[[nodiscard]] static
+auto get_kernels() -> const Kernels& {
+	switch (cpu::get_active()) {
+#	if BHAS_CPU_DISPATCH
+		case bhas::instruction_set::avx512: return AVX512;
+		case bhas::instruction_set::avx2:   return AVX2;
+#	endif
+#	if BHAS_CPU_SSE2
+		case bhas::instruction_set::sse2:   return SSE2;
+#	endif
+		default:                            return SCALAR;
+	}
+}
+
+auto is_supported(bhas::sample_rate from, bhas::sample_rate to) -> bool {
+	if (from.value == 0 || to.value == 0) {
+		return false;
+	}
+	const auto g = std::gcd(from.value, to.value);
+	return
+		std::max(from.value, to.value) / g <= MAX_PHASES &&
+		std::max(from.value, to.value) <= std::min(from.value, to.value) * MAX_RATIO;
+}
+
+auto get_taps(bhas::resampler_quality quality) -> uint32_t {
+	return get_design(quality).taps;
+}
+
+auto get_latency(bhas::resampler_quality quality) -> double {
+	return get_taps(quality) / 2.0;
+}
+
+// Each phase is normalised separately so that a constant signal comes
+// out exactly as it went in, rather than with a tiny ripple at the
+// output rate.
+[[nodiscard]] static
+auto make_coefficients(const Design& design, uint32_t num_phases, uint32_t step) -> std::vector<float> {
+	const auto length = size_t(design.taps) * num_phases;
+	const auto center = double(length - 1) / 2.0;
+	const auto cutoff = design.cutoff * 0.5 / double(std::max(num_phases, step));
+	const auto norm   = bessel_i0(design.beta);
+	std::vector<double> h(length);
+	for (size_t i = 0; i < length; i++) {
+		const auto x    = double(i) - center;
+		const auto r    = x / (center + 1.0);
+		const auto sinc = x == 0.0 ? 2.0 * cutoff : std::sin(2.0 * std::numbers::pi * cutoff * x) / (std::numbers::pi * x);
+		h[i] = sinc * bessel_i0(design.beta * std::sqrt(std::max(0.0, 1.0 - r * r))) / norm;
+	}
+	std::vector<float> coefficients(length);
+	for (uint32_t phase = 0; phase < num_phases; phase++) {
+		auto sum = 0.0;
+		for (uint32_t k = 0; k < design.taps; k++) {
+			sum += h[phase + size_t(k) * num_phases];
+		}
+		for (uint32_t k = 0; k < design.taps; k++) {
+			coefficients[size_t(phase) * design.taps + (design.taps - 1 - k)] = static_cast<float>(h[phase + size_t(k) * num_phases] / sum);
+		}
+	}
+	return coefficients;
+}
+
+auto make_converter(bhas::sample_rate from, bhas::sample_rate to, bhas::resampler_quality quality, bhas::channel_count num_channels, uint32_t max_input_frames) -> converter {
+	const auto design = get_design(quality);
+	const auto g      = std::gcd(from.value, to.value);
+	converter c;
+	c.num_channels = num_channels.value;
+	c.taps         = design.taps;
+	c.num_phases   = to.value / g;
+	c.step         = from.value / g;
+	c.coefficients = make_coefficients(design, c.num_phases, c.step);
+	// Whatever is left over after producing output is less than a window
+	// plus one step.
+	c.capacity     = max_input_frames + c.taps + c.step / c.num_phases + 1;
+	c.stride       = (size_t(c.capacity) + 15) & ~size_t(15);
+	c.history.assign(c.stride * c.num_channels, 0.0f);
+	c.fill         = c.taps - 1;
+	return c;
+}
+
+auto get_required_input(const converter& c, uint32_t count) -> uint32_t {
+	if (count == 0) {
+		return 0;
+	}
+	const auto last   = c.position + (uint64_t(c.phase) + uint64_t(count - 1) * c.step) / c.num_phases;
+	const auto needed = last + c.taps;
+	return needed > c.fill ? static_cast<uint32_t>(needed - c.fill) : 0;
+}
+
+auto get_available_output(const converter& c) -> uint32_t {
+	if (c.fill < c.position + c.taps) {
+		return 0;
+	}
+	const auto room = uint64_t(c.fill - c.position - c.taps + 1) * c.num_phases - c.phase;
+	return static_cast<uint32_t>((room + c.step - 1) / c.step);
+}
+
+auto commit(converter* c, uint32_t frames) -> void {
+	c->fill += frames;
+}
+
+auto process(converter* c, float* const* dst, size_t dst_stride, uint32_t count) -> void {
+	const auto filter = get_kernels().filter;
+	for (uint32_t ch = 0; ch < c->num_channels; ch++) {
+		filter(*c, c->history.data() + ch * c->stride, dst[ch], dst_stride, count);
+	}
+	const auto total = uint64_t(c->phase) + uint64_t(count) * c->step;
+	c->position += static_cast<uint32_t>(total / c->num_phases);
+	c->phase     = static_cast<uint32_t>(total % c->num_phases);
+	// Move what's left to the front so that the next input has room
+	const auto left = c->fill - c->position;
+	for (uint32_t ch = 0; ch < c->num_channels; ch++) {
+		const auto plane = c->history.data() + ch * c->stride;
+		std::memmove(plane, plane + c->position, size_t(left) * sizeof(float));
+	}
+	c->fill     = left;
+	c->position = 0;
+}
+
+} // resample
+} // bhas
@@ -0,0 +1,71 @@
+#pragma once
+
+#include "bhas.h"
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Polyphase sample rate conversion.
+// The ratio between the two rates is reduced to num_phases / step, and the
+// signal is conceptually upsampled by num_phases, low-pass filtered and
+// downsampled by step. Only the filter phases which land on an output
+// frame are ever computed, so each output frame costs one dot product of
+// taps coefficients per channel.
+namespace bhas {
+namespace resample {
+
+// A ratio which needs more phases than this can't be resampled. Every
+// pair of common sample rates needs far fewer.
+static constexpr uint32_t MAX_PHASES = 1024;
+// Neither rate can be more than this many times the other, so that one
+// step never skips over a whole window.
+static constexpr uint32_t MAX_RATIO = 8;
+
+struct converter {
+	uint32_t num_channels = 0;
+	uint32_t taps = 0;
+	uint32_t num_phases = 0;
+	uint32_t step = 0;
+	// num_phases sets of taps coefficients, each one reversed so that it
+	// lines up with the history in memory order
+	std::vector<float> coefficients;
+	// One plane per channel, holding the input frames which haven't been
+	// used up yet. Starts off with taps - 1 frames of silence.
+	std::vector<float> history;
+	size_t stride = 0;
+	uint32_t capacity = 0;
+	uint32_t fill = 0;
+	// Where the next output frame's window starts in the history, and which
+	// phase it uses
+	uint32_t position = 0;
+	uint32_t phase = 0;
+};
+
+// Main thread
+[[nodiscard]] auto is_supported(bhas::sample_rate from, bhas::sample_rate to) -> bool;
+[[nodiscard]] auto get_taps(bhas::resampler_quality quality) -> uint32_t;
+// How far the filter delays the signal, in input frames
+[[nodiscard]] auto get_latency(bhas::resampler_quality quality) -> double;
+// max_input_frames is the most frames which will be written between two
+// calls to process().
+[[nodiscard]] auto make_converter(bhas::sample_rate from, bhas::sample_rate to, bhas::resampler_quality quality, bhas::channel_count num_channels, uint32_t max_input_frames) -> converter;
+
+// Audio thread
+// How many more input frames have to be written before count output
+// frames can be produced.
+[[nodiscard]] auto get_required_input(const converter& c, uint32_t count) -> uint32_t;
+// How many output frames can be produced from what has been written.
+[[nodiscard]] auto get_available_output(const converter& c) -> uint32_t;
+// Where to write the next input frames for a channel. Call commit() once
+// every channel has been written.
+[[nodiscard]] inline
+auto get_write_pointer(converter* c, uint32_t channel) -> float* {
+	return c->history.data() + channel * c->stride + c->fill;
+}
+auto commit(converter* c, uint32_t frames) -> void;
+// Produces count output frames, which must be available. Channel ch is
+// written to dst[ch], dst_stride samples apart.
+auto process(converter* c, float* const* dst, size_t dst_stride, uint32_t count) -> void;
+
+} // resample
+} // bhas
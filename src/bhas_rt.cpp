@@ -0,0 +1,527 @@
+#include "bhas_rt.h"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <format>
+#include <fstream>
+#include <map>
+#include <string>
+#include <thread>
+#ifdef __linux__
+#include <pthread.h>
+#include <time.h>
+#endif
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+#	define BHAS_NOINLINE __attribute__((noinline))
+#elif defined(_MSC_VER)
+#	define BHAS_NOINLINE __declspec(noinline)
+#else
+#	define BHAS_NOINLINE
+#endif
+
+namespace bhas {
+namespace rt {
+
+// Written by the audio thread before applied is set, and only read by the
+// main thread after it sees applied.
+struct ThreadResult {
+	thread_setup setup;
+	int policy_error = 0;
+	int affinity_error = 0;
+	bhas::audio_thread_state state;
+#	ifdef __linux__
+	int actual_policy = SCHED_OTHER;
+	cpu_set_t actual_cpus;
+#	endif
+};
+
+// A page-aligned range of locked memory
+struct Region {
+	memory_owner owner;
+	uintptr_t begin;
+	uintptr_t end;
+};
+
+struct Model {
+	ThreadResult thread;
+	std::atomic<bool> thread_applied = false;
+	bool thread_reported = false;
+	std::vector<Region> regions;
+	// How many regions cover each locked page. Regions from the two owners
+	// can share pages, so a page is only unlocked once nothing covers it.
+	std::map<uintptr_t, uint32_t> page_counts;
+};
+
+static Model model;
+
+[[nodiscard]] static
+auto get_policy_name(bhas::thread_policy policy) -> const char* {
+	switch (policy) {
+		case bhas::thread_policy::other:       return "SCHED_OTHER";
+		case bhas::thread_policy::fifo:        return "SCHED_FIFO";
+		case bhas::thread_policy::round_robin: return "SCHED_RR";
+		default:                               return "unknown";
+	}
+}
+
+[[nodiscard]] static
+auto format_cpus(const std::vector<uint32_t>& cpus) -> std::string {
+	std::string out;
+	for (const auto cpu : cpus) {
+		out += out.empty() ? std::format("{}", cpu) : std::format(", {}", cpu);
+	}
+	return out;
+}
+
+[[nodiscard]] static
+auto info_audio_thread_scheduling(bhas::thread_policy policy, int priority) -> bhas::info {
+	return {std::format("The audio thread is now running with {} priority {}.", get_policy_name(policy), priority)};
+}
+
+[[nodiscard]] static
+auto warn_failed_to_set_audio_thread_scheduling(bhas::thread_policy policy, int priority, int error) -> bhas::warning {
+	return {std::format("Failed to give the audio thread {} priority {}. ({}) Real-time scheduling needs CAP_SYS_NICE or a high enough rtprio limit.", get_policy_name(policy), priority, std::strerror(error))};
+}
+
+[[nodiscard]] static
+auto info_audio_thread_affinity(const std::vector<uint32_t>& cpus) -> bhas::info {
+	return {std::format("The audio thread is now running on CPUs {}.", format_cpus(cpus))};
+}
+
+[[nodiscard]] static
+auto warn_failed_to_set_audio_thread_affinity(int error) -> bhas::warning {
+	return {std::format("Failed to set the audio thread's CPU affinity. ({})", std::strerror(error))};
+}
+
+[[nodiscard]] static
+auto warn_no_cpu_shares_cache(uint32_t cpu) -> bhas::warning {
+	return {std::format("Couldn't find another CPU sharing a cache with CPU {} so the audio thread will be pinned to CPU {} itself.", cpu, cpu)};
+}
+
+#ifdef __linux__
+
+[[nodiscard]] static
+auto to_linux(bhas::thread_policy policy) -> int {
+	switch (policy) {
+		case bhas::thread_policy::fifo:        return SCHED_FIFO;
+		case bhas::thread_policy::round_robin: return SCHED_RR;
+		default:                               return SCHED_OTHER;
+	}
+}
+
+[[nodiscard]] static
+auto from_linux(int policy) -> bhas::thread_policy {
+	switch (policy) {
+		case SCHED_FIFO: return bhas::thread_policy::fifo;
+		case SCHED_RR:   return bhas::thread_policy::round_robin;
+		default:         return bhas::thread_policy::other;
+	}
+}
+
+[[nodiscard]] static
+auto to_vector(const cpu_set_t& set) -> std::vector<uint32_t> {
+	std::vector<uint32_t> cpus;
+	for (uint32_t cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+		if (CPU_ISSET(cpu, &set)) {
+			cpus.push_back(cpu);
+		}
+	}
+	return cpus;
+}
+
+// Parses a sysfs cpu list like "0-3,8-11"
+[[nodiscard]] static
+auto parse_cpu_list(const std::string& list) -> std::vector<uint32_t> {
+	std::vector<uint32_t> cpus;
+	size_t pos = 0;
+	while (pos < list.size()) {
+		auto end = list.find(',', pos);
+		if (end == std::string::npos) {
+			end = list.size();
+		}
+		const auto range = list.substr(pos, end - pos);
+		const auto dash  = range.find('-');
+		try {
+			const auto first = static_cast<uint32_t>(std::stoul(range.substr(0, dash)));
+			const auto last  = dash == std::string::npos ? first : static_cast<uint32_t>(std::stoul(range.substr(dash + 1)));
+			for (auto cpu = first; cpu <= last; cpu++) {
+				cpus.push_back(cpu);
+			}
+		}
+		catch (const std::logic_error&) {}
+		pos = end + 1;
+	}
+	return cpus;
+}
+
+[[nodiscard]] static
+auto read_line(const std::string& path) -> std::optional<std::string> {
+	std::ifstream file{path};
+	std::string line;
+	if (!std::getline(file, line)) {
+		return std::nullopt;
+	}
+	return line;
+}
+
+// The CPUs sharing the first and the last level caches with the given
+// one, according to sysfs.
+[[nodiscard]] static
+auto find_cache_siblings(uint32_t cpu) -> std::pair<std::vector<uint32_t>, std::vector<uint32_t>> {
+	std::vector<uint32_t> first_level;
+	std::vector<uint32_t> last_level;
+	int lowest_level  = 1000;
+	int highest_level = 0;
+	for (int index = 0;; index++) {
+		const auto dir   = std::format("/sys/devices/system/cpu/cpu{}/cache/index{}/", cpu, index);
+		const auto level = read_line(dir + "level");
+		const auto list  = read_line(dir + "shared_cpu_list");
+		if (!level || !list) {
+			break;
+		}
+		const auto level_number = std::atoi(level->c_str());
+		if (level_number < lowest_level) {
+			lowest_level = level_number;
+			first_level  = parse_cpu_list(*list);
+		}
+		if (level_number > highest_level) {
+			highest_level = level_number;
+			last_level    = parse_cpu_list(*list);
+		}
+	}
+	return {first_level, last_level};
+}
+
+// Prefers a CPU on the same last level cache which isn't a hyperthread
+// sibling, since those compete for the same execution units.
+[[nodiscard]] static
+auto find_cpu_sharing_cache(uint32_t cpu, bhas::log* log) -> uint32_t {
+	const auto [first_level, last_level] = find_cache_siblings(cpu);
+	const auto contains = [](const std::vector<uint32_t>& cpus, uint32_t cpu) {
+		return std::find(cpus.begin(), cpus.end(), cpu) != cpus.end();
+	};
+	for (const auto candidate : last_level) {
+		if (candidate != cpu && !contains(first_level, candidate)) {
+			return candidate;
+		}
+	}
+	for (const auto candidate : last_level) {
+		if (candidate != cpu) {
+			return candidate;
+		}
+	}
+	log->push_back(warn_no_cpu_shares_cache(cpu));
+	return cpu;
+}
+
+auto make_thread_setup(const bhas::audio_thread_config& config, bhas::log* log) -> thread_setup {
+	thread_setup setup;
+	CPU_ZERO(&setup.cpus);
+	if (config.policy) {
+		setup.set_policy = true;
+		setup.policy     = *config.policy;
+		setup.priority   = config.priority;
+	}
+	if (config.share_cache_with_cpu) {
+		setup.set_affinity = true;
+		CPU_SET(find_cpu_sharing_cache(*config.share_cache_with_cpu, log), &setup.cpus);
+	}
+	else if (!config.cpus.empty()) {
+		setup.set_affinity = true;
+		for (const auto cpu : config.cpus) {
+			if (cpu < CPU_SETSIZE) {
+				CPU_SET(cpu, &setup.cpus);
+			}
+		}
+	}
+	return setup;
+}
+
+auto apply_audio_thread_setup(const thread_setup& setup) -> void {
+	auto& result      = model.thread;
+	const auto thread = pthread_self();
+	result.setup      = setup;
+	if (setup.set_policy) {
+		sched_param param = {};
+		param.sched_priority = setup.priority;
+		result.policy_error = pthread_setschedparam(thread, to_linux(setup.policy), &param);
+	}
+	if (setup.set_affinity) {
+		result.affinity_error = pthread_setaffinity_np(thread, sizeof(cpu_set_t), &setup.cpus);
+	}
+	sched_param param = {};
+	if (pthread_getschedparam(thread, &result.actual_policy, &param) == 0) {
+		result.state.priority = param.sched_priority;
+	}
+	CPU_ZERO(&result.actual_cpus);
+	pthread_getaffinity_np(thread, sizeof(cpu_set_t), &result.actual_cpus);
+	if (setup.prefault_stack) {
+		prefault_stack();
+	}
+	model.thread_applied.store(true, std::memory_order_release);
+}
+
+auto apply_worker_thread_setup(const thread_setup& setup) -> void {
+	if (setup.set_policy) {
+		sched_param param = {};
+		param.sched_priority = setup.priority;
+		pthread_setschedparam(pthread_self(), to_linux(setup.policy), &param);
+	}
+	if (setup.prefault_stack) {
+		prefault_stack();
+	}
+}
+
+auto get_audio_thread_state() -> std::optional<bhas::audio_thread_state> {
+	if (!model.thread_applied.load(std::memory_order_acquire)) {
+		return std::nullopt;
+	}
+	auto state   = model.thread.state;
+	state.policy = from_linux(model.thread.actual_policy);
+	state.cpus   = to_vector(model.thread.actual_cpus);
+	return state;
+}
+
+auto take_audio_thread_report() -> bhas::log {
+	bhas::log log;
+	if (model.thread_reported || !model.thread_applied.load(std::memory_order_acquire)) {
+		return log;
+	}
+	model.thread_reported = true;
+	const auto& result = model.thread;
+	const auto state   = *get_audio_thread_state();
+	if (result.setup.set_policy) {
+		if (result.policy_error == 0) {
+			log.push_back(info_audio_thread_scheduling(state.policy, state.priority));
+		}
+		else {
+			log.push_back(warn_failed_to_set_audio_thread_scheduling(result.setup.policy, result.setup.priority, result.policy_error));
+		}
+	}
+	if (result.setup.set_affinity) {
+		if (result.affinity_error == 0) {
+			log.push_back(info_audio_thread_affinity(state.cpus));
+		}
+		else {
+			log.push_back(warn_failed_to_set_audio_thread_affinity(result.affinity_error));
+		}
+	}
+	return log;
+}
+
+#else
+
+[[nodiscard]] static
+auto warn_audio_thread_config_not_supported() -> bhas::warning {
+	return {"Audio thread scheduling and CPU affinity are only supported on Linux. The audio thread config will be ignored."};
+}
+
+[[nodiscard]] static
+auto is_empty(const bhas::audio_thread_config& config) -> bool {
+	return !config.policy && config.cpus.empty() && !config.share_cache_with_cpu;
+}
+
+auto make_thread_setup(const bhas::audio_thread_config& config, bhas::log* log) -> thread_setup {
+	if (!is_empty(config)) {
+		log->push_back(warn_audio_thread_config_not_supported());
+	}
+	return {};
+}
+
+auto apply_audio_thread_setup(const thread_setup& setup) -> void {
+	if (setup.prefault_stack) {
+		prefault_stack();
+	}
+	model.thread_applied.store(true, std::memory_order_release);
+}
+
+auto apply_worker_thread_setup(const thread_setup& setup) -> void {
+	if (setup.prefault_stack) {
+		prefault_stack();
+	}
+}
+
+auto get_audio_thread_state() -> std::optional<bhas::audio_thread_state> {
+	if (!model.thread_applied.load(std::memory_order_acquire)) {
+		return std::nullopt;
+	}
+	return model.thread.state;
+}
+
+auto take_audio_thread_report() -> bhas::log {
+	return {};
+}
+
+#endif
+
+[[nodiscard]] static
+auto get_page_size() -> size_t {
+#	ifdef _WIN32
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return info.dwPageSize;
+#	else
+	return static_cast<size_t>(sysconf(_SC_PAGESIZE));
+#	endif
+}
+
+[[nodiscard]] static
+auto os_lock(uintptr_t begin, uintptr_t end) -> bool {
+#	ifdef _WIN32
+	return VirtualLock(reinterpret_cast<void*>(begin), end - begin) != 0;
+#	else
+	return mlock(reinterpret_cast<void*>(begin), end - begin) == 0;
+#	endif
+}
+
+static
+auto os_unlock(uintptr_t begin, uintptr_t end) -> void {
+#	ifdef _WIN32
+	VirtualUnlock(reinterpret_cast<void*>(begin), end - begin);
+#	else
+	munlock(reinterpret_cast<void*>(begin), end - begin);
+#	endif
+}
+
+[[nodiscard]] static
+auto make_region(memory_owner owner, const void* ptr, size_t size) -> Region {
+	const auto page_size = get_page_size();
+	const auto address   = reinterpret_cast<uintptr_t>(ptr);
+	return {owner, address / page_size * page_size, (address + size + page_size - 1) / page_size * page_size};
+}
+
+[[nodiscard]] static
+auto info_locked_everything() -> bhas::info {
+	return {"All of the process's memory is locked, now and in the future."};
+}
+
+[[nodiscard]] static
+auto warn_failed_to_lock_everything(const char* reason) -> bhas::warning {
+	return {std::format("Failed to lock all of the process's memory. ({})", reason)};
+}
+
+auto get_locked_memory() -> bhas::byte_count {
+	return {model.page_counts.size() * get_page_size()};
+}
+
+auto lock_everything(bhas::log* log) -> bool {
+#	ifdef _WIN32
+	log->push_back(warn_failed_to_lock_everything("not supported on Windows"));
+	return false;
+#	else
+	if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0) {
+		log->push_back(warn_failed_to_lock_everything(std::strerror(errno)));
+		return false;
+	}
+	log->push_back(info_locked_everything());
+	return true;
+#	endif
+}
+
+auto lock_memory(memory_owner owner, const void* ptr, size_t size) -> bool {
+	if (!ptr || size == 0) {
+		return true;
+	}
+	const auto region = make_region(owner, ptr, size);
+	if (!os_lock(region.begin, region.end)) {
+		return false;
+	}
+	// Locking normally faults the pages in anyway but touching them makes
+	// sure of it.
+	const auto page_size = get_page_size();
+	for (auto page = region.begin; page < region.end; page += page_size) {
+		static_cast<void>(*reinterpret_cast<const volatile std::byte*>(page));
+		model.page_counts[page]++;
+	}
+	model.regions.push_back(region);
+	return true;
+}
+
+// Unlocks whichever of the region's pages no other region covers, a run
+// of them at a time.
+static
+auto release_region(const Region& region) -> void {
+	const auto page_size = get_page_size();
+	auto run_begin = region.begin;
+	for (auto page = region.begin; page < region.end; page += page_size) {
+		const auto pos = model.page_counts.find(page);
+		if (pos != model.page_counts.end() && --pos->second == 0) {
+			model.page_counts.erase(pos);
+			continue;
+		}
+		if (run_begin < page) {
+			os_unlock(run_begin, page);
+		}
+		run_begin = page + page_size;
+	}
+	if (run_begin < region.end) {
+		os_unlock(run_begin, region.end);
+	}
+}
+
+auto unlock_memory(memory_owner owner, const void* ptr, size_t size) -> void {
+	if (!ptr || size == 0) {
+		return;
+	}
+	const auto region = make_region(owner, ptr, size);
+	const auto pos    = std::find_if(model.regions.begin(), model.regions.end(), [region](const Region& r) {
+		return r.owner == region.owner && r.begin == region.begin && r.end == region.end;
+	});
+	if (pos == model.regions.end()) {
+		return;
+	}
+	release_region(*pos);
+	model.regions.erase(pos);
+}
+
+auto unlock_all_memory(memory_owner owner) -> void {
+	std::erase_if(model.regions, [owner](const Region& region) {
+		if (region.owner != owner) {
+			return false;
+		}
+		release_region(region);
+		return true;
+	});
+}
+
+// Kept out of line so that the array really is on the stack below the
+// caller. The audio thread setup calls it from this same file, so without
+// the attribute the compiler would be free to inline it.
+BHAS_NOINLINE
+auto prefault_stack() -> void {
+	volatile std::byte stack[STACK_PREFAULT_SIZE];
+	for (size_t i = 0; i < STACK_PREFAULT_SIZE; i += 1024) {
+		stack[i] = std::byte{0};
+	}
+	static_cast<void>(stack[0]);
+}
+
+auto sleep_until(std::chrono::steady_clock::time_point deadline) -> void {
+#	ifdef __linux__
+	const auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(deadline.time_since_epoch()).count();
+	timespec ts;
+	ts.tv_sec  = static_cast<time_t>(ns / 1'000'000'000);
+	ts.tv_nsec = static_cast<long>(ns % 1'000'000'000);
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, nullptr) == EINTR) {}
+#	else
+	std::this_thread::sleep_until(deadline);
+#	endif
+}
+
+auto reset_audio_thread_state() -> void {
+	model.thread_applied.store(false, std::memory_order_relaxed);
+	model.thread_reported = false;
+	model.thread = {};
+}
+
+} // rt
+} // bhas
@@ -0,0 +1,73 @@
+#pragma once
+
+#include "bhas.h"
+#include <chrono>
+#include <cstddef>
+#include <optional>
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+// Making the audio thread behave like a real-time thread. Everything here
+// is worked out on the main thread when the stream is opened, so that the
+// audio thread only has to make the system calls.
+namespace bhas {
+namespace rt {
+
+struct thread_setup {
+	bool set_policy = false;
+	bool set_affinity = false;
+	bhas::thread_policy policy = bhas::thread_policy::other;
+	int priority = 0;
+#	ifdef __linux__
+	cpu_set_t cpus;
+#	endif
+	bool prefault_stack = false;
+};
+
+// How much of the audio thread's stack is touched on its first callback
+static constexpr size_t STACK_PREFAULT_SIZE = 128 * 1024;
+
+enum class memory_owner { engine, user };
+
+// Main thread
+[[nodiscard]] auto get_locked_memory() -> bhas::byte_count;
+auto lock_everything(bhas::log* log) -> bool;
+// Locks the pages covering the region and touches every one of them.
+[[nodiscard]] auto lock_memory(memory_owner owner, const void* ptr, size_t size) -> bool;
+auto unlock_memory(memory_owner owner, const void* ptr, size_t size) -> void;
+auto unlock_all_memory(memory_owner owner) -> void;
+[[nodiscard]] auto get_audio_thread_state() -> std::optional<bhas::audio_thread_state>;
+[[nodiscard]] auto make_thread_setup(const bhas::audio_thread_config& config, bhas::log* log) -> thread_setup;
+// Reports the results of apply_audio_thread_setup() once they're in.
+[[nodiscard]] auto take_audio_thread_report() -> bhas::log;
+// Only while no stream is running
+auto reset_audio_thread_state() -> void;
+
+// Audio thread
+auto apply_audio_thread_setup(const thread_setup& setup) -> void;
+// For the worker threads. Only the scheduling policy is applied, so that
+// the workers aren't pinned to the audio thread's CPUs.
+auto apply_worker_thread_setup(const thread_setup& setup) -> void;
+auto prefault_stack() -> void;
+// Sleeps until the deadline, however many signals arrive in between.
+// steady_clock is CLOCK_MONOTONIC on Linux, which is what the timer
+// sleeps on.
+auto sleep_until(std::chrono::steady_clock::time_point deadline) -> void;
+
+// Real-time safety checks (the BHAS_RT_CHECKS build option.) While the
+// calling thread is between enter and leave, any allocation, mutex lock or
+// blocking system call is recorded along with a backtrace.
+#if BHAS_RT_CHECKS
+auto enter_audio_callback() -> void;
+auto leave_audio_callback() -> void;
+// Main thread. Appends an error for every violation recorded so far.
+auto take_violation_report(bhas::log* log) -> void;
+#else
+inline auto enter_audio_callback() -> void {}
+inline auto leave_audio_callback() -> void {}
+inline auto take_violation_report(bhas::log*) -> void {}
+#endif
+
+} // rt
+} // bhas
@@ -0,0 +1,369 @@
+// Real-time safety checker. Only built when BHAS_RT_CHECKS is defined
+// (the BHAS_RT_CHECKS CMake option.)
+//
+// Interposes the C library's allocation functions, mutex locking and a
+// handful of blocking system call wrappers. If one of them is called while
+// a thread is inside a callback, a backtrace is captured and pushed onto
+// a lock-free ring belonging to that thread, and the main thread drains
+// every ring into the report callback during update().
+#include "bhas_rt.h"
+
+#if BHAS_RT_CHECKS
+
+#ifndef __GLIBC__
+#error "BHAS_RT_CHECKS is only supported with glibc"
+#endif
+
+#include "bhas_spsc.h"
+#include <array>
+#include <atomic>
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <dlfcn.h>
+#include <execinfo.h>
+#include <fcntl.h>
+#include <format>
+#include <new>
+#include <pthread.h>
+#include <semaphore.h>
+#include <time.h>
+#include <unistd.h>
+
+extern "C" {
+auto __libc_malloc(size_t size) -> void*;
+auto __libc_calloc(size_t count, size_t size) -> void*;
+auto __libc_realloc(void* ptr, size_t size) -> void*;
+auto __libc_memalign(size_t alignment, size_t size) -> void*;
+auto __libc_free(void* ptr) -> void;
+}
+
+namespace bhas {
+namespace rt {
+
+// The audio thread, the render-ahead thread and every worker can all be
+// inside a callback at once
+static constexpr size_t MAX_CHECKED_THREADS  = bhas::MAX_WORKER_THREADS.value + 2;
+// Per thread
+static constexpr size_t VIOLATION_QUEUE_SIZE = 16;
+static constexpr int MAX_BACKTRACE_DEPTH     = 24;
+
+struct violation {
+	const char* function;
+	int depth;
+	void* frames[MAX_BACKTRACE_DEPTH];
+};
+
+// Resolved the first time any of them is needed. The allocation functions
+// go straight to glibc's internal entry points instead, because dlsym()
+// itself allocates.
+struct RealFunctions {
+	decltype(&::write) write;
+	decltype(&::read) read;
+	decltype(&::open) open;
+	decltype(&::close) close;
+	decltype(&::fsync) fsync;
+	decltype(&::fwrite) fwrite;
+	decltype(&::fflush) fflush;
+	decltype(&::nanosleep) nanosleep;
+	decltype(&::usleep) usleep;
+	decltype(&::sleep) sleep;
+	decltype(&::sem_wait) sem_wait;
+	decltype(&::pthread_mutex_lock) pthread_mutex_lock;
+	decltype(&::pthread_cond_wait) pthread_cond_wait;
+	decltype(&::pthread_cond_timedwait) pthread_cond_timedwait;
+};
+
+// A ring only takes one producer, so each thread claims a queue of its
+// own when it enters a callback and hands it back when it leaves. Whoever
+// claims it next carries on where the last thread left off, which is safe
+// because the claim acquires what the hand-back released.
+struct ViolationQueue {
+	std::atomic<bool> claimed = false;
+	spsc_ring<violation, VIOLATION_QUEUE_SIZE> violations;
+};
+
+struct CheckModel {
+	std::array<ViolationQueue, MAX_CHECKED_THREADS> queues;
+	// Violations which didn't fit, or which were made by a thread that
+	// couldn't get a queue
+	std::atomic<uint64_t> overflow_count = 0;
+	RealFunctions real = {};
+	std::atomic<bool> resolved = false;
+};
+
+static CheckModel check_model;
+
+// initial-exec so that touching these never allocates
+[[gnu::tls_model("initial-exec")]] static thread_local bool in_audio_callback = false;
+[[gnu::tls_model("initial-exec")]] static thread_local bool recording = false;
+[[gnu::tls_model("initial-exec")]] static thread_local ViolationQueue* queue = nullptr;
+
+template <typename Fn> static
+auto resolve(Fn* fn, const char* name) -> void {
+	*fn = reinterpret_cast<Fn>(dlsym(RTLD_NEXT, name));
+}
+
+static
+auto resolve_real_functions() -> void {
+	auto& real = check_model.real;
+	resolve(&real.write, "write");
+	resolve(&real.read, "read");
+	resolve(&real.open, "open");
+	resolve(&real.close, "close");
+	resolve(&real.fsync, "fsync");
+	resolve(&real.fwrite, "fwrite");
+	resolve(&real.fflush, "fflush");
+	resolve(&real.nanosleep, "nanosleep");
+	resolve(&real.usleep, "usleep");
+	resolve(&real.sleep, "sleep");
+	resolve(&real.sem_wait, "sem_wait");
+	resolve(&real.pthread_mutex_lock, "pthread_mutex_lock");
+	resolve(&real.pthread_cond_wait, "pthread_cond_wait");
+	resolve(&real.pthread_cond_timedwait, "pthread_cond_timedwait");
+	check_model.resolved.store(true, std::memory_order_release);
+}
+
+[[nodiscard]] static
+auto get_real() -> const RealFunctions& {
+	if (!check_model.resolved.load(std::memory_order_acquire)) {
+		resolve_real_functions();
+	}
+	return check_model.real;
+}
+
+// The first call to backtrace() loads libgcc, which allocates, so get that
+// out of the way before any audio thread exists.
+static const auto warm_up = [] {
+	void* frames[1];
+	resolve_real_functions();
+	return backtrace(frames, 1);
+}();
+
+static
+auto check(const char* function) -> void {
+	if (!in_audio_callback || recording) {
+		return;
+	}
+	recording = true;
+	violation v;
+	v.function = function;
+	v.depth    = backtrace(v.frames, MAX_BACKTRACE_DEPTH);
+	if (!queue || !queue->violations.push(v)) {
+		check_model.overflow_count.fetch_add(1, std::memory_order_relaxed);
+	}
+	recording = false;
+}
+
+auto enter_audio_callback() -> void {
+	for (auto& q : check_model.queues) {
+		auto expected = false;
+		if (q.claimed.compare_exchange_strong(expected, true, std::memory_order_acquire, std::memory_order_relaxed)) {
+			queue = &q;
+			break;
+		}
+	}
+	in_audio_callback = true;
+}
+
+auto leave_audio_callback() -> void {
+	in_audio_callback = false;
+	if (queue) {
+		queue->claimed.store(false, std::memory_order_release);
+		queue = nullptr;
+	}
+}
+
+[[nodiscard]] static
+auto err_realtime_violation(const violation& v) -> bhas::error {
+	auto text = std::format("Real-time safety violation: {} was called in the audio thread.", v.function);
+	// Skip check() and the interposer itself
+	static constexpr int SKIP_FRAMES = 2;
+	const auto symbols = backtrace_symbols(v.frames, v.depth);
+	for (int i = SKIP_FRAMES; i < v.depth; i++) {
+		text += std::format("\n  {}", symbols ? symbols[i] : "?");
+	}
+	std::free(symbols);
+	return {std::move(text)};
+}
+
+[[nodiscard]] static
+auto err_realtime_violations_dropped(uint64_t count) -> bhas::error {
+	return {std::format("{} more real-time safety violations were dropped because their thread's queue was full.", count)};
+}
+
+auto take_violation_report(bhas::log* log) -> void {
+	for (auto& q : check_model.queues) {
+		q.violations.drain([log](const violation& v) {
+			log->push_back(err_realtime_violation(v));
+		});
+	}
+	if (const auto dropped = check_model.overflow_count.exchange(0, std::memory_order_relaxed); dropped > 0) {
+		log->push_back(err_realtime_violations_dropped(dropped));
+	}
+}
+
+} // rt
+} // bhas
+
+using bhas::rt::check;
+using bhas::rt::get_real;
+
+extern "C" {
+
+auto malloc(size_t size) noexcept -> void* {
+	check("malloc");
+	return __libc_malloc(size);
+}
+
+auto calloc(size_t count, size_t size) noexcept -> void* {
+	check("calloc");
+	return __libc_calloc(count, size);
+}
+
+auto realloc(void* ptr, size_t size) noexcept -> void* {
+	check("realloc");
+	return __libc_realloc(ptr, size);
+}
+
+auto free(void* ptr) noexcept -> void {
+	if (ptr) {
+		check("free");
+	}
+	__libc_free(ptr);
+}
+
+auto aligned_alloc(size_t alignment, size_t size) noexcept -> void* {
+	check("aligned_alloc");
+	return __libc_memalign(alignment, size);
+}
+
+auto posix_memalign(void** ptr, size_t alignment, size_t size) noexcept -> int {
+	check("posix_memalign");
+	*ptr = __libc_memalign(alignment, size);
+	return *ptr ? 0 : ENOMEM;
+}
+
+auto write(int fd, const void* buffer, size_t count) -> ssize_t {
+	check("write");
+	return get_real().write(fd, buffer, count);
+}
+
+auto read(int fd, void* buffer, size_t count) -> ssize_t {
+	check("read");
+	return get_real().read(fd, buffer, count);
+}
+
+auto open(const char* path, int flags, ...) -> int {
+	check("open");
+	mode_t mode = 0;
+	if (flags & (O_CREAT | O_TMPFILE)) {
+		va_list args;
+		va_start(args, flags);
+		mode = va_arg(args, mode_t);
+		va_end(args);
+	}
+	return get_real().open(path, flags, mode);
+}
+
+auto close(int fd) -> int {
+	check("close");
+	return get_real().close(fd);
+}
+
+auto fsync(int fd) -> int {
+	check("fsync");
+	return get_real().fsync(fd);
+}
+
+auto fwrite(const void* buffer, size_t size, size_t count, FILE* file) -> size_t {
+	check("fwrite");
+	return get_real().fwrite(buffer, size, count, file);
+}
+
+auto fflush(FILE* file) -> int {
+	check("fflush");
+	return get_real().fflush(file);
+}
+
+auto nanosleep(const timespec* duration, timespec* remaining) -> int {
+	check("nanosleep");
+	return get_real().nanosleep(duration, remaining);
+}
+
+auto usleep(useconds_t usec) -> int {
+	check("usleep");
+	return get_real().usleep(usec);
+}
+
+auto sleep(unsigned int seconds) -> unsigned int {
+	check("sleep");
+	return get_real().sleep(seconds);
+}
+
+auto sem_wait(sem_t* sem) -> int {
+	check("sem_wait");
+	return get_real().sem_wait(sem);
+}
+
+auto pthread_mutex_lock(pthread_mutex_t* mutex) noexcept -> int {
+	check("pthread_mutex_lock");
+	return get_real().pthread_mutex_lock(mutex);
+}
+
+auto pthread_cond_wait(pthread_cond_t* cond, pthread_mutex_t* mutex) -> int {
+	check("pthread_cond_wait");
+	return get_real().pthread_cond_wait(cond, mutex);
+}
+
+auto pthread_cond_timedwait(pthread_cond_t* cond, pthread_mutex_t* mutex, const timespec* time) -> int {
+	check("pthread_cond_timedwait");
+	return get_real().pthread_cond_timedwait(cond, mutex, time);
+}
+
+} // extern "C"
+
+// operator new and delete are replaced too so that they are caught even
+// if the standard library's versions don't go through malloc.
+auto operator new(size_t size) -> void* {
+	check("operator new");
+	if (const auto ptr = __libc_malloc(size ? size : 1)) {
+		return ptr;
+	}
+	throw std::bad_alloc{};
+}
+
+auto operator new[](size_t size) -> void* {
+	check("operator new[]");
+	if (const auto ptr = __libc_malloc(size ? size : 1)) {
+		return ptr;
+	}
+	throw std::bad_alloc{};
+}
+
+auto operator new(size_t size, std::align_val_t alignment) -> void* {
+	check("operator new");
+	if (const auto ptr = __libc_memalign(static_cast<size_t>(alignment), size ? size : 1)) {
+		return ptr;
+	}
+	throw std::bad_alloc{};
+}
+
+auto operator new[](size_t size, std::align_val_t alignment) -> void* {
+	check("operator new[]");
+	if (const auto ptr = __libc_memalign(static_cast<size_t>(alignment), size ? size : 1)) {
+		return ptr;
+	}
+	throw std::bad_alloc{};
+}
+
+auto operator delete(void* ptr) noexcept -> void                                     { if (ptr) { check("operator delete"); } __libc_free(ptr); }
+auto operator delete[](void* ptr) noexcept -> void                                   { if (ptr) { check("operator delete[]"); } __libc_free(ptr); }
+auto operator delete(void* ptr, size_t) noexcept -> void                             { if (ptr) { check("operator delete"); } __libc_free(ptr); }
+auto operator delete[](void* ptr, size_t) noexcept -> void                           { if (ptr) { check("operator delete[]"); } __libc_free(ptr); }
+auto operator delete(void* ptr, std::align_val_t) noexcept -> void                   { if (ptr) { check("operator delete"); } __libc_free(ptr); }
+auto operator delete[](void* ptr, std::align_val_t) noexcept -> void                 { if (ptr) { check("operator delete[]"); } __libc_free(ptr); }
+auto operator delete(void* ptr, size_t, std::align_val_t) noexcept -> void           { if (ptr) { check("operator delete"); } __libc_free(ptr); }
+auto operator delete[](void* ptr, size_t, std::align_val_t) noexcept -> void         { if (ptr) { check("operator delete[]"); } __libc_free(ptr); }
+
+#endif // BHAS_RT_CHECKS
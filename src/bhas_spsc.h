@@ -0,0 +1,76 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <type_traits>
+
+namespace bhas {
+
+// std::hardware_destructive_interference_size isn't reliably available
+static constexpr size_t CACHE_LINE_SIZE = 64;
+
+// Bounded, wait-free, single-producer single-consumer ring buffer.
+// push() must only ever be called from one thread and pop() from one
+// other thread. Neither of them will ever block or allocate.
+template <typename T, size_t Size>
+struct spsc_ring {
+	static_assert(Size > 0 && (Size & (Size - 1)) == 0, "Size must be a power of two");
+	static_assert(std::is_trivially_copyable_v<T>, "T must be trivially copyable");
+	static constexpr auto MASK = Size - 1;
+	// Producer thread only.
+	// Returns false if the ring is full.
+	[[nodiscard]] auto push(const T& item) -> bool {
+		const auto pos = write_pos.load(std::memory_order_relaxed);
+		if (pos - cached_read_pos == Size) {
+			cached_read_pos = read_pos.load(std::memory_order_acquire);
+			if (pos - cached_read_pos == Size) {
+				return false;
+			}
+		}
+		slots[pos & MASK] = item;
+		write_pos.store(pos + 1, std::memory_order_release);
+		return true;
+	}
+	// Consumer thread only.
+	// Returns false if the ring is empty.
+	[[nodiscard]] auto pop(T* item) -> bool {
+		const auto pos = read_pos.load(std::memory_order_relaxed);
+		if (pos == cached_write_pos) {
+			cached_write_pos = write_pos.load(std::memory_order_acquire);
+			if (pos == cached_write_pos) {
+				return false;
+			}
+		}
+		*item = slots[pos & MASK];
+		read_pos.store(pos + 1, std::memory_order_release);
+		return true;
+	}
+	// Consumer thread only. Calls fn(item) for everything currently in the ring.
+	template <typename Fn>
+	auto drain(Fn&& fn) -> void {
+		const auto end = write_pos.load(std::memory_order_acquire);
+		auto pos       = read_pos.load(std::memory_order_relaxed);
+		if (pos == end) {
+			return;
+		}
+		for (; pos != end; pos++) {
+			fn(slots[pos & MASK]);
+		}
+		cached_write_pos = end;
+		read_pos.store(end, std::memory_order_release);
+	}
+	// Safe to call from either thread but only a snapshot.
+	[[nodiscard]] auto size() const -> size_t {
+		const auto read = read_pos.load(std::memory_order_acquire);
+		return write_pos.load(std::memory_order_acquire) - read;
+	}
+private:
+	alignas(CACHE_LINE_SIZE) std::atomic<size_t> read_pos = 0;
+	size_t cached_write_pos = 0;
+	alignas(CACHE_LINE_SIZE) std::atomic<size_t> write_pos = 0;
+	size_t cached_read_pos = 0;
+	alignas(CACHE_LINE_SIZE) std::array<T, Size> slots = {};
+};
+
+} // bhas
@@ -1,7 +1,29 @@
 #define DOCTEST_CONFIG_IMPLEMENT_WITH_MAIN
 #include "bhas.h"
+#include "bhas_buffer.h"
+#include "bhas_convert.h"
+#include "bhas_engine.h"
+#include "bhas_resample.h"
+#include "bhas_rt.h"
+#include "bhas_wav.h"
+#include "bhas_workers.h"
 #include "doctest.h"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cmath>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <numeric>
 #include <thread>
+#include <utility>
+#ifdef __linux__
+#include <sched.h>
+#include <sys/resource.h>
+#endif
 
 static constexpr auto NUM_OUTPUT_CHANNELS  = 2;
 static constexpr auto START_STREAM_TIMEOUT = std::chrono::seconds(5);
@@ -22,11 +44,7 @@ auto default_report(bhas::log log) -> void {
 
 auto make_default_audio_cb() -> bhas::audio_cb {
 	return [](bhas::input_buffer input, bhas::output_buffer output, bhas::frame_count frame_count, bhas::sample_rate sample_rate, bhas::output_latency output_latency, const bhas::time_info* time_info) -> bhas::callback_result {
-		for (uint32_t i = 0; i < frame_count.value; ++i) {
-			for (auto j = 0; j < NUM_OUTPUT_CHANNELS; ++j) {
-				output.buffer[j][i] = 0.0f;
-			}
-		}
+		bhas::buffer::zero(output, {NUM_OUTPUT_CHANNELS}, frame_count);
 		return bhas::callback_result::complete;
 	};
 }
@@ -82,35 +100,131 @@ auto try_to_stop_stream(Tracking* tracking) -> bool {
 	}
 }
 
-TEST_CASE("start and stop the system default audio stream") {
-	Tracking tracking;
+auto wait_for_audio_callback(const std::atomic<int>& call_count) -> bool {
+	const auto start_time = std::chrono::system_clock::now();
+	while (call_count == 0) {
+		if (std::chrono::system_clock::now() - start_time > START_STREAM_TIMEOUT) {
+			return false;
+		}
+		std::this_thread::sleep_for(WAIT_TIME);
+	}
+	return true;
+}
+
+auto make_default_callbacks(Tracking* tracking) -> bhas::callbacks {
 	bhas::callbacks cb;
 	cb.audio = make_default_audio_cb();
 	cb.report = make_default_report_cb();
 	cb.stream_starting = [](bhas::stream stream) -> void {
 		MESSAGE("stream starting");
 	};
-	cb.stream_start_failure = [&tracking]() -> void {
-		tracking.stream_start_fail_count++;
+	cb.stream_start_failure = [tracking]() -> void {
+		tracking->stream_start_fail_count++;
 		MESSAGE("stream failed to start");
 	};
-	cb.stream_start_success = [&tracking](bhas::stream stream) -> void {
-		tracking.stream_start_success_count++;
+	cb.stream_start_success = [tracking](bhas::stream stream) -> void {
+		tracking->stream_start_success_count++;
 		MESSAGE("stream started successfully");
 	};
-	cb.stream_stopped = [&tracking]() -> void {
-		tracking.stream_stop_count++;
+	cb.stream_stopped = [tracking]() -> void {
+		tracking->stream_stop_count++;
 		MESSAGE("stream stopped");
 	};
-	if (!bhas::init(std::move(cb))) {
-		FAIL_CHECK("failed to initialize");
-		return;
-	}
+	return cb;
+}
+
+auto make_default_request() -> bhas::stream_request {
 	const auto& system = bhas::get_system();
 	bhas::stream_request request;
 	request.input_device  = system.default_input_device;
 	request.output_device = system.default_output_device;
 	request.sample_rate   = system.devices.at(request.output_device.value).default_sample_rate;
+	return request;
+}
+
+// For streams which stop themselves by returning complete
+auto wait_for_stream_to_finish() -> void {
+	const auto start_time = std::chrono::steady_clock::now();
+	while (bhas::get_current_stream() && std::chrono::steady_clock::now() - start_time < STOP_STREAM_TIMEOUT) {
+		bhas::update();
+		std::this_thread::sleep_for(WAIT_TIME);
+	}
+}
+
+template <typename Setup, typename Fn>
+auto run_initialized_stream(Tracking* tracking, Setup setup, Fn fn) -> void {
+	auto request = make_default_request();
+	setup(&request);
+	if (!try_to_open_stream(request, tracking)) {
+		FAIL_CHECK("failed to start an audio stream");
+		bhas::shutdown();
+		return;
+	}
+	fn(std::as_const(request));
+	if (!try_to_stop_stream(tracking)) {
+		FAIL_CHECK("failed to stop the audio stream");
+	}
+	bhas::shutdown();
+}
+
+// Initializes bhas on the given backend and opens a stream with the
+// default request, after setup has had a chance to change it. fn is
+// called with the request while the stream runs, and then the stream is
+// stopped and bhas is shut down. Only the default stream test uses real
+// hardware. Everything else goes through here with one of the virtual
+// backends, so that it runs on machines without a sound card.
+template <typename Setup, typename Fn>
+auto run_stream(bhas::audio_cb audio, bhas::backend backend, Setup setup, Fn fn) -> void {
+	Tracking tracking;
+	auto cb = make_default_callbacks(&tracking);
+	cb.audio = std::move(audio);
+	if (!bhas::init(std::move(cb), backend)) {
+		FAIL_CHECK("failed to initialize");
+		return;
+	}
+	run_initialized_stream(&tracking, setup, fn);
+}
+
+template <typename Processor, typename Setup, typename Fn>
+auto run_stream(Processor* processor, bhas::backend backend, Setup setup, Fn fn) -> void {
+	Tracking tracking;
+	if (!bhas::init<NUM_OUTPUT_CHANNELS>(make_default_callbacks(&tracking), processor, backend)) {
+		FAIL_CHECK("failed to initialize");
+		return;
+	}
+	run_initialized_stream(&tracking, setup, fn);
+}
+
+// Checks that the default request, as changed by setup, is turned down
+// with an error.
+template <typename Setup>
+auto check_stream_fails_to_start(bhas::backend backend, Setup setup) -> void {
+	Tracking tracking;
+	int error_count = 0;
+	auto cb = make_default_callbacks(&tracking);
+	cb.report = [&error_count](bhas::log log) -> void {
+		for (const auto& item : log) {
+			if (std::holds_alternative<bhas::error>(item)) { error_count++; }
+		}
+	};
+	if (!bhas::init(std::move(cb), backend)) {
+		FAIL_CHECK("failed to initialize");
+		return;
+	}
+	auto request = make_default_request();
+	setup(&request);
+	CHECK_FALSE(try_to_open_stream(request, &tracking));
+	CHECK(error_count > 0);
+	bhas::shutdown();
+}
+
+TEST_CASE("start and stop the system default audio stream") {
+	Tracking tracking;
+	if (!bhas::init(make_default_callbacks(&tracking))) {
+		FAIL_CHECK("failed to initialize");
+		return;
+	}
+	auto request = make_default_request();
 	if (!try_to_open_stream(request, &tracking)) {
 		FAIL_CHECK("failed to start an audio stream with the default settings");
 		bhas::shutdown();
@@ -130,3 +244,1570 @@ TEST_CASE("start and stop the system default audio stream") {
 	}
 	bhas::shutdown();
 }
+
+struct silent_processor {
+	std::atomic<int> call_count = 0;
+	auto process(const bhas::process_context<NUM_OUTPUT_CHANNELS>& ctx) -> bhas::callback_result {
+		if (ctx.buffer_layout == bhas::buffer_layout::interleaved) {
+			std::ranges::fill(ctx.interleaved_out(), 0.0f);
+		}
+		else {
+			for (const auto channel : ctx.outputs()) {
+				std::fill_n(channel, ctx.frame_count.value, 0.0f);
+			}
+		}
+		call_count++;
+		return bhas::callback_result::complete;
+	}
+};
+
+TEST_CASE("start and stop a stream with a statically-dispatched processor") {
+	silent_processor processor;
+	run_stream(&processor, bhas::backend::null, [](bhas::stream_request*) {}, [&processor](const bhas::stream_request&) {
+		CHECK(bhas::get_current_stream()->num_output_channels.value == NUM_OUTPUT_CHANNELS);
+		CHECK(wait_for_audio_callback(processor.call_count));
+	});
+}
+
+TEST_CASE("commands are executed in order and overflow is counted") {
+	std::vector<int> executed;
+	executed.reserve(bhas::engine::COMMAND_QUEUE_SIZE);
+	const auto old_overflow_count = bhas::get_command_overflow_count();
+	std::vector<int> expected;
+	for (int i = 0; i < int(bhas::engine::COMMAND_QUEUE_SIZE); i++) {
+		REQUIRE(bhas::push_command([&executed, i] { executed.push_back(i); }));
+		expected.push_back(i);
+	}
+	CHECK_FALSE(bhas::push_command([&executed] { executed.push_back(-1); }));
+	CHECK(bhas::get_command_overflow_count().value == old_overflow_count.value + 1);
+	bhas::engine::drain_commands();
+	CHECK(executed == expected);
+}
+
+TEST_CASE("sample format conversions round trip") {
+	static constexpr auto NUM_SAMPLES = 1001;
+	std::vector<float> original(NUM_SAMPLES);
+	for (int i = 0; i < NUM_SAMPLES; i++) {
+		original[i] = std::sin(float(i) * 0.01f) * 0.9f;
+	}
+	original[0] = 2.0f;
+	original[1] = -2.0f;
+	const auto check_round_trip = [&original](bhas::sample_format format, float tolerance) {
+		std::vector<std::byte> device(NUM_SAMPLES * bhas::convert::get_bytes_per_sample(format));
+		std::vector<float> result(NUM_SAMPLES);
+		bhas::convert::from_float(format, original.data(), device.data(), NUM_SAMPLES, nullptr);
+		bhas::convert::to_float(format, device.data(), result.data(), NUM_SAMPLES);
+		CHECK(result[0] == doctest::Approx(1.0f).epsilon(tolerance));
+		CHECK(result[1] == doctest::Approx(-1.0f).epsilon(tolerance));
+		for (int i = 2; i < NUM_SAMPLES; i++) {
+			if (std::abs(result[i] - original[i]) > tolerance) {
+				FAIL_CHECK("sample " << i << " was " << result[i] << " but expected " << original[i]);
+				return;
+			}
+		}
+	};
+	check_round_trip(bhas::sample_format::int16, 2.0f / 32767.0f);
+	check_round_trip(bhas::sample_format::int24, 2.0f / 8388607.0f);
+	check_round_trip(bhas::sample_format::int32, 2.0e-7f);
+}
+
+TEST_CASE("dithered conversion stays within one LSB") {
+	static constexpr auto NUM_SAMPLES = 1003;
+	std::vector<float> original(NUM_SAMPLES, 0.25f);
+	std::vector<int16_t> device(NUM_SAMPLES);
+	auto dither = bhas::convert::make_dither_state(1234);
+	bhas::convert::from_float(bhas::sample_format::int16, original.data(), device.data(), NUM_SAMPLES, &dither);
+	const auto expected = 0.25f * 32767.0f;
+	auto min = device[0];
+	auto max = device[0];
+	for (const auto sample : device) {
+		CHECK(std::abs(float(sample) - expected) <= 1.5f);
+		min = std::min(min, sample);
+		max = std::max(max, sample);
+	}
+	CHECK(min != max);
+}
+
+// Runs fn with the kernels forced onto each instruction set the CPU
+// supports in turn, then goes back to the best one.
+template <typename Fn>
+auto for_each_instruction_set(Fn&& fn) -> void {
+	const auto supported = bhas::get_supported_instruction_set();
+	for (auto isa = bhas::instruction_set::scalar; isa <= supported; isa = bhas::instruction_set(int(isa) + 1)) {
+		REQUIRE(bhas::force_instruction_set(isa));
+		REQUIRE(bhas::get_instruction_set() == isa);
+		INFO("instruction set " << int(isa));
+		fn(isa);
+	}
+	REQUIRE(bhas::force_instruction_set(std::nullopt));
+}
+
+TEST_CASE("an instruction set the CPU doesn't support can't be forced") {
+	const auto supported = bhas::get_supported_instruction_set();
+	if (supported < bhas::instruction_set::avx512) {
+		CHECK_FALSE(bhas::force_instruction_set(bhas::instruction_set(int(supported) + 1)));
+	}
+	CHECK(bhas::force_instruction_set(bhas::instruction_set::scalar));
+	CHECK(bhas::get_instruction_set() == bhas::instruction_set::scalar);
+	CHECK(bhas::force_instruction_set(std::nullopt));
+	CHECK(bhas::get_instruction_set() == supported);
+}
+
+TEST_CASE("every instruction set converts sample formats identically") {
+	static constexpr size_t NUM_SAMPLES = 1003;
+	std::vector<float> original(NUM_SAMPLES);
+	for (size_t i = 0; i < NUM_SAMPLES; i++) {
+		original[i] = std::sin(float(i) * 0.37f) * (i % 7 == 0 ? 1.5f : 1.0f);
+	}
+	// Exactly half way between two int16 values, to check the rounding
+	original[3] = 100.5f / 32767.0f;
+	original[4] = -100.5f / 32767.0f;
+	struct result {
+		std::vector<std::byte> device;
+		std::vector<std::byte> dithered;
+		std::vector<float> round_trip;
+		bhas::convert::dither_state dither;
+	};
+	for (const auto format : {bhas::sample_format::int16, bhas::sample_format::int24, bhas::sample_format::int32}) {
+		INFO("format " << int(format));
+		const auto bytes = NUM_SAMPLES * bhas::convert::get_bytes_per_sample(format);
+		std::optional<result> expected;
+		for_each_instruction_set([&](bhas::instruction_set) {
+			result r{std::vector<std::byte>(bytes), std::vector<std::byte>(bytes), std::vector<float>(NUM_SAMPLES), bhas::convert::make_dither_state(99)};
+			bhas::convert::from_float(format, original.data(), r.device.data(), NUM_SAMPLES, nullptr);
+			// Converted in two uneven pieces to check that the dither carries on from where it left off
+			bhas::convert::from_float(format, original.data(), r.dithered.data(), 21, &r.dither);
+			bhas::convert::from_float(format, original.data() + 21, r.dithered.data() + 21 * (bytes / NUM_SAMPLES), NUM_SAMPLES - 21, &r.dither);
+			bhas::convert::to_float(format, r.device.data(), r.round_trip.data(), NUM_SAMPLES);
+			if (!expected) {
+				expected = std::move(r);
+				return;
+			}
+			CHECK(r.device == expected->device);
+			CHECK(r.dithered == expected->dithered);
+			CHECK(std::equal(std::begin(r.dither.lanes), std::end(r.dither.lanes), std::begin(expected->dither.lanes)));
+			CHECK(r.round_trip == expected->round_trip);
+		});
+	}
+}
+
+TEST_CASE("buffer kernels match the naive loops at every length and alignment") {
+	for_each_instruction_set([](bhas::instruction_set) {
+		static constexpr size_t MAX_COUNT = 67;
+		static constexpr float GAIN       = 0.75f;
+		// Room for both channels of an interleaved buffer, plus an offset
+		std::vector<float> src(MAX_COUNT * 2 + 8);
+		std::vector<float> dst(MAX_COUNT * 2 + 8);
+		std::vector<float> expected(MAX_COUNT * 2 + 8);
+		for (size_t i = 0; i < src.size(); i++) {
+			src[i] = std::sin(float(i) * 0.37f) * (i % 5 == 0 ? 1.5f : 1.0f);
+		}
+		const auto reset = [&] {
+			for (size_t i = 0; i < dst.size(); i++) {
+				dst[i] = expected[i] = std::cos(float(i) * 0.11f);
+			}
+		};
+		for (size_t offset = 0; offset < 8; offset++) {
+			for (size_t count = 0; count <= MAX_COUNT; count++) {
+				const auto s = src.data() + offset;
+				const auto d = dst.data() + offset;
+				const auto e = expected.data() + offset;
+				reset();
+				bhas::buffer::zero(d, count);
+				std::fill_n(e, count, 0.0f);
+				CHECK(dst == expected);
+				reset();
+				bhas::buffer::copy(s, d, count);
+				std::copy_n(s, count, e);
+				CHECK(dst == expected);
+				reset();
+				bhas::buffer::apply_gain(d, count, GAIN);
+				for (size_t i = 0; i < count; i++) { e[i] *= GAIN; }
+				CHECK(dst == expected);
+				reset();
+				bhas::buffer::mix(s, d, count, GAIN);
+				for (size_t i = 0; i < count; i++) { e[i] += s[i] * GAIN; }
+				CHECK(dst == expected);
+				float peak = 0.0f;
+				for (size_t i = 0; i < count; i++) { peak = std::max(peak, std::fabs(s[i])); }
+				CHECK(bhas::buffer::peak(s, count) == peak);
+			}
+		}
+		for (const auto num_channels : {1u, 2u, 3u}) {
+			for (size_t count = 0; count <= MAX_COUNT / 2; count++) {
+				const float* planes[] = {src.data(), src.data() + 1, src.data() + 2};
+				std::vector<float> interleaved(count * num_channels);
+				bhas::buffer::interleave({planes}, interleaved.data(), {num_channels}, {uint32_t(count)});
+				auto ok = true;
+				for (size_t i = 0; i < count; i++) {
+					for (uint32_t ch = 0; ch < num_channels; ch++) {
+						ok = ok && interleaved[i * num_channels + ch] == planes[ch][i];
+					}
+				}
+				CHECK(ok);
+				std::vector<float> out(count * 3);
+				float* out_planes[] = {out.data(), out.data() + count, out.data() + count * 2};
+				bhas::buffer::deinterleave(interleaved.data(), {out_planes}, {num_channels}, {uint32_t(count)});
+				for (size_t i = 0; i < count; i++) {
+					for (uint32_t ch = 0; ch < num_channels; ch++) {
+						ok = ok && out_planes[ch][i] == planes[ch][i];
+					}
+				}
+				CHECK(ok);
+			}
+		}
+	});
+}
+
+TEST_CASE("measuring levels gives the same results on every instruction set") {
+	static constexpr size_t MAX_FRAMES = 67;
+	std::vector<float> src(MAX_FRAMES * 5);
+	for (size_t i = 0; i < src.size(); i++) {
+		src[i] = std::sin(float(i) * 0.37f) * (i % 7 == 0 ? 1.5f : 1.0f);
+	}
+	for_each_instruction_set([&](bhas::instruction_set) {
+		for (const auto num_channels : {1u, 2u, 3u, 4u, 5u}) {
+			for (size_t frames = 0; frames <= MAX_FRAMES; frames++) {
+				std::vector<bhas::buffer::levels> expected(num_channels);
+				for (size_t i = 0; i < frames; i++) {
+					for (uint32_t ch = 0; ch < num_channels; ch++) {
+						const auto x = src[i * num_channels + ch];
+						expected[ch].peak = std::max(expected[ch].peak, std::fabs(x));
+						expected[ch].sum_of_squares += x * x;
+					}
+				}
+				std::vector<bhas::buffer::levels> result(num_channels);
+				bhas::buffer::measure(src.data(), {num_channels}, {uint32_t(frames)}, result.data());
+				for (uint32_t ch = 0; ch < num_channels; ch++) {
+					CHECK(result[ch].peak == expected[ch].peak);
+					CHECK(result[ch].sum_of_squares == doctest::Approx(expected[ch].sum_of_squares).epsilon(1e-5));
+				}
+				if (num_channels == 1) {
+					const auto levels = bhas::buffer::measure(src.data(), frames);
+					CHECK(levels.peak == expected[0].peak);
+					CHECK(levels.sum_of_squares == doctest::Approx(expected[0].sum_of_squares).epsilon(1e-5));
+				}
+			}
+		}
+	});
+}
+
+TEST_CASE("start and stop an int16 stream converted by the engine") {
+	silent_processor processor;
+	const auto setup = [](bhas::stream_request* request) {
+		request->sample_format = bhas::sample_format::int16;
+	};
+	run_stream(&processor, bhas::backend::null, setup, [&processor](const bhas::stream_request&) {
+		CHECK(bhas::get_current_stream()->sample_format == bhas::sample_format::int16);
+		CHECK(wait_for_audio_callback(processor.call_count));
+	});
+}
+
+TEST_CASE("start and stop interleaved streams") {
+	std::atomic<int> call_count = 0;
+	auto audio = [&call_count](bhas::input_buffer input, bhas::output_buffer output, bhas::frame_count frame_count, bhas::sample_rate sample_rate, bhas::output_latency output_latency, const bhas::time_info* time_info) -> bhas::callback_result {
+		std::fill_n(output.buffer[0], frame_count.value * NUM_OUTPUT_CHANNELS, 0.0f);
+		call_count++;
+		return bhas::callback_result::complete;
+	};
+	const auto setup = [](bhas::stream_request* request) {
+		request->buffer_layout = bhas::buffer_layout::interleaved;
+		SUBCASE("float32") { request->sample_format = bhas::sample_format::float32; }
+		SUBCASE("int24")   { request->sample_format = bhas::sample_format::int24; }
+	};
+	run_stream(std::move(audio), bhas::backend::null, setup, [&call_count](const bhas::stream_request&) {
+		CHECK(bhas::get_current_stream()->buffer_layout == bhas::buffer_layout::interleaved);
+		CHECK(wait_for_audio_callback(call_count));
+	});
+}
+
+// The null device has eight channels each way
+TEST_CASE("start and stop a stream on a subset of the output channels") {
+	silent_processor processor;
+	const auto setup = [](bhas::stream_request* request) {
+		request->output_channels = {bhas::channel_index{3}, bhas::channel_index{1}};
+		SUBCASE("float32") {}
+		SUBCASE("interleaved float32") { request->buffer_layout = bhas::buffer_layout::interleaved; }
+		SUBCASE("int16")               { request->sample_format = bhas::sample_format::int16; }
+	};
+	run_stream(&processor, bhas::backend::null, setup, [&processor](const bhas::stream_request&) {
+		CHECK(bhas::get_current_stream()->num_output_channels.value == NUM_OUTPUT_CHANNELS);
+		CHECK(wait_for_audio_callback(processor.call_count));
+	});
+}
+
+TEST_CASE("an output channel the device doesn't have fails to start") {
+	check_stream_fails_to_start(bhas::backend::null, [](bhas::stream_request* request) {
+		const auto& device = bhas::get_system().devices.at(request->output_device.value);
+		request->output_channels = {bhas::channel_index{0}, bhas::channel_index{device.num_output_channels.value}};
+	});
+}
+
+TEST_CASE("a channel selection with no channels or a repeated channel fails to start") {
+	check_stream_fails_to_start(bhas::backend::null, [](bhas::stream_request* request) {
+		SUBCASE("no outputs")       { request->num_output_channels = bhas::channel_count{0}; }
+		SUBCASE("no inputs")        { request->num_input_channels = bhas::channel_count{0}; }
+		SUBCASE("repeated output")  { request->output_channels = {bhas::channel_index{1}, bhas::channel_index{0}, bhas::channel_index{1}}; }
+		SUBCASE("repeated input")   { request->input_channels = {bhas::channel_index{0}, bhas::channel_index{0}}; }
+	});
+}
+
+TEST_CASE("start and stop a stream on a subset of the input channels") {
+	silent_processor processor;
+	const auto setup = [](bhas::stream_request* request) {
+		SUBCASE("count")               { request->num_input_channels = bhas::channel_count{2}; }
+		SUBCASE("float32")             { request->input_channels = {bhas::channel_index{5}, bhas::channel_index{2}}; }
+		SUBCASE("interleaved float32") { request->input_channels = {bhas::channel_index{5}, bhas::channel_index{2}}; request->buffer_layout = bhas::buffer_layout::interleaved; }
+		SUBCASE("int16")               { request->input_channels = {bhas::channel_index{5}, bhas::channel_index{2}}; request->sample_format = bhas::sample_format::int16; }
+	};
+	run_stream(&processor, bhas::backend::null, setup, [&processor](const bhas::stream_request&) {
+		CHECK(bhas::get_current_stream()->num_input_channels.value == 2);
+		CHECK(wait_for_audio_callback(processor.call_count));
+	});
+}
+
+TEST_CASE("the re-blocker delivers fixed blocks and delays the output by its latency") {
+	static constexpr auto BLOCK_SIZE   = bhas::frame_count{64};
+	static constexpr auto NUM_CHANNELS = bhas::channel_count{2};
+	static constexpr auto SAMPLE_RATE  = bhas::sample_rate{48000};
+	auto layout = bhas::buffer_layout::non_interleaved;
+	SUBCASE("non-interleaved") {}
+	SUBCASE("interleaved") { layout = bhas::buffer_layout::interleaved; }
+	const auto spf        = layout == bhas::buffer_layout::interleaved ? NUM_CHANNELS.value : 1u;
+	const auto num_planes = NUM_CHANNELS.value / spf;
+	const auto latency    = bhas::engine::get_reblock_latency(BLOCK_SIZE, std::nullopt);
+	CHECK(latency.value == BLOCK_SIZE.value - 1);
+	CHECK(bhas::engine::get_reblock_latency(BLOCK_SIZE, bhas::frame_count{256}).value == 0);
+	CHECK(bhas::engine::get_reblock_latency(BLOCK_SIZE, bhas::frame_count{48}).value == 48);
+	auto r = bhas::engine::make_reblocker(BLOCK_SIZE, latency, layout, NUM_CHANNELS, NUM_CHANNELS);
+	struct passthrough {
+		uint32_t samples_per_frame;
+		uint32_t num_planes;
+		int bad_block_count = 0;
+	} context{spf, num_planes};
+	const auto fn = [](void* context, bhas::input_buffer input, bhas::output_buffer output, bhas::frame_count frame_count, const bhas::time_info& time_info) -> bhas::callback_result {
+		auto& pass = *static_cast<passthrough*>(context);
+		for (uint32_t plane = 0; plane < pass.num_planes; plane++) {
+			if (frame_count.value != BLOCK_SIZE.value || reinterpret_cast<uintptr_t>(output.buffer[plane]) % 64 != 0) {
+				pass.bad_block_count++;
+			}
+			std::copy_n(input.buffer[plane], frame_count.value * pass.samples_per_frame, output.buffer[plane]);
+		}
+		return bhas::callback_result::continue_;
+	};
+	// Odd device buffer sizes, feeding a ramp through
+	const uint32_t device_frame_counts[] = {1, 63, 64, 65, 200, 7, 256, 100, 3};
+	std::vector<float> in(size_t(256) * NUM_CHANNELS.value);
+	std::vector<float> out(in.size());
+	std::vector<float> received;
+	uint32_t next = 1;
+	for (int pass = 0; pass < 4; pass++) {
+		for (const auto frames : device_frame_counts) {
+			std::vector<const float*> in_planes;
+			std::vector<float*> out_planes;
+			for (uint32_t plane = 0; plane < num_planes; plane++) {
+				in_planes.push_back(in.data() + plane * 256);
+				out_planes.push_back(out.data() + plane * 256);
+			}
+			for (uint32_t frame = 0; frame < frames; frame++, next++) {
+				for (uint32_t ch = 0; ch < NUM_CHANNELS.value; ch++) {
+					const auto plane = ch / spf;
+					const auto index = frame * spf + ch % spf;
+					const_cast<float*>(in_planes[plane])[index] = float(next) + float(ch) * 0.5f;
+				}
+			}
+			bhas::engine::reblock(&r, {in_planes.data()}, {out_planes.data()}, {frames}, {}, SAMPLE_RATE, fn, &context);
+			for (uint32_t frame = 0; frame < frames; frame++) {
+				received.push_back(out_planes[0][frame * spf]);
+			}
+		}
+	}
+	CHECK(context.bad_block_count == 0);
+	for (size_t i = 0; i < received.size(); i++) {
+		const auto expected = i < latency.value ? 0.0f : float(i - latency.value + 1);
+		if (received[i] != expected) {
+			FAIL_CHECK("frame " << i << " was " << received[i] << " but should have been " << expected);
+			break;
+		}
+	}
+}
+
+TEST_CASE("the resampler runs the user at their own rate in both directions") {
+	static constexpr auto NUM_CHANNELS = bhas::channel_count{2};
+	static constexpr auto QUALITY      = bhas::resampler_quality::medium;
+	static constexpr auto FREQUENCY    = 1000.0;
+	static constexpr auto AMPLITUDE    = 0.5;
+	auto sample_rate        = bhas::sample_rate{44100};
+	auto device_sample_rate = bhas::sample_rate{48000};
+	SUBCASE("44.1 kHz on a 48 kHz device") {}
+	SUBCASE("48 kHz on a 44.1 kHz device") { std::swap(sample_rate, device_sample_rate); }
+	SUBCASE("96 kHz on a 48 kHz device")   { sample_rate = bhas::sample_rate{96000}; }
+	const auto U    = double(sample_rate.value);
+	const auto D    = double(device_sample_rate.value);
+	const auto g    = double(std::gcd(sample_rate.value, device_sample_rate.value));
+	const auto taps = double(bhas::resample::get_taps(QUALITY));
+	// The filter's group delay, in frames at its input rate
+	const auto output_delay = taps / 2.0 - 1.0 / (2.0 * D / g);
+	const auto input_delay  = taps / 2.0 - 1.0 / (2.0 * U / g);
+	for (const auto layout : {bhas::buffer_layout::non_interleaved, bhas::buffer_layout::interleaved}) {
+		const auto spf        = layout == bhas::buffer_layout::interleaved ? NUM_CHANNELS.value : 1u;
+		const auto num_planes = NUM_CHANNELS.value / spf;
+		for_each_instruction_set([&](bhas::instruction_set) {
+			auto r = bhas::engine::make_resampler(QUALITY, layout, NUM_CHANNELS, NUM_CHANNELS, sample_rate, device_sample_rate);
+			CHECK(r.latency == bhas::resample::get_taps(QUALITY) / 2);
+			// Records what the user receives, and sends back a sine wave at the user's rate
+			struct sine_loop {
+				uint32_t samples_per_frame;
+				uint32_t num_planes;
+				double step;
+				uint64_t frames = 0;
+				std::vector<float> received;
+			} context{spf, num_planes, 2.0 * M_PI * FREQUENCY / U};
+			const auto fn = [](void* context, bhas::input_buffer input, bhas::output_buffer output, bhas::frame_count frame_count, const bhas::time_info&) -> bhas::callback_result {
+				auto& loop = *static_cast<sine_loop*>(context);
+				for (uint32_t frame = 0; frame < frame_count.value; frame++) {
+					loop.received.push_back(input.buffer[0][frame * loop.samples_per_frame]);
+					const auto value = float(AMPLITUDE * std::sin(loop.step * double(loop.frames + frame)));
+					for (uint32_t plane = 0; plane < loop.num_planes; plane++) {
+						std::fill_n(output.buffer[plane] + frame * loop.samples_per_frame, loop.samples_per_frame, value);
+					}
+				}
+				loop.frames += frame_count.value;
+				return bhas::callback_result::continue_;
+			};
+			const uint32_t device_frame_counts[] = {1, 63, 64, 65, 200, 7, 256, 100, 3, 512};
+			std::vector<float> in(size_t(512) * NUM_CHANNELS.value);
+			std::vector<float> out(in.size());
+			std::vector<float> played;
+			uint64_t next = 0;
+			for (int pass = 0; pass < 8; pass++) {
+				for (const auto frames : device_frame_counts) {
+					std::vector<float*> in_planes;
+					std::vector<float*> out_planes;
+					for (uint32_t plane = 0; plane < num_planes; plane++) {
+						in_planes.push_back(in.data() + plane * 512);
+						out_planes.push_back(out.data() + plane * 512);
+					}
+					for (uint32_t frame = 0; frame < frames; frame++, next++) {
+						const auto value = float(AMPLITUDE * std::sin(2.0 * M_PI * FREQUENCY / D * double(next)));
+						for (uint32_t plane = 0; plane < num_planes; plane++) {
+							std::fill_n(in_planes[plane] + frame * spf, spf, value);
+						}
+					}
+					const std::vector<const float*> in_pointers(in_planes.begin(), in_planes.end());
+					bhas::engine::resample(&r, {in_pointers.data()}, {out_planes.data()}, {frames}, {}, fn, &context);
+					for (uint32_t frame = 0; frame < frames; frame++) {
+						played.push_back(out_planes[0][frame * spf]);
+					}
+				}
+			}
+			CHECK(context.received.size() == context.frames);
+			CHECK(std::abs(double(context.frames) - double(next) * U / D) <= 2.0);
+			// Past the first few windows, which start from silence, both
+			// directions should be the same sine wave delayed by the filter.
+			auto max_output_error = 0.0;
+			for (size_t n = size_t(taps * 2 * D / U); n < played.size(); n++) {
+				const auto expected = AMPLITUDE * std::sin(2.0 * M_PI * FREQUENCY / U * (double(n) * U / D - output_delay));
+				max_output_error = std::max(max_output_error, std::abs(double(played[n]) - expected));
+			}
+			auto max_input_error = 0.0;
+			for (size_t m = size_t(taps * 2 * U / D); m < context.received.size(); m++) {
+				const auto expected = AMPLITUDE * std::sin(2.0 * M_PI * FREQUENCY / D * (double(m) * D / U - input_delay));
+				max_input_error = std::max(max_input_error, std::abs(double(context.received[m]) - expected));
+			}
+			CHECK(max_output_error < 1e-4);
+			CHECK(max_input_error < 1e-4);
+		});
+	}
+}
+
+TEST_CASE("a resampled stream runs the callback at the requested rate") {
+	std::atomic<int> call_count = 0;
+	std::atomic<int> bad_rate_count = 0;
+	auto audio = [&call_count, &bad_rate_count](bhas::input_buffer input, bhas::output_buffer output, bhas::frame_count frame_count, bhas::sample_rate sample_rate, bhas::output_latency output_latency, const bhas::time_info* time_info) -> bhas::callback_result {
+		if (sample_rate.value != 44100) {
+			bad_rate_count++;
+		}
+		for (auto j = 0; j < NUM_OUTPUT_CHANNELS; ++j) {
+			std::fill_n(output.buffer[j], frame_count.value, 0.0f);
+		}
+		return ++call_count < 10 ? bhas::callback_result::continue_ : bhas::callback_result::complete;
+	};
+	const auto setup = [](bhas::stream_request* request) {
+		request->sample_rate                  = bhas::sample_rate{44100};
+		request->resampler.enabled            = true;
+		request->resampler.device_sample_rate = bhas::sample_rate{48000};
+		SUBCASE("float32") {}
+		SUBCASE("int16") { request->sample_format = bhas::sample_format::int16; }
+		SUBCASE("fixed block size") { request->block_size = bhas::frame_count{128}; }
+	};
+	run_stream(std::move(audio), bhas::backend::null, setup, [&call_count](const bhas::stream_request& request) {
+		const auto stream = *bhas::get_current_stream();
+		CHECK(stream.sample_rate.value == 44100);
+		CHECK(stream.device_sample_rate.value == 48000);
+		CHECK(stream.resampler_latency.value == bhas::resample::get_taps(request.resampler.quality) / 2);
+		CHECK(wait_for_audio_callback(call_count));
+	});
+	CHECK(bad_rate_count == 0);
+}
+
+TEST_CASE("start and stop a stream with a fixed block size") {
+	static constexpr auto BLOCK_SIZE = bhas::frame_count{128};
+	std::atomic<int> call_count = 0;
+	std::atomic<int> bad_block_count = 0;
+	auto audio = [&call_count, &bad_block_count](bhas::input_buffer input, bhas::output_buffer output, bhas::frame_count frame_count, bhas::sample_rate sample_rate, bhas::output_latency output_latency, const bhas::time_info* time_info) -> bhas::callback_result {
+		if (frame_count.value != BLOCK_SIZE.value) {
+			bad_block_count++;
+		}
+		for (auto j = 0; j < NUM_OUTPUT_CHANNELS; ++j) {
+			std::fill_n(output.buffer[j], frame_count.value, 0.0f);
+		}
+		return ++call_count < 10 ? bhas::callback_result::continue_ : bhas::callback_result::complete;
+	};
+	const auto setup = [](bhas::stream_request* request) {
+		request->block_size = BLOCK_SIZE;
+		SUBCASE("float32") {}
+		SUBCASE("int16") { request->sample_format = bhas::sample_format::int16; }
+	};
+	run_stream(std::move(audio), bhas::backend::null, setup, [&call_count](const bhas::stream_request&) {
+		CHECK(bhas::get_current_stream()->block_size->value == BLOCK_SIZE.value);
+		CHECK(bhas::get_current_stream()->block_latency.value < BLOCK_SIZE.value);
+		CHECK(wait_for_audio_callback(call_count));
+	});
+	CHECK(bad_block_count == 0);
+}
+
+TEST_CASE("the requested buffer size, latency and flags are echoed back") {
+	silent_processor processor;
+	const auto setup = [](bhas::stream_request* request) {
+		request->frames_per_buffer = bhas::frame_count{96};
+		request->block_size        = bhas::frame_count{32};
+		request->flags.value       = bhas::stream_flags::clip_off | bhas::stream_flags::dither_off | bhas::stream_flags::prime_output_buffers_using_stream_callback;
+		SUBCASE("latency in seconds") { request->suggested_latency = bhas::seconds{0.01}; }
+		SUBCASE("latency in frames")  { request->suggested_latency = bhas::frame_count{request->sample_rate.value / 100}; }
+	};
+	run_stream(&processor, bhas::backend::null, setup, [&processor](const bhas::stream_request& request) {
+		const auto stream = *bhas::get_current_stream();
+		CHECK(stream.frames_per_buffer->value == 96);
+		CHECK(stream.flags.value == request.flags.value);
+		// 96 frames per buffer is a multiple of the block size, so re-blocking doesn't add any latency
+		CHECK(stream.block_latency.value == 0);
+		CHECK(stream.output_latency.value > 0.0);
+		CHECK(wait_for_audio_callback(processor.call_count));
+	});
+}
+
+TEST_CASE("callback timing percentiles separate steady load from spikes") {
+	static constexpr auto FRAME_COUNT = bhas::frame_count{480};
+	static constexpr auto SAMPLE_RATE = bhas::sample_rate{48000};
+	const auto period = std::chrono::duration_cast<bhas::engine::callback_clock::duration>(std::chrono::milliseconds{10});
+	bhas::engine::reset_callback_timing();
+	for (int i = 0; i < 995; i++) {
+		bhas::engine::record_callback_duration(period * 4 / 10, FRAME_COUNT, SAMPLE_RATE);
+	}
+	for (int i = 0; i < 5; i++) {
+		bhas::engine::record_callback_duration(period * 12 / 10, FRAME_COUNT, SAMPLE_RATE);
+	}
+	const auto timing = bhas::engine::get_callback_timing();
+	CHECK(timing.callback_count == 1000);
+	CHECK(timing.deadline_miss_count == 5);
+	CHECK(timing.p50_load == doctest::Approx(0.4).epsilon(0.1));
+	CHECK(timing.p99_load == doctest::Approx(0.4).epsilon(0.1));
+	CHECK(timing.p999_load == doctest::Approx(1.2).epsilon(0.1));
+	CHECK(timing.max_load == doctest::Approx(1.2));
+	CHECK(timing.max_duration.value == doctest::Approx(0.012));
+	bhas::engine::reset_callback_timing();
+	CHECK(bhas::engine::get_callback_timing().callback_count == 0);
+}
+
+TEST_CASE("callback timing is recorded while a stream runs") {
+	silent_processor processor;
+	run_stream(&processor, bhas::backend::null, [](bhas::stream_request*) {}, [&processor](const bhas::stream_request&) {
+		CHECK(wait_for_audio_callback(processor.call_count));
+	});
+	const auto timing = bhas::get_callback_timing();
+	CHECK(timing.callback_count > 0);
+	CHECK(timing.max_load >= timing.p50_load);
+}
+
+TEST_CASE("xruns are counted with the time of the most recent one") {
+	bhas::engine::reset_xrun_stats();
+	bhas::engine::record_xruns({}, {1.0});
+	bhas::engine::record_xruns({bhas::xrun_flags::output_underflow}, {2.0});
+	bhas::engine::record_xruns({bhas::xrun_flags::output_underflow | bhas::xrun_flags::input_overflow}, {3.5});
+	const auto stats = bhas::engine::get_xrun_stats();
+	CHECK(stats.output_underflow.count == 2);
+	CHECK(stats.output_underflow.last_time.value == 3.5);
+	CHECK(stats.input_overflow.count == 1);
+	CHECK(stats.input_underflow.count == 0);
+	CHECK(stats.output_overflow.count == 0);
+	CHECK(stats.priming_output.count == 0);
+	bhas::engine::reset_xrun_stats();
+	CHECK(bhas::engine::get_xrun_stats().output_underflow.count == 0);
+}
+
+// The first CPU this process is allowed to run on, which isn't
+// necessarily CPU 0 inside a container or a cpuset.
+auto get_allowed_cpu() -> uint32_t {
+#	ifdef __linux__
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+		for (uint32_t cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+			if (CPU_ISSET(cpu, &set)) {
+				return cpu;
+			}
+		}
+	}
+#	endif
+	return 0;
+}
+
+TEST_CASE("the audio thread config is applied on the first callback") {
+	silent_processor processor;
+	const auto cpu = get_allowed_cpu();
+	const auto setup = [cpu](bhas::stream_request* request) {
+		request->audio_thread.cpus = {cpu};
+	};
+	run_stream(&processor, bhas::backend::null, setup, [&processor, cpu](const bhas::stream_request&) {
+		CHECK(wait_for_audio_callback(processor.call_count));
+		bhas::update();
+		const auto state = bhas::get_audio_thread_state();
+		REQUIRE(state.has_value());
+#		ifdef __linux__
+		CHECK(state->cpus == std::vector<uint32_t>{cpu});
+#		endif
+	});
+}
+
+TEST_CASE("the worker pool runs every job in a batch exactly once") {
+	static constexpr uint32_t MAX_JOBS = 40;
+	static constexpr int NUM_BATCHES   = 500;
+	std::array<std::atomic<int>, MAX_JOBS> runs = {};
+	std::array<int, MAX_JOBS> expected = {};
+	REQUIRE(bhas::workers::start(bhas::thread_count{3}, {}).value == 3);
+	for (int batch = 0; batch < NUM_BATCHES; batch++) {
+		const auto count = uint32_t(batch * 7) % (MAX_JOBS + 1);
+		bhas::run_jobs(count, [&runs](uint32_t index) { runs[index]++; });
+		for (uint32_t i = 0; i < count; i++) {
+			expected[i]++;
+		}
+		// Everything must have finished by the time run_jobs() returns
+		CHECK(std::equal(expected.begin(), expected.end(), runs.begin()));
+	}
+	bhas::workers::stop();
+	CHECK(bhas::workers::get_thread_count().value == 0);
+}
+
+TEST_CASE("a processor can run jobs on the stream's worker threads") {
+	struct job_processor {
+		std::atomic<int> call_count = 0;
+		std::atomic<int> job_count = 0;
+		auto process(const bhas::process_context<NUM_OUTPUT_CHANNELS>& ctx) -> bhas::callback_result {
+			// One job per output channel
+			bhas::run_jobs(NUM_OUTPUT_CHANNELS, [&ctx, this](uint32_t channel) {
+				std::ranges::fill(ctx.out(channel), 0.0f);
+				job_count++;
+			});
+			call_count++;
+			return bhas::callback_result::continue_;
+		}
+	};
+	job_processor processor;
+	const auto setup = [](bhas::stream_request* request) {
+		request->worker_threads = bhas::thread_count{2};
+	};
+	run_stream(&processor, bhas::backend::null, setup, [&processor](const bhas::stream_request&) {
+		CHECK(bhas::get_current_stream()->worker_threads.value == 2);
+		CHECK(wait_for_audio_callback(processor.call_count));
+	});
+	CHECK(processor.job_count == processor.call_count * NUM_OUTPUT_CHANNELS);
+	CHECK(bhas::workers::get_thread_count().value == 0);
+}
+
+TEST_CASE("render-ahead delays the output by exactly one block") {
+	static constexpr auto BLOCK_SIZE  = bhas::frame_count{64};
+	static constexpr auto SAMPLE_RATE = bhas::sample_rate{48000};
+	static constexpr auto NUM_BLOCKS  = 50;
+	const auto pipeline = bhas::engine::make_render_pipeline(BLOCK_SIZE, bhas::buffer_layout::non_interleaved, {1}, {1});
+	struct render_context {
+		std::thread::id thread;
+		double last_dac_time = 0.0;
+	} context;
+	const auto fn = [](void* context, bhas::input_buffer input, bhas::output_buffer output, bhas::frame_count frame_count, const bhas::time_info& time_info, bhas::xrun_flags) -> bhas::callback_result {
+		auto& render = *static_cast<render_context*>(context);
+		render.thread        = std::this_thread::get_id();
+		render.last_dac_time = time_info.output_buffer_dac_time;
+		std::copy_n(input.buffer[0], frame_count.value, output.buffer[0]);
+		return bhas::callback_result::continue_;
+	};
+	bhas::engine::start_render_thread(pipeline.get(), fn, &context, {});
+	std::vector<float> in(BLOCK_SIZE.value);
+	std::vector<float> out(BLOCK_SIZE.value);
+	const float* in_planes[] = {in.data()};
+	float* out_planes[]      = {out.data()};
+	for (int block = 0; block < NUM_BLOCKS; block++) {
+		std::ranges::fill(in, float(block + 1));
+		bhas::time_info time;
+		time.output_buffer_dac_time = double(block * BLOCK_SIZE.value) / SAMPLE_RATE.value;
+		const auto result = bhas::engine::render_ahead(pipeline.get(), {in_planes}, {out_planes}, BLOCK_SIZE, time, {}, SAMPLE_RATE);
+		CHECK(result == bhas::callback_result::continue_);
+		// The block which was sent last time has had a whole period to render
+		CHECK(out.front() == float(block));
+		CHECK(out.back() == float(block));
+		// Give the render thread its period
+		while (pipeline->rendered.size() == 0) {
+			std::this_thread::yield();
+		}
+		CHECK(context.last_dac_time == doctest::Approx(double((block + 1) * BLOCK_SIZE.value) / SAMPLE_RATE.value));
+	}
+	CHECK(context.thread != std::this_thread::get_id());
+	bhas::engine::stop_render_thread(pipeline.get());
+}
+
+TEST_CASE("a render-ahead stream reports the extra block of latency") {
+	silent_processor processor;
+	const auto setup = [](bhas::stream_request* request) {
+		request->block_size        = bhas::frame_count{128};
+		request->frames_per_buffer = bhas::frame_count{128};
+		request->render_ahead      = bhas::render_ahead{true};
+	};
+	run_stream(&processor, bhas::backend::null, setup, [&processor](const bhas::stream_request&) {
+		const auto stream = *bhas::get_current_stream();
+		CHECK(stream.render_ahead_latency.value == 128);
+		CHECK(stream.block_latency.value == 0);
+		CHECK(stream.output_latency.value >= 128.0 / stream.sample_rate.value);
+		CHECK(wait_for_audio_callback(processor.call_count));
+	});
+}
+
+TEST_CASE("meters report the peak, RMS and held peak of each window") {
+	// 100 frames per window and a 300 frame peak hold, fed 50 frames at a time
+	static constexpr auto FRAMES = 50u;
+	bhas::metering_config config;
+	config.enabled   = true;
+	config.window    = bhas::seconds{0.1};
+	config.peak_hold = bhas::seconds{0.3};
+	auto layout = bhas::buffer_layout::non_interleaved;
+	SUBCASE("non-interleaved") {}
+	SUBCASE("interleaved") { layout = bhas::buffer_layout::interleaved; }
+	const auto bank = bhas::engine::make_meter_bank(config, layout, {1}, {2}, {1000});
+	// One input channel and two output channels, filled with a square
+	// wave of the given amplitude, a constant -0.25, and silence.
+	std::vector<float> input(FRAMES);
+	std::vector<float> output(FRAMES * 2);
+	const auto feed = [&](float amplitude) {
+		for (uint32_t i = 0; i < FRAMES; i++) {
+			input[i] = i % 2 ? amplitude : -amplitude;
+			if (layout == bhas::buffer_layout::interleaved) {
+				output[i * 2]     = -0.25f;
+				output[i * 2 + 1] = 0.0f;
+			}
+			else {
+				output[i]          = -0.25f;
+				output[FRAMES + i] = 0.0f;
+			}
+		}
+		const float* input_planes[] = {input.data()};
+		float* output_planes[]      = {output.data(), output.data() + FRAMES};
+		bhas::engine::meter(bank.get(), {input_planes}, {output_planes}, {FRAMES});
+	};
+	CHECK(bhas::engine::read_meters(*bank).update_count == 0);
+	feed(0.5f);
+	CHECK(bhas::engine::read_meters(*bank).update_count == 0);
+	feed(0.5f);
+	auto meters = bhas::engine::read_meters(*bank);
+	REQUIRE(meters.input.size() == 1);
+	REQUIRE(meters.output.size() == 2);
+	CHECK(meters.update_count == 1);
+	CHECK(meters.input[0].peak == 0.5f);
+	CHECK(meters.input[0].rms == doctest::Approx(0.5f));
+	CHECK(meters.input[0].peak_hold == 0.5f);
+	CHECK(meters.output[0].peak == 0.25f);
+	CHECK(meters.output[0].rms == doctest::Approx(0.25f));
+	CHECK(meters.output[1].peak == 0.0f);
+	CHECK(meters.output[1].rms == 0.0f);
+	// A loud window followed by quiet ones. The peak is held for three
+	// windows and then drops.
+	feed(1.0f);
+	feed(0.1f);
+	for (int window = 0; window < 3; window++) {
+		meters = bhas::engine::read_meters(*bank);
+		CHECK(meters.input[0].peak_hold == 1.0f);
+		feed(0.1f);
+		feed(0.1f);
+		meters = bhas::engine::read_meters(*bank);
+		CHECK(meters.input[0].peak == 0.1f);
+	}
+	CHECK(meters.input[0].peak_hold == 0.1f);
+	CHECK(meters.update_count == 5);
+}
+
+TEST_CASE("a stream with metering enabled publishes its output levels") {
+	struct constant_processor {
+		auto process(const bhas::process_context<NUM_OUTPUT_CHANNELS>& ctx) -> bhas::callback_result {
+			if (ctx.buffer_layout == bhas::buffer_layout::interleaved) {
+				std::ranges::fill(ctx.interleaved_out(), 0.5f);
+			}
+			else {
+				for (const auto channel : ctx.outputs()) {
+					std::fill_n(channel, ctx.frame_count.value, 0.5f);
+				}
+			}
+			return bhas::callback_result::continue_;
+		}
+	};
+	constant_processor processor;
+	const auto setup = [](bhas::stream_request* request) {
+		SUBCASE("disabled") {}
+		SUBCASE("enabled") {
+			request->metering.enabled = true;
+			request->metering.window  = bhas::seconds{0.001};
+		}
+	};
+	run_stream(&processor, bhas::backend::null, setup, [](const bhas::stream_request& request) {
+		if (!request.metering.enabled) {
+			std::this_thread::sleep_for(WAIT_TIME);
+			const auto meters = bhas::get_meters();
+			CHECK(meters.input.empty());
+			CHECK(meters.output.empty());
+			CHECK(meters.update_count == 0);
+			return;
+		}
+		const auto start_time = std::chrono::system_clock::now();
+		auto meters = bhas::get_meters();
+		while (meters.update_count == 0 && std::chrono::system_clock::now() - start_time < START_STREAM_TIMEOUT) {
+			std::this_thread::sleep_for(WAIT_TIME);
+			meters = bhas::get_meters();
+		}
+		REQUIRE(meters.output.size() == NUM_OUTPUT_CHANNELS);
+		CHECK(meters.update_count > 0);
+		for (const auto& meter : meters.output) {
+			CHECK(meter.peak == 0.5f);
+			CHECK(meter.rms == doctest::Approx(0.5f));
+			CHECK(meter.peak_hold == 0.5f);
+		}
+		CHECK(meters.input.size() == bhas::get_current_stream()->num_input_channels.value);
+	});
+}
+
+#ifdef __linux__
+TEST_CASE("steady-state callbacks take no page faults with real-time memory enabled") {
+	static constexpr auto FIRST_CALL = 20;
+	static constexpr auto LAST_CALL  = 60;
+	static constexpr auto USER_BUFFER_SIZE = size_t(4096) * LAST_CALL;
+	struct fault_counting_processor {
+		// Left uninitialized and touched a page at a time, so it would
+		// fault on every call if it wasn't locked
+		std::unique_ptr<float[]> user_buffer{new float[USER_BUFFER_SIZE]};
+		std::atomic<int> call_count = 0;
+		std::atomic<long> faults = -1;
+		long faults_at_first_call = 0;
+		auto process(const bhas::process_context<NUM_OUTPUT_CHANNELS>& ctx) -> bhas::callback_result {
+			for (const auto channel : ctx.outputs()) {
+				std::fill_n(channel, ctx.frame_count.value, 0.0f);
+			}
+			user_buffer[(call_count * 4096) % USER_BUFFER_SIZE] = 1.0f;
+			rusage usage;
+			getrusage(RUSAGE_THREAD, &usage);
+			const auto count = ++call_count;
+			if (count == FIRST_CALL) {
+				faults_at_first_call = usage.ru_minflt + usage.ru_majflt;
+			}
+			if (count == LAST_CALL) {
+				faults = usage.ru_minflt + usage.ru_majflt - faults_at_first_call;
+			}
+			return bhas::callback_result::continue_;
+		}
+	};
+	fault_counting_processor processor;
+	const auto setup = [&processor](bhas::stream_request* request) {
+		CHECK(bhas::lock_memory(processor.user_buffer.get(), USER_BUFFER_SIZE * sizeof(float)));
+		request->realtime_memory.enabled = true;
+		request->sample_format           = bhas::sample_format::int16;
+		request->block_size              = bhas::frame_count{64};
+	};
+	run_stream(&processor, bhas::backend::null, setup, [&processor](const bhas::stream_request&) {
+		CHECK(bhas::get_current_stream()->locked_memory.value >= USER_BUFFER_SIZE * sizeof(float));
+		const auto start_time = std::chrono::system_clock::now();
+		while (processor.faults == -1 && std::chrono::system_clock::now() - start_time < START_STREAM_TIMEOUT) {
+			std::this_thread::sleep_for(WAIT_TIME);
+		}
+		CHECK(processor.faults == 0);
+	});
+	bhas::unlock_memory(processor.user_buffer.get(), USER_BUFFER_SIZE * sizeof(float));
+	CHECK(bhas::get_locked_memory().value == 0);
+}
+
+// How much of the process's memory the kernel says is locked
+auto get_vm_locked_kb() -> size_t {
+	std::ifstream status{"/proc/self/status"};
+	std::string line;
+	while (std::getline(status, line)) {
+		if (line.starts_with("VmLck:")) {
+			return std::stoul(line.substr(6));
+		}
+	}
+	return 0;
+}
+
+TEST_CASE("a page locked by both owners stays locked until both have unlocked it") {
+	const auto page_size = size_t(sysconf(_SC_PAGESIZE));
+	const auto memory    = std::unique_ptr<std::byte[]>{new std::byte[page_size * 8]};
+	// Page-aligned, with the user's three pages and the engine's two
+	// sharing the page in the middle
+	const auto base = reinterpret_cast<std::byte*>((reinterpret_cast<uintptr_t>(memory.get()) + page_size - 1) / page_size * page_size);
+	const auto vm_locked_kb = get_vm_locked_kb();
+	if (!bhas::rt::lock_memory(bhas::rt::memory_owner::user, base, page_size * 3)) {
+		MESSAGE("can't lock memory (check RLIMIT_MEMLOCK)");
+		return;
+	}
+	REQUIRE(bhas::rt::lock_memory(bhas::rt::memory_owner::engine, base + page_size * 2, page_size * 2));
+	CHECK(bhas::get_locked_memory().value == page_size * 4);
+	CHECK(get_vm_locked_kb() - vm_locked_kb == page_size * 4 / 1024);
+	bhas::rt::unlock_all_memory(bhas::rt::memory_owner::engine);
+	CHECK(bhas::get_locked_memory().value == page_size * 3);
+	CHECK(get_vm_locked_kb() - vm_locked_kb == page_size * 3 / 1024);
+	bhas::rt::unlock_memory(bhas::rt::memory_owner::user, base, page_size * 3);
+	CHECK(bhas::get_locked_memory().value == 0);
+	CHECK(get_vm_locked_kb() == vm_locked_kb);
+}
+#endif
+
+TEST_CASE("the null backend calls back at the stream's rate") {
+	static constexpr auto FRAMES_PER_BUFFER = 256;
+	static constexpr auto SAMPLE_RATE       = 48000;
+	static constexpr auto NUM_CALLBACKS     = 50;
+	std::atomic<int> call_count = 0;
+	std::atomic<int> bad_step_count = 0;
+	std::chrono::steady_clock::time_point first_call;
+	std::chrono::steady_clock::time_point last_call;
+	auto audio = [&, previous_dac_time = -1.0](bhas::input_buffer input, bhas::output_buffer output, bhas::frame_count frame_count, bhas::sample_rate sample_rate, bhas::output_latency output_latency, const bhas::time_info* time_info) mutable -> bhas::callback_result {
+		const auto now = std::chrono::steady_clock::now();
+		if (call_count == 0) {
+			first_call = now;
+		}
+		else if (std::abs(time_info->output_buffer_dac_time - previous_dac_time - double(FRAMES_PER_BUFFER) / SAMPLE_RATE) > 1e-9) {
+			bad_step_count++;
+		}
+		previous_dac_time = time_info->output_buffer_dac_time;
+		last_call = now;
+		bhas::buffer::zero(output, {NUM_OUTPUT_CHANNELS}, frame_count);
+		return ++call_count < NUM_CALLBACKS ? bhas::callback_result::continue_ : bhas::callback_result::complete;
+	};
+	const auto setup = [](bhas::stream_request* request) {
+		const auto& system = bhas::get_system();
+		REQUIRE(system.devices.size() == 1);
+		CHECK(system.devices[0].name.value == "Null device");
+		request->sample_rate       = bhas::sample_rate{SAMPLE_RATE};
+		request->frames_per_buffer = bhas::frame_count{FRAMES_PER_BUFFER};
+	};
+	run_stream(std::move(audio), bhas::backend::null, setup, [](const bhas::stream_request&) {
+		CHECK(bhas::get_current_stream()->frames_per_buffer->value == FRAMES_PER_BUFFER);
+		// The stream closes itself once the callback returns complete
+		wait_for_stream_to_finish();
+		CHECK(!bhas::get_current_stream());
+	});
+	CHECK(call_count == NUM_CALLBACKS);
+	CHECK(bad_step_count == 0);
+	// The callbacks are paced by the clock, so they take as long as the
+	// audio they produce, give or take a buffer for scheduling.
+	const auto expected = double(FRAMES_PER_BUFFER * (NUM_CALLBACKS - 1)) / SAMPLE_RATE;
+	const auto elapsed  = std::chrono::duration<double>(last_call - first_call).count();
+	CHECK(elapsed == doctest::Approx(expected).epsilon(0.25));
+}
+
+auto read_file(const std::filesystem::path& path) -> std::vector<std::byte> {
+	std::ifstream file{path, std::ios::binary};
+	std::vector<char> bytes{std::istreambuf_iterator<char>{file}, std::istreambuf_iterator<char>{}};
+	std::vector<std::byte> out(bytes.size());
+	std::memcpy(out.data(), bytes.data(), bytes.size());
+	return out;
+}
+
+auto read_u32(const std::vector<std::byte>& bytes, size_t offset) -> uint32_t {
+	uint32_t v;
+	std::memcpy(&v, bytes.data() + offset, sizeof(v));
+	return v;
+}
+
+auto read_u64(const std::vector<std::byte>& bytes, size_t offset) -> uint64_t {
+	uint64_t v;
+	std::memcpy(&v, bytes.data() + offset, sizeof(v));
+	return v;
+}
+
+auto read_tag(const std::vector<std::byte>& bytes, size_t offset) -> std::string {
+	return {reinterpret_cast<const char*>(bytes.data()) + offset, 4};
+}
+
+TEST_CASE("wav files are written as RIFF, or as RF64 when they're too big for it") {
+	static constexpr auto NUM_FRAMES = uint64_t{1001};
+	const auto path = std::filesystem::temp_directory_path() / "bhas_test_writer.wav";
+	bhas::wav::format format;
+	format.num_channels = {3};
+	format.sample_rate  = {44100};
+	SUBCASE("int16") { format.sample_format = bhas::sample_format::int16; }
+	SUBCASE("int24") { format.sample_format = bhas::sample_format::int24; }
+	SUBCASE("float32") { format.sample_format = bhas::sample_format::float32; }
+	const auto bytes_per_sample = bhas::convert::get_bytes_per_sample(format.sample_format);
+	// Every sample has a different value, so misplaced samples show up
+	std::vector<std::vector<std::byte>> planes(format.num_channels.value, std::vector<std::byte>(NUM_FRAMES * bytes_per_sample));
+	for (uint32_t ch = 0; ch < format.num_channels.value; ch++) {
+		for (size_t i = 0; i < planes[ch].size(); i++) {
+			planes[ch][i] = std::byte(i * 7 + ch);
+		}
+	}
+	const std::vector<const void*> pointers = {planes[0].data(), planes[1].data(), planes[2].data()};
+	for (const auto rf64 : {false, true}) {
+		CAPTURE(rf64);
+		bhas::log log;
+		bhas::wav::writer writer;
+		// A tiny buffer, so that the writes straddle it
+		REQUIRE(bhas::wav::open(path.string(), format, &writer, &log, 100));
+		if (rf64) {
+			writer.max_riff_size = 1000;
+		}
+		// In two uneven halves
+		CHECK(bhas::wav::write(&writer, pointers.data(), 400));
+		const std::vector<const void*> rest = {planes[0].data() + 400 * bytes_per_sample, planes[1].data() + 400 * bytes_per_sample, planes[2].data() + 400 * bytes_per_sample};
+		CHECK(bhas::wav::write(&writer, rest.data(), NUM_FRAMES - 400));
+		CHECK(bhas::wav::get_frame_count(writer) == NUM_FRAMES);
+		CHECK(bhas::wav::close(&writer, &log));
+		CHECK(log.empty());
+		const auto bytes     = read_file(path);
+		const auto data_size = NUM_FRAMES * format.num_channels.value * bytes_per_sample;
+		// RIFF, then the JUNK or ds64 chunk, then an extensible fmt chunk
+		// because there are more than two channels
+		const auto data_offset = size_t{12 + 36 + 48 + 8};
+		REQUIRE(bytes.size() == data_offset + data_size + (data_size & 1));
+		CHECK(read_tag(bytes, 8) == "WAVE");
+		CHECK(read_tag(bytes, 48) == "fmt ");
+		CHECK(read_u32(bytes, 52) == 40);
+		CHECK(read_tag(bytes, data_offset - 8) == "data");
+		if (rf64) {
+			CHECK(read_tag(bytes, 0) == "RF64");
+			CHECK(read_u32(bytes, 4) == 0xFFFFFFFF);
+			CHECK(read_tag(bytes, 12) == "ds64");
+			CHECK(read_u64(bytes, 20) == bytes.size() - 8);
+			CHECK(read_u64(bytes, 28) == data_size);
+			CHECK(read_u64(bytes, 36) == NUM_FRAMES);
+			CHECK(read_u32(bytes, data_offset - 4) == 0xFFFFFFFF);
+		}
+		else {
+			CHECK(read_tag(bytes, 0) == "RIFF");
+			CHECK(read_u32(bytes, 4) == bytes.size() - 8);
+			CHECK(read_tag(bytes, 12) == "JUNK");
+			CHECK(read_u32(bytes, data_offset - 4) == data_size);
+		}
+		auto mismatches = 0;
+		for (uint64_t frame = 0; frame < NUM_FRAMES; frame++) {
+			for (uint32_t ch = 0; ch < format.num_channels.value; ch++) {
+				const auto file = bytes.data() + data_offset + (frame * format.num_channels.value + ch) * bytes_per_sample;
+				mismatches += std::memcmp(file, planes[ch].data() + frame * bytes_per_sample, bytes_per_sample) != 0;
+			}
+		}
+		CHECK(mismatches == 0);
+	}
+	std::filesystem::remove(path);
+}
+
+TEST_CASE("the offline backend renders faster than real time with frame-accurate timing") {
+	static constexpr auto SAMPLE_RATE       = 48000;
+	static constexpr auto FRAMES_PER_BUFFER = 1024;
+	// Not a multiple of the buffer size, so the last buffer is short
+	static constexpr auto NUM_FRAMES        = uint64_t{SAMPLE_RATE * 10 + 100};
+	const auto path = std::filesystem::temp_directory_path() / "bhas_test_offline.wav";
+	std::atomic<uint64_t> frames_seen = 0;
+	std::atomic<int> bad_time_count = 0;
+	std::atomic<int> complete_after = 0;
+	auto audio = [&](bhas::input_buffer input, bhas::output_buffer output, bhas::frame_count frame_count, bhas::sample_rate sample_rate, bhas::output_latency output_latency, const bhas::time_info* time_info) -> bhas::callback_result {
+		const auto first = frames_seen.load();
+		if (time_info->output_buffer_dac_time != double(first) / SAMPLE_RATE) {
+			bad_time_count++;
+		}
+		// Each sample holds its frame's position in the file, in the
+		// first channel only
+		for (uint32_t i = 0; i < frame_count.value; i++) {
+			output.buffer[0][i] = float((first + i) % 65536);
+			output.buffer[1][i] = 0.0f;
+		}
+		frames_seen += frame_count.value;
+		const auto calls = first / FRAMES_PER_BUFFER + 1;
+		return complete_after > 0 && calls >= uint64_t(complete_after) ? bhas::callback_result::complete : bhas::callback_result::continue_;
+	};
+	auto expected_frames = NUM_FRAMES;
+	std::chrono::steady_clock::time_point start_time;
+	const auto setup = [&](bhas::stream_request* request) {
+		request->sample_rate       = bhas::sample_rate{SAMPLE_RATE};
+		request->frames_per_buffer = bhas::frame_count{FRAMES_PER_BUFFER};
+		request->offline.path      = path.string();
+		SUBCASE("a fixed length") {
+			request->offline.num_frames = NUM_FRAMES;
+		}
+		SUBCASE("until the callback completes") {
+			complete_after  = 7;
+			expected_frames = 7 * FRAMES_PER_BUFFER;
+		}
+		start_time = std::chrono::steady_clock::now();
+	};
+	run_stream(std::move(audio), bhas::backend::offline, setup, [&](const bhas::stream_request&) {
+		CHECK(bhas::get_current_stream()->output_latency.value == 0.0);
+		wait_for_stream_to_finish();
+		const auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+		REQUIRE(!bhas::get_current_stream());
+		if (expected_frames >= SAMPLE_RATE) {
+			CHECK(elapsed < double(expected_frames) / SAMPLE_RATE);
+		}
+	});
+	CHECK(frames_seen == expected_frames);
+	CHECK(bad_time_count == 0);
+	// Stereo float, so a plain 18 byte fmt chunk
+	const auto bytes       = read_file(path);
+	const auto data_offset = size_t{12 + 36 + 26 + 8};
+	REQUIRE(bytes.size() == data_offset + expected_frames * 2 * sizeof(float));
+	CHECK(read_tag(bytes, 0) == "RIFF");
+	CHECK(read_u32(bytes, data_offset - 4) == expected_frames * 2 * sizeof(float));
+	auto mismatches = 0;
+	for (uint64_t frame = 0; frame < expected_frames; frame++) {
+		float sample;
+		std::memcpy(&sample, bytes.data() + data_offset + frame * 2 * sizeof(float), sizeof(float));
+		mismatches += sample != float(frame % 65536);
+	}
+	CHECK(mismatches == 0);
+	std::filesystem::remove(path);
+}
+
+TEST_CASE("the offline backend takes the engine's latency back out of the file") {
+	static constexpr auto SAMPLE_RATE = 48000;
+	// The buffer size isn't a multiple of the block size, so the
+	// re-blocker delays the output
+	static constexpr auto FRAMES_PER_BUFFER = 1000;
+	static constexpr auto BLOCK_SIZE        = 256;
+	static constexpr auto NUM_FRAMES        = uint64_t{10000};
+	const auto path = std::filesystem::temp_directory_path() / "bhas_test_offline_latency.wav";
+	uint64_t frames_seen = 0;
+	auto audio = [&frames_seen](bhas::input_buffer input, bhas::output_buffer output, bhas::frame_count frame_count, bhas::sample_rate sample_rate, bhas::output_latency output_latency, const bhas::time_info* time_info) -> bhas::callback_result {
+		for (uint32_t i = 0; i < frame_count.value; i++) {
+			output.buffer[0][i] = float(frames_seen + i + 1);
+			output.buffer[1][i] = 0.0f;
+		}
+		frames_seen += frame_count.value;
+		return bhas::callback_result::continue_;
+	};
+	const auto setup = [&path](bhas::stream_request* request) {
+		request->sample_rate        = bhas::sample_rate{SAMPLE_RATE};
+		request->frames_per_buffer  = bhas::frame_count{FRAMES_PER_BUFFER};
+		request->block_size         = bhas::frame_count{BLOCK_SIZE};
+		request->offline.path       = path.string();
+		request->offline.num_frames = NUM_FRAMES;
+	};
+	run_stream(std::move(audio), bhas::backend::offline, setup, [](const bhas::stream_request&) {
+		CHECK(bhas::get_current_stream()->output_latency.value > 0.0);
+		wait_for_stream_to_finish();
+		REQUIRE(!bhas::get_current_stream());
+	});
+	// Every frame the callback produced is in the file, from the first
+	// one on, and nothing else
+	const auto bytes       = read_file(path);
+	const auto data_offset = size_t{12 + 36 + 26 + 8};
+	REQUIRE(bytes.size() == data_offset + NUM_FRAMES * 2 * sizeof(float));
+	auto mismatches = 0;
+	for (uint64_t frame = 0; frame < NUM_FRAMES; frame++) {
+		float sample;
+		std::memcpy(&sample, bytes.data() + data_offset + frame * 2 * sizeof(float), sizeof(float));
+		mismatches += sample != float(frame + 1);
+	}
+	CHECK(mismatches == 0);
+	std::filesystem::remove(path);
+}
+
+TEST_CASE("render-ahead is rejected by the offline backend") {
+	check_stream_fails_to_start(bhas::backend::offline, [](bhas::stream_request* request) {
+		request->block_size         = bhas::frame_count{256};
+		request->render_ahead.value = true;
+		request->offline.num_frames = uint64_t{1024};
+	});
+}
+
+auto write_test_wav(const std::filesystem::path& path, bhas::sample_format sample_format, uint32_t num_channels, uint32_t num_frames) -> void {
+	// Channel ch of frame i holds (i + 1000 * ch) / 32768, which every
+	// format can represent exactly.
+	bhas::wav::format format;
+	format.sample_format = sample_format;
+	format.num_channels  = {num_channels};
+	format.sample_rate   = {48000};
+	std::vector<float> floats(size_t(num_frames) * num_channels);
+	for (uint32_t i = 0; i < num_frames; i++) {
+		for (uint32_t ch = 0; ch < num_channels; ch++) {
+			floats[size_t(i) * num_channels + ch] = float((i % 30000) + 1000 * ch) / 32768.0f;
+		}
+	}
+	std::vector<std::byte> samples(floats.size() * bhas::convert::get_bytes_per_sample(sample_format));
+	bhas::convert::from_float(sample_format, floats.data(), samples.data(), floats.size(), nullptr);
+	bhas::log log;
+	bhas::wav::writer writer;
+	REQUIRE(bhas::wav::open(path.string(), format, &writer, &log));
+	REQUIRE(bhas::wav::write(&writer, samples.data(), num_frames));
+	REQUIRE(bhas::wav::close(&writer, &log));
+}
+
+auto expected_input_sample(uint64_t frame, uint32_t ch) -> float {
+	return float((frame % 30000) + 1000 * ch) / 32768.0f;
+}
+
+TEST_CASE("an input file is fed to the callback frame for frame under the offline backend") {
+	static constexpr auto FILE_FRAMES  = 10000u;
+	static constexpr auto NUM_FRAMES   = uint64_t{25000};
+	static constexpr auto NUM_CHANNELS = 3u;
+	const auto path = std::filesystem::temp_directory_path() / "bhas_test_input.wav";
+	// The file has one channel fewer than the stream opens
+	write_test_wav(path, bhas::sample_format::int16, NUM_CHANNELS - 1, FILE_FRAMES);
+	std::vector<std::array<float, NUM_CHANNELS>> received;
+	received.reserve(NUM_FRAMES);
+	bhas::buffer_layout layout = bhas::buffer_layout::non_interleaved;
+	auto loop = false;
+	auto audio = [&received, &layout](bhas::input_buffer input, bhas::output_buffer output, bhas::frame_count frame_count, bhas::sample_rate sample_rate, bhas::output_latency output_latency, const bhas::time_info* time_info) -> bhas::callback_result {
+		for (uint32_t i = 0; i < frame_count.value; i++) {
+			std::array<float, NUM_CHANNELS> frame;
+			for (uint32_t ch = 0; ch < NUM_CHANNELS; ch++) {
+				frame[ch] = layout == bhas::buffer_layout::interleaved ? input.buffer[0][i * NUM_CHANNELS + ch] : input.buffer[ch][i];
+			}
+			received.push_back(frame);
+		}
+		return bhas::callback_result::continue_;
+	};
+	const auto setup = [&](bhas::stream_request* request) {
+		request->sample_rate        = bhas::sample_rate{48000};
+		request->num_input_channels = bhas::channel_count{NUM_CHANNELS};
+		request->frames_per_buffer  = bhas::frame_count{1000};
+		request->offline.num_frames = NUM_FRAMES;
+		request->input_file.path    = path.string();
+		// Smaller than the file, so the reader has to keep up
+		request->input_file.prefetch = bhas::seconds{0.01};
+		SUBCASE("once") {}
+		SUBCASE("looping") { request->input_file.loop = loop = true; }
+		SUBCASE("interleaved float") {
+			request->sample_format = bhas::sample_format::float32;
+			request->buffer_layout = layout = bhas::buffer_layout::interleaved;
+		}
+		SUBCASE("int24 device") { request->sample_format = bhas::sample_format::int24; }
+	};
+	run_stream(std::move(audio), bhas::backend::offline, setup, [](const bhas::stream_request&) {
+		wait_for_stream_to_finish();
+		CHECK(bhas::get_xrun_stats().input_underflow.count == 0);
+	});
+	REQUIRE(received.size() == NUM_FRAMES);
+	auto mismatches = 0;
+	for (uint64_t i = 0; i < NUM_FRAMES; i++) {
+		for (uint32_t ch = 0; ch < NUM_CHANNELS; ch++) {
+			const auto in_file  = ch < NUM_CHANNELS - 1 && (loop || i < FILE_FRAMES);
+			const auto expected = in_file ? expected_input_sample(i % FILE_FRAMES, ch) : 0.0f;
+			mismatches += received[i][ch] != expected;
+		}
+	}
+	CHECK(mismatches == 0);
+	std::filesystem::remove(path);
+}
+
+TEST_CASE("an input file which ends part way through a buffer renders the same every time") {
+	static constexpr auto FILE_FRAMES = 10007u;
+	static constexpr auto NUM_FRAMES  = uint64_t{12000};
+	static constexpr auto NUM_RENDERS = 10;
+	const auto path = std::filesystem::temp_directory_path() / "bhas_test_input_tail.wav";
+	write_test_wav(path, bhas::sample_format::float32, 1, FILE_FRAMES);
+	for (int render = 0; render < NUM_RENDERS; render++) {
+		CAPTURE(render);
+		std::vector<float> received;
+		received.reserve(NUM_FRAMES);
+		auto audio = [&received](bhas::input_buffer input, bhas::output_buffer output, bhas::frame_count frame_count, bhas::sample_rate sample_rate, bhas::output_latency output_latency, const bhas::time_info* time_info) -> bhas::callback_result {
+			received.insert(received.end(), input.buffer[0], input.buffer[0] + frame_count.value);
+			return bhas::callback_result::continue_;
+		};
+		const auto setup = [&path](bhas::stream_request* request) {
+			request->sample_rate         = bhas::sample_rate{48000};
+			request->num_input_channels  = bhas::channel_count{1};
+			request->frames_per_buffer   = bhas::frame_count{1000};
+			request->offline.num_frames  = NUM_FRAMES;
+			request->input_file.path     = path.string();
+			request->input_file.prefetch = bhas::seconds{0.01};
+		};
+		run_stream(std::move(audio), bhas::backend::offline, setup, [](const bhas::stream_request&) {
+			wait_for_stream_to_finish();
+			CHECK(bhas::get_xrun_stats().input_underflow.count == 0);
+		});
+		REQUIRE(received.size() == NUM_FRAMES);
+		// The whole file, with nothing but silence after it
+		auto mismatches = 0;
+		for (uint64_t i = 0; i < NUM_FRAMES; i++) {
+			mismatches += received[i] != (i < FILE_FRAMES ? expected_input_sample(i, 0) : 0.0f);
+		}
+		CHECK(mismatches == 0);
+	}
+	std::filesystem::remove(path);
+}
+
+TEST_CASE("an input file plays in real time under the null backend") {
+	static constexpr auto FILE_FRAMES = 4800u;
+	const auto path = std::filesystem::temp_directory_path() / "bhas_test_input_rt.wav";
+	write_test_wav(path, bhas::sample_format::float32, 1, FILE_FRAMES);
+	std::atomic<uint64_t> frames_seen = 0;
+	std::atomic<int> mismatches = 0;
+	auto audio = [&frames_seen, &mismatches](bhas::input_buffer input, bhas::output_buffer output, bhas::frame_count frame_count, bhas::sample_rate sample_rate, bhas::output_latency output_latency, const bhas::time_info* time_info) -> bhas::callback_result {
+		const auto first = frames_seen.load();
+		for (uint32_t i = 0; i < frame_count.value; i++) {
+			mismatches += input.buffer[0][i] != expected_input_sample((first + i) % FILE_FRAMES, 0);
+		}
+		bhas::buffer::zero(output, {NUM_OUTPUT_CHANNELS}, frame_count);
+		frames_seen += frame_count.value;
+		return frames_seen < FILE_FRAMES * 3 ? bhas::callback_result::continue_ : bhas::callback_result::complete;
+	};
+	const auto setup = [&path](bhas::stream_request* request) {
+		request->sample_rate       = bhas::sample_rate{48000};
+		request->frames_per_buffer = bhas::frame_count{480};
+		request->input_file.path   = path.string();
+		request->input_file.loop   = true;
+	};
+	run_stream(std::move(audio), bhas::backend::null, setup, [](const bhas::stream_request&) {
+		wait_for_stream_to_finish();
+		CHECK(bhas::get_xrun_stats().input_underflow.count == 0);
+	});
+	CHECK(frames_seen >= FILE_FRAMES * 3);
+	CHECK(mismatches == 0);
+	std::filesystem::remove(path);
+}
+
+TEST_CASE("an input file at another rate to the device fails to start") {
+	const auto path = std::filesystem::temp_directory_path() / "bhas_test_input_rate.wav";
+	write_test_wav(path, bhas::sample_format::float32, 1, 480);
+	const auto setup = [&path](bhas::stream_request* request) {
+		request->sample_rate     = bhas::sample_rate{44100};
+		request->input_file.path = path.string();
+	};
+	check_stream_fails_to_start(bhas::backend::null, setup);
+	// Resampling from the file's rate works, and any error would fail the
+	// test through the default report callback
+	const auto resample = [&setup](bhas::stream_request* request) {
+		setup(request);
+		request->resampler.enabled            = true;
+		request->resampler.device_sample_rate = bhas::sample_rate{48000};
+	};
+	run_stream(make_default_audio_cb(), bhas::backend::null, resample, [](const bhas::stream_request&) {});
+	std::filesystem::remove(path);
+}
+
+TEST_CASE("the loopback backend returns the output to the input after the configured delay") {
+	static constexpr auto FRAMES_PER_BUFFER = 256u;
+	static constexpr auto SAMPLE_RATE       = 48000u;
+	// Deliberately not a multiple of the buffer size
+	static constexpr auto DELAY             = 700u;
+	static constexpr auto NUM_FRAMES        = FRAMES_PER_BUFFER * 8;
+	uint64_t frames_seen = 0;
+	std::optional<uint64_t> impulse_frame;
+	int stray_samples = 0;
+	auto audio = [&](bhas::input_buffer input, bhas::output_buffer output, bhas::frame_count frame_count, bhas::sample_rate sample_rate, bhas::output_latency output_latency, const bhas::time_info* time_info) -> bhas::callback_result {
+		bhas::buffer::zero(output, {NUM_OUTPUT_CHANNELS}, frame_count);
+		for (uint32_t i = 0; i < frame_count.value; i++) {
+			const auto frame = frames_seen + i;
+			if (frame == 0) {
+				output.buffer[0][i] = 1.0f;
+			}
+			if (input.buffer[0][i] != 0.0f) {
+				if (impulse_frame) { stray_samples++; }
+				else               { impulse_frame = frame; }
+			}
+			// Nothing was sent on the other channel
+			stray_samples += input.buffer[1][i] != 0.0f;
+		}
+		frames_seen += frame_count.value;
+		return frames_seen < NUM_FRAMES ? bhas::callback_result::continue_ : bhas::callback_result::complete;
+	};
+	const auto setup = [](bhas::stream_request* request) {
+		request->sample_rate       = bhas::sample_rate{SAMPLE_RATE};
+		request->frames_per_buffer = bhas::frame_count{FRAMES_PER_BUFFER};
+		request->loopback.delay    = bhas::frame_count{DELAY};
+	};
+	run_stream(std::move(audio), bhas::backend::loopback, setup, [](const bhas::stream_request&) {
+		// The latencies the stream reports add up to the round trip
+		const auto stream = bhas::get_current_stream();
+		CHECK(stream->input_latency.value + stream->output_latency.value == doctest::Approx(double(DELAY) / SAMPLE_RATE));
+		wait_for_stream_to_finish();
+	});
+	REQUIRE(impulse_frame);
+	CHECK(*impulse_frame == DELAY);
+	CHECK(stray_samples == 0);
+}
+
+TEST_CASE("the loopback backend's clock drift shows up in the timing, and its jitter as xruns") {
+	static constexpr auto FRAMES_PER_BUFFER = 256u;
+	static constexpr auto SAMPLE_RATE       = 48000u;
+	static constexpr auto DRIFT_PPM         = 20000.0;
+	static constexpr auto NUM_CALLBACKS     = 40;
+	int call_count = 0;
+	int bad_step_count = 0;
+	auto drifting = [&, previous_adc_time = -1.0](bhas::input_buffer input, bhas::output_buffer output, bhas::frame_count frame_count, bhas::sample_rate sample_rate, bhas::output_latency output_latency, const bhas::time_info* time_info) mutable -> bhas::callback_result {
+		// The device's clock runs fast, so each buffer takes less system
+		// time than it would at the nominal rate
+		const auto step = time_info->input_buffer_adc_time - previous_adc_time;
+		if (call_count > 0 && std::abs(step - double(FRAMES_PER_BUFFER) / (SAMPLE_RATE * (1.0 + DRIFT_PPM * 1e-6))) > 1e-9) {
+			bad_step_count++;
+		}
+		previous_adc_time = time_info->input_buffer_adc_time;
+		bhas::buffer::zero(output, {NUM_OUTPUT_CHANNELS}, frame_count);
+		return ++call_count < NUM_CALLBACKS ? bhas::callback_result::continue_ : bhas::callback_result::complete;
+	};
+	const auto drift = [](bhas::stream_request* request) {
+		request->sample_rate        = bhas::sample_rate{SAMPLE_RATE};
+		request->frames_per_buffer  = bhas::frame_count{FRAMES_PER_BUFFER};
+		request->loopback.drift_ppm = DRIFT_PPM;
+	};
+	run_stream(std::move(drifting), bhas::backend::loopback, drift, [](const bhas::stream_request&) {
+		wait_for_stream_to_finish();
+		CHECK(bhas::get_xrun_stats().output_underflow.count == 0);
+	});
+	CHECK(call_count == NUM_CALLBACKS);
+	CHECK(bad_step_count == 0);
+	// Now wake each callback up to three buffers late. Some of them lose
+	// their buffer, but the stream carries on.
+	call_count = 0;
+	auto jittery = [&](bhas::input_buffer input, bhas::output_buffer output, bhas::frame_count frame_count, bhas::sample_rate sample_rate, bhas::output_latency output_latency, const bhas::time_info* time_info) -> bhas::callback_result {
+		bhas::buffer::zero(output, {NUM_OUTPUT_CHANNELS}, frame_count);
+		return ++call_count < NUM_CALLBACKS ? bhas::callback_result::continue_ : bhas::callback_result::complete;
+	};
+	const auto jitter = [](bhas::stream_request* request) {
+		request->sample_rate       = bhas::sample_rate{SAMPLE_RATE};
+		request->frames_per_buffer = bhas::frame_count{FRAMES_PER_BUFFER};
+		request->loopback.jitter   = bhas::seconds{3.0 * FRAMES_PER_BUFFER / SAMPLE_RATE};
+		request->loopback.seed     = 1234;
+	};
+	run_stream(std::move(jittery), bhas::backend::loopback, jitter, [](const bhas::stream_request&) {
+		wait_for_stream_to_finish();
+		CHECK(bhas::get_xrun_stats().output_underflow.count > 0);
+	});
+	CHECK(call_count == NUM_CALLBACKS);
+}
+
+TEST_CASE("a loopback delay shorter than a buffer is rejected") {
+	check_stream_fails_to_start(bhas::backend::loopback, [](bhas::stream_request* request) {
+		request->frames_per_buffer = bhas::frame_count{256};
+		request->loopback.delay    = bhas::frame_count{100};
+	});
+}
+
+// Only runs when the library was built with BHAS_ALSA, on a machine whose
+// ALSA configuration has the null PCM (every stock one does.)
+TEST_CASE("the ALSA backend streams to the null PCM") {
+	static constexpr auto FRAMES_PER_BUFFER = 256u;
+	static constexpr auto NUM_CALLBACKS     = 50;
+	Tracking tracking;
+	std::atomic<int> call_count = 0;
+	auto cb = make_default_callbacks(&tracking);
+	cb.report = [](bhas::log log) -> void {};
+	cb.audio  = [&call_count](bhas::input_buffer input, bhas::output_buffer output, bhas::frame_count frame_count, bhas::sample_rate sample_rate, bhas::output_latency output_latency, const bhas::time_info* time_info) -> bhas::callback_result {
+		bhas::buffer::zero(output, {NUM_OUTPUT_CHANNELS}, frame_count);
+		return ++call_count < NUM_CALLBACKS ? bhas::callback_result::continue_ : bhas::callback_result::complete;
+	};
+	if (!bhas::init(std::move(cb), bhas::backend::alsa)) {
+		MESSAGE("the ALSA backend isn't available");
+		return;
+	}
+	const auto& system = bhas::get_system();
+	const auto device  = std::find_if(system.devices.begin(), system.devices.end(), [](const bhas::device& d) { return d.name.value == "null"; });
+	if (device == system.devices.end()) {
+		MESSAGE("there's no null PCM");
+		bhas::shutdown();
+		return;
+	}
+	bhas::stream_request request;
+	request.output_device       = device->index;
+	request.num_output_channels = bhas::channel_count{NUM_OUTPUT_CHANNELS};
+	request.sample_rate         = bhas::sample_rate{48000};
+	request.frames_per_buffer   = bhas::frame_count{FRAMES_PER_BUFFER};
+	if (!try_to_open_stream(request, &tracking)) {
+		FAIL_CHECK("failed to start an ALSA stream");
+		bhas::shutdown();
+		return;
+	}
+	CHECK(bhas::get_current_stream()->frames_per_buffer->value == FRAMES_PER_BUFFER);
+	const auto start_time = std::chrono::steady_clock::now();
+	while (bhas::get_current_stream() && std::chrono::steady_clock::now() - start_time < STOP_STREAM_TIMEOUT) {
+		bhas::update();
+		std::this_thread::sleep_for(WAIT_TIME);
+	}
+	CHECK(!bhas::get_current_stream());
+	CHECK(call_count == NUM_CALLBACKS);
+	bhas::shutdown();
+}
+
+#if BHAS_RT_CHECKS
+TEST_CASE("the real-time checker reports allocations and locks made in the audio callback") {
+	const auto contains = [](const bhas::log& log, std::string_view function) {
+		return std::any_of(log.begin(), log.end(), [function](const bhas::log_item& item) {
+			const auto e = std::get_if<bhas::error>(&item);
+			return e && e->value.find(function) != std::string::npos;
+		});
+	};
+	std::mutex mutex;
+	// volatile so that the allocation isn't optimized out
+	void* volatile ptr = nullptr;
+	bhas::rt::enter_audio_callback();
+	ptr = std::malloc(64);
+	std::free(ptr);
+	{
+		std::lock_guard lock{mutex};
+	}
+	bhas::rt::leave_audio_callback();
+	// Outside of the callback nothing is recorded
+	ptr = std::malloc(64);
+	std::free(ptr);
+	bhas::log log;
+	bhas::rt::take_violation_report(&log);
+	CHECK(log.size() == 3);
+	CHECK(contains(log, "malloc was called"));
+	CHECK(contains(log, "free was called"));
+	CHECK(contains(log, "pthread_mutex_lock was called"));
+	log.clear();
+	bhas::rt::take_violation_report(&log);
+	CHECK(log.empty());
+}
+
+TEST_CASE("the real-time checker reports allocations made by worker jobs and the audio callback at the same time") {
+	static constexpr uint32_t NUM_JOBS = 4;
+	static constexpr int NUM_BATCHES   = 200;
+	REQUIRE(bhas::workers::start(bhas::thread_count{3}, {}).value == 3);
+	size_t num_mallocs = 0;
+	size_t num_frees   = 0;
+	size_t num_other   = 0;
+	for (int batch = 0; batch < NUM_BATCHES; batch++) {
+		bhas::rt::enter_audio_callback();
+		bhas::run_jobs(NUM_JOBS, [](uint32_t) {
+			// volatile so that the allocation isn't optimized out
+			void* volatile ptr = std::malloc(64);
+			std::free(ptr);
+		});
+		void* volatile ptr = std::malloc(64);
+		std::free(ptr);
+		bhas::rt::leave_audio_callback();
+		bhas::log log;
+		bhas::rt::take_violation_report(&log);
+		for (const auto& item : log) {
+			const auto e = std::get_if<bhas::error>(&item);
+			if (e && e->value.starts_with("Real-time safety violation: malloc was called")) {
+				num_mallocs++;
+			}
+			else if (e && e->value.starts_with("Real-time safety violation: free was called")) {
+				num_frees++;
+			}
+			else {
+				num_other++;
+			}
+		}
+	}
+	bhas::workers::stop();
+	// Every one reported once, whichever thread it happened on, and
+	// nothing dropped or garbled
+	CHECK(num_mallocs == NUM_BATCHES * (NUM_JOBS + 1));
+	CHECK(num_frees == NUM_BATCHES * (NUM_JOBS + 1));
+	CHECK(num_other == 0);
+}
+#endif
@@ -0,0 +1,58 @@
+#pragma once
+
+#include "bhas_spsc.h"
+#include <atomic>
+#include <cstdint>
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#include <immintrin.h>
+#endif
+
+namespace bhas {
+
+// How long a thread spins before going to sleep in the kernel.
+static constexpr int WAIT_SPIN_COUNT = 2000;
+
+// A word which threads can wait on. Waiting spins for a while first, and
+// waking only makes a system call if somebody is actually asleep.
+struct wait_word {
+	alignas(CACHE_LINE_SIZE) std::atomic<uint32_t> value = 0;
+	std::atomic<uint32_t> sleepers = 0;
+};
+
+inline
+auto cpu_relax() -> void {
+#	if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+	_mm_pause();
+#	elif defined(__aarch64__)
+	asm volatile("yield");
+#	endif
+}
+
+template <typename Pred>
+auto wait_until(wait_word* word, Pred done) -> void {
+	for (int i = 0; i < WAIT_SPIN_COUNT; i++) {
+		if (done(word->value.load(std::memory_order_acquire))) {
+			return;
+		}
+		cpu_relax();
+	}
+	word->sleepers.fetch_add(1, std::memory_order_seq_cst);
+	for (;;) {
+		const auto value = word->value.load(std::memory_order_seq_cst);
+		if (done(value)) {
+			break;
+		}
+		word->value.wait(value, std::memory_order_acquire);
+	}
+	word->sleepers.fetch_sub(1, std::memory_order_relaxed);
+}
+
+// Call after changing the value with a seq_cst operation.
+inline
+auto wake(wait_word* word) -> void {
+	if (word->sleepers.load(std::memory_order_seq_cst) > 0) {
+		word->value.notify_all();
+	}
+}
+
+} // bhas
@@ -0,0 +1,445 @@
+#include "bhas_wav.h"
+#include "bhas_convert.h"
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <cstring>
+#include <format>
+#include <optional>
+
+namespace bhas {
+namespace wav {
+
+static constexpr uint16_t FORMAT_PCM        = 0x0001;
+static constexpr uint16_t FORMAT_FLOAT      = 0x0003;
+static constexpr uint16_t FORMAT_EXTENSIBLE = 0xFFFE;
+// The size of an RF64 ds64 chunk with an empty table. The JUNK chunk
+// which holds its place is the same size.
+static constexpr uint32_t DS64_SIZE         = 28;
+// The rest of the GUID which follows the format tag in an extensible
+// fmt chunk
+static constexpr std::array<uint8_t, 14> SUBFORMAT_GUID_TAIL = {0x00, 0x00, 0x00, 0x00, 0x10, 0x00, 0x80, 0x00, 0x00, 0xAA, 0x00, 0x38, 0x9B, 0x71};
+
+// Writes little-endian fields into a header.
+struct HeaderBuilder {
+	std::vector<std::byte> bytes;
+	auto tag(const char* s) -> void {
+		for (int i = 0; i < 4; i++) {
+			bytes.push_back(std::byte(s[i]));
+		}
+	}
+	auto u16(uint16_t v) -> void {
+		bytes.push_back(std::byte(v & 0xFF));
+		bytes.push_back(std::byte(v >> 8));
+	}
+	auto u32(uint32_t v) -> void {
+		u16(uint16_t(v & 0xFFFF));
+		u16(uint16_t(v >> 16));
+	}
+	auto u64(uint64_t v) -> void {
+		u32(uint32_t(v & 0xFFFFFFFF));
+		u32(uint32_t(v >> 32));
+	}
+	auto zeros(size_t count) -> void {
+		bytes.insert(bytes.end(), count, std::byte{0});
+	}
+};
+
+[[nodiscard]] static
+auto get_bits_per_sample(bhas::sample_format format) -> uint16_t {
+	return uint16_t(convert::get_bytes_per_sample(format) * 8);
+}
+
+// Plain PCM and float headers are only unambiguous for up to two
+// channels of at most 16 bits. Anything else gets the extensible form.
+[[nodiscard]] static
+auto is_extensible(const format& fmt) -> bool {
+	if (fmt.num_channels.value > 2) {
+		return true;
+	}
+	return fmt.sample_format == bhas::sample_format::int24 || fmt.sample_format == bhas::sample_format::int32;
+}
+
+[[nodiscard]] static
+auto get_format_tag(const format& fmt) -> uint16_t {
+	return fmt.sample_format == bhas::sample_format::float32 ? FORMAT_FLOAT : FORMAT_PCM;
+}
+
+// Everything up to and including the data chunk's size field, with the
+// sizes left at zero.
+[[nodiscard]] static
+auto make_header(const format& fmt) -> std::vector<std::byte> {
+	const auto bits        = get_bits_per_sample(fmt.sample_format);
+	const auto block_align = uint16_t(fmt.num_channels.value * (bits / 8));
+	const auto extensible  = is_extensible(fmt);
+	const auto tag         = get_format_tag(fmt);
+	HeaderBuilder h;
+	h.tag("RIFF");
+	h.u32(0);
+	h.tag("WAVE");
+	h.tag("JUNK");
+	h.u32(DS64_SIZE);
+	h.zeros(DS64_SIZE);
+	h.tag("fmt ");
+	h.u32(extensible ? 40 : tag == FORMAT_FLOAT ? 18 : 16);
+	h.u16(extensible ? FORMAT_EXTENSIBLE : tag);
+	h.u16(uint16_t(fmt.num_channels.value));
+	h.u32(fmt.sample_rate.value);
+	h.u32(fmt.sample_rate.value * block_align);
+	h.u16(block_align);
+	h.u16(bits);
+	if (extensible) {
+		h.u16(22);
+		h.u16(bits);
+		// No speaker assignment
+		h.u32(0);
+		h.u16(tag);
+		for (const auto b : SUBFORMAT_GUID_TAIL) {
+			h.bytes.push_back(std::byte(b));
+		}
+	}
+	else if (tag == FORMAT_FLOAT) {
+		h.u16(0);
+	}
+	h.tag("data");
+	h.u32(0);
+	return h.bytes;
+}
+
+[[nodiscard]] static
+auto get_header_size(const format& fmt) -> size_t {
+	return make_header(fmt).size();
+}
+
+[[nodiscard]] static
+auto err_failed_to_open(const std::string& path, int error) -> bhas::error {
+	return {std::format("Failed to open '{}' for writing. ({})", path, std::strerror(error))};
+}
+
+[[nodiscard]] static
+auto err_failed_to_write(const std::string& path) -> bhas::error {
+	return {std::format("Failed to write to '{}'. The file is incomplete. (Is the disk full?)", path)};
+}
+
+[[nodiscard]] static
+auto write_bytes(writer* w, const void* bytes, size_t count) -> bool {
+	if (w->failed) {
+		return false;
+	}
+	if (std::fwrite(bytes, 1, count, w->file) != count) {
+		w->failed = true;
+		return false;
+	}
+	return true;
+}
+
+[[nodiscard]] static
+auto flush(writer* w) -> bool {
+	const auto ok = write_bytes(w, w->buffer.data(), w->fill);
+	w->fill = 0;
+	return ok;
+}
+
+auto open(const std::string& path, const format& fmt, writer* w, bhas::log* log, size_t buffer_size) -> bool {
+	*w = {};
+	w->file = std::fopen(path.c_str(), "wb");
+	if (!w->file) {
+		log->push_back(err_failed_to_open(path, errno));
+		return false;
+	}
+	// Everything is buffered here already
+	std::setvbuf(w->file, nullptr, _IONBF, 0);
+	w->path            = path;
+	w->format          = fmt;
+	w->bytes_per_frame = convert::get_bytes_per_sample(fmt.sample_format) * fmt.num_channels.value;
+	// Always room for at least one frame
+	w->buffer.resize(std::max(buffer_size, w->bytes_per_frame));
+	const auto header = make_header(fmt);
+	if (!write_bytes(w, header.data(), header.size())) {
+		log->push_back(err_failed_to_write(path));
+		std::fclose(w->file);
+		w->file = nullptr;
+		return false;
+	}
+	return true;
+}
+
+auto write(writer* w, const void* frames, uint64_t frame_count) -> bool {
+	auto src   = static_cast<const std::byte*>(frames);
+	auto bytes = frame_count * w->bytes_per_frame;
+	w->data_size += bytes;
+	while (bytes > 0) {
+		// Big writes skip the buffer if there's nothing in it
+		if (w->fill == 0 && bytes >= w->buffer.size()) {
+			return write_bytes(w, src, size_t(bytes));
+		}
+		const auto n = size_t(std::min<uint64_t>(bytes, w->buffer.size() - w->fill));
+		std::memcpy(w->buffer.data() + w->fill, src, n);
+		w->fill += n;
+		src     += n;
+		bytes   -= n;
+		if (w->fill == w->buffer.size() && !flush(w)) {
+			return false;
+		}
+	}
+	return !w->failed;
+}
+
+template <size_t BytesPerSample> static
+auto interleave(const void* const* channels, uint32_t num_channels, uint64_t first_frame, size_t frame_count, std::byte* dst) -> void {
+	for (size_t i = 0; i < frame_count; i++) {
+		for (uint32_t ch = 0; ch < num_channels; ch++) {
+			const auto src = static_cast<const std::byte*>(channels[ch]) + (first_frame + i) * BytesPerSample;
+			std::memcpy(dst, src, BytesPerSample);
+			dst += BytesPerSample;
+		}
+	}
+}
+
+auto write(writer* w, const void* const* channels, uint64_t frame_count) -> bool {
+	const auto num_channels     = w->format.num_channels.value;
+	const auto bytes_per_sample = convert::get_bytes_per_sample(w->format.sample_format);
+	w->data_size += frame_count * w->bytes_per_frame;
+	uint64_t frame = 0;
+	while (frame < frame_count) {
+		const auto n   = size_t(std::min<uint64_t>(frame_count - frame, (w->buffer.size() - w->fill) / w->bytes_per_frame));
+		const auto dst = w->buffer.data() + w->fill;
+		switch (bytes_per_sample) {
+			case 2: interleave<2>(channels, num_channels, frame, n, dst); break;
+			case 3: interleave<3>(channels, num_channels, frame, n, dst); break;
+			default: interleave<4>(channels, num_channels, frame, n, dst); break;
+		}
+		w->fill += n * w->bytes_per_frame;
+		frame   += n;
+		// Flush once there isn't room for another frame
+		if (w->buffer.size() - w->fill < w->bytes_per_frame && !flush(w)) {
+			return false;
+		}
+	}
+	return !w->failed;
+}
+
+// Fills in the sizes, as RIFF if they fit and as RF64 if they don't.
+[[nodiscard]] static
+auto write_sizes(writer* w) -> bool {
+	const auto header_size = get_header_size(w->format);
+	const auto pad         = w->data_size & 1;
+	const auto riff_size   = header_size - 8 + w->data_size + pad;
+	const auto rf64        = riff_size > w->max_riff_size;
+	HeaderBuilder h;
+	h.tag(rf64 ? "RF64" : "RIFF");
+	h.u32(rf64 ? 0xFFFFFFFF : uint32_t(riff_size));
+	h.tag("WAVE");
+	if (rf64) {
+		h.tag("ds64");
+		h.u32(DS64_SIZE);
+		h.u64(riff_size);
+		h.u64(w->data_size);
+		h.u64(get_frame_count(*w));
+		// No table
+		h.u32(0);
+	}
+	if (std::fseek(w->file, 0, SEEK_SET) != 0 || !write_bytes(w, h.bytes.data(), h.bytes.size())) {
+		w->failed = true;
+		return false;
+	}
+	const auto data_size = rf64 ? 0xFFFFFFFF : uint32_t(w->data_size);
+	HeaderBuilder d;
+	d.u32(data_size);
+	if (std::fseek(w->file, long(header_size - 4), SEEK_SET) != 0 || !write_bytes(w, d.bytes.data(), d.bytes.size())) {
+		w->failed = true;
+		return false;
+	}
+	return true;
+}
+
+auto close(writer* w, bhas::log* log) -> bool {
+	if (!w->file) {
+		return false;
+	}
+	auto ok = flush(w);
+	// Chunks have to be an even number of bytes long
+	if (ok && (w->data_size & 1)) {
+		const auto zero = std::byte{0};
+		ok = write_bytes(w, &zero, 1);
+	}
+	ok = ok && write_sizes(w);
+	ok = std::fclose(w->file) == 0 && ok;
+	w->file = nullptr;
+	if (!ok || w->failed) {
+		log->push_back(err_failed_to_write(w->path));
+		return false;
+	}
+	return true;
+}
+
+[[nodiscard]] static
+auto err_failed_to_open_for_reading(const std::string& path, int error) -> bhas::error {
+	return {std::format("Failed to open '{}' for reading. ({})", path, std::strerror(error))};
+}
+
+[[nodiscard]] static
+auto err_not_a_wav_file(const std::string& path, const char* reason) -> bhas::error {
+	return {std::format("'{}' isn't a WAV file I can read. ({})", path, reason)};
+}
+
+[[nodiscard]] static
+auto get_u16(const std::byte* p) -> uint16_t {
+	return uint16_t(uint16_t(p[0]) | uint16_t(p[1]) << 8);
+}
+
+[[nodiscard]] static
+auto get_u32(const std::byte* p) -> uint32_t {
+	return uint32_t(get_u16(p)) | uint32_t(get_u16(p + 2)) << 16;
+}
+
+[[nodiscard]] static
+auto get_u64(const std::byte* p) -> uint64_t {
+	return uint64_t(get_u32(p)) | uint64_t(get_u32(p + 4)) << 32;
+}
+
+[[nodiscard]] static
+auto is_tag(const std::byte* p, const char* tag) -> bool {
+	return std::memcmp(p, tag, 4) == 0;
+}
+
+[[nodiscard]] static
+auto read_exactly(std::FILE* file, void* dst, size_t count) -> bool {
+	return std::fread(dst, 1, count, file) == count;
+}
+
+[[nodiscard]] static
+auto to_sample_format(uint16_t tag, uint16_t bits) -> std::optional<bhas::sample_format> {
+	if (tag == FORMAT_FLOAT && bits == 32) { return bhas::sample_format::float32; }
+	if (tag != FORMAT_PCM)                 { return std::nullopt; }
+	switch (bits) {
+		case 16: return bhas::sample_format::int16;
+		case 24: return bhas::sample_format::int24;
+		case 32: return bhas::sample_format::int32;
+		default: return std::nullopt;
+	}
+}
+
+// Parses a fmt chunk. Returns the reason if it can't be read.
+[[nodiscard]] static
+auto parse_fmt(const std::vector<std::byte>& chunk, format* fmt) -> const char* {
+	if (chunk.size() < 16) {
+		return "The fmt chunk is too short.";
+	}
+	auto tag        = get_u16(chunk.data());
+	const auto bits = get_u16(chunk.data() + 14);
+	if (tag == FORMAT_EXTENSIBLE) {
+		if (chunk.size() < 40) {
+			return "The fmt chunk is too short.";
+		}
+		tag = get_u16(chunk.data() + 24);
+	}
+	const auto sample_format = to_sample_format(tag, bits);
+	if (!sample_format) {
+		return "Only 16, 24 and 32 bit integer and 32 bit float samples are supported.";
+	}
+	fmt->sample_format = *sample_format;
+	fmt->num_channels  = {get_u16(chunk.data() + 2)};
+	fmt->sample_rate   = {get_u32(chunk.data() + 4)};
+	if (fmt->num_channels.value == 0 || fmt->sample_rate.value == 0) {
+		return "The file has no channels or a sample rate of 0 Hz.";
+	}
+	return nullptr;
+}
+
+// Walks the chunks up to the start of the audio. Returns the reason if
+// the file can't be read.
+[[nodiscard]] static
+auto read_header(reader* r) -> const char* {
+	std::byte riff[12];
+	if (!read_exactly(r->file, riff, sizeof(riff)) || !(is_tag(riff, "RIFF") || is_tag(riff, "RF64")) || !is_tag(riff + 8, "WAVE")) {
+		return "There is no RIFF or RF64 header.";
+	}
+	const auto rf64 = is_tag(riff, "RF64");
+	std::optional<uint64_t> ds64_data_size;
+	bool have_fmt = false;
+	uint64_t offset = sizeof(riff);
+	for (;;) {
+		std::byte header[8];
+		if (!read_exactly(r->file, header, sizeof(header))) {
+			return "There is no data chunk.";
+		}
+		offset += sizeof(header);
+		const auto size = get_u32(header + 4);
+		if (is_tag(header, "data")) {
+			if (!have_fmt) {
+				return "The data chunk comes before the fmt chunk.";
+			}
+			const auto data_size = rf64 && size == 0xFFFFFFFF && ds64_data_size ? *ds64_data_size : uint64_t{size};
+			r->bytes_per_frame = convert::get_bytes_per_sample(r->format.sample_format) * r->format.num_channels.value;
+			r->data_offset     = offset;
+			r->num_frames      = data_size / r->bytes_per_frame;
+			return nullptr;
+		}
+		// Chunks are padded to an even length
+		const auto padded = uint64_t{size} + (size & 1);
+		if (is_tag(header, "fmt ") || (rf64 && is_tag(header, "ds64"))) {
+			std::vector<std::byte> chunk(size);
+			if (!read_exactly(r->file, chunk.data(), chunk.size()) || std::fseek(r->file, long(padded - size), SEEK_CUR) != 0) {
+				return "The file is truncated.";
+			}
+			if (is_tag(header, "ds64")) {
+				if (chunk.size() < 16) {
+					return "The ds64 chunk is too short.";
+				}
+				ds64_data_size = get_u64(chunk.data() + 8);
+			}
+			else if (const auto reason = parse_fmt(chunk, &r->format)) {
+				return reason;
+			}
+			else {
+				have_fmt = true;
+			}
+		}
+		else if (std::fseek(r->file, long(padded), SEEK_CUR) != 0) {
+			return "The file is truncated.";
+		}
+		offset += padded;
+	}
+}
+
+auto open(const std::string& path, reader* r, bhas::log* log) -> bool {
+	*r = {};
+	r->file = std::fopen(path.c_str(), "rb");
+	if (!r->file) {
+		log->push_back(err_failed_to_open_for_reading(path, errno));
+		return false;
+	}
+	r->path = path;
+	if (const auto reason = read_header(r)) {
+		log->push_back(err_not_a_wav_file(path, reason));
+		close(r);
+		return false;
+	}
+	return true;
+}
+
+auto read(reader* r, void* frames, uint64_t frame_count) -> uint64_t {
+	const auto count = std::min(frame_count, r->num_frames - r->position);
+	const auto read  = std::fread(frames, r->bytes_per_frame, size_t(count), r->file);
+	r->position += read;
+	return read;
+}
+
+auto rewind(reader* r) -> bool {
+	if (std::fseek(r->file, long(r->data_offset), SEEK_SET) != 0) {
+		return false;
+	}
+	r->position = 0;
+	return true;
+}
+
+auto close(reader* r) -> void {
+	if (r->file) {
+		std::fclose(r->file);
+		r->file = nullptr;
+	}
+}
+
+} // wav
+} // bhas
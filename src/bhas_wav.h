@@ -0,0 +1,87 @@
+#pragma once
+
+#include "bhas.h"
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+// Reading and writing WAV files, as fast as the disk will go.
+// Samples are written into a large buffer of our own and handed to the OS
+// in big sequential writes. The header starts off with a JUNK chunk
+// where an RF64 ds64 chunk would go, so that if the file ends up bigger
+// than a RIFF file can describe it's turned into an RF64 file when it's
+// closed, without having to move any of the audio. Reading understands
+// RIFF and RF64, and 16, 24 and 32 bit integer or 32 bit float samples,
+// which are exactly the sample formats a stream can have.
+namespace bhas {
+namespace wav {
+
+// The most a RIFF chunk size field can say
+static constexpr uint64_t MAX_RIFF_SIZE = 0xFFFFFFFF;
+static constexpr size_t DEFAULT_BUFFER_SIZE = 1 << 20;
+
+struct format {
+	bhas::sample_format sample_format = bhas::sample_format::float32;
+	bhas::channel_count num_channels;
+	bhas::sample_rate sample_rate;
+};
+
+struct writer {
+	std::FILE* file = nullptr;
+	std::string path;
+	wav::format format;
+	size_t bytes_per_frame = 0;
+	std::vector<std::byte> buffer;
+	size_t fill = 0;
+	// How many bytes of audio have been written so far, including
+	// whatever is still in the buffer
+	uint64_t data_size = 0;
+	// Files bigger than this are written as RF64. Only ever lowered by
+	// the tests.
+	uint64_t max_riff_size = MAX_RIFF_SIZE;
+	// Set once a write fails. Nothing else is written after that.
+	bool failed = false;
+};
+
+struct reader {
+	std::FILE* file = nullptr;
+	std::string path;
+	wav::format format;
+	size_t bytes_per_frame = 0;
+	// Where the audio starts in the file
+	uint64_t data_offset = 0;
+	uint64_t num_frames = 0;
+	// The next frame read() will return
+	uint64_t position = 0;
+};
+
+// Creates the file, replacing anything which is already there, and
+// writes a placeholder header.
+[[nodiscard]] auto open(const std::string& path, const format& fmt, writer* w, bhas::log* log, size_t buffer_size = DEFAULT_BUFFER_SIZE) -> bool;
+// Appends interleaved frames in the writer's sample format.
+[[nodiscard]] auto write(writer* w, const void* frames, uint64_t frame_count) -> bool;
+// Appends frames from one buffer per channel, in the writer's sample
+// format. Each buffer holds at least frame_count samples.
+[[nodiscard]] auto write(writer* w, const void* const* channels, uint64_t frame_count) -> bool;
+// Writes out the rest of the buffer, fills in the header and closes the
+// file. The writer can't be used again until it's reopened.
+[[nodiscard]] auto close(writer* w, bhas::log* log) -> bool;
+// Opens the file and reads the header. Anything a stream couldn't play
+// (8 bit, 64 bit float, compressed) is rejected.
+[[nodiscard]] auto open(const std::string& path, reader* r, bhas::log* log) -> bool;
+// Reads up to frame_count interleaved frames in the file's sample format.
+// Returns how many were read, which is less than frame_count at the end of
+// the file or if the read fails.
+[[nodiscard]] auto read(reader* r, void* frames, uint64_t frame_count) -> uint64_t;
+// Goes back to the first frame.
+[[nodiscard]] auto rewind(reader* r) -> bool;
+auto close(reader* r) -> void;
+[[nodiscard]] inline
+auto get_frame_count(const writer& w) -> uint64_t {
+	return w.bytes_per_frame > 0 ? w.data_size / w.bytes_per_frame : 0;
+}
+
+} // wav
+} // bhas
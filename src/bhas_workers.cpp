@@ -0,0 +1,214 @@
+#include "bhas_workers.h"
+#include "bhas_spsc.h"
+#include "bhas_wait.h"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+namespace bhas {
+namespace workers {
+
+// Every participant (each worker, plus the audio thread at index 0) owns
+// one of these. A batch is split into contiguous ranges of job indices up
+// front, so the deque doesn't need any storage: the jobs still to be done
+// are just the indices in [top, bottom). The owner takes jobs from the
+// bottom and anyone else can steal them from the top, as in the
+// Chase-Lev deque.
+struct alignas(CACHE_LINE_SIZE) Deque {
+	alignas(CACHE_LINE_SIZE) std::atomic<int64_t> top = 0;
+	alignas(CACHE_LINE_SIZE) std::atomic<int64_t> bottom = 0;
+};
+
+// The low bits count the workers which are currently working on the
+// batch. Workers can only join while the batch is open.
+static constexpr uint32_t BATCH_OPEN = 1u << 31;
+
+struct Model {
+	std::array<Deque, bhas::MAX_WORKER_THREADS.value + 1> deques;
+	// Incremented for every batch, and to tell the workers to stop
+	wait_word generation;
+	wait_word batch;
+	// Written by the audio thread before the batch is opened
+	bhas::job_fn fn = nullptr;
+	void* context = nullptr;
+	uint32_t num_participants = 1;
+	std::atomic<bool> stopping = false;
+	// Main thread only
+	std::vector<std::thread> threads;
+};
+
+static Model model;
+
+enum class steal_result { empty, lost_race, success };
+
+[[nodiscard]] static
+auto pop(Deque* deque, int64_t* index) -> bool {
+	const auto b = deque->bottom.load(std::memory_order_relaxed) - 1;
+	deque->bottom.store(b, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	auto t = deque->top.load(std::memory_order_relaxed);
+	if (t > b) {
+		deque->bottom.store(b + 1, std::memory_order_relaxed);
+		return false;
+	}
+	if (t == b) {
+		// Last one. Race the thieves for it.
+		const auto won = deque->top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+		deque->bottom.store(b + 1, std::memory_order_relaxed);
+		if (!won) {
+			return false;
+		}
+	}
+	*index = b;
+	return true;
+}
+
+[[nodiscard]] static
+auto steal(Deque* deque, int64_t* index) -> steal_result {
+	auto t = deque->top.load(std::memory_order_acquire);
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	const auto b = deque->bottom.load(std::memory_order_acquire);
+	if (t >= b) {
+		return steal_result::empty;
+	}
+	if (!deque->top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+		return steal_result::lost_race;
+	}
+	*index = t;
+	return steal_result::success;
+}
+
+// Runs jobs until there are none left to take. Some may still be running
+// in other threads when this returns.
+static
+auto work(uint32_t participant) -> void {
+	const auto fn      = model.fn;
+	const auto context = model.context;
+	const auto n       = model.num_participants;
+	int64_t index;
+	for (;;) {
+		if (pop(&model.deques[participant], &index)) {
+			fn(context, static_cast<uint32_t>(index));
+			continue;
+		}
+		auto found     = false;
+		auto lost_race = false;
+		for (uint32_t i = 1; i < n && !found; i++) {
+			switch (steal(&model.deques[(participant + i) % n], &index)) {
+				case steal_result::success:   found = true; break;
+				case steal_result::lost_race: lost_race = true; break;
+				case steal_result::empty:     break;
+			}
+		}
+		if (found) {
+			fn(context, static_cast<uint32_t>(index));
+			continue;
+		}
+		if (!lost_race) {
+			// Every job has been taken by someone
+			return;
+		}
+	}
+}
+
+// A worker which wakes up late may find that the batch it was woken for
+// has already finished, in which case it doesn't join it.
+[[nodiscard]] static
+auto try_to_join_batch() -> bool {
+	auto value = model.batch.value.load(std::memory_order_relaxed);
+	while (value & BATCH_OPEN) {
+		if (model.batch.value.compare_exchange_weak(value, value + 1, std::memory_order_acquire, std::memory_order_relaxed)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+static
+auto leave_batch() -> void {
+	if (model.batch.value.fetch_sub(1, std::memory_order_seq_cst) - 1 == 0) {
+		wake(&model.batch);
+	}
+}
+
+static
+auto worker_main(uint32_t participant, rt::thread_setup setup) -> void {
+	rt::apply_worker_thread_setup(setup);
+	uint32_t seen = 0;
+	for (;;) {
+		wait_until(&model.generation, [seen](uint32_t generation) { return generation != seen; });
+		seen = model.generation.value.load(std::memory_order_acquire);
+		if (model.stopping.load(std::memory_order_acquire)) {
+			return;
+		}
+		if (try_to_join_batch()) {
+			rt::enter_audio_callback();
+			work(participant);
+			rt::leave_audio_callback();
+			leave_batch();
+		}
+	}
+}
+
+auto start(bhas::thread_count count, const rt::thread_setup& setup) -> bhas::thread_count {
+	stop();
+	count.value = std::min(count.value, bhas::MAX_WORKER_THREADS.value);
+	model.stopping.store(false, std::memory_order_relaxed);
+	model.num_participants = count.value + 1;
+	model.threads.reserve(count.value);
+	for (uint32_t i = 0; i < count.value; i++) {
+		model.threads.emplace_back(worker_main, i + 1, setup);
+	}
+	return count;
+}
+
+auto stop() -> void {
+	if (model.threads.empty()) {
+		return;
+	}
+	model.stopping.store(true, std::memory_order_release);
+	model.generation.value.fetch_add(1, std::memory_order_seq_cst);
+	wake(&model.generation);
+	for (auto& thread : model.threads) {
+		thread.join();
+	}
+	model.threads.clear();
+	model.num_participants = 1;
+}
+
+auto get_thread_count() -> bhas::thread_count {
+	return {static_cast<uint32_t>(model.threads.size())};
+}
+
+auto lock_memory() -> bool {
+	return rt::lock_memory(rt::memory_owner::engine, &model, sizeof(model));
+}
+
+auto run(bhas::job_fn fn, void* context, uint32_t count) -> void {
+	const auto n = model.num_participants;
+	if (n == 1 || count == 1) {
+		for (uint32_t i = 0; i < count; i++) {
+			fn(context, i);
+		}
+		return;
+	}
+	model.fn      = fn;
+	model.context = context;
+	for (uint32_t p = 0; p < n; p++) {
+		model.deques[p].top.store(int64_t(uint64_t(count) * p / n), std::memory_order_relaxed);
+		model.deques[p].bottom.store(int64_t(uint64_t(count) * (p + 1) / n), std::memory_order_relaxed);
+	}
+	model.batch.value.store(BATCH_OPEN, std::memory_order_release);
+	model.generation.value.fetch_add(1, std::memory_order_seq_cst);
+	wake(&model.generation);
+	work(0);
+	// Every job has been taken, so close the batch and wait for the
+	// workers which are still running theirs.
+	model.batch.value.fetch_and(~BATCH_OPEN, std::memory_order_seq_cst);
+	wait_until(&model.batch, [](uint32_t value) { return value == 0; });
+}
+
+} // workers
+} // bhas
@@ -0,0 +1,27 @@
+#pragma once
+
+#include "bhas.h"
+#include "bhas_rt.h"
+
+// A pool of real-time worker threads which the audio thread can hand a
+// batch of jobs to in the middle of a callback. The audio thread works on
+// the batch too, and doesn't return until every job has finished.
+namespace bhas {
+namespace workers {
+
+// Main thread
+// Returns how many workers were actually started.
+auto start(bhas::thread_count count, const rt::thread_setup& setup) -> bhas::thread_count;
+auto stop() -> void;
+[[nodiscard]] auto get_thread_count() -> bhas::thread_count;
+// Locks the pool's own state
+[[nodiscard]] auto lock_memory() -> bool;
+
+// Audio thread
+// Calls fn(context, i) for every i in [0, count) and returns once they
+// have all finished. Never allocates. If there are no workers then the
+// jobs are run in the calling thread.
+auto run(bhas::job_fn fn, void* context, uint32_t count) -> void;
+
+} // workers
+} // bhas